@@ -45,6 +45,7 @@ options.distanceattenuation = true;                 % apply distance attenuation
 options.subsampleaccuracy   = false;                % apply subsample accuracy?
 options.highpasscutoff      = 0;                    % 3dB frequency of high-pass filter (0=none)
 options.verbose             = true;                 % print status messages?
+options.filterlength        = 512;                  % reflection filter length per order, last for higher orders and diffuse tail (samples)
 
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 %
@@ -58,10 +59,21 @@ options.reflectionorder     = [ 10 10 10 ];         % maximum specular reflectio
 %    diffuse reflections simulation options
 %
 options.simulatediffuse     = false;                 % simulate diffuse reflections?
-options.numberofrays        = 2000;                 % number of rays in simulation (20*K^2)
+options.numberofrays        = 2000;                 % number of rays in simulation (20*K^2 for icosahedron rays)
 options.diffusetimestep     = 0.010;                % time resolution in diffuse energy histogram (seconds)
 options.rayenergyfloordB    = -80;                  % ray energy threshold (dB, with respect to initial energy)
 options.uncorrelatednoise   = true;                 % use uncorrelated poisson arrivals for binaural impulse responses?
+options.diffuselineardomain = false;                % track ray energies in the linear domain (faster, equivalent)?
+options.numberofthreads     = 1;                    % number of ray tracing threads (0 = all processors)
+options.diffusetolerancedB  = 0;                    % adaptive ray count: energy decay tolerance (dB, 0 = fixed numberofrays)
+options.diffusedirections   = 6;                    % number of direction bins of the diffuse tail (6 = room axes, else 20*K^2)
+options.raygenerator        = 'icosahedron';        % ray directions ('icosahedron', 'icosphere', 'fibonacci', 'sobol')
+options.responsefloordB     = 0;                    % sparse responses truncated at this energy floor [dB], 0 for dense responses
+options.transitiontime      = 0;                    % hybrid simulation: image sources up to this time, diffuse tail after (seconds, -1 = mixing time, 0 = off)
+options.trajectorytolerancedB = 0.1;                % trajectories: image filter reuse tolerance between frames (dB, 0 = design every frame)
+options.fftwwisdom          = '';                   % FFTW wisdom file ('' = $SOFAMYROOM_FFTW_WISDOM, if set)
+options.fftwplanning        = 'estimate';           % FFTW planning effort ('estimate', 'measure', 'patient')
+options.fftwthreads         = 1;                    % threads of large FFTW transforms (0 = all processors)
 
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 %
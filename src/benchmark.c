@@ -0,0 +1,162 @@
+/*********************************************************************//**
+ * @file benchmark.c
+ * @brief Setup file parsing benchmark.
+ *
+ * Generates a large setup file with many receivers and large absorption
+ * and diffusion arrays, and measures the time needed to read and load it,
+ * both as text and as binary setup file.
+ *
+ * Usage: sofamyroombench [size in MB] [file name]
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "interface.h"
+#include "binsetup.h"
+#include "mem.h"
+#include "msg.h"
+#include "setup.h"
+
+/* disable warnings about unsafe CRT functions */
+#ifdef _MSC_VER
+#  pragma warning( disable : 4996)
+#endif
+
+/* number of frequency bands in the generated surface arrays */
+#define BENCH_NBANDS 1000
+
+static void WriteArray(FILE *fid, const char *name, int nRows, int nCols, double scale)
+{
+	int r, c;
+
+	fprintf(fid, "room.surface.%s = [", name);
+	for (r=0; r<nRows; r++)
+	{
+		for (c=0; c<nCols; c++)
+			fprintf(fid, " %.6f", scale * (1 + (r * nCols + c) % 97) / 100.0);
+		fprintf(fid, r < nRows-1 ? ";\n" : " ];\n");
+	}
+}
+
+/** Writes a setup file of about \a size bytes. */
+static long WriteSetup(const char *filename, long size)
+{
+	FILE *fid = fopen(filename, "w");
+	long r;
+	int  i;
+
+	if (!fid)
+		return -1;
+
+	fprintf(fid, "room.dimension = [ 10 7 4 ];\nroom.humidity = 0.42;\nroom.temperature = 20;\n");
+	fprintf(fid, "room.surface.frequency = [");
+	for (i=0; i<BENCH_NBANDS; i++)
+		fprintf(fid, " %d", 20 + 20 * i);
+	fprintf(fid, " ];\n");
+	WriteArray(fid, "absorption", 6, BENCH_NBANDS, 1.0);
+	WriteArray(fid, "diffusion", 6, BENCH_NBANDS, 0.5);
+
+	fprintf(fid,
+		"options.fs = 44100;\noptions.responseduration = 1.25;\noptions.bandsperoctave = 1;\n"
+		"options.referencefrequency = 125;\noptions.airabsorption = true;\noptions.distanceattenuation = true;\n"
+		"options.subsampleaccuracy = false;\noptions.highpasscutoff = 0;\noptions.verbose = true;\n"
+		"options.simulatespecular = true;\noptions.reflectionorder = [ 10 10 10 ];\n"
+		"options.simulatediffuse = true;\noptions.numberofrays = 2000;\noptions.diffusetimestep = 0.010;\n"
+		"options.rayenergyfloordB = -80;\noptions.uncorrelatednoise = true;\noptions.outputname = 'output';\n"
+		"source(1).location = [ 8 2.5 1.6 ];\nsource(1).orientation = [ 180 0 0 ];\nsource(1).description = 'omnidirectional';\n");
+
+	/* add receivers until the file has the requested size */
+	for (r=1; ftell(fid) < size; r++)
+	{
+		fprintf(fid, "receiver(%ld).location    = [ %.4f %.4f %.4f ];  %% receiver %ld\n",
+			r, 0.5 + (r % 90) / 10.0, 0.5 + (r % 60) / 10.0, 0.5 + (r % 30) / 10.0, r);
+		fprintf(fid, "receiver(%ld).orientation = [ %ld 0 0 ];\n", r, r % 360);
+		fprintf(fid, "receiver(%ld).description = 'omnidirectional';\n", r);
+	}
+
+	fclose(fid);
+	return r - 1;
+}
+
+int main(int argc, char **argv)
+{
+	const char *filename = argc > 2 ? argv[2] : "benchmark_setup.txt";
+	double     megabytes = argc > 1 ? atof(argv[1]) : 50.0;
+	const char *binname = "benchmark_setup" BINSETUP_EXTENSION;
+	CFileSetup filesetup;
+	CBinarySetup binsetup;
+	CRoomSetup setup, binary;
+	clock_t    t0, t1, t2, t3;
+	long       nReceivers;
+	int        i;
+
+	MsgPrintf("Writing %.0f MB setup file '%s'...\n", megabytes, filename);
+	nReceivers = WriteSetup(filename, (long) (megabytes * 1048576.0));
+	if (nReceivers < 0)
+	{
+		MsgPrintf("unable to write '%s'\n", filename);
+		return 1;
+	}
+
+	t0 = clock();
+	if (ReadSetup((char *) filename, &filesetup) < 0)
+	{
+		MsgPrintf("error reading setup file: %s\n", filesetup.error);
+		return 1;
+	}
+	t1 = clock();
+	LoadCRoomSetup(&filesetup.root, &setup);
+	t2 = clock();
+
+	if (setup.nReceivers != nReceivers || setup.room.surface.nBands != BENCH_NBANDS)
+	{
+		MsgPrintf("incorrect setup: %d receivers, %d bands\n", setup.nReceivers, setup.room.surface.nBands);
+		return 1;
+	}
+
+	MsgPrintf("%ld receivers, %d bands\n", nReceivers, BENCH_NBANDS);
+	MsgPrintf("read: %8.3f s (%.1f MB/s)\n", (double) (t1 - t0) / CLOCKS_PER_SEC,
+		megabytes / ((double) (t1 - t0 + 1) / CLOCKS_PER_SEC));
+	MsgPrintf("load: %8.3f s\n", (double) (t2 - t1) / CLOCKS_PER_SEC);
+
+	/* binary setup file of the same setup */
+	if (WriteBinarySetup(binname, &setup) < 0)
+	{
+		MsgPrintf("unable to write '%s'\n", binname);
+		return 1;
+	}
+	t2 = clock();
+	if (ReadBinarySetup(binname, &binsetup, &binary) < 0)
+	{
+		MsgPrintf("error reading binary setup file: %s\n", binsetup.error);
+		return 1;
+	}
+	t3 = clock();
+	for (i=0; i<setup.nReceivers; i++)
+		if (memcmp(binary.receiver[i].location, setup.receiver[i].location, sizeof(setup.receiver[i].location)) != 0)
+			break;
+	if (binary.nReceivers != setup.nReceivers || i < setup.nReceivers)
+	{
+		MsgPrintf("incorrect binary setup\n");
+		return 1;
+	}
+	MsgPrintf("read and load binary: %8.3f s\n", (double) (t3 - t2) / CLOCKS_PER_SEC);
+	MemFree((void *) binary.room.surface.frequency);
+	MemFree((void *) binary.room.surface.absorption);
+	MemFree((void *) binary.room.surface.diffusion);
+	FreeBinarySetup(&binsetup);
+	remove(binname);
+
+	MemFree((void *) setup.room.surface.frequency);
+	MemFree((void *) setup.room.surface.absorption);
+	MemFree((void *) setup.room.surface.diffusion);
+	MemFree((void *) setup.source);
+	MemFree((void *) setup.receiver);
+	FreeSetup(&filesetup);
+	remove(filename);
+
+	return 0;
+}
@@ -0,0 +1,66 @@
+/*********************************************************************//**
+ * @file convert.c
+ * @brief Conversion between text and binary setup files.
+ *
+ * The format of each file follows from its extension: binary setup files
+ * end in .smr, all other files are text setup files.
+ *
+ * Usage: sofamyroomconvert input output
+ **********************************************************************/
+
+#include <stdio.h>
+
+#include "interface.h"
+#include "binsetup.h"
+#include "msg.h"
+#include "setup.h"
+
+int main(int argc, char **argv)
+{
+	CRoomSetup   setup;
+	CFileSetup   filesetup;
+	CBinarySetup binsetup;
+	int          binary, result;
+
+	if (argc != 3)
+	{
+		MsgPrintf("Usage: sofamyroomconvert input output\n");
+		MsgPrintf("Files ending in '" BINSETUP_EXTENSION "' are binary setup files, others text setup files.\n");
+		return 1;
+	}
+
+	binary = IsBinarySetup(argv[1]);
+	if (binary)
+	{
+		if (ReadBinarySetup(argv[1], &binsetup, &setup) < 0)
+		{
+			MsgPrintf("error reading binary setup file '%s'\n%s\n", argv[1], binsetup.error);
+			return 1;
+		}
+	}
+	else
+	{
+		if (ReadSetup(argv[1], &filesetup) < 0)
+		{
+			MsgPrintf("error reading setup file '%s'\n%s\n", argv[1], filesetup.error);
+			return 1;
+		}
+		LoadCRoomSetup(&filesetup.root, &setup);
+	}
+
+	if (IsBinarySetup(argv[2]))
+		result = WriteBinarySetup(argv[2], &setup);
+	else
+		result = WriteTextSetup(argv[2], &setup);
+	if (result < 0)
+		MsgPrintf("error writing setup file '%s'\n", argv[2]);
+	else
+		MsgPrintf("converted '%s' to '%s' (%d sources, %d receivers)\n", argv[1], argv[2], setup.nSources, setup.nReceivers);
+
+	if (binary)
+		FreeBinarySetup(&binsetup);
+	else
+		FreeSetup(&filesetup);
+
+	return result < 0;
+}
@@ -9,8 +9,12 @@
 #include "types.h"
 #include "interface.h"
 
+int   CheckSetup      ( const CRoomSetup *pSetup, char *error );
 void  ValidateSetup   ( const CRoomSetup *pSetup );
 BRIR *Roomsim         ( const CRoomSetup *pSetup );
+void  RoomsimPrepareSensors ( const CRoomSetup *pSetup );
+int   RoomsimAcquireSensors ( const CRoomSetup *pSetup, char *error );
+void  RoomsimReleaseSensors ( void );
 void  ReleaseBRIR     ( BRIR *brir );
 void  ClearAllSensors ( void );
 
@@ -0,0 +1,99 @@
+/*********************************************************************//**
+ * @file binsetup.h
+ * @brief Binary setup files and setup file conversion.
+ *
+ * A binary setup file (extension .smr) holds the same fields as a text
+ * setup file, in little-endian byte order:
+ *
+ *   - a header (CBinarySetupHeader);
+ *   - a table of fields (CBinarySetupField), each naming its full path,
+ *     such as room.surface.absorption, in the string table;
+ *   - a string table of NUL-terminated paths and string values;
+ *   - the field data, aligned to 8 bytes: numeric arrays as rows of
+ *     doubles, and sensor arrays (source, receiver) as CBinarySensor
+ *     records.
+ *
+ * The file is mapped into memory when read. Numeric arrays, strings, and
+ * sensor arrays are used in place, without parsing or copying.
+ **********************************************************************/
+
+#ifndef _BINSETUP_H_27364519283746501928
+#define _BINSETUP_H_27364519283746501928
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interface.h"
+#include "setup.h"
+
+#define BINSETUP_MAGIC		"SMRSETUP"	/**< File signature, without terminating NUL. */
+#define BINSETUP_VERSION	1			/**< Current version of the binary setup format. */
+#define BINSETUP_EXTENSION	".smr"		/**< File extension of binary setup files. */
+
+#define SETUP_MAXPATH		256			/**< Maximum length of a field path. */
+
+/** Type of a field in a binary setup file. */
+enum {
+	BS_STRING,		/**< String, data is its offset in the string table. */
+	BS_NUMBER,		/**< Numeric array of nRows x nCols doubles, row by row. */
+	BS_SENSOR		/**< Array of nRows CBinarySensor records. */
+};
+
+/** Header of a binary setup file. */
+typedef struct {
+	char     magic[8];			/**< BINSETUP_MAGIC. */
+	uint32_t version;			/**< BINSETUP_VERSION. */
+	uint32_t headersize;		/**< Size of this header. */
+	uint32_t nFields;			/**< Number of entries in the field table. */
+	uint32_t reserved;
+	uint64_t fieldoffset;		/**< File offset of the field table. */
+	uint64_t stringoffset;		/**< File offset of the string table. */
+	uint64_t stringsize;		/**< Size of the string table. */
+	uint64_t filesize;			/**< Total size of the file. */
+} CBinarySetupHeader;
+
+/** Field table entry of a binary setup file. */
+typedef struct {
+	uint32_t type;				/**< BS_STRING, BS_NUMBER, or BS_SENSOR. */
+	uint32_t nRows, nCols;		/**< Array dimensions; nCols is 1 for sensor arrays. */
+	uint32_t path;				/**< Offset of the field path in the string table. */
+	uint64_t data;				/**< File offset of the data, or string table offset of a string. */
+} CBinarySetupField;
+
+/** Sensor record of a binary setup file; laid out like CSensor on 64-bit hosts. */
+typedef struct {
+	double   location[3];
+	double   orientation[3];
+	uint64_t description;		/**< Offset of the description in the string table. */
+} CBinarySensor;
+
+/** Binary setup file mapped into memory. */
+typedef struct {
+	CFileSetup fields;			/**< Setup tree of room and options, referring into the mapped file. */
+	void       *map;			/**< Mapped file contents. */
+	size_t     size;			/**< Size of the mapped file. */
+	CSensor    *sensors[2];		/**< Copied sensor arrays, if CSensor differs from CBinarySensor. */
+	int        nSensorCopies;
+	char       error[256];		/**< Description of read error, if any. */
+} CBinarySetup;
+
+/** Setup writer. The savers generated by mstruct.h pass every field to its callbacks. */
+typedef struct CSetupWriter CSetupWriter;
+struct CSetupWriter {
+	/** Writes a numeric array; \a isbool marks logical scalars. */
+	void (*number)(CSetupWriter *w, const char *path, const double *data, int nRows, int nCols, int isbool);
+	/** Writes a string. */
+	void (*string)(CSetupWriter *w, const char *path, const char *value);
+	/** Writes an array of structs in bulk, or returns 0 to have its elements saved one by one. */
+	int  (*structarray)(CSetupWriter *w, const char *path, const void *data, size_t size, int count);
+};
+
+char *SetupWriterPath(char *buffer, const char *path, const char *name, int index);
+
+int  IsBinarySetup(const char *filename);
+int  ReadBinarySetup(const char *filename, CBinarySetup *pSetup, CRoomSetup *setup);
+void FreeBinarySetup(CBinarySetup *pSetup);
+int  WriteBinarySetup(const char *filename, const CRoomSetup *setup);
+int  WriteTextSetup(const char *filename, const CRoomSetup *setup);
+
+#endif /* _BINSETUP_H_27364519283746501928 */
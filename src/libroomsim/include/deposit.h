@@ -0,0 +1,60 @@
+/*********************************************************************//**
+ * @file deposit.h
+ * @brief Buffered histogram accumulation for concurrent writers.
+ *
+ * A deposit log collects (bin, energy) pairs of a single writer in a
+ * fixed-size buffer. When full, the log is sorted by bin with a radix 
+ * sort, runs of equal bins are summed, and the result is added to the
+ * shared histogram in ascending memory order under a lock. Memory use is
+ * bounded by the log capacity, independent of the histogram size.
+ *
+ * The histogram is stored in pages, which can be allocated when first 
+ * deposited to, so that a large, sparsely filled histogram only takes the 
+ * memory of its pages in use.
+ **********************************************************************/
+
+#ifndef _DEPOSIT_H_91827364501928374650
+#define _DEPOSIT_H_91827364501928374650
+
+#include "thread.h"
+
+/** Histogram stored in pages of bins. */
+typedef struct {
+	double       **page;		/**< Pages of bins, NULL until first deposited to if allocated on demand. */
+	unsigned int nPages;		/**< Number of pages. */
+	unsigned int pagesize;		/**< Number of bins per page. */
+	int          ondemand;		/**< Nonzero if pages are allocated on demand, and released by FreePagedHistogram. */
+} CPagedHistogram;
+
+typedef struct {
+	int          capacity;		/**< Maximum number of deposits in the log. */
+	int          count;			/**< Current number of deposits in the log. */
+	int          keybits;		/**< Number of significant bits in histogram bin indices. */
+	unsigned int *key;			/**< Histogram bin index of deposits. */
+	double       *energy;		/**< Energy of deposits. */
+	unsigned int *tmpkey;		/**< Scratch space for sorting. */
+	double       *tmpenergy;	/**< Scratch space for sorting. */
+	CPagedHistogram *histogram;	/**< Shared target histogram. */
+	CMutex       *lock;			/**< Lock protecting the target histogram, or NULL if not shared. */
+	int          failed;		/**< Nonzero if deposits were lost because a page could not be allocated. */
+} CDepositLog;
+
+double *PagedHistogramPage(CPagedHistogram *histogram, unsigned int p);
+void ClearPagedHistogram(CPagedHistogram *histogram);
+void FreePagedHistogram(CPagedHistogram *histogram);
+
+CDepositLog *AllocDepositLog(int capacity, CPagedHistogram *histogram, CMutex *lock);
+void FlushDepositLog(CDepositLog *log);
+void FreeDepositLog(CDepositLog *log);
+double DepositLogMemory(int capacity);
+
+/** Adds \a e to histogram bin \a k through deposit log \a log. */
+#define DEPOSIT(log,k,e) \
+	do { \
+		if ((log)->count == (log)->capacity) FlushDepositLog(log); \
+		(log)->key[(log)->count]    = (k); \
+		(log)->energy[(log)->count] = (e); \
+		(log)->count++; \
+	} while (0)
+
+#endif /* _DEPOSIT_H_91827364501928374650 */
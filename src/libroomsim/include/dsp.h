@@ -6,22 +6,48 @@
 #ifndef _DSP_H_123795791719246514351
 #define _DSP_H_123795791719246514351
 
-void FIRfilter(const double *h, int hlen, const double *x, int xlen, double *y, double *state);
+#include "types.h"
+
+void FIRfilter(const double *h, int hlen, const SAMPLE *x, int xlen, SAMPLE *y, double *state);
 void Conv(const double *h, int hlen, const double *x, int xlen, double *y);
 
 void FreqzLogMagnitude(double *h, int hlen, double *w, int wlen, double *logmag);
 
+/** Environment variable naming the FFTW wisdom file, if not set in the options. */
+#define FFTW_WISDOM_ENV			"SOFAMYROOM_FFTW_WISDOM"
+/** Minimum number of samples of a transform planned with multiple threads. */
+#define FFTW_THREADS_MINSIZE	16384
+
+int  FFTWPlanningFlags(const char *planning);
+int  ConfigureFFTW(const char *wisdomfile, const char *planning, int nThreads);
+void CleanupFFTW(void);
+int  CountFFTWPlans(void);
+
 /** Opague type for minimum-phase FIR conversion routine. */
 typedef struct CMinPhaseFIRplan CMinPhaseFIRplan;
 
+/** Number of filters designed at once by LogMagFreqResp2MinPhaseFIRs, a multiple of the vector width. */
+#define MINPHASE_BATCH 8
+
 CMinPhaseFIRplan *AllocMinPhaseFIRplan(unsigned int nFFT, double *F, unsigned int nF);
 void LogMagFreqResp2MinPhaseFIR(const double *logmag, double *h, CMinPhaseFIRplan *plan);
+void LogMagFreqResp2MinPhaseFIRs(const double *logmag, int logmagstride, double *h, int hstride, int nFilters, CMinPhaseFIRplan *plan);
 void FreeMinPhaseFIRplan(CMinPhaseFIRplan *plan);
 
-void TimeVaryingConv(const double *hh, int hlen, 
+/** Opaque type for uniformly partitioned convolution. */
+typedef struct CPartitionedConv CPartitionedConv;
+
+CPartitionedConv *AllocPartitionedConv(int blocksize, int nInputs, int nOutputs, int maxlength);
+int  SetPartitionedConvFilter(CPartitionedConv *conv, int iInput, int iOutput, const SAMPLE *h, int hlen, int offset);
+void PartitionedConvProcess(CPartitionedConv *conv, const double *x, double *y);
+void FreePartitionedConv(CPartitionedConv *conv);
+int  BandSplitFilterLength(const double *frequency, int nBands, double fs, int maxlength);
+void BandSplitFilters(const double *frequency, int nBands, double fs, int length, double *h);
+
+void TimeVaryingConv(const SAMPLE *hh, int hlen, 
 					 const int *idx, int nidx, 
 					 const unsigned int *x, int xlen,
 					 int xstart, unsigned int xthreshold,
-					 double *y);
+					 SAMPLE *y);
 
 #endif /* #ifndef _DSP_H_123795791719246514351 */
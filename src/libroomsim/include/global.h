@@ -1,6 +0,0 @@
-#ifndef GLOBAL_FOR_MYSOFA
-#define GLOBAL_FOR_MYSOFA
-
-extern double g_fs;
-
-#endif /* GLOBAL_FOR_MYSOFA */
\ No newline at end of file
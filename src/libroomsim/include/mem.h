@@ -1,6 +1,12 @@
 /*********************************************************************//**
  * @file mem.h
  * @brief Defines for memory allocation routines.
+ *
+ * Besides the heap routines, an arena serves allocations that share a
+ * lifetime, such as those of a simulation: it carves them from large
+ * blocks, aligned for SIMD and FFTW use, and releases them all at once.
+ * Like MemMalloc, arenas may only be used on the calling thread in MEX
+ * builds.
  **********************************************************************/
 
 #ifndef _MEM_H_19237197329817461287
@@ -19,4 +25,35 @@
 #  define MemFree(p)     free(p)
 #endif
 
+#include <stddef.h>
+
+#define ARENA_ALIGNMENT	64			/**< Alignment of arena allocations, a cache line. */
+#define ARENA_BLOCKSIZE	(1 << 20)	/**< Default minimum size of arena blocks. */
+
+typedef struct CArenaBlock CArenaBlock;
+
+/** Arena of allocations that are released together. */
+typedef struct {
+	CArenaBlock *block;			/**< Current block, linked to the previous ones. */
+	size_t      blocksize;		/**< Minimum size of new blocks. */
+	size_t      used;			/**< Bytes in use, excluding alignment padding. */
+	size_t      peak;			/**< Largest number of bytes in use. */
+	size_t      reserved;		/**< Bytes of all blocks. */
+	int         nBlocks;		/**< Number of blocks. */
+} CArena;
+
+/** Position in an arena, to release the allocations made after it. */
+typedef struct {
+	CArenaBlock *block;
+	size_t      offset;
+	size_t      used;
+} CArenaMark;
+
+void       ArenaInit(CArena *arena, size_t blocksize);
+void      *ArenaMalloc(CArena *arena, size_t size);
+void      *ArenaCalloc(CArena *arena, size_t n, size_t size);
+CArenaMark ArenaGetMark(const CArena *arena);
+void       ArenaRewind(CArena *arena, CArenaMark mark);
+void       ArenaRelease(CArena *arena);
+
 #endif /* _MEM_H_19237197329817461287 */
@@ -18,6 +18,11 @@
 #undef FIELDDYNDOUBLEARRAY
 #undef FIELDDYNDOUBLEARRAY2D
 #undef FIELDDYNSTRUCTARRAY
+#undef FIELDOPTBOOL
+#undef FIELDOPTINT
+#undef FIELDOPTDOUBLE
+#undef FIELDOPTSTRING
+#undef FIELDOPTDYNDOUBLEARRAY
 
 /***************************
  * Define types            *
@@ -44,6 +49,13 @@
 #define FIELDDYNDOUBLEARRAY2D(na,ncR,ncC) int ncR; int ncC; const double *na;
 #define FIELDDYNSTRUCTARRAY(t,na,nc)    int nc; const t *na;
 
+/* optional fields take default value d when absent from the setup */
+#define FIELDOPTBOOL(n,d)               bool n;
+#define FIELDOPTINT(n,d)                int n;
+#define FIELDOPTDOUBLE(n,d)             double n;
+#define FIELDOPTSTRING(n,d)             const char *n;
+#define FIELDOPTDYNDOUBLEARRAY(na,nc)   int nc; const double *na;	/* absent: nc = 0, na = NULL */
+
 
 /***************************
  * Define prototypes       *
@@ -77,6 +89,12 @@
 #define FIELDDYNDOUBLEARRAY2D(na,ncR,ncC)
 #define FIELDDYNSTRUCTARRAY(t,na,nc)
 
+#define FIELDOPTBOOL(n,d)
+#define FIELDOPTINT(n,d)
+#define FIELDOPTDOUBLE(n,d)
+#define FIELDOPTSTRING(n,d)
+#define FIELDOPTDYNDOUBLEARRAY(na,nc)
+
 
 /***************************
  * Define loaders          *
@@ -165,6 +183,33 @@
     (plhs->na) = (t *) mxMalloc((plhs->nc) * sizeof(t)); \
     { int i; for (i=0; i<plhs->nc; i++) Load##t(tmp,i,(t *)(&((plhs->na)[i]))); }
 
+#define FIELDOPTBOOL(n,d) \
+    if (!(tmp = mxGetField(prhs,index,#n))) (plhs->n) = (d); else { \
+    if (!(mxIsLogical(tmp) && (mxGetNumberOfElements(tmp)==1))) mexErrMsgTxt("expected field '" #n "' to be a logical scalar"); \
+    (plhs->n) = *((bool *)mxGetData(tmp)); }
+
+#define FIELDOPTINT(n,d) \
+    if (!(tmp = mxGetField(prhs,index,#n))) (plhs->n) = (d); else { \
+    if (!mxIsNumeric(tmp) || mxGetNumberOfElements(tmp)!=1) mexErrMsgTxt("expected field '" #n "' to be a numeric scalar"); \
+    (plhs->n) = (int) *((double *)mxGetData(tmp)); }
+
+#define FIELDOPTDOUBLE(n,d) \
+    if (!(tmp = mxGetField(prhs,index,#n))) (plhs->n) = (d); else { \
+    if (!mxIsDouble(tmp) || mxGetNumberOfElements(tmp)!=1) mexErrMsgTxt("expected field '" #n "' to be a double scalar"); \
+    (plhs->n) = *((double *)mxGetData(tmp)); }
+
+/* NB: plhs->n should be freed using mxFree upon unloading, unless it equals the default */
+#define FIELDOPTSTRING(n,d) \
+    if (!(tmp = mxGetField(prhs,index,#n))) (plhs->n) = (d); else { \
+    if (!mxIsChar(tmp)) mexErrMsgTxt("expected field '" #n "' to be a string"); \
+    (plhs->n) = mxArrayToString(tmp); }
+
+#define FIELDOPTDYNDOUBLEARRAY(na,nc) \
+    if (!(tmp = mxGetField(prhs,index,#na))) { (plhs->nc) = 0; (plhs->na) = NULL; } else { \
+    if (!mxIsDouble(tmp)) mexErrMsgTxt("expected field '" #na "' to be a double vector"); \
+    (plhs->nc) = (int) mxGetNumberOfElements(tmp); \
+    (plhs->na) = (double *)mxGetData(tmp); }
+
 #  else /* !MEX */
 
 /* 
@@ -193,12 +238,6 @@
 #include "msg.h"
 #include "setup.h"
 
-#define ENTERARRAY(p)	while (*(p)!='[' && *(p)!=0) (p)++; if (*(p)) (p)++
-#define SKIPWHITE(p)	while (*(p)<=' ' && *(p)>0) (p)++
-#define SKIPCOLSEP(p)	while ((*(p)<=' ' && *(p)>0) || *(p)==',') (p)++
-#define SKIPDATA(p)		while (*(p)>' ' && *(p)!=',' && *(p)!=';' && *(p)!=']') (p)++
-#define SKIPROWSEP(p)	SKIPWHITE(p); if (*(p)!=';') { /* error */ } (p)++; SKIPWHITE(p)
-
 #define GETFIELD(n) \
 	pSubItem = SetupFindField(pItem,#n); \
 if (!pSubItem) { MsgPrintf("missing field '"); SetupPrintItemName(pItem); MsgPrintf("." #n "'\n"); return; } 
@@ -207,11 +246,19 @@ if (!pSubItem) { MsgPrintf("missing field '"); SetupPrintItemName(pItem); MsgPri
 	pSubItem = SetupFindStruct(pItem,#n); \
 if (!pSubItem) { MsgPrintf("missing field '"); SetupPrintItemName(pItem); MsgPrintf("." #n "'\n"); return; } 
 
-#define COUNTFIELDS(count) \
-	{ CFileSetupItem *field=pSubItem->data.field; (count)=0; while (field) { field=field->next; (count)++; } } 
+#define GETOPTFIELD(n) \
+	pSubItem = SetupFindField(pItem,#n); \
+	if (pSubItem)
+
+#define COUNTFIELDS(n) \
+	(n) = (int) pSubItem->count; 
 
-int ParseBool(char *str)
+/* scalars are text, or a numeric array when loaded from a binary setup file */
+int ParseBool(CFileSetupItem *item)
 {
+	const char *str = item->data.value;
+	if (item->number)
+		return item->nRows * item->nCols > 0 && item->number[0] != 0.0;
 	if (stricmp(str,"true")==0 || strcmp(str,"1")==0)
 		return 1;
 	if (stricmp(str,"false")==0 || strcmp(str,"0")==0)
@@ -220,131 +267,154 @@ int ParseBool(char *str)
 	return 0;
 }
 
-void ParseIntArray(char *str, int *array, int count)
+int ParseInt(CFileSetupItem *item)
 {
-	int i;
-	ENTERARRAY(str);
-	for (i=0; i<count; i++)	array[i] = (int) strtol(str,&str,10);
-	while (*str<=' ' && *str>0) str++;
-	if (*str!=']') { /* error */ }
+	if (item->number)
+		return item->nRows * item->nCols > 0 ? (int) item->number[0] : 0;
+	return (int) strtol(item->data.value,NULL,10);
 }
 
-void ParseDoubleArray(char *str, double *array, int count)
+double ParseDouble(CFileSetupItem *item)
 {
-	int i;
-	ENTERARRAY(str);
-	for (i=0; i<count; i++)	array[i] = strtod(str,&str);
-	while (*str<=' ' && *str>0) str++;
-	if (*str!=']') { /* error */ }
+	if (item->number)
+		return item->nRows * item->nCols > 0 ? item->number[0] : 0.0;
+	return strtod(item->data.value,NULL);
 }
 
-void GetArrayDims(char *str, int *nr, int *nc)
+/* numeric arrays are parsed while reading the setup file; elements missing from the file are set to zero */
+void ParseIntArray(CFileSetupItem *item, int *array, int count)
 {
-	char *p;
-
-	*nr = 1; 
-	*nc = 0;
-	ENTERARRAY(str); 
-	SKIPWHITE(str);
-
-	p = str;
-	while (*p!=']' && *p!=0)
-	{
-		if (*p++==';') 
-			*nr += 1;
-	}
-
-	p = str;
-	while (*p!=']' && *p!=';' && *p!=0)
-	{
-		SKIPDATA(p);
-		*nc += 1;
-		SKIPCOLSEP(p);
-	}
+	int i, n = item->number ? item->nRows * item->nCols : 0;
+	for (i=0; i<count; i++)	array[i] = i < n ? (int) item->number[i] : 0;
 }
 
-void ParseDynDoubleArray(char *str, double **array, int *count)
+void ParseDoubleArray(CFileSetupItem *item, double *array, int count)
 {
-	int  nr, nc, i;
+	int i, n = item->number ? item->nRows * item->nCols : 0;
+	for (i=0; i<count; i++)	array[i] = i < n ? item->number[i] : 0.0;
+}
 
-	GetArrayDims(str,&nr,&nc);
-	if (nr!=1 || nc==0)
+void ParseDynDoubleArray(CFileSetupItem *item, double **array, int *count)
+{
+	if (!item->number || item->nRows!=1 || item->nCols==0)
 	{
 		*array = NULL; 
 		*count = 0;
 		return;
 	}
-	*array = MemMalloc(nc*sizeof(double));
-	*count = nc;
+	*count = item->nCols;
+	*array = MemMalloc((*count)*sizeof(double));
+	memcpy(*array, item->number, (*count)*sizeof(double));
+}
 
-	ENTERARRAY(str);
-	SKIPWHITE(str);
-	for (i=0; i<*count; i++)
+/* optional arrays may also be a scalar, which is text when read from a text setup file */
+void ParseOptDynDoubleArray(CFileSetupItem *item, double **array, int *count)
+{
+	if (item->number)
 	{
-		(*array)[i] = strtod(str,&str);
-		SKIPCOLSEP(str);
+		ParseDynDoubleArray(item, array, count);
+		return;
 	}
+	*count = 1;
+	*array = MemMalloc(sizeof(double));
+	**array = ParseDouble(item);
 }
 
-void ParseDynDoubleArray2D(char *str, double **array, int *nr, int *nc)
+void ParseDynDoubleArray2D(CFileSetupItem *item, double **array, int *nr, int *nc)
 {
-	int r, c, idx=0;
-
-	GetArrayDims(str,nr,nc);
-	if ((*nr) * (*nc) == 0)
+	if (!item->number || item->nRows * item->nCols == 0)
 	{
 		*nr = 0;
 		*nc = 0;
 		*array = NULL;
 		return;
 	}
-
+	*nr = item->nRows;
+	*nc = item->nCols;
 	*array = MemMalloc((*nr) * (*nc) * sizeof(double));
-
-	ENTERARRAY(str);
-	SKIPWHITE(str);
-	for (r=0; r<(*nr); r++)
-	{
-		for (c=0; c<(*nc); c++)
-		{
-			(*array)[idx++] = strtod(str,&str);
-			SKIPCOLSEP(str);
-		}
-		SKIPROWSEP(str);
-	}
+	memcpy(*array, item->number, (*nr) * (*nc) * sizeof(double));
 }
 
 #    define STRUCTBEGIN(n)			void Load##n(CFileSetupItem *pItem, n *p) { CFileSetupItem *pSubItem;
 #    define STRUCTEND(n)			}
 
-#    define FIELDBOOL(n)			GETFIELD(n); p->n = ParseBool(pSubItem->data.value);
-#    define FIELDINT(n)				GETFIELD(n); p->n = (int) strtol(pSubItem->data.value,NULL,10);
-#    define FIELDDOUBLE(n)			GETFIELD(n); p->n = strtod(pSubItem->data.value,NULL);
+#    define FIELDBOOL(n)			GETFIELD(n); p->n = ParseBool(pSubItem);
+#    define FIELDINT(n)				GETFIELD(n); p->n = ParseInt(pSubItem);
+#    define FIELDDOUBLE(n)			GETFIELD(n); p->n = ParseDouble(pSubItem);
 #    define FIELDSTRING(n)			GETFIELD(n); p->n = pSubItem->data.value;
 #    define FIELDSTRUCT(t,n)		GETSTRUCT(n); Load##t(pSubItem, &p->n);
-#    define FIELDINTARRAY(n,c)		GETFIELD(n); ParseIntArray(pSubItem->data.value, p->n, c);
-#    define FIELDDOUBLEARRAY(n,c)	GETFIELD(n); ParseDoubleArray(pSubItem->data.value, p->n, c);
+#    define FIELDINTARRAY(n,c)		GETFIELD(n); ParseIntArray(pSubItem, p->n, c);
+#    define FIELDDOUBLEARRAY(n,c)	GETFIELD(n); ParseDoubleArray(pSubItem, p->n, c);
 
 #    define FIELDSTRUCTARRAY(t,n,c) \
 	GETSTRUCT(n); \
 	{ int i; pSubItem = pSubItem->data.field; for (i=0; i<p->c; i++) { Load##t(pSubItem->data.field,(t *)&p->n[i]); pSubItem = pSubItem->next; } }
 
 #    define FIELDDYNDOUBLEARRAY(na,nc) \
-	GETFIELD(na); ParseDynDoubleArray(pSubItem->data.value, (double **)&p->na, &p->nc);
+	GETFIELD(na); ParseDynDoubleArray(pSubItem, (double **)&p->na, &p->nc);
 
 #    define FIELDDYNDOUBLEARRAY2D(na,ncR,ncC) \
-	GETFIELD(na); ParseDynDoubleArray2D(pSubItem->data.value, (double **)&p->na, &p->ncR, &p->ncC);
+	GETFIELD(na); ParseDynDoubleArray2D(pSubItem, (double **)&p->na, &p->ncR, &p->ncC);
 
 #    define FIELDDYNSTRUCTARRAY(t,na,nc) \
 	GETSTRUCT(na); COUNTFIELDS(p->nc); \
 	p->na = MemMalloc(p->nc * sizeof(t)); \
 	{ int i; pSubItem=pSubItem->data.field; for (i=0; i<p->nc; i++) { Load##t(pSubItem,(t *)&p->na[i]); pSubItem = pSubItem->next; } }
 
+#    define FIELDOPTBOOL(n,d)		GETOPTFIELD(n) p->n = ParseBool(pSubItem); else p->n = (d);
+#    define FIELDOPTINT(n,d)		GETOPTFIELD(n) p->n = ParseInt(pSubItem); else p->n = (d);
+#    define FIELDOPTDOUBLE(n,d)		GETOPTFIELD(n) p->n = ParseDouble(pSubItem); else p->n = (d);
+#    define FIELDOPTSTRING(n,d)		GETOPTFIELD(n) p->n = pSubItem->data.value; else p->n = (d);
+#    define FIELDOPTDYNDOUBLEARRAY(na,nc) \
+	GETOPTFIELD(na) ParseOptDynDoubleArray(pSubItem, (double **)&p->na, &p->nc); else { p->na = NULL; p->nc = 0; }
+
 #  endif /* MEX */
 
+/***************************
+ * Define savers           *
+ ***************************/
+#elif defined(MSTRUCT_SAVE)
+
+#include "binsetup.h"
+
+/* savers pass every field, with its full path, to the callbacks of a setup writer */
+#define STRUCTBEGIN(n)					static void Save##n(CSetupWriter *w, const char *path, const n *p) { char sub[SETUP_MAXPATH];
+#define STRUCTEND(n)					}
+
+#define SAVEPATH(n)						SetupWriterPath(sub, path, #n, 0)
+#define SAVEINDEX(n,i)					SetupWriterPath(sub, path, #n, i)
+
+#define FIELDBOOL(n)					{ double x = p->n ? 1.0 : 0.0; w->number(w, SAVEPATH(n), &x, 1, 1, 1); }
+#define FIELDINT(n)						{ double x = p->n; w->number(w, SAVEPATH(n), &x, 1, 1, 0); }
+#define FIELDDOUBLE(n)					w->number(w, SAVEPATH(n), &p->n, 1, 1, 0);
+#define FIELDSTRING(n)					w->string(w, SAVEPATH(n), p->n);
+#define FIELDSTRUCT(t,n)				Save##t(w, SAVEPATH(n), &p->n);
+
+#define FIELDINTARRAY(n,c) \
+	{ double x[c]; int i; for (i=0; i<c; i++) x[i] = p->n[i]; w->number(w, SAVEPATH(n), x, 1, c, 0); }
+
+#define FIELDDOUBLEARRAY(n,c)			w->number(w, SAVEPATH(n), p->n, 1, c, 0);
+
+#define FIELDSTRUCTARRAY(t,n,c) \
+	{ int i; for (i=0; i<(int) (sizeof(p->n)/sizeof(p->n[0])); i++) Save##t(w, SAVEINDEX(n,i+1), &p->n[i]); }
+
+#define FIELDDYNDOUBLEARRAY(na,nc)		w->number(w, SAVEPATH(na), p->na, 1, p->nc, 0);
+#define FIELDDYNDOUBLEARRAY2D(na,ncR,ncC) w->number(w, SAVEPATH(na), p->na, p->ncR, p->ncC, 0);
+
+/* writers may store struct arrays in bulk, otherwise each element is saved as na(i) */
+#define FIELDDYNSTRUCTARRAY(t,na,nc) \
+	if (!w->structarray || !w->structarray(w, SAVEPATH(na), p->na, sizeof(t), p->nc)) \
+	{ int i; for (i=0; i<p->nc; i++) Save##t(w, SAVEINDEX(na,i+1), &p->na[i]); }
+
+#define FIELDOPTBOOL(n,d)				FIELDBOOL(n)
+#define FIELDOPTINT(n,d)				FIELDINT(n)
+#define FIELDOPTDOUBLE(n,d)				FIELDDOUBLE(n)
+#define FIELDOPTSTRING(n,d)				FIELDSTRING(n)
+#define FIELDOPTDYNDOUBLEARRAY(na,nc)	if (p->nc > 0) FIELDDYNDOUBLEARRAY(na,nc)
+
 #else
 
-#  error "Specify one of MSTRUCT_DECLARE, MSTRUCT_PROTOTYPE, and MSTRUCT_LOAD"
+#  error "Specify one of MSTRUCT_DECLARE, MSTRUCT_PROTOTYPE, MSTRUCT_LOAD, and MSTRUCT_SAVE"
 
 #endif
 
@@ -384,6 +454,18 @@ STRUCTBEGIN ( COptions )
 	FIELDDOUBLE   ( diffusetimestep     )
 	FIELDDOUBLE   ( rayenergyfloordB    )
 	FIELDBOOL	  ( uncorrelatednoise   )
+	FIELDOPTBOOL  ( diffuselineardomain, false )
+	FIELDOPTINT   ( numberofthreads, 1 )
+	FIELDOPTDOUBLE( diffusetolerancedB, 0 )
+	FIELDOPTINT   ( diffusedirections, 6 )
+	FIELDOPTSTRING( raygenerator, "icosahedron" )
+	FIELDOPTDOUBLE( responsefloordB, 0 )
+	FIELDOPTSTRING( fftwwisdom, "" )
+	FIELDOPTSTRING( fftwplanning, "estimate" )
+	FIELDOPTINT   ( fftwthreads, 1 )
+	FIELDOPTDYNDOUBLEARRAY( filterlength, nFilterLengths )
+	FIELDOPTDOUBLE( transitiontime, 0 )
+	FIELDOPTDOUBLE( trajectorytolerancedB, 0.1 )
 
 	FIELDSTRING	  ( outputname			)
 #	ifdef MEX
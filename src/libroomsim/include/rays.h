@@ -0,0 +1,37 @@
+/*********************************************************************//**
+ * @file rays.h
+ * @brief Ray direction generators for diffuse ray tracing.
+ **********************************************************************/
+
+#ifndef _RAYS_H_50192837465019283746
+#define _RAYS_H_50192837465019283746
+
+#include "types.h"
+
+/** Ray direction generator types. Random rotations and scrambling are drawn
+ *  from a fixed random stream, the same in every run. */
+typedef enum {
+	RG_ICOSAHEDRON,		/**< Subdivided icosahedron, aligned with the room axes (20*k*k rays). */
+	RG_ICOSPHERE,		/**< Subdivided icosahedron, randomly rotated (20*k*k rays). */
+	RG_FIBONACCI,		/**< Spherical Fibonacci lattice, randomly rotated. */
+	RG_SOBOL			/**< Scrambled two-dimensional Sobol sequence, randomly rotated. */
+} CRayGeneratorType;
+
+/** Ray direction generator. Directions are generated on request, in batches. */
+typedef struct {
+	CRayGeneratorType type;
+	int          nRays;			/**< Number of ray directions. */
+	int          stride;		/**< Index stride for interleaved enumeration. */
+	XYZ          *ray;			/**< Precomputed directions (icosahedron types only). */
+	double       rotation[3][3];/**< Rotation applied to all directions. */
+	unsigned int scramble[2];	/**< Digital shift of the Sobol sequence. */
+} CRayGenerator;
+
+int FindRayGenerator(const char *name);
+int CountIcosahedronRays(int nDesiredRays);
+CRayGenerator *AllocRayGenerator(const char *name, int nDesiredRays);
+void InterleaveRayGenerator(CRayGenerator *generator);
+int GetRayDirections(const CRayGenerator *generator, int first, int count, XYZ *ray);
+void FreeRayGenerator(CRayGenerator *generator);
+
+#endif /* _RAYS_H_50192837465019283746 */
@@ -0,0 +1,43 @@
+/*********************************************************************//**
+ * @file realtime.h
+ * @brief Real-time rendering of a setup with moving receivers.
+ *
+ * The renderer filters the signals of the sources, block by block, with
+ * the early reflections of the image sources up to a low reflection
+ * order, recomputed whenever a receiver moves, and with a diffuse tail:
+ * the image sources of higher order and the diffuse reflections, simulated
+ * once for the initial receiver locations and applied by partitioned
+ * convolution.
+ *
+ * Each source signal is split into the frequency bands of the simulation
+ * by linear-phase filters, into delay lines from which every image source
+ * reads at its own fractional delay, weighting the bands with its
+ * attenuation and the directional response of the receiver per channel.
+ * When a receiver moves, the delays and band gains of its images glide
+ * from their old to their new values over the next block. The output is
+ * delayed by the band-splitting filters, see RealtimeLatency.
+ *
+ * Receivers move from a control thread and blocks are processed on an
+ * audio thread, concurrently: updates are computed by the control thread
+ * and passed to the audio thread without locks, which neither allocates
+ * memory nor waits. Each function must be called from one thread at a time.
+ **********************************************************************/
+
+#ifndef _REALTIME_H_27364509182736450912
+#define _REALTIME_H_27364509182736450912
+
+#include "types.h"
+#include "interface.h"
+
+/** Opaque type of a real-time renderer. */
+typedef struct CRealtime CRealtime;
+
+CRealtime *RealtimeInit(const CRoomSetup *pSetup, int blocksize, int maxorder);
+void RealtimeMoveReceiver(CRealtime *rt, int ri, const double *location, const double *orientation);
+void RealtimeProcess(CRealtime *rt, const double *x, double *y);
+int  RealtimeChannels(const CRealtime *rt);
+int  RealtimeLatency(const CRealtime *rt);
+int  RealtimeImageCount(const CRealtime *rt);
+void RealtimeFree(CRealtime *rt);
+
+#endif /* _REALTIME_H_27364509182736450912 */
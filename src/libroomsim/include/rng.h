@@ -11,6 +11,7 @@
 
 /*double RandomUniform(void); */
 void RngInit(sfmt_t *sfmt);
+void RngInitStream(sfmt_t *sfmt, unsigned int stream);
 void RngLambert(sfmt_t *sfmt, XYZ *xyz);
 
 #define RngFill_uint32(sfmt,array,size) RngInit(sfmt);sfmt_fill_array32(sfmt,array,size)
@@ -8,7 +8,9 @@
 
 #include "types.h"
 
-extern CSensorDefinition *LoadSensor(const char *description);
+extern CSensorDefinition *LoadSensor(const char *description, double fs);
+extern CSensorDefinition *TryLoadSensor(const char *description, double fs, char *error);
+extern CSensorDefinition *FindLoadedSensor(const char *description, double fs);
 /*extern void LoadSensor(char *description, CSensorProbeFunction *probe, CSensorData **data); */
 
 int SensorGetResponse(const CSensorDefinition *sensor, const XYZ *xyz, CSensorResponse *response);
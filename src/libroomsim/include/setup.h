@@ -14,16 +14,31 @@ struct CFileSetupItem {
 		struct CFileSetupItem *field;
 	} data;
 	struct CFileSetupItem *next, *prev, *parent;
+
+	/* numeric array values, parsed while reading */
+	double			*number;		/**< Array elements, row by row, or NULL if value is not an array. */
+	int				nRows, nCols;	/**< Array dimensions. */
+
+	/* struct items: fast field lookup and appending */
+	struct CFileSetupItem *last;	/**< Last field of struct. */
+	struct CFileSetupItem **hash;	/**< Hash table of fields, chained through hashnext. */
+	struct CFileSetupItem *hashnext;
+	unsigned int	hashsize;		/**< Number of hash table entries (power of two), or 0. */
+	unsigned int	count;			/**< Number of fields of struct. */
 };
 typedef struct CFileSetupItem CFileSetupItem;
 
+struct CSetupBlock;
+
 typedef struct {
 	CFileSetupItem	root;
-	unsigned long	buflen;
-	char			*buf;
+	struct CSetupBlock *blocks;		/**< Memory holding all items, names, and values. */
+	char			error[256];		/**< Description of parse error, if any. */
 } CFileSetup;
 
+void InitSetup(CFileSetup *pSetup);
 int ReadSetup(char *filename, CFileSetup *pSetup);
+void FreeSetup(CFileSetup *pSetup);
 void PrintSetup(CFileSetupItem *item);
 void SetupPrintItem(CFileSetupItem *item);
 void SetupPrintItemName(CFileSetupItem *item);
@@ -31,5 +46,6 @@ void SetupPrintItemName(CFileSetupItem *item);
 
 CFileSetupItem *SetupFindField(CFileSetupItem *item, char *name);
 CFileSetupItem *SetupFindStruct(CFileSetupItem *item, char *name);
+CFileSetupItem *SetupAddField(CFileSetup *pSetup, const char *path);
 
 #endif /* SETUP_H_2193798154871641379127 */
@@ -0,0 +1,242 @@
+/*********************************************************************//**
+ * @file simd.h
+ * @brief Portable two-lane double precision vector primitives.
+ *
+ * Maps a small set of vector operations onto SSE2 (all x86-64 targets),
+ * NEON (AArch64), or plain C when neither is available. All loads and
+ * stores are unaligned, so arrays allocated with MemMalloc can be used.
+ * VLOADF widens two floats to a vector of doubles.
+ **********************************************************************/
+
+#ifndef _SIMD_H_40918273645519283746
+#define _SIMD_H_40918273645519283746
+
+#include <math.h>
+
+#ifdef _MSC_VER
+#  define SIMD_INLINE static __inline
+#else
+#  define SIMD_INLINE static inline
+#endif
+
+#define VDOUBLE_WIDTH 2     /**< Number of doubles in a vdouble. */
+
+/** Rounds \a n up to a multiple of the vector width. */
+#define VDOUBLE_PAD(n) (((n) + VDOUBLE_WIDTH - 1) & ~(VDOUBLE_WIDTH - 1))
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+
+#  define SIMD_SSE2
+#  include <emmintrin.h>
+
+typedef __m128d vdouble;
+
+#  define VLOAD(p)      _mm_loadu_pd(p)
+#  define VLOADF(p)     _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)(p))))
+#  define VSTORE(p,a)   _mm_storeu_pd(p,a)
+#  define VSET1(x)      _mm_set1_pd(x)
+#  define VADD(a,b)     _mm_add_pd(a,b)
+#  define VSUB(a,b)     _mm_sub_pd(a,b)
+#  define VMUL(a,b)     _mm_mul_pd(a,b)
+#  define VDIV(a,b)     _mm_div_pd(a,b)
+#  define VSQRT(a)      _mm_sqrt_pd(a)
+#  define VMAX(a,b)     _mm_max_pd(a,b)
+#  define VMIN(a,b)     _mm_min_pd(a,b)
+#  define VNEG(a)       _mm_xor_pd(a,_mm_set1_pd(-0.0))
+
+#elif defined(__aarch64__) || defined(_M_ARM64)
+
+#  define SIMD_NEON
+#  include <arm_neon.h>
+
+typedef float64x2_t vdouble;
+
+#  define VLOAD(p)      vld1q_f64(p)
+#  define VLOADF(p)     vcvt_f64_f32(vld1_f32(p))
+#  define VSTORE(p,a)   vst1q_f64(p,a)
+#  define VSET1(x)      vdupq_n_f64(x)
+#  define VADD(a,b)     vaddq_f64(a,b)
+#  define VSUB(a,b)     vsubq_f64(a,b)
+#  define VMUL(a,b)     vmulq_f64(a,b)
+#  define VDIV(a,b)     vdivq_f64(a,b)
+#  define VSQRT(a)      vsqrtq_f64(a)
+#  define VMAX(a,b)     vmaxq_f64(a,b)
+#  define VMIN(a,b)     vminq_f64(a,b)
+#  define VNEG(a)       vnegq_f64(a)
+
+#else
+
+#  define SIMD_SCALAR
+
+typedef struct { double v[2]; } vdouble;
+
+SIMD_INLINE vdouble vload_c(const double *p)          { vdouble r; r.v[0] = p[0]; r.v[1] = p[1]; return r; }
+SIMD_INLINE vdouble vloadf_c(const float *p)          { vdouble r; r.v[0] = p[0]; r.v[1] = p[1]; return r; }
+SIMD_INLINE void    vstore_c(double *p, vdouble a)    { p[0] = a.v[0]; p[1] = a.v[1]; }
+SIMD_INLINE vdouble vset1_c(double x)                 { vdouble r; r.v[0] = x; r.v[1] = x; return r; }
+SIMD_INLINE vdouble vadd_c(vdouble a, vdouble b)      { a.v[0] += b.v[0]; a.v[1] += b.v[1]; return a; }
+SIMD_INLINE vdouble vsub_c(vdouble a, vdouble b)      { a.v[0] -= b.v[0]; a.v[1] -= b.v[1]; return a; }
+SIMD_INLINE vdouble vmul_c(vdouble a, vdouble b)      { a.v[0] *= b.v[0]; a.v[1] *= b.v[1]; return a; }
+SIMD_INLINE vdouble vdiv_c(vdouble a, vdouble b)      { a.v[0] /= b.v[0]; a.v[1] /= b.v[1]; return a; }
+SIMD_INLINE vdouble vsqrt_c(vdouble a)                { a.v[0] = sqrt(a.v[0]); a.v[1] = sqrt(a.v[1]); return a; }
+SIMD_INLINE vdouble vmax_c(vdouble a, vdouble b)      { a.v[0] = a.v[0]>b.v[0] ? a.v[0] : b.v[0]; a.v[1] = a.v[1]>b.v[1] ? a.v[1] : b.v[1]; return a; }
+SIMD_INLINE vdouble vmin_c(vdouble a, vdouble b)      { a.v[0] = a.v[0]<b.v[0] ? a.v[0] : b.v[0]; a.v[1] = a.v[1]<b.v[1] ? a.v[1] : b.v[1]; return a; }
+
+#  define VLOAD(p)      vload_c(p)
+#  define VLOADF(p)     vloadf_c(p)
+#  define VSTORE(p,a)   vstore_c(p,a)
+#  define VSET1(x)      vset1_c(x)
+#  define VADD(a,b)     vadd_c(a,b)
+#  define VSUB(a,b)     vsub_c(a,b)
+#  define VMUL(a,b)     vmul_c(a,b)
+#  define VDIV(a,b)     vdiv_c(a,b)
+#  define VSQRT(a)      vsqrt_c(a)
+#  define VMAX(a,b)     vmax_c(a,b)
+#  define VMIN(a,b)     vmin_c(a,b)
+#  define VNEG(a)       vsub_c(vset1_c(0.0),a)
+
+#endif
+
+/** Natural exponent of both lanes of \a x.
+ *
+ *  @note
+ *     Uses the Cephes rational approximation of exp on [-ln2/2, ln2/2],
+ *     which is accurate to about one ulp. Arguments below -708 return 0,
+ *     arguments above 709 are clamped.
+ */
+SIMD_INLINE vdouble VEXP(vdouble x)
+{
+#if defined(SIMD_SCALAR)
+	x.v[0] = exp(x.v[0]);
+	x.v[1] = exp(x.v[1]);
+	return x;
+#else
+	const vdouble p0 = VSET1(1.26177193074810590878E-4);
+	const vdouble p1 = VSET1(3.02994407707441961300E-2);
+	const vdouble p2 = VSET1(9.99999999999999999910E-1);
+	const vdouble q0 = VSET1(3.00198505138664455042E-6);
+	const vdouble q1 = VSET1(2.52448340349684104192E-3);
+	const vdouble q2 = VSET1(2.27265548208155028766E-1);
+	const vdouble q3 = VSET1(2.00000000000000000009E0);
+	vdouble k, r, rr, px, qx, e;
+
+	/* reduce x = k ln(2) + r, with |r| <= ln(2)/2 */
+	x  = VMIN(x, VSET1(709.0));
+#  if defined(SIMD_SSE2)
+	{
+		/* adding and subtracting 1.5*2^52 rounds to nearest integer */
+		const __m128d magic = _mm_set1_pd(6755399441055744.0);
+		__m128d xc = _mm_max_pd(x, _mm_set1_pd(-708.0));
+		k = _mm_sub_pd(_mm_add_pd(_mm_mul_pd(xc, _mm_set1_pd(1.4426950408889634074)), magic), magic);
+		r = _mm_sub_pd(xc, _mm_mul_pd(k, _mm_set1_pd(6.93145751953125E-1)));
+		r = _mm_sub_pd(r,  _mm_mul_pd(k, _mm_set1_pd(1.42860682030941723212E-6)));
+	}
+#  else
+	{
+		float64x2_t xc = vmaxq_f64(x, vdupq_n_f64(-708.0));
+		k = vrndnq_f64(vmulq_f64(xc, vdupq_n_f64(1.4426950408889634074)));
+		r = vsubq_f64(xc, vmulq_f64(k, vdupq_n_f64(6.93145751953125E-1)));
+		r = vsubq_f64(r,  vmulq_f64(k, vdupq_n_f64(1.42860682030941723212E-6)));
+	}
+#  endif
+
+	/* rational approximation exp(r) = 1 + 2 r P(r^2) / (Q(r^2) - r P(r^2)) */
+	rr = VMUL(r, r);
+	px = VMUL(r, VADD(VMUL(VADD(VMUL(p0, rr), p1), rr), p2));
+	qx = VADD(VMUL(VADD(VMUL(VADD(VMUL(q0, rr), q1), rr), q2), rr), q3);
+	e  = VADD(VSET1(1.0), VMUL(VSET1(2.0), VDIV(px, VSUB(qx, px))));
+
+	/* scale by 2^k, and flush arguments below -708 to zero */
+#  if defined(SIMD_SSE2)
+	{
+		__m128i ki = _mm_add_epi32(_mm_cvtpd_epi32(k), _mm_set1_epi32(1023));
+		ki = _mm_slli_epi64(_mm_shuffle_epi32(ki, _MM_SHUFFLE(3,1,3,0)), 52);
+		e  = _mm_mul_pd(e, _mm_castsi128_pd(ki));
+		return _mm_and_pd(e, _mm_cmpge_pd(x, _mm_set1_pd(-708.0)));
+	}
+#  else
+	{
+		int64x2_t ki = vshlq_n_s64(vaddq_s64(vcvtq_s64_f64(k), vdupq_n_s64(1023)), 52);
+		e = vmulq_f64(e, vreinterpretq_f64_s64(ki));
+		return vreinterpretq_f64_u64(vandq_u64(vreinterpretq_u64_f64(e), vcgeq_f64(x, vdupq_n_f64(-708.0))));
+	}
+#  endif
+#endif
+}
+
+/** Sine and cosine of both lanes of \a x.
+ *
+ *  @note
+ *     Uses the Cephes reduction to [-pi/4, pi/4] and polynomials of sin
+ *     and cos, which are accurate to about one ulp for |x| < 2^30.
+ */
+SIMD_INLINE void VSINCOS(vdouble x, vdouble *s, vdouble *c)
+{
+#if defined(SIMD_SCALAR)
+	s->v[0] = sin(x.v[0]); c->v[0] = cos(x.v[0]);
+	s->v[1] = sin(x.v[1]); c->v[1] = cos(x.v[1]);
+#else
+	const vdouble s0 = VSET1( 1.58962301576546568060E-10);
+	const vdouble s1 = VSET1(-2.50507477628578072866E-8);
+	const vdouble s2 = VSET1( 2.75573136213857245213E-6);
+	const vdouble s3 = VSET1(-1.98412698295895385996E-4);
+	const vdouble s4 = VSET1( 8.33333333332211858878E-3);
+	const vdouble s5 = VSET1(-1.66666666666666307295E-1);
+	const vdouble c0 = VSET1(-1.13585365213876817300E-11);
+	const vdouble c1 = VSET1( 2.08757008419747316778E-9);
+	const vdouble c2 = VSET1(-2.75573141792967388112E-7);
+	const vdouble c3 = VSET1( 2.48015872888517045348E-5);
+	const vdouble c4 = VSET1(-1.38888888888730564116E-3);
+	const vdouble c5 = VSET1( 4.16666666666665929218E-2);
+	vdouble ax, y, z, zz, ps, pc;
+
+	/* reduce |x| = y pi/4 + z, with y even and |z| <= pi/4; the octant 
+	   y mod 8 selects the polynomial and the signs of sin and cos */
+#  if defined(SIMD_SSE2)
+	__m128i j, m;
+	__m128d swap, sneg, cneg, sign = _mm_set1_pd(-0.0);
+
+	ax = _mm_andnot_pd(sign, x);
+	j  = _mm_cvttpd_epi32(_mm_mul_pd(ax, _mm_set1_pd(1.27323954473516268615)));
+	j  = _mm_and_si128(_mm_add_epi32(j, _mm_set1_epi32(1)), _mm_set1_epi32(~1));
+	y  = _mm_cvtepi32_pd(j);
+	j  = _mm_shuffle_epi32(j, _MM_SHUFFLE(1,1,0,0));
+	m  = _mm_set1_epi32(2); swap = _mm_castsi128_pd(_mm_cmpeq_epi32(_mm_and_si128(j, m), m));
+	m  = _mm_set1_epi32(4); sneg = _mm_and_pd(sign, _mm_castsi128_pd(_mm_cmpeq_epi32(_mm_and_si128(j, m), m)));
+	cneg = _mm_and_pd(sign, _mm_castsi128_pd(_mm_cmpeq_epi32(_mm_and_si128(_mm_add_epi32(j, _mm_set1_epi32(2)), m), m)));
+	sneg = _mm_xor_pd(sneg, _mm_and_pd(sign, x));
+#  else
+	int64x2_t j;
+	uint64x2_t swap, sneg, cneg, sign = vreinterpretq_u64_f64(vdupq_n_f64(-0.0));
+
+	ax = vabsq_f64(x);
+	j  = vcvtq_s64_f64(vmulq_f64(ax, vdupq_n_f64(1.27323954473516268615)));
+	j  = vandq_s64(vaddq_s64(j, vdupq_n_s64(1)), vdupq_n_s64(~1));
+	y  = vcvtq_f64_s64(j);
+	swap = vtstq_s64(j, vdupq_n_s64(2));
+	sneg = vandq_u64(sign, vtstq_s64(j, vdupq_n_s64(4)));
+	cneg = vandq_u64(sign, vtstq_s64(vaddq_s64(j, vdupq_n_s64(2)), vdupq_n_s64(4)));
+	sneg = veorq_u64(sneg, vandq_u64(sign, vreinterpretq_u64_f64(x)));
+#  endif
+
+	z  = VSUB(ax, VMUL(y, VSET1(7.85398125648498535156E-1)));
+	z  = VSUB(z,  VMUL(y, VSET1(3.77489470793079817668E-8)));
+	z  = VSUB(z,  VMUL(y, VSET1(2.69515142907905952645E-15)));
+	zz = VMUL(z, z);
+	ps = VADD(VMUL(VADD(VMUL(VADD(VMUL(VADD(VMUL(VADD(VMUL(s0, zz), s1), zz), s2), zz), s3), zz), s4), zz), s5);
+	ps = VADD(z, VMUL(VMUL(z, zz), ps));
+	pc = VADD(VMUL(VADD(VMUL(VADD(VMUL(VADD(VMUL(VADD(VMUL(c0, zz), c1), zz), c2), zz), c3), zz), c4), zz), c5);
+	pc = VADD(VSUB(VSET1(1.0), VMUL(VSET1(0.5), zz)), VMUL(VMUL(zz, zz), pc));
+
+	/* select polynomials per octant and apply signs */
+#  if defined(SIMD_SSE2)
+	*s = _mm_xor_pd(_mm_or_pd(_mm_and_pd(swap, pc), _mm_andnot_pd(swap, ps)), sneg);
+	*c = _mm_xor_pd(_mm_or_pd(_mm_and_pd(swap, ps), _mm_andnot_pd(swap, pc)), cneg);
+#  else
+	*s = vreinterpretq_f64_u64(veorq_u64(vreinterpretq_u64_f64(vbslq_f64(swap, pc, ps)), sneg));
+	*c = vreinterpretq_f64_u64(veorq_u64(vreinterpretq_u64_f64(vbslq_f64(swap, ps, pc)), cneg));
+#  endif
+#endif
+}
+
+#endif /* _SIMD_H_40918273645519283746 */
@@ -0,0 +1,56 @@
+/*********************************************************************//**
+ * @file sweep.h
+ * @brief Simulation of many source/receiver configurations of one setup.
+ *
+ * A sweep table holds one row per configuration, with the location and
+ * orientation (x y z yaw pitch roll) of every source of the setup,
+ * followed by those of every receiver. All other parameters, including
+ * the sensor descriptions, are taken from the setup.
+ *
+ * Sweep tables are read from text files, with values separated by commas
+ * or white space, one configuration per line, or from binary files: the
+ * signature SWEEP_MAGIC, a 32-bit version and number of columns, a 64-bit
+ * number of rows, and the table as rows of doubles, all little-endian.
+ *
+ * Configurations that differ in receiver orientations only, as in head
+ * rotation datasets, are rendered from a single simulation of the image
+ * sources and diffuse tails, applying only the receivers' directional
+ * responses per orientation.
+ *
+ * Trajectories of moving sources and receivers are tables of the same form,
+ * with the time of each row in a leading column. They are sampled at a 
+ * fixed time step into frames, whose responses are simulated in parallel, 
+ * tracking the image sources from frame to frame.
+ **********************************************************************/
+
+#ifndef _SWEEP_H_81726354019283746512
+#define _SWEEP_H_81726354019283746512
+
+#include "interface.h"
+#include "types.h"
+
+#define SWEEP_MAGIC		"SMRSWEEP"	/**< Signature of binary sweep tables, without terminating NUL. */
+#define SWEEP_VERSION	1			/**< Current version of the binary sweep table format. */
+
+/** Table of source and receiver poses, one row per configuration. */
+typedef struct {
+	int    nConfigs;			/**< Number of configurations (rows). */
+	int    nCols;				/**< Number of values per configuration, 6 per sensor. */
+	double *pose;				/**< Table, row by row. */
+	char   error[256];			/**< Description of read error, if any. */
+} CSweepTable;
+
+/** Receives the responses of configuration \a iConfig, whose setup is \a pSetup.
+ *  Calls are serialized, in order of completion; \a brir is released afterwards. */
+typedef void (*CSweepCallback)(int iConfig, const CRoomSetup *pSetup, const BRIR *brir, void *arg);
+
+int  ReadSweepTable(const char *filename, int nCols, CSweepTable *table);
+int  WriteSweepTable(const char *filename, const CSweepTable *table);
+void FreeSweepTable(CSweepTable *table);
+int  ResampleTrajectory(const CSweepTable *trajectory, double timestep, CSweepTable *frames);
+void RoomsimSweep(const CRoomSetup *pSetup, const CSweepTable *table, CSweepCallback callback, void *arg);
+BRIR *RoomsimOrientations(const CRoomSetup *pSetup, const double *orientation, int nOrientations,
+						  CSweepCallback callback, void *arg);
+void RoomsimTrajectory(const CRoomSetup *pSetup, const CSweepTable *frames, CSweepCallback callback, void *arg);
+
+#endif /* _SWEEP_H_81726354019283746512 */
@@ -0,0 +1,48 @@
+/*********************************************************************//**
+ * @file thread.h
+ * @brief Portable threading primitives.
+ *
+ * Thin wrappers around POSIX threads and the Win32 thread API. Worker 
+ * functions must not call MemMalloc or the Msg* routines, since those map
+ * onto the (single-threaded) MATLAB API in MEX builds. Allocate buffers
+ * beforehand on the calling thread instead.
+ **********************************************************************/
+
+#ifndef _THREAD_H_64019283746510298374
+#define _THREAD_H_64019283746510298374
+
+#ifdef _WIN32
+#  ifndef WIN32_LEAN_AND_MEAN
+#    define WIN32_LEAN_AND_MEAN
+#  endif
+#  include <windows.h>
+typedef SRWLOCK CMutex;
+typedef CONDITION_VARIABLE CCondition;
+#  define MUTEX_INITIALIZER SRWLOCK_INIT
+#  define CONDITION_INITIALIZER CONDITION_VARIABLE_INIT
+#else
+#  include <pthread.h>
+typedef pthread_mutex_t CMutex;
+typedef pthread_cond_t CCondition;
+#  define MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#  define CONDITION_INITIALIZER PTHREAD_COND_INITIALIZER
+#endif
+
+/** Worker function, called with the index of the thread it runs on. */
+typedef void (*CThreadFunction)(int iThread, void *arg);
+
+int  ThreadCount(int nRequested);
+void ThreadRun(int nThreads, CThreadFunction function, void *arg);
+
+void MutexInit(CMutex *mutex);
+void MutexDestroy(CMutex *mutex);
+void MutexLock(CMutex *mutex);
+void MutexUnlock(CMutex *mutex);
+
+void ConditionWait(CCondition *condition, CMutex *mutex);
+void ConditionBroadcast(CCondition *condition);
+
+long AtomicIncrement(volatile long *value);
+long AtomicExchange(volatile long *value, long x);
+
+#endif /* _THREAD_H_64019283746510298374 */
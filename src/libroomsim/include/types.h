@@ -26,22 +26,33 @@ typedef struct {
     double az, el;
 } AZEL;
 
+/* storage type of responses and diffuse tail buffers; building with
+   FLOAT_STORAGE halves their memory, computations remain in double */
+#ifdef FLOAT_STORAGE
+typedef float SAMPLE;
+#else
+typedef double SAMPLE;
+#endif
+
 typedef struct
 {
     double  fs;
     int     nChannels;
     int     nSamples;
-    double  *sample;
+    int     offset;         /* index of first sample; nonzero for sparse responses only */
+    SAMPLE  *sample;
 } BRIR;
 
 /* forward declaration of CSensorDefinition */
 typedef struct CSensorDefinition CSensorDefinition;
 
-typedef void (*CSensorInitFunction)(const char *, CSensorDefinition*);
+typedef int (*CSensorInitFunction)(const char *, CSensorDefinition*, double);
 /*typedef void (*CSensorExitFunction)(void *); */
 
 typedef double (*CSensorProbeLogGainFunction)(const CSensorDefinition*, const XYZ*);
 typedef int (*CSensorProbeXyz2IdxFunction)(const CSensorDefinition*, const XYZ*);
+typedef int (*CSensorProbeGainsFunction)(const CSensorDefinition*, const XYZ*, double*);
+typedef int (*CSensorProbeElementsFunction)(const CSensorDefinition*, const XYZ*, double, double*);
 /*typedef const double *(*CSensorProbeWeightsFunction)(const XYZ*, void *); */
 /*typedef const double *(*CSensorProbeResponseFunction)(const XYZ*, void *); */
 
@@ -50,6 +61,8 @@ typedef union CSensorProbeFunction
 {
     CSensorProbeLogGainFunction  loggain;
     CSensorProbeXyz2IdxFunction	 xyz2idx;
+    CSensorProbeGainsFunction    gains;
+    CSensorProbeElementsFunction elements;
     /*CSensorProbeWeightsFunction  weights; */
     /*CSensorProbeResponseFunction response; */
 } CSensorProbeFunction;
@@ -59,20 +72,28 @@ typedef struct CSensorResponse
     enum {
 		SR_LOGGAIN, 
 		SR_LOGWEIGHTS, 
-		SR_IMPULSERESPONSE
+		SR_IMPULSERESPONSE,
+		SR_GAINS,
+		SR_ELEMENTS
 	} type;
 	union {
 		double loggain;
 		double *logweights;
 		double *impulseresponse;
+		double *gains;		/**< Linear, signed gain per channel. */
+		double *elements;	/**< Linear gain per array element, followed by its path length difference to the array origin [m]. */
 	} data;
+	double *buffer;		/**< Caller's buffer receiving impulse responses, gains, or elements; impulse responses may use the sensor's own buffer when NULL. */
+	double distance;	/**< Distance of the probed point source for array sensors [m], or 0 for a plane wave. */
 } CSensorResponse;
 
 struct CSensorDefinition {
     enum {
 		ST_LOGGAIN, 
 		ST_LOGWEIGHTS, 
-		ST_IMPULSERESPONSE
+		ST_IMPULSERESPONSE,
+		ST_GAINS,
+		ST_ARRAY
 	} type;
 
     CSensorProbeFunction probe;
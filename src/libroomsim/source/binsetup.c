@@ -0,0 +1,754 @@
+/*********************************************************************//**
+ * @file binsetup.c
+ * @brief Binary setup files and setup file conversion.
+ *
+ * Binary setup files are mapped into memory with copy-on-write access,
+ * so that byte order and sensor descriptions can be fixed up in place.
+ * Both the binary and the text writer are driven by the savers that
+ * mstruct.h generates from the parameter structure, so that every field
+ * of CRoomSetup is written.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#  ifndef WIN32_LEAN_AND_MEAN
+#    define WIN32_LEAN_AND_MEAN
+#  endif
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+#include "binsetup.h"
+#include "defs.h"
+#include "mem.h"
+
+/* disable warnings about unsafe CRT functions */
+#ifdef _MSC_VER
+#  pragma warning( disable : 4996)
+#endif
+
+/* savers */
+#undef MSTRUCT_DECLARE
+#undef MSTRUCT_PROTOTYPE
+#undef MSTRUCT_LOAD
+#define MSTRUCT_SAVE
+#include "mstruct.h"
+
+#define BINSETUP_ALIGN(n)	(((n) + 7) & ~(uint64_t) 7)	/**< Rounds up to a multiple of 8 bytes. */
+#define BINSETUP_CHUNK		512							/**< Number of records converted per write. */
+
+/* sensor records can be used in place if CSensor has the same layout */
+#define SENSOR_INPLACE (sizeof(CSensor) == sizeof(CBinarySensor) && \
+	offsetof(CSensor, orientation) == offsetof(CBinarySensor, orientation) && \
+	offsetof(CSensor, description) == offsetof(CBinarySensor, description))
+
+/** Builds the path of a field, as path.name or path.name(index) if \a index is positive. */
+char *SetupWriterPath(char *buffer, const char *path, const char *name, int index)
+{
+	size_t len = strlen(path);
+
+	if (len > SETUP_MAXPATH - 80)
+		len = SETUP_MAXPATH - 80;
+	memcpy(buffer, path, len);
+	if (len > 0)
+		buffer[len++] = '.';
+	if (index > 0)
+		sprintf(buffer + len, "%.60s(%d)", name, index);
+	else
+		sprintf(buffer + len, "%.60s", name);
+	return buffer;
+}
+
+/** Checks the extension of a setup file name. */
+int IsBinarySetup(const char *filename)
+{
+	size_t len = strlen(filename), extlen = strlen(BINSETUP_EXTENSION);
+	return len > extlen && stricmp(filename + len - extlen, BINSETUP_EXTENSION) == 0;
+}
+
+static int IsLittleEndian(void)
+{
+	const uint32_t one = 1;
+	return *(const unsigned char *) &one == 1;
+}
+
+/** Reverses the byte order of \a count words of \a size bytes. */
+static void SwapBytes(void *data, size_t count, size_t size)
+{
+	unsigned char *p = (unsigned char *) data, tmp;
+	size_t i, j;
+
+	for (i=0; i<count; i++, p+=size)
+		for (j=0; j<size/2; j++)
+		{
+			tmp = p[j];
+			p[j] = p[size-1-j];
+			p[size-1-j] = tmp;
+		}
+}
+
+static void PutU32(unsigned char *p, uint32_t x)
+{
+	int i;
+	for (i=0; i<4; i++, x>>=8) p[i] = (unsigned char) x;
+}
+
+static void PutU64(unsigned char *p, uint64_t x)
+{
+	int i;
+	for (i=0; i<8; i++, x>>=8) p[i] = (unsigned char) x;
+}
+
+static void PutDouble(unsigned char *p, double x)
+{
+	uint64_t u;
+	memcpy(&u, &x, sizeof(u));
+	PutU64(p, u);
+}
+
+
+/*******************************************************************************
+ * Text writer
+ ******************************************************************************/
+
+typedef struct {
+	CSetupWriter w;
+	FILE         *fid;
+} CTextWriter;
+
+/** Formats a number with 15 significant digits, or with 17 if needed to read it back exactly. */
+static void FormatNumber(char *buffer, double x)
+{
+	sprintf(buffer, "%.15g", x);
+	if (strtod(buffer, NULL) != x)
+		sprintf(buffer, "%.17g", x);
+}
+
+static void TextNumber(CSetupWriter *w, const char *path, const double *data, int nRows, int nCols, int isbool)
+{
+	FILE *fid = ((CTextWriter *) w)->fid;
+	char number[32];
+	int  r, c;
+
+	if (isbool)
+	{
+		fprintf(fid, "%s = %s;\n", path, data[0] != 0.0 ? "true" : "false");
+	}
+	else if (nRows == 1 && nCols == 1)
+	{
+		FormatNumber(number, data[0]);
+		fprintf(fid, "%s = %s;\n", path, number);
+	}
+	else
+	{
+		fprintf(fid, "%s = [", path);
+		for (r=0; r<nRows; r++)
+		{
+			for (c=0; c<nCols; c++)
+			{
+				FormatNumber(number, data[r*nCols + c]);
+				fprintf(fid, " %s", number);
+			}
+			if (r < nRows-1)
+				fprintf(fid, ";\n   ");
+		}
+		fprintf(fid, " ];\n");
+	}
+}
+
+static void TextString(CSetupWriter *w, const char *path, const char *value)
+{
+	fprintf(((CTextWriter *) w)->fid, "%s = '%s';\n", path, value ? value : "");
+}
+
+/** Writes a setup to a text setup file.
+ *
+ *	@param[in]  filename	Name of setup file.
+ *	@param[in]  setup		Room setup.
+ *	@return					1 on success, or -1 if the file cannot be written.
+ */
+int WriteTextSetup(const char *filename, const CRoomSetup *setup)
+{
+	CTextWriter writer;
+	int         failed;
+
+	writer.w.number      = TextNumber;
+	writer.w.string      = TextString;
+	writer.w.structarray = NULL;
+	writer.fid = fopen(filename, "w");
+	if (!writer.fid)
+		return -1;
+
+	SaveCRoomSetup(&writer.w, "", setup);
+
+	failed = ferror(writer.fid);
+	return fclose(writer.fid) == 0 && !failed ? 1 : -1;
+}
+
+
+/*******************************************************************************
+ * Binary writer
+ ******************************************************************************/
+
+typedef struct {
+	CSetupWriter      w;
+	CBinarySetupField *field;		/**< Field table, data offsets relative to the data section. */
+	const void        **data;		/**< Sensor array of each sensor field. */
+	uint64_t          **description;/**< Description offsets of each sensor field. */
+	int               nFields, maxFields;
+	char              *strings;		/**< String table. */
+	size_t            stringsize, maxstringsize;
+	size_t            *hash;		/**< Hash table of string table offsets plus one, for sharing strings. */
+	size_t            hashsize, nHashed;
+	double            *number;		/**< Copies of numeric arrays, in the order of the data section. */
+	size_t            numbersize, maxnumbersize;
+	uint64_t          datasize;
+	int               error;
+} CBinaryWriter;
+
+static size_t StringHash(const char *str)
+{
+	size_t h = 2166136261U;
+	while (*str)
+	{
+		h ^= (unsigned char) *str++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/** Adds a string to the string table, or finds an identical string there. */
+static uint64_t AddString(CBinaryWriter *bw, const char *str)
+{
+	size_t len = strlen(str) + 1, h, i;
+
+	if (bw->error)
+		return 0;
+
+	/* grow hash table at load factor one half */
+	if (2 * (bw->nHashed + 1) > bw->hashsize)
+	{
+		size_t *old = bw->hash, oldsize = bw->hashsize;
+		bw->hashsize = oldsize ? 2 * oldsize : 1024;
+		bw->hash = (size_t *) calloc(bw->hashsize, sizeof(size_t));
+		if (!bw->hash)
+		{
+			bw->error = 1;
+			free(old);
+			return 0;
+		}
+		for (i=0; i<oldsize; i++)
+			if (old[i])
+			{
+				for (h=StringHash(bw->strings + old[i] - 1); bw->hash[h & (bw->hashsize-1)]; h++)
+					;
+				bw->hash[h & (bw->hashsize-1)] = old[i];
+			}
+		free(old);
+	}
+
+	for (h=StringHash(str); bw->hash[h & (bw->hashsize-1)]; h++)
+		if (strcmp(bw->strings + bw->hash[h & (bw->hashsize-1)] - 1, str) == 0)
+			return bw->hash[h & (bw->hashsize-1)] - 1;
+
+	if (bw->stringsize + len > bw->maxstringsize)
+	{
+		char *strings;
+		bw->maxstringsize = 2 * (bw->stringsize + len) + 4096;
+		strings = (char *) realloc(bw->strings, bw->maxstringsize);
+		if (!strings)
+		{
+			bw->error = 1;
+			return 0;
+		}
+		bw->strings = strings;
+	}
+	memcpy(bw->strings + bw->stringsize, str, len);
+	bw->hash[h & (bw->hashsize-1)] = bw->stringsize + 1;
+	bw->nHashed++;
+	bw->stringsize += len;
+	return bw->stringsize - len;
+}
+
+static CBinarySetupField *AddField(CBinaryWriter *bw, const char *path, int type, int nRows, int nCols, const void *data)
+{
+	CBinarySetupField *field;
+
+	if (bw->error)
+		return NULL;
+
+	if (bw->nFields == bw->maxFields)
+	{
+		bw->maxFields   = bw->maxFields ? 2 * bw->maxFields : 64;
+		bw->field       = (CBinarySetupField *) realloc(bw->field, bw->maxFields * sizeof(CBinarySetupField));
+		bw->data        = (const void **) realloc((void *) bw->data, bw->maxFields * sizeof(const void *));
+		bw->description = (uint64_t **) realloc(bw->description, bw->maxFields * sizeof(uint64_t *));
+		if (!bw->field || !bw->data || !bw->description)
+		{
+			bw->error = 1;
+			return NULL;
+		}
+	}
+
+	field = &bw->field[bw->nFields];
+	field->type  = type;
+	field->nRows = nRows > 0 ? nRows : 0;
+	field->nCols = nCols > 0 ? nCols : 0;
+	field->path  = (uint32_t) AddString(bw, path);
+	field->data  = bw->datasize;
+	bw->data[bw->nFields] = data;
+	bw->description[bw->nFields] = NULL;
+	bw->nFields++;
+
+	if (type == BS_NUMBER)
+		bw->datasize += (uint64_t) field->nRows * field->nCols * sizeof(double);
+	else if (type == BS_SENSOR)
+		bw->datasize += (uint64_t) field->nRows * sizeof(CBinarySensor);
+
+	return field;
+}
+
+/* numbers are copied, since savers may pass temporary arrays */
+static void BinaryNumber(CSetupWriter *w, const char *path, const double *data, int nRows, int nCols, int isbool)
+{
+	CBinaryWriter     *bw = (CBinaryWriter *) w;
+	CBinarySetupField *field = AddField(bw, path, BS_NUMBER, data ? nRows : 0, data ? nCols : 0, NULL);
+	size_t            count;
+
+	(void) isbool;
+	if (!field)
+		return;
+
+	count = (size_t) field->nRows * field->nCols;
+	if (bw->numbersize + count > bw->maxnumbersize)
+	{
+		double *number;
+		bw->maxnumbersize = 2 * (bw->numbersize + count) + 256;
+		number = (double *) realloc(bw->number, bw->maxnumbersize * sizeof(double));
+		if (!number)
+		{
+			bw->error = 1;
+			return;
+		}
+		bw->number = number;
+	}
+	memcpy(bw->number + bw->numbersize, data, count * sizeof(double));
+	bw->numbersize += count;
+}
+
+static void BinaryString(CSetupWriter *w, const char *path, const char *value)
+{
+	CBinaryWriter     *bw = (CBinaryWriter *) w;
+	CBinarySetupField *field = AddField(bw, path, BS_STRING, 1, 1, NULL);
+
+	if (field)
+		field->data = AddString(bw, value ? value : "");
+}
+
+/* the only dynamic struct arrays are the source and receiver arrays */
+static int BinaryStructArray(CSetupWriter *w, const char *path, const void *data, size_t size, int count)
+{
+	CBinaryWriter     *bw = (CBinaryWriter *) w;
+	const CSensor     *sensor = (const CSensor *) data;
+	CBinarySetupField *field;
+	uint64_t          *description;
+	int               i;
+
+	if (size != sizeof(CSensor))
+		return 0;
+
+	field = AddField(bw, path, BS_SENSOR, data ? count : 0, 1, data);
+	if (!field)
+		return 1;
+
+	description = (uint64_t *) malloc((field->nRows + 1) * sizeof(uint64_t));
+	if (!description)
+	{
+		bw->error = 1;
+		return 1;
+	}
+	for (i=0; i<(int) field->nRows; i++)
+		description[i] = AddString(bw, sensor[i].description ? sensor[i].description : "");
+	bw->description[bw->nFields-1] = description;
+
+	return 1;
+}
+
+/** Writes the data of a numeric or sensor field in little-endian byte order. */
+static void WriteFieldData(FILE *fid, const CBinarySetupField *field, const void *data, const uint64_t *description)
+{
+	unsigned char buf[BINSETUP_CHUNK * sizeof(CBinarySensor)], *p;
+	size_t i, n, count;
+	int    j;
+
+	if (field->type == BS_NUMBER)
+	{
+		const double *number = (const double *) data;
+		count = (size_t) field->nRows * field->nCols;
+		for (i=0; i<count; i+=n)
+		{
+			n = count - i < BINSETUP_CHUNK ? count - i : BINSETUP_CHUNK;
+			for (j=0; j<(int) n; j++)
+				PutDouble(buf + j * sizeof(double), number[i + j]);
+			fwrite(buf, sizeof(double), n, fid);
+		}
+	}
+	else if (field->type == BS_SENSOR)
+	{
+		const CSensor *sensor = (const CSensor *) data;
+		count = field->nRows;
+		for (i=0; i<count; i+=n)
+		{
+			n = count - i < BINSETUP_CHUNK ? count - i : BINSETUP_CHUNK;
+			for (p=buf; p<buf + n * sizeof(CBinarySensor); p+=sizeof(CBinarySensor), sensor++, description++)
+			{
+				for (j=0; j<3; j++)
+				{
+					PutDouble(p + j * sizeof(double), sensor->location[j]);
+					PutDouble(p + (3 + j) * sizeof(double), sensor->orientation[j]);
+				}
+				PutU64(p + offsetof(CBinarySensor, description), *description);
+			}
+			fwrite(buf, sizeof(CBinarySensor), n, fid);
+		}
+	}
+}
+
+/** Writes a setup to a binary setup file.
+ *
+ *	@param[in]  filename	Name of setup file.
+ *	@param[in]  setup		Room setup.
+ *	@return					1 on success, or -1 if the file cannot be written.
+ */
+int WriteBinarySetup(const char *filename, const CRoomSetup *setup)
+{
+	static const unsigned char padding[8] = { 0 };
+	unsigned char header[sizeof(CBinarySetupHeader)], entry[sizeof(CBinarySetupField)];
+	CBinaryWriter writer;
+	uint64_t      fieldoffset, stringoffset, stringsize, dataoffset;
+	FILE          *fid = NULL;
+	size_t        n;
+	int           i, result = -1;
+
+	/* collect fields and strings */
+	memset(&writer, 0, sizeof(writer));
+	writer.w.number      = BinaryNumber;
+	writer.w.string      = BinaryString;
+	writer.w.structarray = BinaryStructArray;
+	SaveCRoomSetup(&writer.w, "", setup);
+	if (writer.error)
+		goto done;
+
+	/* lay out file */
+	fieldoffset  = BINSETUP_ALIGN(sizeof(CBinarySetupHeader));
+	stringoffset = fieldoffset + writer.nFields * sizeof(CBinarySetupField);
+	stringsize   = BINSETUP_ALIGN(writer.stringsize);
+	dataoffset   = stringoffset + stringsize;
+
+	fid = fopen(filename, "wb");
+	if (!fid)
+		goto done;
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, BINSETUP_MAGIC, 8);
+	PutU32(header + offsetof(CBinarySetupHeader, version), BINSETUP_VERSION);
+	PutU32(header + offsetof(CBinarySetupHeader, headersize), sizeof(CBinarySetupHeader));
+	PutU32(header + offsetof(CBinarySetupHeader, nFields), writer.nFields);
+	PutU64(header + offsetof(CBinarySetupHeader, fieldoffset), fieldoffset);
+	PutU64(header + offsetof(CBinarySetupHeader, stringoffset), stringoffset);
+	PutU64(header + offsetof(CBinarySetupHeader, stringsize), stringsize);
+	PutU64(header + offsetof(CBinarySetupHeader, filesize), dataoffset + writer.datasize);
+	fwrite(header, sizeof(header), 1, fid);
+	fwrite(padding, 1, (size_t) (fieldoffset - sizeof(header)), fid);
+
+	for (i=0; i<writer.nFields; i++)
+	{
+		const CBinarySetupField *field = &writer.field[i];
+		PutU32(entry + offsetof(CBinarySetupField, type), field->type);
+		PutU32(entry + offsetof(CBinarySetupField, nRows), field->nRows);
+		PutU32(entry + offsetof(CBinarySetupField, nCols), field->nCols);
+		PutU32(entry + offsetof(CBinarySetupField, path), field->path);
+		PutU64(entry + offsetof(CBinarySetupField, data), field->type == BS_STRING ? field->data : dataoffset + field->data);
+		fwrite(entry, sizeof(entry), 1, fid);
+	}
+
+	fwrite(writer.strings, 1, writer.stringsize, fid);
+	fwrite(padding, 1, (size_t) (stringsize - writer.stringsize), fid);
+
+	for (i=0, n=0; i<writer.nFields; i++)
+	{
+		const CBinarySetupField *field = &writer.field[i];
+		if (field->type == BS_NUMBER)
+		{
+			WriteFieldData(fid, field, writer.number + n, NULL);
+			n += (size_t) field->nRows * field->nCols;
+		}
+		else
+			WriteFieldData(fid, field, writer.data[i], writer.description[i]);
+	}
+
+	result = ferror(fid) ? -1 : 1;
+
+done:
+	if (fid && fclose(fid) != 0)
+		result = -1;
+	for (i=0; i<writer.nFields; i++)
+		free(writer.description[i]);
+	free(writer.description);
+	free((void *) writer.data);
+	free(writer.field);
+	free(writer.strings);
+	free(writer.hash);
+	free(writer.number);
+	return result;
+}
+
+
+/*******************************************************************************
+ * Binary reader
+ ******************************************************************************/
+
+static int BinarySetupError(CBinarySetup *pSetup, int result, const char *msg, const char *detail)
+{
+	sprintf(pSetup->error, "%s%.200s", msg, detail ? detail : "");
+	return result;
+}
+
+/** Maps a file into memory, with copy-on-write access. */
+static int MapSetupFile(const char *filename, CBinarySetup *pSetup)
+{
+#ifdef _WIN32
+	HANDLE        file, mapping;
+	LARGE_INTEGER size;
+
+	file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return 0;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 || (uint64_t) size.QuadPart > (size_t) -1)
+	{
+		CloseHandle(file);
+		return 0;
+	}
+	mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	CloseHandle(file);
+	if (!mapping)
+		return 0;
+	pSetup->map  = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	pSetup->size = (size_t) size.QuadPart;
+	CloseHandle(mapping);
+	return pSetup->map != NULL;
+#else
+	struct stat st;
+	void   *map;
+	int    fd = open(filename, O_RDONLY);
+
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+	pSetup->map  = map;
+	pSetup->size = (size_t) st.st_size;
+	return 1;
+#endif
+}
+
+/** Checks that \a size bytes at \a offset lie within the mapped file. */
+static int InFile(const CBinarySetup *pSetup, uint64_t offset, uint64_t size)
+{
+	return offset <= pSetup->size && size <= pSetup->size - offset;
+}
+
+/** Converts sensor records into CSensor structures, in place if possible. */
+static const CSensor *LoadSensors(CBinarySetup *pSetup, CBinarySensor *record, int count, const char *strings, uint64_t stringsize)
+{
+	CSensor *sensor;
+	int     i, j;
+
+	for (i=0; i<count; i++)
+		if (record[i].description >= stringsize)
+			return NULL;
+
+	if (SENSOR_INPLACE)
+	{
+		for (i=0; i<count; i++)
+		{
+			const char *description = strings + record[i].description;
+			memcpy(&((CSensor *) record)[i].description, &description, sizeof(description));
+		}
+		return (const CSensor *) record;
+	}
+
+	sensor = (CSensor *) MemMalloc((count + 1) * sizeof(CSensor));
+	if (!sensor)
+		return NULL;
+	for (i=0; i<count; i++)
+	{
+		for (j=0; j<3; j++)
+		{
+			sensor[i].location[j]    = record[i].location[j];
+			sensor[i].orientation[j] = record[i].orientation[j];
+		}
+		sensor[i].description = strings + record[i].description;
+	}
+	pSetup->sensors[pSetup->nSensorCopies++] = sensor;
+	return sensor;
+}
+
+/** Reads a binary setup file.
+ *
+ *	@param[in]  filename	Name of binary setup file.
+ *	@param[out] pSetup		Mapped file, to be released with FreeBinarySetup after the simulation.
+ *	@param[out] setup		Room setup, referring into the mapped file.
+ *	@return					1 on success, -1 if the file cannot be opened, or
+ *							-3 if the file is invalid, described in pSetup->error.
+ */
+int ReadBinarySetup(const char *filename, CBinarySetup *pSetup, CRoomSetup *setup)
+{
+	CBinarySetupHeader *header;
+	CBinarySetupField  *field;
+	CFileSetupItem     *item, *room, *options;
+	unsigned char      *base;
+	const char         *strings, *path;
+	const CSensor      *sensor;
+	uint64_t           count;
+	uint32_t           i;
+	int                swap = !IsLittleEndian();
+
+	memset(pSetup, 0, sizeof(*pSetup));
+	memset(setup, 0, sizeof(*setup));
+	InitSetup(&pSetup->fields);
+
+	if (!MapSetupFile(filename, pSetup))
+		return BinarySetupError(pSetup, -1, "unable to open file", NULL);
+
+	/* check header */
+	base   = (unsigned char *) pSetup->map;
+	header = (CBinarySetupHeader *) base;
+	if (pSetup->size < sizeof(CBinarySetupHeader) || memcmp(header->magic, BINSETUP_MAGIC, 8) != 0)
+		return BinarySetupError(pSetup, -3, "not a binary setup file", NULL);
+	if (swap)
+	{
+		SwapBytes(&header->version, 4, sizeof(uint32_t));
+		SwapBytes(&header->fieldoffset, 4, sizeof(uint64_t));
+	}
+	if (header->version != BINSETUP_VERSION)
+		return BinarySetupError(pSetup, -3, "unsupported binary setup file version", NULL);
+	if (header->headersize < sizeof(CBinarySetupHeader) || header->filesize != pSetup->size ||
+		header->fieldoffset % 8 != 0 || !InFile(pSetup, header->fieldoffset, (uint64_t) header->nFields * sizeof(CBinarySetupField)) ||
+		header->stringsize == 0 || !InFile(pSetup, header->stringoffset, header->stringsize) ||
+		base[header->stringoffset + header->stringsize - 1] != '\0')
+		return BinarySetupError(pSetup, -3, "corrupt file header", NULL);
+
+	/* add fields to setup tree, numbers and strings in place */
+	field   = (CBinarySetupField *) (base + header->fieldoffset);
+	strings = (const char *) (base + header->stringoffset);
+	for (i=0; i<header->nFields; i++, field++)
+	{
+		if (swap)
+		{
+			SwapBytes(field, 4, sizeof(uint32_t));
+			SwapBytes(&field->data, 1, sizeof(uint64_t));
+		}
+		if (field->path >= header->stringsize)
+			return BinarySetupError(pSetup, -3, "corrupt field table", NULL);
+		path = strings + field->path;
+
+		switch (field->type)
+		{
+		case BS_STRING:
+			if (field->data >= header->stringsize)
+				return BinarySetupError(pSetup, -3, "corrupt string field ", path);
+			if (!(item = SetupAddField(&pSetup->fields, path)))
+				return BinarySetupError(pSetup, -3, "duplicate or invalid field ", path);
+			item->data.value = (char *) strings + field->data;
+			break;
+
+		case BS_NUMBER:
+			count = (uint64_t) field->nRows * field->nCols;
+			if (field->data % 8 != 0 || field->nRows > 0x7fffffff || field->nCols > 0x7fffffff ||
+				count > pSetup->size / sizeof(double) || !InFile(pSetup, field->data, count * sizeof(double)))
+				return BinarySetupError(pSetup, -3, "corrupt numeric field ", path);
+			if (!(item = SetupAddField(&pSetup->fields, path)))
+				return BinarySetupError(pSetup, -3, "duplicate or invalid field ", path);
+			if (swap)
+				SwapBytes(base + field->data, (size_t) count, sizeof(double));
+			item->number     = (double *) (base + field->data);
+			item->nRows      = field->nRows;
+			item->nCols      = field->nCols;
+			item->data.value = "";
+			break;
+
+		case BS_SENSOR:
+			count = field->nRows;
+			if (field->data % 8 != 0 || count > 0x7fffffff || !InFile(pSetup, field->data, count * sizeof(CBinarySensor)))
+				return BinarySetupError(pSetup, -3, "corrupt sensor field ", path);
+			if (swap)
+				SwapBytes(base + field->data, (size_t) count * sizeof(CBinarySensor) / 8, 8);
+			if (stricmp(path, "source") != 0 && stricmp(path, "receiver") != 0)
+				return BinarySetupError(pSetup, -3, "unknown sensor field ", path);
+			if (stricmp(path, "source") == 0 ? setup->source != NULL : setup->receiver != NULL)
+				return BinarySetupError(pSetup, -3, "duplicate or invalid field ", path);
+			if (!(sensor = LoadSensors(pSetup, (CBinarySensor *) (base + field->data), (int) count, strings, header->stringsize)))
+				return BinarySetupError(pSetup, -3, "corrupt sensor field ", path);
+			if (stricmp(path, "source") == 0)
+			{
+				setup->source   = sensor;
+				setup->nSources = (int) count;
+			}
+			else
+			{
+				setup->receiver   = sensor;
+				setup->nReceivers = (int) count;
+			}
+			break;
+
+		default:
+			return BinarySetupError(pSetup, -3, "unknown type of field ", path);
+		}
+	}
+
+	room    = SetupFindStruct(&pSetup->fields.root, "room");
+	options = SetupFindStruct(&pSetup->fields.root, "options");
+	if (!room)				return BinarySetupError(pSetup, -3, "missing field 'room'", NULL);
+	if (!options)			return BinarySetupError(pSetup, -3, "missing field 'options'", NULL);
+	if (!setup->source)		return BinarySetupError(pSetup, -3, "missing field 'source'", NULL);
+	if (!setup->receiver)	return BinarySetupError(pSetup, -3, "missing field 'receiver'", NULL);
+
+	LoadCRoom(room, &setup->room);
+	LoadCOptions(options, &setup->options);
+
+	return 1;
+}
+
+/** Releases a binary setup file; the room setup read from it becomes invalid. */
+void FreeBinarySetup(CBinarySetup *pSetup)
+{
+	int i;
+
+	for (i=0; i<pSetup->nSensorCopies; i++)
+		MemFree(pSetup->sensors[i]);
+	FreeSetup(&pSetup->fields);
+	if (pSetup->map)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(pSetup->map);
+#else
+		munmap(pSetup->map, pSetup->size);
+#endif
+	}
+	memset(pSetup, 0, sizeof(*pSetup));
+}
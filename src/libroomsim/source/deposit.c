@@ -0,0 +1,165 @@
+/*********************************************************************//**
+ * @file deposit.c
+ * @brief Buffered histogram accumulation for concurrent writers.
+ **********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "deposit.h"
+#include "mem.h"
+
+/* number of bits sorted per radix pass */
+#define RADIXBITS 8
+#define RADIXSIZE (1 << RADIXBITS)
+
+/** Returns page \a p of a histogram, allocating it when it is allocated on 
+ *  demand and used for the first time, or NULL if out of memory. 
+ *
+ *  Pages allocated on demand are zeroed. They are allocated with calloc, 
+ *  rather than the memory management routines, so that worker threads may 
+ *  deposit to them; calls must be serialized by the caller.
+ */
+double *PagedHistogramPage(CPagedHistogram *histogram, unsigned int p)
+{
+	if (!histogram->page[p] && histogram->ondemand)
+		histogram->page[p] = (double *) calloc(histogram->pagesize, sizeof(double));
+	return histogram->page[p];
+}
+
+/** Sets all bins of the pages in use of a histogram to zero. */
+void ClearPagedHistogram(CPagedHistogram *histogram)
+{
+	unsigned int p;
+
+	for (p=0; p<histogram->nPages; p++)
+		if (histogram->page[p])
+			memset(histogram->page[p], 0, histogram->pagesize * sizeof(double));
+}
+
+/** Releases the pages of a histogram that were allocated on demand. */
+void FreePagedHistogram(CPagedHistogram *histogram)
+{
+	unsigned int p;
+
+	if (!histogram->ondemand)
+		return;
+	for (p=0; p<histogram->nPages; p++)
+	{
+		free(histogram->page[p]);
+		histogram->page[p] = NULL;
+	}
+}
+
+/** Allocates a deposit log.
+ *
+ *	@param[in]  capacity	Number of deposits buffered before flushing.
+ *	@param[in]  histogram	Target histogram, of at most 2^32-1 bins; deposits
+ *							are keyed by page * pagesize + bin in page.
+ *	@param[in]  lock		Lock protecting the target histogram, or NULL.
+ *	@return					Deposit log, to be released with FreeDepositLog.
+ */
+CDepositLog *AllocDepositLog(int capacity, CPagedHistogram *histogram, CMutex *lock)
+{
+	CDepositLog *log = (CDepositLog *) MemMalloc(sizeof(CDepositLog));
+	size_t      nBins = (size_t) histogram->nPages * histogram->pagesize;
+
+	log->capacity  = capacity;
+	log->count     = 0;
+	log->histogram = histogram;
+	log->lock      = lock;
+	log->failed    = 0;
+
+	/* only sort on bits that can be nonzero */
+	for (log->keybits = 1; log->keybits < 32 && ((size_t) 1 << log->keybits) < nBins; log->keybits++);
+
+	log->key       = (unsigned int *) MemMalloc(capacity * sizeof(unsigned int));
+	log->energy    = (double *)       MemMalloc(capacity * sizeof(double));
+	log->tmpkey    = (unsigned int *) MemMalloc(capacity * sizeof(unsigned int));
+	log->tmpenergy = (double *)       MemMalloc(capacity * sizeof(double));
+
+	return log;
+}
+
+/** Returns the number of bytes used by a deposit log of the given capacity. */
+double DepositLogMemory(int capacity)
+{
+	return sizeof(CDepositLog) + 2.0 * capacity * (sizeof(unsigned int) + sizeof(double));
+}
+
+/** Sorts the deposits by bin and adds them to the target histogram. */
+void FlushDepositLog(CDepositLog *log)
+{
+	unsigned int count[RADIXSIZE];
+	unsigned int *key = log->key, *tmpkey = log->tmpkey, *swapkey;
+	double       *energy = log->energy, *tmpenergy = log->tmpenergy, *swapenergy;
+	unsigned int sum, c, digit, pagesize = log->histogram->pagesize, p, pagestart = 0, pageend = 0;
+	double       *page = NULL;
+	int          n = log->count, i, j, shift;
+
+	if (n == 0)
+		return;
+
+	/* LSD radix sort on bin index, stable, RADIXBITS per pass */
+	for (shift=0; shift<log->keybits; shift+=RADIXBITS)
+	{
+		memset(count, 0, sizeof(count));
+		for (i=0; i<n; i++)
+			count[(key[i] >> shift) & (RADIXSIZE-1)]++;
+
+		for (sum=0, digit=0; digit<RADIXSIZE; digit++)
+		{
+			c = count[digit];
+			count[digit] = sum;
+			sum += c;
+		}
+
+		for (i=0; i<n; i++)
+		{
+			j = count[(key[i] >> shift) & (RADIXSIZE-1)]++;
+			tmpkey[j]    = key[i];
+			tmpenergy[j] = energy[i];
+		}
+
+		swapkey = key; key = tmpkey; tmpkey = swapkey;
+		swapenergy = energy; energy = tmpenergy; tmpenergy = swapenergy;
+	}
+
+	/* sum runs of deposits to the same bin */
+	for (i=0, j=0; i<n; j++)
+	{
+		key[j]    = key[i];
+		energy[j] = energy[i];
+		for (i++; i<n && key[i]==key[j]; i++)
+			energy[j] += energy[i];
+	}
+
+	/* add to histogram in ascending order, a page at a time */
+	if (log->lock) MutexLock(log->lock);
+	for (i=0; i<j; i++)
+	{
+		if (key[i] >= pageend)
+		{
+			p         = key[i] / pagesize;
+			pagestart = p * pagesize;
+			pageend   = pagestart + pagesize;
+			page      = PagedHistogramPage(log->histogram, p);
+			if (!page)
+				log->failed = 1;
+		}
+		if (page)
+			page[key[i] - pagestart] += energy[i];
+	}
+	if (log->lock) MutexUnlock(log->lock);
+
+	log->count = 0;
+}
+
+void FreeDepositLog(CDepositLog *log)
+{
+	MemFree(log->key);
+	MemFree(log->energy);
+	MemFree(log->tmpkey);
+	MemFree(log->tmpenergy);
+	MemFree(log);
+}
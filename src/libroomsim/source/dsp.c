@@ -4,6 +4,8 @@
  **********************************************************************/
 
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef __GNUC__
@@ -15,6 +17,91 @@
 #include "dsp.h"
 #include "interp.h"
 #include "mem.h"
+#include "simd.h"
+#include "thread.h"
+
+/* serializes the FFTW planner, which is not thread-safe */
+static CMutex g_fftwlock = MUTEX_INITIALIZER;
+
+/* FFTW configuration, set by ConfigureFFTW, and protected by g_fftwlock */
+static unsigned g_fftwflags   = FFTW_ESTIMATE;	/* planning effort */
+static int      g_fftwthreads = 1;				/* threads of large transforms */
+static char     g_fftwwisdom[FILENAME_MAX];		/* wisdom file, empty if none */
+
+/* Process-wide cache of FFTW plans, shared by all simulations. Cached plans 
+   are only executed with fftw_execute_r2r, on buffers of the caller, which
+   is thread-safe. Entries are allocated with malloc, rather than MemMalloc,
+   since they outlive the MEX call that creates them. */
+typedef struct CFFTWPlanEntry CFFTWPlanEntry;
+struct CFFTWPlanEntry {
+	int            n, howmany, nThreads;
+	fftw_r2r_kind  kind;
+	unsigned       flags;
+	fftw_plan      plan;
+	CFFTWPlanEntry *next;
+};
+static CFFTWPlanEntry *g_fftwplans = NULL;
+
+/* Number of outputs computed at once by the convolution kernels, in four vectors. */
+#define CONV_BLOCK	(4 * VDOUBLE_WIDTH)
+
+/* Defines a kernel that adds outputs i0 ... i0 + CONV_BLOCK - 1 of the
+   convolution of h[0 ... hlen-1] and x[0 ... xlen-1], of type XTYPE, to acc.
+   Every output sums its terms in order of increasing k, like a scalar loop
+   would, so the result does not depend on the vector width. Terms shared by
+   all outputs of the block are accumulated in vector registers; the few 
+   terms at the edges of the block are added one by one. */
+#define DEFINE_CONVBLOCK(NAME, XTYPE, VLOADX)											\
+static void NAME(const double *h, int hlen, const XTYPE *x, int xlen, int i0, double *acc)	\
+{																						\
+	vdouble a0, a1, a2, a3, hk;															\
+	const XTYPE *xp;																	\
+	int j, k, klo, khi;																	\
+																						\
+	/* range of k for which x[i0 + j - k] exists for all outputs j */					\
+	klo = MAX(0, i0 + CONV_BLOCK - xlen);												\
+	khi = MIN(hlen - 1, i0);															\
+	if (klo > khi)																		\
+	{																					\
+		for (j=0; j<CONV_BLOCK; j++)													\
+			for (k=MAX(0, i0 + j - xlen + 1); k<=MIN(hlen - 1, i0 + j); k++)			\
+				acc[j] += x[i0 + j - k] * h[k];											\
+		return;																			\
+	}																					\
+																						\
+	for (j=0; j<CONV_BLOCK; j++)														\
+		for (k=MAX(0, i0 + j - xlen + 1); k<klo; k++)									\
+			acc[j] += x[i0 + j - k] * h[k];												\
+																						\
+	a0 = VLOAD(acc);																	\
+	a1 = VLOAD(acc +     VDOUBLE_WIDTH);												\
+	a2 = VLOAD(acc + 2 * VDOUBLE_WIDTH);												\
+	a3 = VLOAD(acc + 3 * VDOUBLE_WIDTH);												\
+	for (k=klo; k<=khi; k++)															\
+	{																					\
+		hk = VSET1(h[k]);																\
+		xp = x + i0 - k;																\
+		a0 = VADD(a0, VMUL(VLOADX(xp), hk));											\
+		a1 = VADD(a1, VMUL(VLOADX(xp +     VDOUBLE_WIDTH), hk));						\
+		a2 = VADD(a2, VMUL(VLOADX(xp + 2 * VDOUBLE_WIDTH), hk));						\
+		a3 = VADD(a3, VMUL(VLOADX(xp + 3 * VDOUBLE_WIDTH), hk));						\
+	}																					\
+	VSTORE(acc,                     a0);												\
+	VSTORE(acc +     VDOUBLE_WIDTH, a1);												\
+	VSTORE(acc + 2 * VDOUBLE_WIDTH, a2);												\
+	VSTORE(acc + 3 * VDOUBLE_WIDTH, a3);												\
+																						\
+	for (j=0; j<CONV_BLOCK; j++)														\
+		for (k=khi + 1; k<=MIN(hlen - 1, i0 + j); k++)									\
+			acc[j] += x[i0 + j - k] * h[k];												\
+}
+
+DEFINE_CONVBLOCK(ConvBlock, double, VLOAD)
+#ifdef FLOAT_STORAGE
+DEFINE_CONVBLOCK(ConvBlockSample, SAMPLE, VLOADF)
+#else
+#  define ConvBlockSample ConvBlock
+#endif
 
 /** Convolution. The sequence \a h[0...\a hlen - 1] is convolved with
  *  the sequence \a x[0...\a xlen - 1], and the result is stored in 
@@ -36,48 +123,26 @@
  */
 void Conv(const double *h, int hlen, const double *x, int xlen, double *y)
 {
-    const double *hp, *xp;
-    int   count, i;
+    const double *tmp;
+    double acc[CONV_BLOCK];
+    int    i, j, n;
     
     /* make sure hlen <= xlen */
     if (hlen>xlen) 
     { 
         /* swap h and x */
-        hp = h; h = x; x = hp;
+        tmp = h; h = x; x = tmp;
         i = hlen; hlen = xlen; xlen = i;
     }
     
-    /* compute head */
-    for (i=0; i<hlen-1; i++)
+    /* compute head, mid-section, and tail, CONV_BLOCK outputs at a time */
+    for (i=0; i<xlen+hlen-1; i+=CONV_BLOCK)
     {
-        y[i] = 0.0;
-        hp = h;
-        xp = &(x[i]);
-        count = i+1;
-        while (count--)
-            y[i] += (*xp--) * (*hp++);
-    }
-
-    /* compute mid-section */
-    for (i=hlen-1; i<=xlen-1; i++)
-    {
-        y[i] = 0.0;
-        hp = h;
-        xp = &(x[i]);
-        count = hlen;
-        while (count--)
-            y[i] += (*xp--) * (*hp++);
-    }
-    
-    /* compute tail */
-    for (i=xlen; i<xlen+hlen-1; i++)
-    {
-        y[i] = 0.0;
-        hp = &(h[(i-xlen) + 1]);
-        xp = &(x[xlen-1]);
-        count = hlen-1 - (i-xlen);
-        while (count--)
-            y[i] += (*xp--) * (*hp++);
+        memset(acc, 0, sizeof(acc));
+        ConvBlock(h, hlen, x, xlen, i, acc);
+        n = MIN(CONV_BLOCK, xlen+hlen-1 - i);
+        for (j=0; j<n; j++)
+            y[i+j] = acc[j];
     }
 }
 
@@ -101,68 +166,33 @@ void Conv(const double *h, int hlen, const double *x, int xlen, double *y)
  *  @warning
  *     Requires that \a xlen > \a hlen.
  */
-void FIRfilter(const double *h, int hlen, const double *x, int xlen, double *y, double *state)
+void FIRfilter(const double *h, int hlen, const SAMPLE *x, int xlen, SAMPLE *y, double *state)
 {
-    const double *hp, *xp;
-    int          count, i;
+    double acc[CONV_BLOCK];
+    int    i, j, n;
     
-    if (state)
+    /* outputs are accumulated in double, also when stored as float */
+    for (i=0; i<xlen; i+=CONV_BLOCK)
     {
-        /* compute initial output using previous state */
-        for (i=0; i<hlen-1; i++)
-        {
-            y[i]  = state[i];
-            hp    = h;
-            xp    = &(x[i]);
-            count = i+1;
-            while (count--)
-                y[i] += (*xp--) * (*hp++);
-        }
-        
-        /* compute mid-section  */
-        for (i=hlen-1; i<xlen; i++)
-        {
-            y[i]  = 0.0;
-            hp    = h;
-            xp    = &(x[i]);
-            count = hlen;
-            while (count--)
-                y[i] += (*xp--) * (*hp++);
-        }
-        
-        /* update state */
-        for (i=0; i<hlen-1; i++)
-        {
-            state[i] = 0.0;
-            hp       = &(h[i+1]);
-            xp       = &(x[xlen-1]);
-            count    = hlen - 1 - i;
-            while (count--)
-                state[i] += (*xp--) * (*hp++);
-        }
+        /* initial outputs start from the previous state */
+        for (j=0; j<CONV_BLOCK; j++)
+            acc[j] = (state && i+j < hlen-1) ? state[i+j] : 0.0;
+        ConvBlockSample(h, hlen, x, xlen, i, acc);
+        n = MIN(CONV_BLOCK, xlen - i);
+        for (j=0; j<n; j++)
+            y[i+j] = (SAMPLE) acc[j];
     }
-    else
+
+    /* update state with the part of the convolution beyond the output */
+    if (state)
     {
-        /* compute initial output without a previous state */
-        for (i=0; i<hlen-1; i++)
+        for (i=xlen; i<xlen+hlen-1; i+=CONV_BLOCK)
         {
-            y[i]  = 0.0;
-            hp    = h;
-            xp    = &(x[i]);
-            count = i+1;
-            while (count--)
-                y[i] += (*xp--) * (*hp++);
-        }
-        
-        /* compute mid-section */
-        for (i=hlen-1; i<xlen; i++)
-        {
-            y[i]  = 0.0;
-            hp    = h;
-            xp    = &(x[i]);
-            count = hlen;
-            while (count--)
-                y[i] += (*xp--) * (*hp++);
+            memset(acc, 0, sizeof(acc));
+            ConvBlockSample(h, hlen, x, xlen, i, acc);
+            n = MIN(CONV_BLOCK, xlen+hlen-1 - i);
+            for (j=0; j<n; j++)
+                state[i-xlen+j] = acc[j];
         }
     }
 }
@@ -196,6 +226,152 @@ void FreqzLogMagnitude(double *h, int hlen, double *w, int wlen, double *logmag)
 	}
 }
 
+/** Returns the FFTW planner flags of a planning effort: "estimate" (also if
+ *  NULL or empty), "measure", or "patient", or -1 if \a planning is unknown.
+ */
+int FFTWPlanningFlags(const char *planning)
+{
+	if (planning == NULL || planning[0] == '\0' || strcmp(planning, "estimate") == 0)
+		return FFTW_ESTIMATE;
+	if (strcmp(planning, "measure") == 0)
+		return FFTW_MEASURE;
+	if (strcmp(planning, "patient") == 0)
+		return FFTW_PATIENT;
+	return -1;
+}
+
+/** Configure FFTW planning of subsequent simulations.
+ *
+ *  @param[in]	wisdomfile	FFTW wisdom file, or NULL or empty to take it from
+ *							the environment variable FFTW_WISDOM_ENV, if set.
+ *							Wisdom is imported once per file, and exported
+ *							whenever new plans are measured.
+ *  @param[in]	planning	planning effort: "estimate", "measure", or "patient".
+ *  @param[in]	nThreads	number of threads of transforms of at least 
+ *							FFTW_THREADS_MINSIZE samples, if built with FFTW_THREADS.
+ *  @return		1 on success, or 0 if \a planning is unknown.
+ */
+int ConfigureFFTW(const char *wisdomfile, const char *planning, int nThreads)
+{
+	int flags;
+
+	flags = FFTWPlanningFlags(planning);
+	if (flags < 0)
+		return 0;
+
+	if (wisdomfile == NULL || wisdomfile[0] == '\0')
+		wisdomfile = getenv(FFTW_WISDOM_ENV);
+
+	MutexLock(&g_fftwlock);
+	g_fftwflags   = flags;
+	g_fftwthreads = nThreads > 1 ? nThreads : 1;
+#ifdef FFTW_THREADS
+	{
+		static int initialized = 0;
+		if (!initialized)
+			initialized = fftw_init_threads();
+		if (!initialized)
+			g_fftwthreads = 1;
+	}
+#endif
+	if (wisdomfile == NULL)
+		g_fftwwisdom[0] = '\0';
+	else if (strcmp(wisdomfile, g_fftwwisdom) != 0)
+	{
+		/* a missing file is created when wisdom is first exported */
+		strncpy(g_fftwwisdom, wisdomfile, sizeof(g_fftwwisdom) - 1);
+		g_fftwwisdom[sizeof(g_fftwwisdom) - 1] = '\0';
+		fftw_import_wisdom_from_filename(g_fftwwisdom);
+	}
+	MutexUnlock(&g_fftwlock);
+	return 1;
+}
+
+/** Release all cached FFTW plans and FFTW's own memory. Must not be called 
+ *  while simulations are running. */
+void CleanupFFTW(void)
+{
+	CFFTWPlanEntry *entry;
+
+	MutexLock(&g_fftwlock);
+	while ((entry = g_fftwplans) != NULL)
+	{
+		g_fftwplans = entry->next;
+		fftw_destroy_plan(entry->plan);
+		free(entry);
+	}
+#ifdef FFTW_THREADS
+	fftw_cleanup_threads();
+#else
+	fftw_cleanup();
+#endif
+	MutexUnlock(&g_fftwlock);
+}
+
+/** Returns the number of cached FFTW plans. */
+int CountFFTWPlans(void)
+{
+	CFFTWPlanEntry *entry;
+	int            n = 0;
+
+	MutexLock(&g_fftwlock);
+	for (entry = g_fftwplans; entry; entry = entry->next)
+		n++;
+	MutexUnlock(&g_fftwlock);
+	return n;
+}
+
+/* Returns the cached plan of \a howmany interleaved, out-of-place real-to-real
+   transforms of size \a n, with the configured planning effort, creating it
+   when first used. Plans are created on scratch buffers, since measuring 
+   overwrites them; any fftw_malloc'ed buffers may be used for execution. */
+static fftw_plan GetFFTWPlan(int n, int howmany, fftw_r2r_kind kind)
+{
+	CFFTWPlanEntry *entry;
+	double         *in, *out;
+	int            nThreads;
+
+	MutexLock(&g_fftwlock);
+	nThreads = n * howmany >= FFTW_THREADS_MINSIZE ? g_fftwthreads : 1;
+	for (entry = g_fftwplans; entry; entry = entry->next)
+		if (entry->n == n && entry->howmany == howmany && entry->kind == kind &&
+			entry->flags == g_fftwflags && entry->nThreads == nThreads)
+			break;
+
+	if (!entry)
+	{
+		entry = (CFFTWPlanEntry *) malloc(sizeof(CFFTWPlanEntry));
+		entry->n        = n;
+		entry->howmany  = howmany;
+		entry->kind     = kind;
+		entry->flags    = g_fftwflags;
+		entry->nThreads = nThreads;
+
+		in  = (double *) fftw_malloc(n * howmany * sizeof(double));
+		out = (double *) fftw_malloc(n * howmany * sizeof(double));
+#ifdef FFTW_THREADS
+		fftw_plan_with_nthreads(nThreads);
+#endif
+		if (howmany == 1)
+			entry->plan = fftw_plan_r2r_1d(n, in, out, kind, g_fftwflags);
+		else
+			entry->plan = fftw_plan_many_r2r(1, &n, howmany, in, NULL, howmany, 1, 
+											 out, NULL, howmany, 1, &kind, g_fftwflags);
+		fftw_free(in);
+		fftw_free(out);
+
+		entry->next = g_fftwplans;
+		g_fftwplans = entry;
+
+		/* estimated plans add no wisdom */
+		if (g_fftwflags != FFTW_ESTIMATE && g_fftwwisdom[0] != '\0')
+			fftw_export_wisdom_to_filename(g_fftwwisdom);
+	}
+	MutexUnlock(&g_fftwlock);
+
+	return entry->plan;
+}
+
 /** Plan for creating minimum phase FIR filters.
   */
 struct CMinPhaseFIRplan {
@@ -208,8 +384,8 @@ struct CMinPhaseFIRplan {
     double *weight1;				/**< Freq. interpolation: right weight. */
     /*double *righthalfhannwin; */
 
-	fftw_plan fftwplanr2hc;			/**< Real to half-complex forward FFTW plan. */
-    fftw_plan fftwplanhc2r;			/**< Half-complex to real inverse FFTW plan. */
+	fftw_plan fftwplanr2hc;			/**< Real to half-complex forward FFTW plan, cached. */
+    fftw_plan fftwplanhc2r;			/**< Half-complex to real inverse FFTW plan, cached. */
     double    *fftwbufhc;			/**< FFTW buffer for half-complex FFT output. */
 	double	  *fftwbufr;			/**< FFTW buffer for real FFT output. */
     
@@ -219,6 +395,12 @@ struct CMinPhaseFIRplan {
     
     unsigned int complexexpend;		/**< Index. */
     unsigned int realexpnyquist;	/**< Index. */
+
+	/* batched design: sample i of filter k is at [i * MINPHASE_BATCH + k] */
+	fftw_plan fftwbatchr2hc;		/**< Real to half-complex forward FFTW plan of a batch, cached. */
+	fftw_plan fftwbatchhc2r;		/**< Half-complex to real inverse FFTW plan of a batch, cached. */
+	double    *fftwbatchhc;			/**< FFTW buffer for half-complex batch. */
+	double    *fftwbatchr;			/**< FFTW buffer for real batch. */
 };
 
 /** Allocate and initialize a minimum phase FIR filter design plan. 
@@ -256,11 +438,17 @@ CMinPhaseFIRplan *AllocMinPhaseFIRplan(unsigned int nFFT, double *F, unsigned in
     PrepareLinearInterpolate(F,nF,FFTfreq,nFFThalf+1, plan->idx0, plan->idx1, plan->weight0, plan->weight1);
     MemFree(FFTfreq);
 
-    /* allocate FFTW memory and prepare FFTW plans */
+    /* allocate FFTW memory and get cached FFTW plans */
     plan->fftwbufhc  = (double *) fftw_malloc(nFFT * sizeof(double));
     plan->fftwbufr   = (double *) fftw_malloc(nFFT * sizeof(double));
-    plan->fftwplanhc2r = fftw_plan_r2r_1d(nFFT, plan->fftwbufhc, plan->fftwbufr,  FFTW_HC2R, FFTW_ESTIMATE);
-    plan->fftwplanr2hc = fftw_plan_r2r_1d(nFFT, plan->fftwbufr,  plan->fftwbufhc, FFTW_R2HC, FFTW_ESTIMATE);
+    plan->fftwplanhc2r = GetFFTWPlan((int) nFFT, 1, FFTW_HC2R);
+    plan->fftwplanr2hc = GetFFTWPlan((int) nFFT, 1, FFTW_R2HC);
+
+    /* get cached FFTW plans of interleaved batches */
+    plan->fftwbatchhc = (double *) fftw_malloc(nFFT * MINPHASE_BATCH * sizeof(double));
+    plan->fftwbatchr  = (double *) fftw_malloc(nFFT * MINPHASE_BATCH * sizeof(double));
+    plan->fftwbatchhc2r = GetFFTWPlan((int) nFFT, MINPHASE_BATCH, FFTW_HC2R);
+    plan->fftwbatchr2hc = GetFFTWPlan((int) nFFT, MINPHASE_BATCH, FFTW_R2HC);
     
     plan->liftermul2end = (nFFT+1)>>1;
     plan->lifterzerostart = &plan->fftwbufr[(nFFT>>1)+1];
@@ -290,7 +478,7 @@ void LogMagFreqResp2MinPhaseFIR(const double *logmag, double *h, CMinPhaseFIRpla
     memset(&plan->fftwbufhc[plan->nFFThalf+1], 0, (plan->nFFT - plan->nFFThalf - 1) * sizeof(double));
     
     /* compute real cepstrum by taking real output of ifft  */
-    fftw_execute(plan->fftwplanhc2r);
+    fftw_execute_r2r(plan->fftwplanhc2r, plan->fftwbufhc, plan->fftwbufr);
     
     /** @todo Normalization should be integrated with multiplication step 
               below, or with complex exp step further below. */
@@ -305,7 +493,7 @@ void LogMagFreqResp2MinPhaseFIR(const double *logmag, double *h, CMinPhaseFIRpla
     memset(plan->lifterzerostart, 0, plan->lifterzerosize);
 
     /* take fft */
-    fftw_execute(plan->fftwplanr2hc);
+    fftw_execute_r2r(plan->fftwplanr2hc, plan->fftwbufr, plan->fftwbufhc);
     
     /* compute complex exp of half-complex buffer */
     plan->fftwbufhc[0] = exp(plan->fftwbufhc[0]); /* DC */
@@ -320,7 +508,7 @@ void LogMagFreqResp2MinPhaseFIR(const double *logmag, double *h, CMinPhaseFIRpla
 		plan->fftwbufhc[plan->realexpnyquist] = exp(plan->fftwbufhc[plan->realexpnyquist]); 
     
     /* take ifft and real => minphase sequence */
-    fftw_execute(plan->fftwplanhc2r);
+    fftw_execute_r2r(plan->fftwplanhc2r, plan->fftwbufhc, plan->fftwbufr);
     for (i=0; i<plan->nFFT; i++) 
 		plan->fftwbufr[i] /= plan->nFFT;
     
@@ -331,6 +519,82 @@ void LogMagFreqResp2MinPhaseFIR(const double *logmag, double *h, CMinPhaseFIRpla
     memcpy(h, plan->fftwbufr, plan->nFFT*sizeof(double));
 }
 
+/** Design minimum phase FIR filters for many log-magnitude frequency responses.
+ *  Does the same as LogMagFreqResp2MinPhaseFIR for each response, but designs
+ *  MINPHASE_BATCH filters at a time, interleaved so that the exp, sin, and cos
+ *  steps are vectorized across filters. Both normalizations by 1/nFFT are 
+ *  fused with the liftering and complex exp steps.
+ *
+ *  @param[in]	logmag			desired log-magnitude frequency responses.
+ *  @param[in]	logmagstride	distance between responses in \a logmag.
+ *  @param[out]	h				filter coefficients.
+ *  @param[in]	hstride			distance between filters in \a h.
+ *  @param[in]	nFilters		number of filters.
+ *  @param[in]	plan			filter design plan, obtained from \a AllocMinPhaseFIRplan.
+ *
+ *  @note
+ *     The results match LogMagFreqResp2MinPhaseFIR to within a few ulps, since 
+ *     exp, sin, and cos are computed by the simd.h approximations.
+ */
+void LogMagFreqResp2MinPhaseFIRs(const double *logmag, int logmagstride, double *h, int hstride, int nFilters, CMinPhaseFIRplan *plan)
+{
+    const unsigned int B = MINPHASE_BATCH, N = plan->nFFT;
+    const double invN = 1.0 / N;
+    double       *hc = plan->fftwbatchhc, *r = plan->fftwbatchr;
+    const double *lm;
+    vdouble      scale, e, sn, cs;
+    unsigned int i, k, n;
+    int          f0;
+
+    for (f0=0; f0<nFilters; f0+=B)
+    {
+        n = MIN(B, (unsigned int) (nFilters - f0));
+
+        /* resample log mag onto FFT grid, and set imaginary part to 0 */
+        for (k=0; k<B; k++)
+        {
+            lm = logmag + (k < n ? f0 + k : 0) * logmagstride;
+            for (i=0; i<=plan->nFFThalf; i++)
+                hc[i*B + k] = k < n ? lm[plan->idx0[i]] * plan->weight0[i] + lm[plan->idx1[i]] * plan->weight1[i] : 0.0;
+        }
+        memset(&hc[(plan->nFFThalf+1) * B], 0, (N - plan->nFFThalf - 1) * B * sizeof(double));
+
+        /* compute real cepstrum, and lifter it with the normalization by 1/N */
+        fftw_execute_r2r(plan->fftwbatchhc2r, hc, r);
+        scale = VSET1(2 * invN);
+        for (i=0; i<B; i+=VDOUBLE_WIDTH)
+            VSTORE(&r[i], VMUL(VLOAD(&r[i]), VSET1(invN)));
+        for (i=B; i<plan->liftermul2end * B; i+=VDOUBLE_WIDTH)
+            VSTORE(&r[i], VMUL(VLOAD(&r[i]), scale));
+        for (; i<((N>>1)+1) * B; i+=VDOUBLE_WIDTH)
+            VSTORE(&r[i], VMUL(VLOAD(&r[i]), VSET1(invN)));
+        memset(&r[((N>>1)+1) * B], 0, ((N-1)>>1) * B * sizeof(double));
+
+        /* take fft, and compute complex exp with the normalization of the final ifft */
+        fftw_execute_r2r(plan->fftwbatchr2hc, r, hc);
+        scale = VSET1(invN);
+        for (k=0; k<B; k+=VDOUBLE_WIDTH)
+        {
+            VSTORE(&hc[k], VMUL(VEXP(VLOAD(&hc[k])), scale));
+            for (i=1; i<plan->complexexpend; i++)
+            {
+                e = VMUL(VEXP(VLOAD(&hc[i*B + k])), scale);
+                VSINCOS(VLOAD(&hc[(N-i)*B + k]), &sn, &cs);
+                VSTORE(&hc[i*B + k],     VMUL(e, cs));
+                VSTORE(&hc[(N-i)*B + k], VMUL(e, sn));
+            }
+            if (plan->realexpnyquist)
+                VSTORE(&hc[plan->realexpnyquist*B + k], VMUL(VEXP(VLOAD(&hc[plan->realexpnyquist*B + k])), scale));
+        }
+
+        /* take ifft => minphase sequences, and copy them to the output */
+        fftw_execute_r2r(plan->fftwbatchhc2r, hc, r);
+        for (k=0; k<n; k++)
+            for (i=0; i<N; i++)
+                h[(f0 + k) * hstride + i] = r[i*B + k];
+    }
+}
+
 /** Release memory associated with minimum phase FIR filter design plan. 
  *
  *  @param[in]	plan	filter design plan, obtained from \a AllocMinPhaseFIRplan.
@@ -343,23 +607,23 @@ void FreeMinPhaseFIRplan(CMinPhaseFIRplan *plan)
     MemFree(plan->weight0);
     MemFree(plan->weight1);
 
-    /* destroy FFTW plans and free FFTW memory */
-    fftw_destroy_plan(plan->fftwplanhc2r);
-    fftw_destroy_plan(plan->fftwplanr2hc);
+    /* free FFTW memory; the plans stay cached for later simulations */
     fftw_free(plan->fftwbufr);
     fftw_free(plan->fftwbufhc);
+    fftw_free(plan->fftwbatchr);
+    fftw_free(plan->fftwbatchhc);
     
     /* free plan memory     */
     MemFree(plan);
 }
 
-void TimeVaryingConv(const double *hh, int hlen, 
+void TimeVaryingConv(const SAMPLE *hh, int hlen, 
 					 const int *idx, int nidx, 
 					 const unsigned int *x, int xlen, 
 					 int xstart, unsigned int xthreshold,
-					 double *y)
+					 SAMPLE *y)
 {
-	const double *h0, *h1;
+	const SAMPLE *h0, *h1;
 	double		 len, w0, w1;
 	int			 idx0, idx1;
 	int			 i, j, jmin, k, n=0;
@@ -390,7 +654,7 @@ void TimeVaryingConv(const double *hh, int hlen,
 
 			/* add two weighted impulse responses to current output sample */
 			for (j=i, k=0; j>=jmin; k++, j--)
-				y[j] += w0 * h0[k] + w1 * h1[k];
+				y[j] += (SAMPLE) (w0 * h0[k] + w1 * h1[k]);
 		}
 
 		/* move to next pair of impulse responses? */
@@ -419,3 +683,243 @@ void TimeVaryingConv(const double *hh, int hlen,
 
 	} /* next input sample */
 }
+
+/** Uniformly partitioned convolution of several inputs with a matrix of 
+ *  filters, by overlap-save: filters are split into partitions of one block,
+ *  whose spectra multiply those of the recent input blocks, kept in a 
+ *  frequency-domain delay line per input. Every block then costs one forward
+ *  transform per input and one inverse transform per output.
+ */
+struct CPartitionedConv {
+	int       blocksize;			/**< Block size B; transforms have 2B points. */
+	int       nInputs, nOutputs;
+	int       nPartitions;			/**< Partitions of the longest filter, and length of the delay lines. */
+	int       head;					/**< Slot of the latest input spectrum in the delay lines. */
+	double    **filter;				/**< Half-complex spectra of the partitions of each input/output filter, or NULL. */
+	int       *first;				/**< First nonzero partition of each filter. */
+	int       *count;				/**< Number of partitions of each filter from the first. */
+	double    *fdl;					/**< Frequency-domain delay line of each input. */
+	double    *input;				/**< Last two blocks of each input. */
+	double    *acc;					/**< Spectrum of an output block. */
+	double    *out;					/**< Output of the inverse transform. */
+	fftw_plan fftwplanr2hc;			/**< Real to half-complex forward FFTW plan, cached. */
+	fftw_plan fftwplanhc2r;			/**< Half-complex to real inverse FFTW plan, cached. */
+};
+
+/** Allocate a partitioned convolution of \a nInputs inputs and \a nOutputs
+ *  outputs, in blocks of \a blocksize samples, with filters of at most 
+ *  \a maxlength samples. Filters are added with SetPartitionedConvFilter.
+ *  Block sizes that are powers of two transform fastest.
+ */
+CPartitionedConv *AllocPartitionedConv(int blocksize, int nInputs, int nOutputs, int maxlength)
+{
+	CPartitionedConv *conv;
+	int nFFT = 2 * blocksize;
+
+	conv = (CPartitionedConv *) MemMalloc(sizeof(CPartitionedConv));
+	conv->blocksize   = blocksize;
+	conv->nInputs     = nInputs;
+	conv->nOutputs    = nOutputs;
+	conv->nPartitions = maxlength > blocksize ? (maxlength + blocksize - 1) / blocksize : 1;
+	conv->head        = 0;
+	conv->filter      = (double **) MemCalloc(nInputs * nOutputs, sizeof(double *));
+	conv->first       = (int *) MemCalloc(nInputs * nOutputs, sizeof(int));
+	conv->count       = (int *) MemCalloc(nInputs * nOutputs, sizeof(int));
+
+	/* delay lines hold spectra of 2B points, which keeps them aligned for FFTW */
+	conv->fdl   = (double *) fftw_malloc((size_t) nInputs * conv->nPartitions * nFFT * sizeof(double));
+	conv->input = (double *) fftw_malloc((size_t) nInputs * nFFT * sizeof(double));
+	conv->acc   = (double *) fftw_malloc(nFFT * sizeof(double));
+	conv->out   = (double *) fftw_malloc(nFFT * sizeof(double));
+	memset(conv->fdl, 0, (size_t) nInputs * conv->nPartitions * nFFT * sizeof(double));
+	memset(conv->input, 0, (size_t) nInputs * nFFT * sizeof(double));
+
+	conv->fftwplanr2hc = GetFFTWPlan(nFFT, 1, FFTW_R2HC);
+	conv->fftwplanhc2r = GetFFTWPlan(nFFT, 1, FFTW_HC2R);
+	return conv;
+}
+
+/** Set the filter from input \a iInput to output \a iOutput: \a hlen samples
+ *  \a h, preceded by \a offset zeros, as the responses of a sparse simulation.
+ *  Partitions of zeros only are skipped.
+ *
+ *	@return		1, or 0 if the filter is longer than the maximum length.
+ */
+int SetPartitionedConvFilter(CPartitionedConv *conv, int iInput, int iOutput, const SAMPLE *h, int hlen, int offset)
+{
+	int    B = conv->blocksize, nFFT = 2 * B, f = iInput * conv->nOutputs + iOutput;
+	int    lo, hi, p, i, k;
+	double *spectrum;
+
+	/* find the span of nonzero samples */
+	for (lo=0; lo<hlen && h[lo]==0; lo++)
+		;
+	for (hi=hlen; hi>lo && h[hi-1]==0; hi--)
+		;
+	if (offset + hi > conv->nPartitions * B)
+		return 0;
+
+	if (conv->filter[f])
+		MemFree(conv->filter[f]);
+	conv->filter[f] = NULL;
+	if (lo == hi)
+		return 1;
+
+	conv->first[f] = (offset + lo) / B;
+	conv->count[f] = (offset + hi - 1) / B - conv->first[f] + 1;
+	conv->filter[f] = (double *) MemMalloc((size_t) conv->count[f] * nFFT * sizeof(double));
+
+	/* transform each partition, zero padded to 2B points; the scaling of the 
+	   inverse transform is applied to the filter */
+	for (k=0; k<conv->count[f]; k++)
+	{
+		p = conv->first[f] + k;
+		memset(conv->out, 0, nFFT * sizeof(double));
+		for (i=0; i<B; i++)
+		{
+			int j = p * B + i - offset;
+			if (j >= lo && j < hi)
+				conv->out[i] = h[j] / nFFT;
+		}
+		fftw_execute_r2r(conv->fftwplanr2hc, conv->out, conv->acc);
+		spectrum = &conv->filter[f][(size_t) k * nFFT];
+		memcpy(spectrum, conv->acc, nFFT * sizeof(double));
+	}
+	return 1;
+}
+
+/* Adds the product of half-complex spectra a and b of n points to acc. */
+static void MultiplyAddHalfComplex(const double *a, const double *b, double *acc, int n)
+{
+	int k;
+
+	acc[0] += a[0] * b[0];
+	for (k=1; k<n-k; k++)
+	{
+		acc[k]   += a[k] * b[k]   - a[n-k] * b[n-k];
+		acc[n-k] += a[k] * b[n-k] + a[n-k] * b[k];
+	}
+	if (k == n-k)
+		acc[k] += a[k] * b[k];
+}
+
+/** Convolve the next block of every input, \a x, blocksize samples per input
+ *  one after the other, into the next block of every output, \a y, likewise.
+ */
+void PartitionedConvProcess(CPartitionedConv *conv, const double *x, double *y)
+{
+	int    B = conv->blocksize, nFFT = 2 * B, P = conv->nPartitions;
+	int    i, o, k, f, slot, any;
+	double *in;
+
+	/* transform the last two blocks of every input into its delay line */
+	conv->head = (conv->head + 1) % P;
+	for (i=0; i<conv->nInputs; i++)
+	{
+		in = &conv->input[(size_t) i * nFFT];
+		memcpy(in, in + B, B * sizeof(double));
+		memcpy(in + B, &x[(size_t) i * B], B * sizeof(double));
+		fftw_execute_r2r(conv->fftwplanr2hc, in, &conv->fdl[((size_t) i * P + conv->head) * nFFT]);
+	}
+
+	/* partition p of a filter applies to the input spectrum of p blocks ago */
+	for (o=0; o<conv->nOutputs; o++)
+	{
+		memset(conv->acc, 0, nFFT * sizeof(double));
+		for (i=0, any=0; i<conv->nInputs; i++)
+		{
+			f = i * conv->nOutputs + o;
+			if (!conv->filter[f])
+				continue;
+			for (k=0; k<conv->count[f]; k++)
+			{
+				slot = (conv->head - conv->first[f] - k + P) % P;
+				MultiplyAddHalfComplex(&conv->fdl[((size_t) i * P + slot) * nFFT], 
+					&conv->filter[f][(size_t) k * nFFT], conv->acc, nFFT);
+			}
+			any = 1;
+		}
+
+		/* the second half of the circular convolution is the output block */
+		if (any)
+		{
+			fftw_execute_r2r(conv->fftwplanhc2r, conv->acc, conv->out);
+			memcpy(&y[(size_t) o * B], conv->out + B, B * sizeof(double));
+		}
+		else
+			memset(&y[(size_t) o * B], 0, B * sizeof(double));
+	}
+}
+
+/** Free a partitioned convolution; its FFTW plans stay cached. */
+void FreePartitionedConv(CPartitionedConv *conv)
+{
+	int f;
+
+	for (f=0; f<conv->nInputs * conv->nOutputs; f++)
+		if (conv->filter[f])
+			MemFree(conv->filter[f]);
+	MemFree(conv->filter);
+	MemFree(conv->first);
+	MemFree(conv->count);
+	fftw_free(conv->fdl);
+	fftw_free(conv->input);
+	fftw_free(conv->acc);
+	fftw_free(conv->out);
+	MemFree(conv);
+}
+
+/* Crossover between bands centered at a and b, halfway on a log scale */
+static double BandCrossover(double a, double b)
+{
+	return a > 0 ? sqrt(a * b) : b / 2;
+}
+
+/** Returns the length of the band-splitting filters of BandSplitFilters:
+ *  odd, long enough to resolve the lowest crossover frequency, but at most
+ *  \a maxlength. Shorter filters blur the lower crossovers.
+ */
+int BandSplitFilterLength(const double *frequency, int nBands, double fs, int maxlength)
+{
+	double crossover;
+
+	if (nBands < 2)
+		return 1;
+	crossover = BandCrossover(frequency[0], frequency[1]);
+	return 2 * (int) MIN(ceil(2 * fs / crossover), (maxlength - 1) / 2) + 1;
+}
+
+/* Hann-windowed sinc lowpass of cutoff fc [Hz], length 2M+1, added with sign */
+static void AddWindowedSinc(double fc, double fs, int M, double sign, double *h)
+{
+	double w = 2 * fc / fs, t;
+	int    n;
+
+	for (n=-M; n<=M; n++)
+	{
+		t = n == 0 ? w : sin(PI * w * n) / (PI * n);
+		h[n+M] += sign * t * (0.5 + 0.5 * cos(PI * n / (M + 1)));
+	}
+}
+
+/** Design linear-phase filters that split a signal into the bands centered 
+ *  at \a frequency, with crossovers halfway between the centers on a log 
+ *  scale. The filters of \a length samples (see BandSplitFilterLength), 
+ *  one after the other in \a h, are differences of windowed sinc lowpass 
+ *  filters, so that they sum to a delay of (\a length - 1) / 2 samples.
+ */
+void BandSplitFilters(const double *frequency, int nBands, double fs, int length, double *h)
+{
+	int    M = (length - 1) / 2, b;
+	double lo, hi;
+
+	memset(h, 0, (size_t) nBands * length * sizeof(double));
+	for (b=0; b<nBands; b++)
+	{
+		lo = b > 0 ? BandCrossover(frequency[b-1], frequency[b]) : 0;
+		hi = b < nBands-1 ? BandCrossover(frequency[b], frequency[b+1]) : fs / 2;
+		AddWindowedSinc(hi, fs, M, 1.0, &h[(size_t) b * length]);
+		if (lo > 0)
+			AddWindowedSinc(lo, fs, M, -1.0, &h[(size_t) b * length]);
+	}
+}
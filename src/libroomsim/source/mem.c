@@ -0,0 +1,110 @@
+/*********************************************************************//**
+ * @file mem.c
+ * @brief Arena allocator.
+ **********************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mem.h"
+
+/** Block of an arena; its data follows the header, aligned to ARENA_ALIGNMENT. */
+struct CArenaBlock {
+	CArenaBlock *prev;			/**< Previously allocated block. */
+	char        *data;			/**< Aligned start of data. */
+	size_t      size;			/**< Size of data. */
+	size_t      offset;			/**< Offset of first free byte in data. */
+};
+
+#define ALIGNUP(n)	(((n) + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1))
+
+/** Initializes an empty arena.
+ *
+ *	@param[out] arena		Arena.
+ *	@param[in]  blocksize	Minimum size of the blocks, or 0 for ARENA_BLOCKSIZE.
+ */
+void ArenaInit(CArena *arena, size_t blocksize)
+{
+	memset(arena, 0, sizeof(*arena));
+	arena->blocksize = blocksize > 0 ? blocksize : ARENA_BLOCKSIZE;
+}
+
+/** Allocates memory from an arena, aligned to ARENA_ALIGNMENT.
+ *
+ *	@return		Allocated memory, or NULL if out of memory.
+ */
+void *ArenaMalloc(CArena *arena, size_t size)
+{
+	CArenaBlock *block = arena->block;
+	size_t      offset = block ? ALIGNUP(block->offset) : 0;
+
+	if (!block || offset + size > block->size)
+	{
+		size_t blocksize = size > arena->blocksize ? ALIGNUP(size) : arena->blocksize;
+
+		block = (CArenaBlock *) MemMalloc(sizeof(CArenaBlock) + ARENA_ALIGNMENT + blocksize);
+		if (!block)
+			return NULL;
+		block->prev   = arena->block;
+		block->data   = (char *) ALIGNUP((uintptr_t) (block + 1));
+		block->size   = blocksize;
+		block->offset = 0;
+		arena->block  = block;
+		arena->reserved += blocksize;
+		arena->nBlocks++;
+		offset = 0;
+	}
+
+	block->offset = offset + size;
+	arena->used  += size;
+	if (arena->used > arena->peak)
+		arena->peak = arena->used;
+	return block->data + offset;
+}
+
+/** Allocates zero-initialized memory from an arena, aligned to ARENA_ALIGNMENT. */
+void *ArenaCalloc(CArena *arena, size_t n, size_t size)
+{
+	void *p = ArenaMalloc(arena, n * size);
+	if (p)
+		memset(p, 0, n * size);
+	return p;
+}
+
+/** Returns the current position of an arena. */
+CArenaMark ArenaGetMark(const CArena *arena)
+{
+	CArenaMark mark;
+
+	mark.block  = arena->block;
+	mark.offset = arena->block ? arena->block->offset : 0;
+	mark.used   = arena->used;
+	return mark;
+}
+
+/** Releases all allocations made after \a mark, including the blocks they required. */
+void ArenaRewind(CArena *arena, CArenaMark mark)
+{
+	CArenaBlock *prev;
+
+	while (arena->block != mark.block)
+	{
+		prev = arena->block->prev;
+		arena->reserved -= arena->block->size;
+		arena->nBlocks--;
+		MemFree(arena->block);
+		arena->block = prev;
+	}
+	if (arena->block)
+		arena->block->offset = mark.offset;
+	arena->used = mark.used;
+}
+
+/** Releases all allocations of an arena at once. The peak usage is kept. */
+void ArenaRelease(CArena *arena)
+{
+	CArenaMark empty;
+
+	memset(&empty, 0, sizeof(empty));
+	ArenaRewind(arena, empty);
+}
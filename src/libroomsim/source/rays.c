@@ -0,0 +1,408 @@
+/*********************************************************************//**
+ * @file rays.c
+ * @brief Ray direction generators for diffuse ray tracing.
+ *
+ * Directions are produced in batches on request, so that only the 
+ * icosahedron generators need to store their directions. All generators 
+ * but the legacy icosahedron are rotated randomly, to avoid alignment of 
+ * the ray directions with the room axes.
+ **********************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "defs.h"
+#include "mem.h"
+#include "msg.h"
+#include "rays.h"
+#include "rng.h"
+#include "SFMT.h"
+#include "types.h"
+
+/* random number stream used for the random rotation of ray directions */
+#define RAYROTATION_STREAM 0xffffffffU
+
+/** Returns the number of rays of a subdivided icosahedron, 20*k*k, of at least \a nDesiredRays. */
+int CountIcosahedronRays(int nDesiredRays)
+{
+	int rayorder = (int) ceil(sqrt(nDesiredRays / 20.0));
+	return rayorder * rayorder * 20;
+}
+
+/** Generates unit vectors equally distributed around a sphere. 
+ *
+ *	@param[in]  nDesiredRays	Number of desired rays.
+ *	@param[out] pnActualRays	Number of rays actually generated.
+ *	@return						XYZ array of unit vectors.
+ *
+ *  @note
+ *     The number of rays N that is actually generated satisfies N = 20*k*k, where
+ *     k is the smallest integer such that N >= nDesiredRays.
+ *  @note
+ *     The generating algorithm subdivides each face of a regular icosahedron into 
+ *     a triangular grid, whose granularity is determined by the number of desired 
+ *     rays. The algorithm then enumerates the triangular cells of the grid and 
+ *     takes the center of the grid cell as a ray direction.
+ * 
+ *                C             Triangle ABC is one face of the icosahedron, which 
+ *              ./_\.           is subdivided into a triangular grid. The grid is 
+ *            ./_\./_\          enumerated from left-to-right, bottom-to-top, 
+ *          ./_\./_\./_\.       starting at A.
+ *         A             B
+ */
+static XYZ *GenerateRays(int nDesiredRays, int *pnActualRays)
+{
+	/* xyz-coordinates of vertices of regular icosahedron */
+	static const XYZ ico_vert[12] = 
+	{
+		{ 0.0000000000,  0.0000000000,  1.0000000000},
+		{ 0.8944271910,  0.0000000000,  0.4472135955},
+		{ 0.2763932023,  0.8506508084,  0.4472135955},
+		{-0.7236067977,  0.5257311121,  0.4472135955},
+		{-0.7236067977, -0.5257311121,  0.4472135955},
+		{ 0.2763932023, -0.8506508084,  0.4472135955},
+		{ 0.7236067977,  0.5257311121, -0.4472135955},
+		{-0.2763932023,  0.8506508084, -0.4472135955},
+		{-0.8944271910,  0.0000000000, -0.4472135955},
+		{-0.2763932023, -0.8506508084, -0.4472135955},
+		{ 0.7236067977, -0.5257311121, -0.4472135955},
+		{ 0.0000000000,  0.0000000000, -1.0000000000}
+	};
+	/* vertex indices of faces of regular icosahedron */
+	static const int ico_face[20][3] = 
+	{
+		{ 0,  1,  2}, { 0,  2,  3}, { 0,  3,  4}, { 0,  4,  5},
+		{ 0,  5,  1}, { 1,  2,  6}, { 2,  6,  7}, { 2,  3,  7},
+		{ 3,  7,  8}, { 3,  4,  8}, { 4,  8,  9}, { 4,  5,  9},
+		{ 5,  9, 10}, { 5,  1, 10}, { 1, 10,  6}, { 6,  7, 11},
+		{ 7,  8, 11}, { 8,  9, 11}, { 9, 10, 11}, {10,  6, 11}
+	};
+
+	int    rayorder = (int) ceil(sqrt(nDesiredRays / 20.0));
+	int    nRays = CountIcosahedronRays(nDesiredRays);
+	XYZ    *rayxyz;
+	XYZ    A, B, C, dAB, dAC;
+	XYZ    p1, p2, p3;
+	int	   f, nSteps, i1, i2, idx=0;
+	double norm;
+
+	/* allocate memory for ray vectors */
+	rayxyz = MemMalloc(nRays * sizeof(XYZ));
+	*pnActualRays = nRays;
+
+	/* loop over all faces of the icosahedron */
+	for (f=0; f<20; f++)
+	{
+		/* get xyz-coords of vertices of current face */
+		A = ico_vert[ico_face[f][0]];
+		B = ico_vert[ico_face[f][1]];
+		C = ico_vert[ico_face[f][2]];
+
+		/* A, B, and C are the coordinates of a triangle in 3D space */
+
+		/* determine grid spacing in A-B direction */
+		dAB.x = (B.x - A.x) / rayorder;
+		dAB.y = (B.y - A.y) / rayorder;
+		dAB.z = (B.z - A.z) / rayorder;
+
+		/* determine grid spacing in A-C direction */
+		dAC.x = (C.x - A.x) / rayorder;
+		dAC.y = (C.y - A.y) / rayorder;
+		dAC.z = (C.z - A.z) / rayorder;
+
+		/* initialize number of grid cells for enumeration */
+		nSteps = 2*rayorder - 1;
+
+		/** @todo Speed up algorithm by updating p = (p1+p2+p3)/3 
+		rather than updating p1, p2, and p3 individually */
+
+		for (i1=0; i1<rayorder; i1++)
+		{
+			/* initialize points p1, p2, and p3 */
+			p1.x = A.x + i1 * dAC.x;
+			p1.y = A.y + i1 * dAC.y;
+			p1.z = A.z + i1 * dAC.z;
+
+			p2.x = p1.x + dAB.x;
+			p2.y = p1.y + dAB.y;
+			p2.z = p1.z + dAB.z;
+
+			p3.x = p1.x + dAC.x;
+			p3.y = p1.y + dAC.y;
+			p3.z = p1.z + dAC.z;
+
+			/* p1, p2, and p3 are coordinates of grid cell in 3D space */
+
+			for (i2=0; i2<nSteps; i2++)
+			{
+				/* use center of triangular grid cell as ray's direction  */
+				rayxyz[idx].x = (p1.x + p2.x + p3.x) / 3;
+				rayxyz[idx].y = (p1.y + p2.y + p3.y) / 3;
+				rayxyz[idx].z = (p1.z + p2.z + p3.z) / 3;
+            
+				/* normalize length to unity */
+				norm = sqrt(rayxyz[idx].x * rayxyz[idx].x + 
+							rayxyz[idx].y * rayxyz[idx].y + 
+							rayxyz[idx].z * rayxyz[idx].z);
+
+				rayxyz[idx].x /= norm;
+				rayxyz[idx].y /= norm;
+				rayxyz[idx].z /= norm;
+
+				idx = idx + 1;
+            
+				/* update p1, p2, and p3 to move to next grid cell */
+				if ((i2 % 2) == 0)
+				{
+					p1 = p2;
+					p2.x = p3.x + dAB.x;
+					p2.y = p3.y + dAB.y;
+					p2.z = p3.z + dAB.z;
+				}
+				else
+				{
+					p3 = p2;
+					p2.x = p1.x + dAB.x;
+					p2.y = p1.y + dAB.y;
+					p2.z = p1.z + dAB.z;
+				}
+			}
+
+			/* for face's next level, reduce number of grid cells by 2 */
+			nSteps = nSteps - 2;
+		}
+
+	} /* next face */
+
+#if 0
+/* DEBUG OUTPUT  */
+	{ 
+		int i;
+		char filename[256];
+		FILE *fid;
+
+		sprintf(filename,"rays%04d.txt", nRays);
+		fid = fopen(filename,"w");
+
+		/* print vertices */
+		fprintf(fid,"12 12 12\n");
+		for (i=0; i<12; i++)
+		{
+			fprintf(fid,"%13.10f %13.10f %13.10f\n", ico_vert[i].x, ico_vert[i].y, ico_vert[i].z);
+		}
+
+		/* print faces */
+		fprintf(fid,"20 20 20\n");
+		for (i=0; i<20; i++)
+		{
+			fprintf(fid,"%2d %2d %2d\n", ico_face[i][0]+1, ico_face[i][1]+1, ico_face[i][2]+1);
+		}
+
+		/* print rays */
+		fprintf(fid,"%d %d 0\n", idx, nRays);
+		for (i=0; i<nRays; i++)
+		{
+			fprintf(fid,"%13.10f %13.10f %13.10f\n", rayxyz[i].x, rayxyz[i].y, rayxyz[i].z);
+		}
+		fclose(fid);
+	}
+/* END DEBUG OUTPUT */
+#endif
+
+	return rayxyz;
+}
+
+
+/** Draws a uniformly distributed random rotation matrix.
+ *
+ *	@note
+ *     Uses the method of K. Shoemake, "Uniform random rotations", 
+ *     Graphics Gems III, 1992, which draws a uniform unit quaternion.
+ */
+static void RandomRotation(sfmt_t *sfmt, double r[3][3])
+{
+	double u1 = sfmt_genrand_uint32(sfmt) / 4294967295.0;
+	double u2 = sfmt_genrand_uint32(sfmt) / 4294967295.0;
+	double u3 = sfmt_genrand_uint32(sfmt) / 4294967295.0;
+	double x = sqrt(1 - u1) * sin(2 * PI * u2);
+	double y = sqrt(1 - u1) * cos(2 * PI * u2);
+	double z = sqrt(u1)     * sin(2 * PI * u3);
+	double w = sqrt(u1)     * cos(2 * PI * u3);
+
+	r[0][0] = 1 - 2*(y*y + z*z); r[0][1] = 2*(x*y - z*w);     r[0][2] = 2*(x*z + y*w);
+	r[1][0] = 2*(x*y + z*w);     r[1][1] = 1 - 2*(x*x + z*z); r[1][2] = 2*(y*z - x*w);
+	r[2][0] = 2*(x*z - y*w);     r[2][1] = 2*(y*z + x*w);     r[2][2] = 1 - 2*(x*x + y*y);
+}
+
+/** Computes point \a i of the two-dimensional Sobol sequence, with a digital shift. */
+static void Sobol2D(unsigned int i, const unsigned int scramble[2], double *u, double *v)
+{
+	unsigned int x = scramble[0], y = scramble[1];
+	unsigned int dx = 0x80000000U, dy = 0x80000000U;
+
+	/* first dimension is the van der Corput sequence, the second one uses 
+	   the direction numbers of primitive polynomial x+1 */
+	for (; i; i >>= 1)
+	{
+		if (i & 1)
+		{
+			x ^= dx;
+			y ^= dy;
+		}
+		dx >>= 1;
+		dy ^= dy >> 1;
+	}
+	*u = (x + 0.5) / 4294967296.0;
+	*v = (y + 0.5) / 4294967296.0;
+}
+
+/** Finds a ray direction generator by name.
+ *
+ *	@param[in]  name	Generator name: icosahedron (also if NULL), icosphere, fibonacci, or sobol.
+ *	@return				Generator type, or -1 if \a name is unknown.
+ */
+int FindRayGenerator(const char *name)
+{
+	if (name == NULL || strcmp(name, "icosahedron") == 0)
+		return RG_ICOSAHEDRON;
+	if (strcmp(name, "icosphere") == 0)
+		return RG_ICOSPHERE;
+	if (strcmp(name, "fibonacci") == 0)
+		return RG_FIBONACCI;
+	if (strcmp(name, "sobol") == 0)
+		return RG_SOBOL;
+	return -1;
+}
+
+/** Allocates a ray direction generator.
+ *
+ *	@param[in]  name			Generator name: icosahedron, icosphere, fibonacci, or sobol.
+ *	@param[in]  nDesiredRays	Number of desired rays; the icosahedron generators round up to 20*k*k.
+ *	@return						Ray direction generator, to be released with FreeRayGenerator.
+ */
+CRayGenerator *AllocRayGenerator(const char *name, int nDesiredRays)
+{
+	CRayGenerator *generator;
+	sfmt_t sfmt;
+	char msg[256];
+	int  type;
+
+	type = FindRayGenerator(name);
+	if (type < 0)
+	{
+		sprintf(msg, "unknown ray generator '%.100s'\n(expected icosahedron, icosphere, fibonacci, or sobol)", name);
+		MsgErrorExit(msg);
+	}
+
+	generator = (CRayGenerator *) MemMalloc(sizeof(CRayGenerator));
+	generator->type   = (CRayGeneratorType) type;
+	generator->nRays  = nDesiredRays;
+	generator->stride = 1;
+	generator->ray    = NULL;
+
+	if (generator->type == RG_ICOSAHEDRON || generator->type == RG_ICOSPHERE)
+		generator->ray = GenerateRays(nDesiredRays, &generator->nRays);
+
+	/* draw a random rotation, and scrambling for the Sobol sequence, from a 
+	   fixed stream: like the rest of the simulation, runs are reproducible */
+	RngInitStream(&sfmt, RAYROTATION_STREAM);
+	RandomRotation(&sfmt, generator->rotation);
+	generator->scramble[0] = sfmt_genrand_uint32(&sfmt);
+	generator->scramble[1] = sfmt_genrand_uint32(&sfmt);
+
+	return generator;
+}
+
+/** Enumerates ray directions in interleaved order, such that any leading 
+ *	subset of rays covers the sphere about uniformly.
+ */
+void InterleaveRayGenerator(CRayGenerator *generator)
+{
+	int stride, a, b, r;
+
+	/* leading subsets of the Sobol sequence are well distributed already */
+	if (generator->type == RG_SOBOL)
+		return;
+
+	/* step through the rays with a stride close to the golden ratio, coprime with the number of rays */
+	for (stride = (int) (0.6180339887 * generator->nRays); stride > 1; stride--)
+	{
+		a = generator->nRays; b = stride;
+		while (b) { r = a % b; a = b; b = r; }
+		if (a == 1)
+			break;
+	}
+	generator->stride = MAX(stride, 1);
+}
+
+/** Generates a batch of ray directions.
+ *
+ *	@param[in]  generator	Ray direction generator.
+ *	@param[in]  first		Index of first ray direction.
+ *	@param[in]  count		Number of ray directions.
+ *	@param[out] ray			Unit vectors of ray directions.
+ *	@return					0, or -1 if the generator type is unknown (an internal error).
+ *
+ *	@note
+ *     This function does not allocate memory, and may be called from multiple threads;
+ *     it leaves reporting errors to its caller.
+ */
+int GetRayDirections(const CRayGenerator *generator, int first, int count, XYZ *ray)
+{
+	const double (*R)[3] = (const double (*)[3]) generator->rotation;
+	double z, rho, phi, u, v;
+	XYZ    d;
+	int    i, k;
+
+	for (i=0; i<count; i++)
+	{
+		k = (int) fmod((double) (first + i) * generator->stride, generator->nRays);
+		switch (generator->type)
+		{
+		case RG_ICOSAHEDRON:
+			ray[i] = generator->ray[k];
+			continue;
+
+		case RG_ICOSPHERE:
+			d = generator->ray[k];
+			break;
+
+		case RG_FIBONACCI:
+			/* equal-area spacing in z, golden angle spacing in azimuth */
+			z   = 1.0 - (2.0 * k + 1.0) / generator->nRays;
+			rho = sqrt(1.0 - z * z);
+			phi = PI * (3.0 - sqrt(5.0)) * k;
+			d.x = rho * cos(phi);
+			d.y = rho * sin(phi);
+			d.z = z;
+			break;
+
+		case RG_SOBOL:
+			/* map unit square to sphere with the equal-area cylindrical projection */
+			Sobol2D((unsigned int) k, generator->scramble, &u, &v);
+			z   = 1.0 - 2.0 * u;
+			rho = sqrt(1.0 - z * z);
+			phi = 2.0 * PI * v;
+			d.x = rho * cos(phi);
+			d.y = rho * sin(phi);
+			d.z = z;
+			break;
+
+		default:
+			return -1;
+		}
+
+		ray[i].x = R[0][0] * d.x + R[0][1] * d.y + R[0][2] * d.z;
+		ray[i].y = R[1][0] * d.x + R[1][1] * d.y + R[1][2] * d.z;
+		ray[i].z = R[2][0] * d.x + R[2][1] * d.y + R[2][2] * d.z;
+	}
+	return 0;
+}
+
+void FreeRayGenerator(CRayGenerator *generator)
+{
+	if (generator->ray)
+		MemFree(generator->ray);
+	MemFree(generator);
+}
@@ -53,6 +53,16 @@ void RngInit(sfmt_t *sfmt)
     sfmt_init_gen_rand(sfmt, 0xdeaf0bad);
 }
 
+/** Initializes the random number generator for one of several independent streams. */
+void RngInitStream(sfmt_t *sfmt, unsigned int stream)
+{
+	uint32_t key[2];
+
+	key[0] = 0xdeaf0bad;
+	key[1] = stream;
+	sfmt_init_by_array(sfmt, key, 2);
+}
+
 void RngSeed(void)
 {
 }
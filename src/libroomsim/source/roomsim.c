@@ -55,25 +55,32 @@
 /* local includes */
 #include "3D.h"
 #include "defs.h"
+#include "deposit.h"
 #include "dsp.h"
 #include "interface.h"
 #include "interp.h"
 #include "mem.h"
 #include "msg.h"
+#include "rays.h"
+#include "realtime.h"
 #include "rng.h"
 #include "sensor.h"
+#include "simd.h"
+#include "sweep.h"
+#include "thread.h"
 #include "types.h"
-#include "global.h"
-
-/* global variable to store sample rate of the setup */
-double g_fs = -1;
 
 /* disable warnings about unreferenced inline functions and unsafe CRT functions */
 #ifdef _MSC_VER
 #  pragma warning( disable : 4514 4996)
 #endif
 
-#define NFFT_SIZE 512
+#define NFFT_SIZE 512			/**< Default filter length. */
+#define MINFILTERLENGTH 16		/**< Range of options.filterlength. */
+#define MAXFILTERLENGTH 65536
+#define BRIR_CHUNK 4096		/**< Number of samples per chunk of sparse responses. */
+#define MAXDIRECTIONS 5120		/**< Range of options.diffusedirections. */
+#define DIRECTION_LOOKUP 64		/**< Direction grid lookup resolution, per side of a cube face. */
 
 /* Note: global variables are persistent across calls, but cleared when mex-function cleared
    mxMalloc'ed memory pointed to by global variables is released after each call, unless
@@ -85,8 +92,9 @@ typedef struct {
     const YPRT           r2s_yprt;      /**< Room-to-sensor coordinate transformation matrix. */
     const YPRT           s2r_yprt;      /**< Sensor-to-room coordinate transformation matrix. */
     CSensorDefinition    *definition;   /**< Sensor definition */
+	double               *response;     /**< Buffer for probed impulse responses, or NULL. */
 
-	double				 *TFShist;
+	double				 **TFScell;		/**< Time-frequency histogram per spatial bin, NULL while empty. */
 	double				 *FirstTOA;
 	int					 nTbin;
 	int					 nFbin;
@@ -97,19 +105,28 @@ typedef struct {
 static const XYZ SpaceBinCenter[6] = {{1,0,0},{-1,0,0},{0,1,0},{0,-1,0},{0,0,1},{0,0,-1}};
 
 /* #define RECV_TFS_BIN(r,t,f,s) (r).TFShist[(t) + ((r).nTbin) * ( (f) + ((r).nFbin) * (s) ) ] */
-#define RECV_TFS_BIN(r,t,f,s) (r).TFShist[(f) + ((r).nFbin) * ( (t) + ((r).nTbin) * (s) ) ]
+#define RECV_TFS_BIN(r,t,f,s) (r).TFScell[s][(f) + (size_t) ((r).nFbin) * (t)]
+
+/* Deposit log key of a histogram bin of receiver ri: its page, the spatial bin, times the page size plus its offset */
+#define TFS_KEY(sim,ri,t,f,s) (unsigned int) (((size_t) (ri) * (sim)->receiver[ri].nSbin + (s)) * (sim)->histogram.pagesize \
+								+ (f) + (size_t) (sim)->receiver[ri].nFbin * (t))
 
 
 /** Internal simulation data structure. */
 typedef struct {
 
+	CArena  arena;					/**< Memory of the simulation, released at once by RoomsimRelease. */
+
 	/* general simulation variables */
 	double  fs;
 	double  duration;
 	int		length;
 	double  diffusetimestep;
+	double  transitiontime;			/**< Hybrid simulation: time of transition from image sources to diffuse tail, or 0. */
+	double  transitionwidth;		/**< Hybrid simulation: duration of the crossfade around the transition. */
     double  c;          /**< speed of sound (m/s) */
     double  csample;    /**< speed of sound (m/sample) */
+	int		distanceattenuation;	/**< Nonzero if amplitudes decay with distance, applied per array element. */
 
 	/* simulation frequency bands */
     int     nBands;					/**< Number of frequency bands in simulation. */
@@ -125,19 +142,31 @@ typedef struct {
 	double  *diffusioncoefficient;
     
 	/* image source method fields */
-    double  *surfaceattenuation;	/**< Attenuation of surfaces on virtual-to-real room. */
     double  *attenuation;			/**< Total attenuation of image source to receiver path. */
     double  *h;						/**< Buffer for impulse responses. */
     double  *convbuf;				/**< Convolution buffer. */
 
 	/* diffuse rain algorithm fields */
-	double	*htv;
+	SAMPLE	*htv;
 	int		*htvidx;
 	unsigned int *noise;
-	double  *shapednoise;
-	double  *directionalshapednoise;
-
-    CMinPhaseFIRplan *minphaseplan;	/**< Design plan for minimum phase FIR filter from attenuation. */
+	SAMPLE  *shapednoise;
+	SAMPLE  *directionalshapednoise;
+	CPagedHistogram histogram;		/**< Time-frequency histograms of all receivers, one page per spatial bin. */
+
+	/* direction grid of the spatial histogram bins */
+	int     nDirections;			/**< Number of spatial bins, 6 for the axes bins. */
+	const XYZ *directioncenter;		/**< Center direction of each spatial bin. */
+	unsigned short *directionlookup;/**< Spatial bin per cube map texel, or NULL for the axes bins. */
+	SAMPLE  *gridnoise;				/**< Buffer for the shaped noise of one bin of a direction grid. */
+
+	/* filter stages: image sources of reflection order 0 ... nStages-2 each have a stage, 
+	   the last stage serves all higher orders and the diffuse tail */
+	int     nStages;				/**< Number of filter stages. */
+	int     *filterlength;			/**< Filter length of each stage. */
+    CMinPhaseFIRplan **minphaseplan;/**< Design plan for minimum phase FIR filter from attenuation, per stage. */
+	struct CImageTrack *track;		/**< Image source filters of the previous trajectory frame, or NULL. */
+	int     firstorder;				/**< Image sources of lower reflection order are left out. */
 
     /* sources */
     int     nSources;
@@ -149,6 +178,12 @@ typedef struct {
 
 	/* output */
     BRIR    *brir;
+
+	/* sparse output, when options.responsefloordB < 0 */
+	double  responsefloor;			/**< Linear energy floor of sparse responses, or 0 for dense responses. */
+	int     nChunks;				/**< Number of chunks per response channel. */
+	SAMPLE  ***chunk;				/**< Per response, lazily allocated chunks of each channel. */
+	int     verbose;
     
 } CRoomsimInternal;
 
@@ -161,6 +196,28 @@ typedef struct {
 /* Convenience macro to negate an XYZ structure */
 #define XYZ_NEGATE(v) ( (v).x = -(v).x; (v).y = -(v).y; (v).z = -(v).z; )
 
+/** Returns the storage of samples \a ofs to \a ofs + *\a n - 1 of channel \a c
+ *  of response \a sr. Chunks of sparse responses are allocated on demand, and 
+ *  *\a n is then limited to the end of the chunk holding sample \a ofs.
+ */
+SAMPLE *BRIRSpan(CRoomsimInternal *pSimulation, int sr, int c, int ofs, int *n)
+{
+	BRIR   *brir = &pSimulation->brir[sr];
+	SAMPLE **chunk;
+	int    k;
+
+	if (!pSimulation->chunk)
+		return &brir->sample[c * brir->nSamples + ofs];
+
+	k     = ofs / BRIR_CHUNK;
+	chunk = &pSimulation->chunk[sr][c * pSimulation->nChunks + k];
+	if (!*chunk)
+		*chunk = (SAMPLE *) MemCalloc(BRIR_CHUNK, sizeof(SAMPLE));
+	if (*n > (k + 1) * BRIR_CHUNK - ofs)
+		*n = (k + 1) * BRIR_CHUNK - ofs;
+	return *chunk + (ofs - k * BRIR_CHUNK);
+}
+
 void ComputeBandFrequencies(const CRoomSetup *pSetup, CRoomsimInternal *pSimulation)
 {
     int p0, p1;
@@ -171,7 +228,7 @@ void ComputeBandFrequencies(const CRoomSetup *pSetup, CRoomsimInternal *pSimulat
     p1 = (int) floor(LOG2(pSetup->options.fs / 2.22 / pSetup->options.referencefrequency) * pSetup->options.bandsperoctave);
     
     pSimulation->nBands = (p1-p0+1+2);
-    pSimulation->frequency = (double *) MemMalloc(pSimulation->nBands * sizeof(double));
+    pSimulation->frequency = (double *) ArenaMalloc(&pSimulation->arena, pSimulation->nBands * sizeof(double));
 
     /* assign frequencies to bands */
     pSimulation->frequency[0] = 0.0;
@@ -242,21 +299,23 @@ void InterpolateAbsorptionAndDiffusion(const CRoomSetup *pSetup, CRoomsimInterna
 {
     int    i, j, Nin, Nout;
 	double *alpha, *d, r;
+	CArenaMark mark;
     
 	Nin  = pSetup->room.surface.nBands;
 	Nout = pSimulation->nBands;
 	
 	/* allocate arrays in simulation structure */
-    pSimulation->logreflection         = (double *) MemMalloc(Nout * 6 * sizeof(double));
-    pSimulation->logabsorption         = (double *) MemMalloc(Nout * 6 * sizeof(double));
-    pSimulation->logdiffusion          = (double *) MemMalloc(Nout * 6 * sizeof(double));
-    pSimulation->logdiffusereflection  = (double *) MemMalloc(Nout * 6 * sizeof(double));
-    pSimulation->logspecularreflection = (double *) MemMalloc(Nout * 6 * sizeof(double));
-    pSimulation->diffusioncoefficient  = (double *) MemMalloc(Nout * 6 * sizeof(double));
+    pSimulation->logreflection         = (double *) ArenaMalloc(&pSimulation->arena, Nout * 6 * sizeof(double));
+    pSimulation->logabsorption         = (double *) ArenaMalloc(&pSimulation->arena, Nout * 6 * sizeof(double));
+    pSimulation->logdiffusion          = (double *) ArenaMalloc(&pSimulation->arena, Nout * 6 * sizeof(double));
+    pSimulation->logdiffusereflection  = (double *) ArenaMalloc(&pSimulation->arena, Nout * 6 * sizeof(double));
+    pSimulation->logspecularreflection = (double *) ArenaMalloc(&pSimulation->arena, Nout * 6 * sizeof(double));
+    pSimulation->diffusioncoefficient  = (double *) ArenaMalloc(&pSimulation->arena, Nout * 6 * sizeof(double));
     
 	/* allocate local arrays */
-	alpha = (double *)MemMalloc(pSimulation->nBands * sizeof(double));
-	d     = (double *)MemMalloc(pSimulation->nBands * sizeof(double));
+	mark  = ArenaGetMark(&pSimulation->arena);
+	alpha = (double *)ArenaMalloc(&pSimulation->arena, pSimulation->nBands * sizeof(double));
+	d     = (double *)ArenaMalloc(&pSimulation->arena, pSimulation->nBands * sizeof(double));
 	for (i=0; i<6; i++)
 	{
 		/* interpolate absorption and diffusion coefficients to simulation bands */
@@ -297,8 +356,7 @@ void InterpolateAbsorptionAndDiffusion(const CRoomSetup *pSetup, CRoomsimInterna
 	}
 
 	/* free local arrays */
-    MemFree(alpha);
-    MemFree(d);
+	ArenaRewind(&pSimulation->arena, mark);
 }
 
 #if 0
@@ -309,7 +367,7 @@ void ComputeAirAbsorption(const CRoomSetup *pSetup, CRoomsimInternal *pSimulatio
 
     /* compute the frequency dependent pressure absorption coeff for air */
     tmp = 5.5e-4 * (0.50 / pSetup->room.humidity);
-    pSimulation->logairattenuation = (double *) MemMalloc(pSimulation->nBands * sizeof(double));
+    pSimulation->logairattenuation = (double *) ArenaMalloc(&pSimulation->arena, pSimulation->nBands * sizeof(double));
     for (i=0; i<pSimulation->nBands; i++)
     {
 		m = tmp * pow(pSimulation->frequency[i] * 1e-3, 1.7);
@@ -333,7 +391,7 @@ void ComputeAirAbsorption(const CRoomSetup *pSetup, CRoomsimInternal *pSimulatio
 	double alpha, f2;
 	int i;
 
-    pSimulation->logairattenuation = (double *) MemMalloc(pSimulation->nBands * sizeof(double));
+    pSimulation->logairattenuation = (double *) ArenaMalloc(&pSimulation->arena, pSimulation->nBands * sizeof(double));
 
 	for (i=0; i<pSimulation->nBands; i++)
 	{
@@ -353,244 +411,777 @@ void ComputeAirAbsorption(const CRoomSetup *pSetup, CRoomsimInternal *pSimulatio
 #define IMGF(x) (((x)+1)&(-2))
 #define IMGS(x) (-(((x)&1)*2-1))
 
+/** Returns the fraction of a hybrid simulation's response at time \a t that is
+ *  left to the diffuse tail: 0 before the transition, rising to 1 across the 
+ *  crossfade, after which image sources are no longer rendered. */
+double HybridLateFraction(const CRoomsimInternal *pSimulation, double t)
+{
+	double x = (t - pSimulation->transitiontime) / pSimulation->transitionwidth + 0.5;
+
+	if (x <= 0.0)
+		return 0.0;
+	if (x >= 1.0)
+		return 1.0;
+	return 0.5 - 0.5 * cos(PI * x);
+}
+
+/** Returns the weight of ray energy arriving at time \a t from a surface with
+ *  diffusion coefficient \a d, in a hybrid simulation: the diffuse part \a d, 
+ *  plus after the transition the \a specular share of the ray, that is no 
+ *  longer covered by image sources. */
+double HybridDiffuseWeight(const CRoomsimInternal *pSimulation, double d, double specular, double t)
+{
+	return d + specular * HybridLateFraction(pSimulation, t);
+}
+
+/** Arrival of an image source at a receiver, apart from the receiver's directional response. */
+typedef struct {
+	int    si, ri;					/**< Source and receiver. */
+	int    image;					/**< Index of the virtual room, in order of enumeration. */
+	int    ofs;						/**< Delay, in samples. */
+	int    stage;					/**< Filter stage. */
+	XYZ    direction;				/**< Receiver to image source vector, in room coordinates. */
+	XYZ    sourcedirection;			/**< Image source to receiver vector, in source coordinates. */
+	const double *sourceimpulse;	/**< Source impulse response, or NULL. */
+} CImageArrival;
+
+/** Image source arrivals of a simulation, kept to render them at several receiver orientations. */
+typedef struct {
+	int           nArrivals;
+	int           maxArrivals;
+	int           nBands;
+	CImageArrival *arrival;
+	double        *attenuation;		/**< Attenuation of each arrival, nBands per arrival. */
+} CImageArrivals;
+
+/** Adds an arrival with attenuation \a attenuation to \a arrivals. Returns 0 when out of memory. */
+int AddImageArrival(CImageArrivals *arrivals, const CImageArrival *arrival, const double *attenuation)
+{
+	CImageArrival *a;
+	double        *att;
+	int           n = arrivals->nArrivals, max;
+
+	if (n == arrivals->maxArrivals)
+	{
+		max = 2 * n + 1024;
+		a   = (CImageArrival *) MemMalloc(max * sizeof(CImageArrival));
+		att = (double *) MemMalloc((size_t) max * arrivals->nBands * sizeof(double));
+		if (!a || !att)
+			return 0;
+		if (n > 0)
+		{
+			memcpy(a, arrivals->arrival, n * sizeof(CImageArrival));
+			memcpy(att, arrivals->attenuation, (size_t) n * arrivals->nBands * sizeof(double));
+			MemFree(arrivals->arrival);
+			MemFree(arrivals->attenuation);
+		}
+		arrivals->arrival     = a;
+		arrivals->attenuation = att;
+		arrivals->maxArrivals = max;
+	}
+
+	arrivals->arrival[n] = *arrival;
+	memcpy(&arrivals->attenuation[(size_t) n * arrivals->nBands], attenuation, arrivals->nBands * sizeof(double));
+	arrivals->nArrivals++;
+	return 1;
+}
+
 typedef struct {
 	int order;
+	int image;						/**< Index of the virtual room, in order of enumeration. */
 	int rx, ry, rz;
 	int surfacecount[6];
 	const CRoomSetup *pSetup;
 	CRoomsimInternal *pSimulation;
+	struct CSpecularPass *pass;		/**< Gathers the virtual rooms, or NULL. */
 } CRoomCallbackArg;
 
-void roomcallback(const CRoomCallbackArg *arg) /*(int order, int rx, int ry, int rz, int *surfacecount) */
+/* Number of image sources per chunk of the specular stage */
+#define SPECULAR_CHUNK 16384
+
+/** Specular stage, run over chunks of virtual rooms in order of enumeration.
+ *  A geometry pass computes the image sources of a chunk for every 
+ *  source/receiver pair at once, vectorized over the virtual rooms, and 
+ *  culls those that arrive too late; a rendering pass then renders the
+ *  remaining images, per source/receiver pair in order of delay, so that
+ *  consecutive images write nearby samples of the same response.
+ *
+ *  The geometry arrays hold one entry per pair and virtual room, at 
+ *  pair*stride + room, with pair = si*nReceivers + ri; the image arrays
+ *  one entry per image that arrives in time.
+ */
+typedef struct CSpecularPass {
+	const CRoomSetup *pSetup;
+	CRoomsimInternal *pSimulation;
+	CImageArrivals   *arrivals;		/**< Collects the arrivals instead of rendering them, or NULL. */
+	int    maxRooms;				/**< Number of virtual rooms per chunk. */
+	int    stride;					/**< maxRooms, rounded up to the vector width. */
+
+	/* virtual rooms of the chunk */
+	int    nRooms;
+	int    *order;					/**< Reflection order. */
+	int    *image;					/**< Index in order of enumeration. */
+	int    *room;					/**< Virtual room coordinates rx, ry, rz. */
+	double *offset[3];				/**< Image position for a source at the origin, per axis. */
+	double *sign[3];				/**< Sign of the source location in the image position, per axis. */
+	double *surfaceattenuation;		/**< Attenuation of surfaces, nBands per room. */
+
+	/* geometry pass */
+	double *position[3];			/**< Image source positions, per source and room. */
+	double *vector[3];				/**< Image source to receiver vectors, per pair and room. */
+	double *distance;				/**< Image source to receiver distances, per pair and room. */
+	double *delay;					/**< Delays [s], per pair and room. */
+
+	/* images that arrive in time */
+	int    nImages;
+	int    *entry;					/**< Entry of the geometry arrays. */
+	int    *ofs;					/**< Delay [samples]. */
+	double *late;					/**< Fraction left to the diffuse tail of a hybrid simulation. */
+	int    *rank;					/**< Images in order of rendering, 3 ints each: key, delay, image. */
+	int    *cut;					/**< Last receiver to render of each room and source. */
+} CSpecularPass;
+
+/** Computes the arrival of image \a i of the current chunk of \a pass, up to
+ *  the receiver's directional response: filter stage, and attenuation by 
+ *  surfaces, distance, air and source, the latter in pSimulation->attenuation.
+ *
+ *	@return		1, or -1 if the source has no response in the direction of
+ *				the receiver.
+ */
+int ComputeImageArrival(const CSpecularPass *pass, int i, CImageArrival *arrival)
+{
+	const CRoomSetup *pSetup      = pass->pSetup;
+	CRoomsimInternal *pSimulation = pass->pSimulation;
+    XYZ				 V, W, xyz;
+    double			 distance, tmp;
+	CSensorResponse  sourceresponse;
+    int				 b, e = pass->entry[i], k = e % pass->stride, pair = e / pass->stride;
+	int				 si = pair / pSetup->nReceivers, ri = pair % pSetup->nReceivers;
+	const int		 *r = &pass->room[3*k];
+    double			 late = pass->late[i];
+
+    /* virtual source to receiver vector and distance, from the geometry pass */
+    V.x = pass->vector[0][e];
+    V.y = pass->vector[1][e];
+    V.z = pass->vector[2][e];
+    distance = pass->distance[e];
+
+	/* derive receiver to virtual source vector */
+	W.x = -V.x; 
+	W.y = -V.y; 
+	W.z = -V.z;
+
+    /* copy virtual room surface attenuation to source/receiver attenuation */
+    memcpy(pSimulation->attenuation,&pass->surfaceattenuation[(size_t) k * pSimulation->nBands],pSimulation->nBands*sizeof(double));
+    
+    /* apply attenuation from distance and air absorption */
+    if (pSetup->options.distanceattenuation)
+    {
+        tmp = LOGDOMAIN(distance);
+        for (b=0; b<pSimulation->nBands; b++)
+            pSimulation->attenuation[b] -= tmp;
+    }
+    if (pSetup->options.airabsorption)
+    {
+        for (b=0; b<pSimulation->nBands; b++)
+            pSimulation->attenuation[b] += distance*pSimulation->logairattenuation[b];
+    }
+    if (late > 0.0)
+    {
+        tmp = LOGDOMAIN(1.0 - late);
+        for (b=0; b<pSimulation->nBands; b++)
+            pSimulation->attenuation[b] += tmp;
+    }
+          
+    /** @todo Add test for maximum attenuation, something like 
+              "if max(Attenuation) < MinReflection, continue; end;". */
+
+    /* flip source vector component depending on reflection order */
+	V.x *= IMGS(r[0]);
+	V.y *= IMGS(r[1]);
+	V.z *= IMGS(r[2]);
+
+	/* convert source vector from room to sensor coordinates */
+    YawPitchRoll(&V,&pSimulation->source[si].r2s_yprt,&xyz);
+
+    /* determine source response to this direction */
+	sourceresponse.buffer = pSimulation->source[si].response;
+	if (!SensorGetResponse(pSimulation->source[si].definition,&xyz,&sourceresponse))
+		return -1;	/* skip receiver if no source response defined for this direction */
+
+    arrival->sourceimpulse = NULL;
+	switch (sourceresponse.type)
+	{
+	case SR_LOGGAIN:
+        for (b=0; b<pSimulation->nBands; b++)
+            pSimulation->attenuation[b] += sourceresponse.data.loggain;
+        break;
+
+	case SR_LOGWEIGHTS:
+        for (b=0; b<pSimulation->nBands; b++)
+            pSimulation->attenuation[b] += sourceresponse.data.logweights[b];
+        break;
+
+	case SR_IMPULSERESPONSE:
+		arrival->sourceimpulse = sourceresponse.data.impulseresponse;
+		break;
+
+	case SR_GAINS:
+	case SR_ELEMENTS:
+		/* unreachable: RoomsimInit rejects gain and array sensors as sources */
+		break;
+	}
+
+	arrival->si              = si;
+	arrival->ri              = ri;
+	arrival->image           = pass->image[k];
+	arrival->ofs             = pass->ofs[i];
+	arrival->stage           = MIN(pass->order[k], pSimulation->nStages-1);
+	arrival->direction       = W;
+	arrival->sourcedirection = xyz;
+	return 1;
+}
+
+/** Minimum-phase filters of the image source arrivals of a trajectory frame,
+ *  in order of enumeration. */
+typedef struct {
+	int    nFilters;
+	int    maxFilters;
+	int    *key;				/**< Virtual room and source/receiver pair of each filter, 2 per filter. */
+	double *logmag;				/**< Attenuation each filter was designed for, nBands per filter. */
+	double *h;					/**< Filters, hstride per filter. */
+} CImageFilters;
+
+/** Image source filters of a trajectory, carried from one frame to the next.
+ *  Images are identified by their virtual room and source/receiver pair, 
+ *  which the enumeration visits in the same order every frame. A filter is
+ *  designed again only when the attenuation of its image has moved more than
+ *  the tolerance away from the attenuation it was designed for; delays are
+ *  always those of the current frame.
+ */
+typedef struct CImageTrack {
+	CImageFilters frame[2];		/**< Filters of the previous and of the current frame. */
+	int    current;				/**< Index of the current frame in frame[]. */
+	int    cursor;				/**< Next filter of the previous frame to match. */
+	int    nBands;
+	int    hstride;				/**< Largest filter length of the simulation. */
+	double tolerance;			/**< Largest change of attenuation for which a filter is reused, log domain. */
+	long   nDesigned, nReused;	/**< Statistics. */
+} CImageTrack;
+
+static void FreeImageFilters(CImageFilters *filters)
+{
+	if (filters->maxFilters > 0)
+	{
+		MemFree(filters->key);
+		MemFree(filters->logmag);
+		MemFree(filters->h);
+	}
+	memset(filters, 0, sizeof(*filters));
+}
+
+/** Grows \a filters to hold at least one more filter. Returns 0 when out of memory. */
+static int GrowImageFilters(CImageFilters *filters, int nBands, int hstride)
+{
+	int    n = filters->nFilters, max = 2 * filters->maxFilters + 256;
+	int    *key   = (int *) MemMalloc((size_t) max * 2 * sizeof(int));
+	double *logmag = (double *) MemMalloc((size_t) max * nBands * sizeof(double));
+	double *h     = (double *) MemMalloc((size_t) max * hstride * sizeof(double));
+
+	if (!key || !logmag || !h)
+		return 0;
+	if (n > 0)
+	{
+		memcpy(key, filters->key, (size_t) n * 2 * sizeof(int));
+		memcpy(logmag, filters->logmag, (size_t) n * nBands * sizeof(double));
+		memcpy(h, filters->h, (size_t) n * hstride * sizeof(double));
+	}
+	FreeImageFilters(filters);
+	filters->key        = key;
+	filters->logmag     = logmag;
+	filters->h          = h;
+	filters->nFilters   = n;
+	filters->maxFilters = max;
+	return 1;
+}
+
+/** Starts a frame of a trajectory: the filters of the current frame become those of the previous frame. */
+static void BeginImageTrackFrame(CImageTrack *track, const CRoomsimInternal *pSimulation)
+{
+	int i, hstride = 0;
+
+	for (i=0; i<pSimulation->nStages; i++)
+		hstride = MAX(hstride, pSimulation->filterlength[i]);
+	if (track->nBands != pSimulation->nBands || track->hstride != hstride)
+	{
+		/* filters of other frequency bands or lengths cannot be reused */
+		FreeImageFilters(&track->frame[0]);
+		FreeImageFilters(&track->frame[1]);
+		track->nBands  = pSimulation->nBands;
+		track->hstride = hstride;
+	}
+	track->current ^= 1;
+	track->frame[track->current].nFilters = 0;
+	track->cursor = 0;
+}
+
+/** Returns the minimum-phase filter of an image source arrival, whose attenuation 
+ *  is in pSimulation->attenuation, from the previous frame of a trajectory if 
+ *  the image is within tolerance of it, or designed anew. */
+static const double *TrackImageFilter(CRoomsimInternal *pSimulation, const CImageArrival *arrival)
+{
+	CImageTrack   *track    = pSimulation->track;
+	CImageFilters *previous = &track->frame[track->current ^ 1];
+	CImageFilters *current  = &track->frame[track->current];
+	const int     *key;
+	const double  *logmag;
+	double        *h;
+	int           b, nBands = track->nBands, n = current->nFilters, c;
+	int           pair = arrival->si * pSimulation->nReceivers + arrival->ri;
+
+	if (n == current->maxFilters && !GrowImageFilters(current, nBands, track->hstride))
+		MsgErrorExit("out of memory tracking image source filters");
+	current->key[2*n]   = arrival->image;
+	current->key[2*n+1] = pair;
+	h = &current->h[(size_t) n * track->hstride];
+	current->nFilters++;
+
+	/* find the image in the previous frame, whose filters are in the same order */
+	for (c=track->cursor; c<previous->nFilters; c++)
+	{
+		key = &previous->key[2*c];
+		if (key[0] > arrival->image || (key[0] == arrival->image && key[1] >= pair))
+			break;
+	}
+	track->cursor = c;
+
+	if (c < previous->nFilters && previous->key[2*c] == arrival->image && previous->key[2*c+1] == pair)
+	{
+		logmag = &previous->logmag[(size_t) c * nBands];
+		for (b=0; b<nBands && fabs(pSimulation->attenuation[b] - logmag[b]) <= track->tolerance; b++)
+			;
+		if (b == nBands)
+		{
+			memcpy(&current->logmag[(size_t) n * nBands], logmag, nBands * sizeof(double));
+			memcpy(h, &previous->h[(size_t) c * track->hstride], pSimulation->filterlength[arrival->stage] * sizeof(double));
+			track->nReused++;
+			return h;
+		}
+	}
+
+	memcpy(&current->logmag[(size_t) n * nBands], pSimulation->attenuation, nBands * sizeof(double));
+	LogMagFreqResp2MinPhaseFIR(pSimulation->attenuation, h, pSimulation->minphaseplan[arrival->stage]);
+	track->nDesigned++;
+	return h;
+}
+
+/** Adds the response \a x of an image source at \a distance from the origin
+ *  of an array to element \a c, whose path to the image is \a path longer,
+ *  with the element gain and a linearly interpolated fractional delay.
+ */
+static void AddArrayElement(CRoomsimInternal *pSimulation, int sr, int c, double distance,
+							double gain, double path, const double *x, int xlen)
+{
+	double	delay, frac, value;
+	int		i, k, n, offset, lim;
+	SAMPLE	*span;
+
+	if (gain == 0)
+		return;
+	if (pSimulation->distanceattenuation)
+		gain *= distance / (distance + path);
+
+	delay  = (distance + path) / pSimulation->csample;
+	offset = (int) floor(delay);
+	frac   = delay - offset;
+	lim    = MIN(xlen+1, pSimulation->brir[sr].nSamples-offset);
+	for (i=0; i<lim; i+=n)
+	{
+		n = lim - i;
+		span = BRIRSpan(pSimulation, sr, c, offset+i, &n);
+		for (k=i; k<i+n; k++)
+		{
+			value = k < xlen ? (1 - frac) * x[k] : 0;
+			if (k > 0)
+				value += frac * x[k-1];
+			span[k-i] += (SAMPLE) (gain * value);
+		}
+	}
+}
+
+/** Renders an image source arrival, whose attenuation is in pSimulation->attenuation,
+ *  through the directional response of its receiver into the receiver's response.
+ *
+ *	@return		1, or 0 if the receiver has no response in the direction of the image.
+ */
+int RenderImageArrival(CRoomsimInternal *pSimulation, const CImageArrival *arrival)
 {
-    XYZ				 S, V, W, xyz;
-    double			 distance, delay, tmp;
+    XYZ				 xyz;
     double			 *y;
-    const double     *sourceimpulse, *receiverimpulse;
-	CSensorResponse  sourceresponse, receiverresponse;
+    const double     *sourceimpulse = arrival->sourceimpulse, *receiverimpulse, *receivergains, *receiverelements;
+	CSensorResponse  receiverresponse;
     const double	 *x, *h;
-    int				 b, s, si, ri;
+    double           gain;
+    int				 b, si = arrival->si, ri = arrival->ri;
     int				 i, sr, ofs, lim;
     int				 xlen, ylen, hlen, nChannels;
+    int				 c, k, n, stage = arrival->stage;
+    SAMPLE			 *span;
+
+	/* convert receiver vector from room to sensor coordinates */
+    YawPitchRoll(&arrival->direction,&pSimulation->receiver[ri].r2s_yprt,&xyz);
+
+    /* determine receiver response to this direction */
+	receiverresponse.buffer   = pSimulation->receiver[ri].response;
+	receiverresponse.distance = sqrt(arrival->direction.x*arrival->direction.x + arrival->direction.y*arrival->direction.y + arrival->direction.z*arrival->direction.z);
+	if (!SensorGetResponse(pSimulation->receiver[ri].definition,&xyz,&receiverresponse))
+		return 0;	/* skip receiver if no receiver response defined for this direction */
+
+    receiverimpulse = NULL;
+    receivergains   = NULL;
+    receiverelements = NULL;
+	switch (receiverresponse.type)
+	{
+	case SR_LOGGAIN:
+        for (b=0; b<pSimulation->nBands; b++)
+            pSimulation->attenuation[b] += receiverresponse.data.loggain;
+        break;
 
-    /* compute surface absorption/diffusion for this virtual room */
-	i = arg->pSimulation->nBands;
-    for (b=0; b<i; b++)
+	case SR_LOGWEIGHTS:
+        for (b=0; b<pSimulation->nBands; b++)
+            pSimulation->attenuation[b] += receiverresponse.data.logweights[b];
+        break;
+
+	case SR_IMPULSERESPONSE:
+		receiverimpulse = receiverresponse.data.impulseresponse;
+		break;
+
+	case SR_GAINS:
+		receivergains = receiverresponse.data.gains;
+		break;
+
+	case SR_ELEMENTS:
+		receiverelements = receiverresponse.data.elements;
+	}
+
+#if 0
+    /* determine receiver response to this direction  */
+    receiverresponse = NULL;
+    YawPitchRoll(&W,&arg->pSimulation->receiver[ri].r2s_yprt,&xyz);
+    switch (arg->pSimulation->receiver[ri].definition->type)
     {
-        arg->pSimulation->surfaceattenuation[b] = 0;
-        for (s=0; s<6; s++)
-            arg->pSimulation->surfaceattenuation[b] += arg->pSimulation->logspecularreflection[b+s*i] * arg->surfacecount[s];
+        case ST_GAIN:
+            gain = arg->pSimulation->receiver[ri].definition->probe.gain(&xyz,arg->pSimulation->receiver[ri].definition->data);
+            if (gain==EMPTY_GAIN) continue;
+            for (b=0; b<arg->pSimulation->nBands; b++)
+                arg->pSimulation->attenuation[b] += gain;
+            break;
+            
+        case ST_WEIGHTS:
+            weights = arg->pSimulation->receiver[ri].definition->probe.weights(&xyz,arg->pSimulation->receiver[ri].definition->data);
+            if (!weights) continue;
+            /** @todo Interpolate receiver weights to simulation freq. bands. */
+            for (b=0; b<arg->pSimulation->nBands; b++)
+                arg->pSimulation->attenuation[b] += weights[b];
+            break;
+            
+        case ST_RESPONSE:
+            receiverresponse = arg->pSimulation->receiver[ri].definition->probe.response(&xyz,arg->pSimulation->receiver[ri].definition->data);
+            if (!receiverresponse) continue;
+    }
+#endif
+
+    /* combine surfaces, air, distance, source, and receiver weights into single impulse response */
+    if (pSimulation->track)
+        x = TrackImageFilter(pSimulation, arrival);
+    else
+    {
+        LogMagFreqResp2MinPhaseFIR(pSimulation->attenuation, pSimulation->h, pSimulation->minphaseplan[stage]);
+        x = pSimulation->h;
     }
+    xlen = pSimulation->filterlength[stage];
+    y = pSimulation->convbuf;
+    nChannels = 1;
+    
+    /** @todo Apply subsample filter if required. */
     
-    /* loop over all sources */
-    for (si=0; si<arg->pSetup->nSources; si++)
+    /* Convolve pSimulation->h with sourceimpulse and receiverimpulse, if any. */
+	/* Note that receiverimpulse could contain 2 channels. */
+    if (sourceimpulse)
     {
-        /* compute virtual source position */
-        S.x = IMGF(arg->rx) * arg->pSetup->room.dimension[0] + IMGS(arg->rx) * arg->pSetup->source[si].location[0];
-        S.y = IMGF(arg->ry) * arg->pSetup->room.dimension[1] + IMGS(arg->ry) * arg->pSetup->source[si].location[1];
-        S.z = IMGF(arg->rz) * arg->pSetup->room.dimension[2] + IMGS(arg->rz) * arg->pSetup->source[si].location[2];
-        
-        /* loop over all receivers */
-        for (ri=0; ri<arg->pSetup->nReceivers; ri++)
+        h = sourceimpulse; hlen = pSimulation->source[si].definition->nSamples;
+        Conv(h, hlen, x, xlen, y);
+        ylen = hlen + xlen - 1;
+        x = y; xlen = ylen;
+        y += ylen;
+    }
+    
+    if (receiverimpulse)
+    {
+        h = receiverimpulse; hlen = pSimulation->receiver[ri].definition->nSamples;
+        Conv(h, hlen, x, xlen, y);
+        ylen = hlen + xlen - 1;
+        if (pSimulation->receiver[ri].definition->nChannels == 2)
         {
-	        /* compute virtual source to receiver vector */
-            V.x = arg->pSetup->receiver[ri].location[0] - S.x;
-            V.y = arg->pSetup->receiver[ri].location[1] - S.y;
-            V.z = arg->pSetup->receiver[ri].location[2] - S.z;
-
-			/* derive receiver to virtual source vector */
-			W.x = -V.x; 
-			W.y = -V.y; 
-			W.z = -V.z;
-                                
-            /* compute distance, delay */
-            distance = sqrt(V.x*V.x + V.y*V.y + V.z*V.z);
-            delay = distance / arg->pSimulation->c;
-            
-            /* jump out of loop if delay > max delay */
-            if (delay > arg->pSetup->options.responseduration) 
-                continue;
+            Conv(&h[hlen], hlen, x, xlen, &y[ylen]);
+            nChannels = 2;
+        }
+        x = y; xlen = ylen;
+        y += nChannels * ylen;
+    }
 
-            /* copy virtual room surface attenuation to source/receiver attenuation */
-            memcpy(arg->pSimulation->attenuation,arg->pSimulation->surfaceattenuation,arg->pSimulation->nBands*sizeof(double));
-            
-            /* apply attenuation from distance and air absorption */
-            if (arg->pSetup->options.distanceattenuation)
-            {
-                tmp = LOGDOMAIN(distance);
-                for (b=0; b<arg->pSimulation->nBands; b++)
-                    arg->pSimulation->attenuation[b] -= tmp;
-            }
-            if (arg->pSetup->options.airabsorption)
-            {
-                for (b=0; b<arg->pSimulation->nBands; b++)
-                    arg->pSimulation->attenuation[b] += distance*arg->pSimulation->logairattenuation[b];
-            }
-                  
-            /** @todo Add test for maximum attenuation, something like 
-                      "if max(Attenuation) < MinReflection, continue; end;". */
+    /* array elements receive the response with their own gain and delay */
+    if (receiverelements)
+    {
+        sr = ri*pSimulation->nSources + si;
+        nChannels = pSimulation->receiver[ri].definition->nChannels;
+        for (c=0; c<nChannels; c++)
+            AddArrayElement(pSimulation, sr, c, receiverresponse.distance,
+                            receiverelements[c], receiverelements[nChannels+c], x, xlen);
+        return 1;
+    }
 
-            /* flip source vector component depending on reflection order */
-			V.x *= IMGS(arg->rx);
-			V.y *= IMGS(arg->ry);
-			V.z *= IMGS(arg->rz);
+    /* signed receiver gains encode the single-channel response into every channel */
+    if (receivergains)
+        nChannels = pSimulation->receiver[ri].definition->nChannels;
+    
+    /* add final impulse response to output room impulse response */
+    sr  = ri*pSimulation->nSources + si;
+    ofs = arrival->ofs;
+    lim = MIN(xlen,pSimulation->brir[sr].nSamples-ofs);
+    for (c=0; c<nChannels; c++)
+    {
+        if (receivergains)
+        {
+            gain = receivergains[c];
+            h    = x;
+            if (gain == 0)
+                continue;
+        }
+        else
+        {
+            gain = 1.0;
+            h    = x + c*xlen;
+        }
+        for (i=0; i<lim; i+=n)
+        {
+            n = lim - i;
+            span = BRIRSpan(pSimulation, sr, c, ofs+i, &n);
+            for (k=0; k<n; k++)
+                span[k] += (SAMPLE) (gain * h[i+k]);
+        }
+    }
 
-			/* convert source vector from room to sensor coordinates */
-            YawPitchRoll(&V,&arg->pSimulation->source[si].r2s_yprt,&xyz);
+	return 1;
+}
 
-            /* determine source response to this direction */
-			if (!SensorGetResponse(arg->pSimulation->source[si].definition,&xyz,&sourceresponse))
-				break;	/* skip receiver if no source response defined for this direction */
+/** Geometry pass of a chunk: computes the image source positions of every
+ *  source, and the vectors, distances and delays to every receiver. */
+static void SpecularGeometry(CSpecularPass *pass)
+{
+	const CRoomSetup *pSetup = pass->pSetup;
+	const vdouble    c = VSET1(pass->pSimulation->c);
+	vdouble          s[3], v[3], d;
+	double           *pos[3], *vec[3];
+	int              n = VDOUBLE_PAD(pass->nRooms), nR = pSetup->nReceivers;
+	int              si, ri, a, k;
+	size_t           e;
+
+	for (si=0; si<pSetup->nSources; si++)
+	{
+		/* image positions of the source */
+		for (a=0; a<3; a++)
+		{
+			pos[a] = &pass->position[a][(size_t) si * pass->stride];
+			s[a]   = VSET1(pSetup->source[si].location[a]);
+			for (k=0; k<n; k+=VDOUBLE_WIDTH)
+				VSTORE(pos[a] + k, VADD(VLOAD(pass->offset[a] + k), VMUL(VLOAD(pass->sign[a] + k), s[a])));
+		}
 
-            sourceimpulse = NULL;
-			switch (sourceresponse.type)
+		/* image source to receiver vectors, distances and delays */
+		for (ri=0; ri<nR; ri++)
+		{
+			e = (size_t) (si * nR + ri) * pass->stride;
+			for (a=0; a<3; a++)
 			{
-			case SR_LOGGAIN:
-                for (b=0; b<arg->pSimulation->nBands; b++)
-                    arg->pSimulation->attenuation[b] += sourceresponse.data.loggain;
-                break;
-
-			case SR_LOGWEIGHTS:
-                for (b=0; b<arg->pSimulation->nBands; b++)
-                    arg->pSimulation->attenuation[b] += sourceresponse.data.logweights[b];
-                break;
-
-			case SR_IMPULSERESPONSE:
-				sourceimpulse = sourceresponse.data.impulseresponse;
+				s[a]   = VSET1(pSetup->receiver[ri].location[a]);
+				vec[a] = &pass->vector[a][e];
 			}
+			for (k=0; k<n; k+=VDOUBLE_WIDTH)
+			{
+				for (a=0; a<3; a++)
+				{
+					v[a] = VSUB(s[a], VLOAD(pos[a] + k));
+					VSTORE(vec[a] + k, v[a]);
+				}
+				d = VSQRT(VADD(VADD(VMUL(v[0], v[0]), VMUL(v[1], v[1])), VMUL(v[2], v[2])));
+				VSTORE(pass->distance + e + k, d);
+				VSTORE(pass->delay + e + k, VDIV(d, c));
+			}
+		}
+	}
+}
 
-#if 0
-            switch (arg->pSimulation->source[si].definition->type)
-            {
-                case ST_GAIN:
-                    gain = arg->pSimulation->source[si].definition->probe.gain(&xyz,arg->pSimulation->source[si].definition->data);
-                    if (gain==EMPTY_GAIN) 
-						continue;
-                    for (b=0; b<arg->pSimulation->nBands; b++)
-                        arg->pSimulation->attenuation[b] += gain;
-                    break;
-                    
-                case ST_WEIGHTS:
-                    weights = arg->pSimulation->source[si].definition->probe.weights(&xyz,arg->pSimulation->source[si].definition->data);
-                    if (!weights) 
-						continue;
-                    /** @todo Interpolate source weights to simulation freq. bands. */
-                    for (b=0; b<arg->pSimulation->nBands; b++)
-                        arg->pSimulation->attenuation[b] += weights[b];
-                    break;
-                    
-                case ST_RESPONSE:
-                    sourceresponse = arg->pSimulation->source[si].definition->probe.response(&xyz,arg->pSimulation->source[si].definition->data);
-                    if (!sourceresponse) 
-						continue;
-            }
-#endif
-            
-			/* convert receiver vector from room to sensor coordinates */
-            YawPitchRoll(&W,&arg->pSimulation->receiver[ri].r2s_yprt,&xyz);
-
-            /* determine receiver response to this direction */
-			if (!SensorGetResponse(arg->pSimulation->receiver[ri].definition,&xyz,&receiverresponse))
-				break;	/* skip receiver if no receiver response defined for this direction */
+/** Lists the images of a chunk that arrive within the response, in order of enumeration. */
+static void SpecularCull(CSpecularPass *pass)
+{
+	const CRoomsimInternal *pSimulation = pass->pSimulation;
+	double duration = pass->pSetup->options.responseduration, delay, late;
+	int    nSR = pass->pSetup->nSources * pass->pSetup->nReceivers;
+	int    k, pair, e, i;
 
-            receiverimpulse = NULL;
-			switch (receiverresponse.type)
+	pass->nImages = 0;
+	for (k=0; k<pass->nRooms; k++)
+	{
+		for (pair=0; pair<nSR; pair++)
+		{
+			e = pair * pass->stride + k;
+			delay = pass->delay[e];
+			if (delay > duration)
+				continue;
+
+			/* hybrid simulation: images after the transition are left to the diffuse tail */
+			late = 0.0;
+			if (pSimulation->transitiontime > 0 && pass->order[k] > 0)
 			{
-			case SR_LOGGAIN:
-                for (b=0; b<arg->pSimulation->nBands; b++)
-                    arg->pSimulation->attenuation[b] += receiverresponse.data.loggain;
-                break;
-
-			case SR_LOGWEIGHTS:
-                for (b=0; b<arg->pSimulation->nBands; b++)
-                    arg->pSimulation->attenuation[b] += receiverresponse.data.logweights[b];
-                break;
-
-			case SR_IMPULSERESPONSE:
-				receiverimpulse = receiverresponse.data.impulseresponse;
+				late = HybridLateFraction(pSimulation, delay);
+				if (late >= 1.0)
+					continue;
 			}
 
-#if 0
-            /* determine receiver response to this direction  */
-            receiverresponse = NULL;
-            YawPitchRoll(&W,&arg->pSimulation->receiver[ri].r2s_yprt,&xyz);
-            switch (arg->pSimulation->receiver[ri].definition->type)
-            {
-                case ST_GAIN:
-                    gain = arg->pSimulation->receiver[ri].definition->probe.gain(&xyz,arg->pSimulation->receiver[ri].definition->data);
-                    if (gain==EMPTY_GAIN) continue;
-                    for (b=0; b<arg->pSimulation->nBands; b++)
-                        arg->pSimulation->attenuation[b] += gain;
-                    break;
-                    
-                case ST_WEIGHTS:
-                    weights = arg->pSimulation->receiver[ri].definition->probe.weights(&xyz,arg->pSimulation->receiver[ri].definition->data);
-                    if (!weights) continue;
-                    /** @todo Interpolate receiver weights to simulation freq. bands. */
-                    for (b=0; b<arg->pSimulation->nBands; b++)
-                        arg->pSimulation->attenuation[b] += weights[b];
-                    break;
-                    
-                case ST_RESPONSE:
-                    receiverresponse = arg->pSimulation->receiver[ri].definition->probe.response(&xyz,arg->pSimulation->receiver[ri].definition->data);
-                    if (!receiverresponse) continue;
-            }
-#endif
+			i = pass->nImages++;
+			pass->entry[i] = e;
+			pass->ofs[i]   = ROUND(pass->distance[e]/pSimulation->csample);
+			pass->late[i]  = late;
+		}
+	}
+}
 
-            /* combine surfaces, air, distance, source, and receiver weights into single impulse response */
-            LogMagFreqResp2MinPhaseFIR(arg->pSimulation->attenuation, arg->pSimulation->h, arg->pSimulation->minphaseplan);
-            
-            x = arg->pSimulation->h; xlen = NFFT_SIZE;
-            y = arg->pSimulation->convbuf;
-            nChannels = 1;
-            
-            /** @todo Apply subsample filter if required. */
-            
-            /* Convolve arg->pSimulation->h with sourceimpulse and receiverimpulse, if any. */
-			/* Note that receiverimpulse could contain 2 channels. */
-            if (sourceimpulse)
-            {
-                h = sourceimpulse; hlen = arg->pSimulation->source[si].definition->nSamples;
-                Conv(h, hlen, x, xlen, y);
-                ylen = hlen + xlen - 1;
-                x = y; xlen = ylen;
-                y += ylen;
-            }
-            
-            if (receiverimpulse)
-            {
-                h = receiverimpulse; hlen = arg->pSimulation->receiver[ri].definition->nSamples;
-                Conv(h, hlen, x, xlen, y);
-                ylen = hlen + xlen - 1;
-                if (arg->pSimulation->receiver[ri].definition->nChannels == 2)
-                {
-                    Conv(&h[hlen], hlen, x, xlen, &y[ylen]);
-                    nChannels = 2;
-                }
-                x = y; xlen = ylen;
-                y += nChannels * ylen;
-            }
-            
-            /* add final impulse response to output room impulse response */
-            sr  = ri*arg->pSimulation->nSources + si;
-            ofs = ROUND(distance/arg->pSimulation->csample);
-            lim = MIN(xlen,arg->pSimulation->brir[sr].nSamples-ofs);
-            for (i=0; i<lim; i++)
-                arg->pSimulation->brir[sr].sample[ofs+i] += x[i];
-            if (nChannels == 2)
-                for (i=0; i<lim; i++)
-                    arg->pSimulation->brir[sr].sample[arg->pSimulation->brir[sr].nSamples+ofs+i] += x[xlen+i];
-            
-        } /* next receiver */
+/** Orders images by response, then delay, then order of enumeration. */
+static int CompareImageRank(const void *a, const void *b)
+{
+	const int *x = (const int *) a, *y = (const int *) b;
+	int       i;
+
+	for (i=0; i<3; i++)
+		if (x[i] != y[i])
+			return x[i] < y[i] ? -1 : 1;
+	return 0;
+}
+
+/** Rendering pass of a chunk. Images are rendered per source/receiver pair, 
+ *  ordered by receiver and then source, in order of delay; they are 
+ *  collected, or rendered with the filters of a trajectory, in order of 
+ *  enumeration instead. A source or receiver without response in the 
+ *  direction of an image skips the remaining receivers of that image and
+ *  source, which the order by receiver keeps for the images of all pairs.
+ */
+static void SpecularRender(CSpecularPass *pass)
+{
+	CRoomsimInternal *pSimulation = pass->pSimulation;
+	CImageArrival    arrival;
+	int              nS = pass->pSetup->nSources, nR = pass->pSetup->nReceivers;
+	int              sorted = !pass->arrivals && !pSimulation->track;
+	int              j, i, k, pair, si, ri, *cut;
+
+	for (j=0; j<pass->nRooms*nS; j++)
+		pass->cut[j] = nR;
+
+	if (sorted)
+	{
+		for (i=0; i<pass->nImages; i++)
+		{
+			pair = pass->entry[i] / pass->stride;
+			pass->rank[3*i]   = (pair % nR) * nS + pair / nR;
+			pass->rank[3*i+1] = pass->ofs[i];
+			pass->rank[3*i+2] = i;
+		}
+		qsort(pass->rank, pass->nImages, 3 * sizeof(int), CompareImageRank);
+	}
+
+	for (j=0; j<pass->nImages; j++)
+	{
+		i    = sorted ? pass->rank[3*j+2] : j;
+		k    = pass->entry[i] % pass->stride;
+		pair = pass->entry[i] / pass->stride;
+		si   = pair / nR;
+		ri   = pair % nR;
+		cut  = &pass->cut[k*nS + si];
+		if (ri > *cut)
+			continue;
+
+		if (ComputeImageArrival(pass, i, &arrival) < 0)
+		{
+			*cut = ri;
+			continue;
+		}
+
+		if (pass->arrivals)
+		{
+			/* keep arrival for rendering at every receiver orientation */
+			if (!AddImageArrival(pass->arrivals, &arrival, pSimulation->attenuation))
+				MsgErrorExit("out of memory caching image source arrivals");
+			continue;
+		}
+
+		if (!RenderImageArrival(pSimulation, &arrival))
+			*cut = ri;
+	}
+}
+
+/** Runs the geometry and rendering passes over the gathered virtual rooms. */
+static void FlushSpecularPass(CSpecularPass *pass)
+{
+	if (pass->nRooms == 0)
+		return;
+	SpecularGeometry(pass);
+	SpecularCull(pass);
+	SpecularRender(pass);
+	pass->nRooms = 0;
+}
+
+/** Adds a virtual room to the current chunk, and runs the chunk when full. */
+static void GatherVirtualRoom(const CRoomCallbackArg *arg)
+{
+	CSpecularPass *pass = arg->pass;
+	double        *att;
+	int           k = pass->nRooms, nBands = arg->pSimulation->nBands, a, b, s, r[3];
+
+	if (arg->order < arg->pSimulation->firstorder)
+		return;
+
+	r[0] = arg->rx;
+	r[1] = arg->ry;
+	r[2] = arg->rz;
+
+	pass->order[k] = arg->order;
+	pass->image[k] = arg->image;
+	for (a=0; a<3; a++)
+	{
+		pass->room[3*k+a]  = r[a];
+		pass->offset[a][k] = IMGF(r[a]) * arg->pSetup->room.dimension[a];
+		pass->sign[a][k]   = IMGS(r[a]);
+	}
 
-    } /* next source */
+    /* compute surface absorption/diffusion for this virtual room */
+	att = &pass->surfaceattenuation[(size_t) k * nBands];
+    for (b=0; b<nBands; b++)
+    {
+        att[b] = 0;
+        for (s=0; s<6; s++)
+            att[b] += arg->pSimulation->logspecularreflection[b+s*nBands] * arg->surfacecount[s];
+    }
 
+	if (++pass->nRooms == pass->maxRooms)
+		FlushSpecularPass(pass);
 }
 
 typedef void (*CVirtualRoomCallback)(const CRoomCallbackArg *);
 
-void EnumerateVirtualRooms(const CRoomSetup *pSetup, CRoomsimInternal *pSimulation,
-						   int maxx, int maxy, int maxz, CVirtualRoomCallback callback)
+/** Calls \a callback for every virtual room up to the given reflection orders, 
+ *  and returns the number of virtual rooms. */
+int EnumerateVirtualRooms(const CRoomSetup *pSetup, CRoomsimInternal *pSimulation,
+						   int maxx, int maxy, int maxz, CVirtualRoomCallback callback, CSpecularPass *pass)
 {
     int maxorder;
     int x,sx,y,sy,z,sz;
@@ -598,6 +1189,8 @@ void EnumerateVirtualRooms(const CRoomSetup *pSetup, CRoomsimInternal *pSimulati
 
 	arg.pSetup = pSetup;
 	arg.pSimulation = pSimulation;
+	arg.pass = pass;
+	arg.image = 0;
     
     maxorder = MAX(maxx,MAX(maxy,maxz));
     
@@ -639,6 +1232,7 @@ void EnumerateVirtualRooms(const CRoomSetup *pSetup, CRoomsimInternal *pSimulati
 							arg.rz = sz*z;
 
                             /* invoke callback */
+                            arg.image++;
                             callback(&arg);
                             
                         } /* for sz */
@@ -647,17 +1241,69 @@ void EnumerateVirtualRooms(const CRoomSetup *pSetup, CRoomsimInternal *pSimulati
             } /* for sx */
         } /* for x */
     } /* order */
+
+	return arg.image;
 }
 
-void InitSimulationWeights(CRoomsimInternal *pSimulation, CSensorDefinition *pSensor)
+/** Allocates the specular stage of a simulation from \a arena. Arrivals 
+ *  are collected in \a arrivals, if not NULL, instead of being rendered. */
+static CSpecularPass *AllocSpecularPass(CArena *arena, const CRoomSetup *pSetup, CRoomsimInternal *pSimulation, 
+										CImageArrivals *arrivals)
 {
-	int i, icount;
+	CSpecularPass *pass = (CSpecularPass *) ArenaCalloc(arena, 1, sizeof(CSpecularPass));
+	int           nSR = pSetup->nSources * pSetup->nReceivers, a;
+	size_t        n;
+
+	pass->pSetup      = pSetup;
+	pass->pSimulation = pSimulation;
+	pass->arrivals    = arrivals;
+	pass->maxRooms    = MAX(1, SPECULAR_CHUNK / MAX(1, nSR));
+	pass->stride      = VDOUBLE_PAD(pass->maxRooms);
+
+	n = pass->maxRooms;
+	pass->order = (int *) ArenaMalloc(arena, n * sizeof(int));
+	pass->image = (int *) ArenaMalloc(arena, n * sizeof(int));
+	pass->room  = (int *) ArenaMalloc(arena, 3 * n * sizeof(int));
+	pass->cut   = (int *) ArenaMalloc(arena, n * pSetup->nSources * sizeof(int));
+	pass->surfaceattenuation = (double *) ArenaMalloc(arena, n * pSimulation->nBands * sizeof(double));
+
+	/* padding of the vectorized arrays is computed, but never used */
+	for (a=0; a<3; a++)
+	{
+		pass->offset[a]   = (double *) ArenaCalloc(arena, pass->stride, sizeof(double));
+		pass->sign[a]     = (double *) ArenaCalloc(arena, pass->stride, sizeof(double));
+		pass->position[a] = (double *) ArenaMalloc(arena, (size_t) pSetup->nSources * pass->stride * sizeof(double));
+		pass->vector[a]   = (double *) ArenaMalloc(arena, (size_t) nSR * pass->stride * sizeof(double));
+	}
+	pass->distance = (double *) ArenaMalloc(arena, (size_t) nSR * pass->stride * sizeof(double));
+	pass->delay    = (double *) ArenaMalloc(arena, (size_t) nSR * pass->stride * sizeof(double));
+
+	n *= nSR;
+	pass->entry = (int *) ArenaMalloc(arena, n * sizeof(int));
+	pass->ofs   = (int *) ArenaMalloc(arena, n * sizeof(int));
+	pass->late  = (double *) ArenaMalloc(arena, n * sizeof(double));
+	pass->rank  = (int *) ArenaMalloc(arena, 3 * n * sizeof(int));
+	return pass;
+}
 
-	if (pSensor->type == ST_LOGGAIN)
-		return;
+/** Runs the specular stage over every virtual room up to the given reflection orders. */
+static void SpecularImages(CSpecularPass *pass, const int *maxorder)
+{
+	pass->nRooms = 0;
+	EnumerateVirtualRooms(pass->pSetup, pass->pSimulation, maxorder[0], maxorder[1], maxorder[2], 
+		GatherVirtualRoom, pass);
+	FlushSpecularPass(pass);
+}
+
+/** Returns nonzero if the simulation weights of a sensor are valid for the
+ *  frequency bands of a simulation. */
+int SimulationWeightsValid(const CRoomsimInternal *pSimulation, const CSensorDefinition *pSensor)
+{
+	int i;
+
+	if (pSensor->type == ST_LOGGAIN || pSensor->type == ST_GAINS || pSensor->type == ST_ARRAY)
+		return 1;
 
-	/* check existing simulation weights, if any */
-		
 	if ( (pSensor->nSimulationBands == pSimulation->nBands) /* number of simulation bands same as current simulation? */
          && pSensor->simulationfrequency				    /* and simulation frequency information available? */
 		 && pSensor->simulationlogweights					/* and simulation log-weights available? */
@@ -669,11 +1315,20 @@ void InitSimulationWeights(CRoomsimInternal *pSimulation, CSensorDefinition *pSe
 				break;
 
 		/* all frequencies identical? */
-		if (i == pSensor->nSimulationBands)
-		{
-			/* then simulation weights are properly initialized */
-			return;
-		}
+		return i == pSensor->nSimulationBands;
+	}
+	return 0;
+}
+
+void InitSimulationWeights(CRoomsimInternal *pSimulation, CSensorDefinition *pSensor)
+{
+	int i, icount;
+
+	/* check existing simulation weights, if any */
+	if (SimulationWeightsValid(pSimulation, pSensor))
+	{
+		/* then simulation weights are properly initialized */
+		return;
 	}
 
 	/* release existing simulation weights (if any), because they are invalid for current simulation */
@@ -734,25 +1389,206 @@ void InitSimulationWeights(CRoomsimInternal *pSimulation, CSensorDefinition *pSe
 
 }
 
-CRoomsimInternal *RoomsimInit(const CRoomSetup *pSetup, sfmt_t *sfmt)
+void InitReceiverWeights(CRoomsimInternal *pSimulation, CSensorDefinition *pSensor)
 {
-    char msg[256];
-    int  i, s, r;
-	int  nTimebin, nFreqbin, nSpacebin, nBins;
-	int  length;
-
-	/* check simulation sample frequency */
-	if (pSetup->options.fs < 44100)
+	/* workaround, not used for impulse response */
+	if (pSensor->type == ST_IMPULSERESPONSE)
 	{
-		sprintf(msg, "warning: the sample rate of the simulation is low, should be at least 44100Hz\n");
-		MsgPrintf("%s", msg);
+		/* leave prepared sensors untouched, they may be in use by concurrent simulations */
+		if (pSensor->nSimulationBands != -1)
+		{
+			pSensor->simulationfrequency = NULL;
+			pSensor->simulationlogweights = NULL;
+			pSensor->nSimulationBands = -1;
+		}
+	}
+	else
+		InitSimulationWeights(pSimulation, pSensor);
+}
+
+/** Allocates a buffer for probing a sensor, if it has an impulse response, gains, or array elements. */
+double *AllocSensorResponse(CArena *arena, const CSensorDefinition *pSensor)
+{
+	if (pSensor->type == ST_GAINS)
+		return (double *) ArenaMalloc(arena, pSensor->nChannels * sizeof(double));
+	if (pSensor->type == ST_ARRAY)
+		return (double *) ArenaMalloc(arena, 2 * pSensor->nChannels * sizeof(double));
+	if (pSensor->type != ST_IMPULSERESPONSE)
+		return NULL;
+	return (double *) ArenaMalloc(arena, pSensor->nChannels * pSensor->nSamples * sizeof(double));
+}
+
+/** Allocates the responses of all source/receiver combinations, or, for
+ *  sparse responses, their chunk tables. Returns the size of dense responses.
+ */
+size_t AllocBRIR(const CRoomSetup *pSetup, CRoomsimInternal *pSimulation)
+{
+	size_t storage = 0;
+	int    i, s, r;
+
+    /* allocate memory for BRIR matrix */
+    pSimulation->brir = (BRIR *)MemCalloc(pSimulation->nSources * pSimulation->nReceivers + 1, sizeof(BRIR));
+	if (pSimulation->nChunks > 0)
+		pSimulation->chunk = (SAMPLE ***) ArenaCalloc(&pSimulation->arena, pSimulation->nSources * pSimulation->nReceivers, sizeof(SAMPLE **));
+    
+    /* initialize structure and allocate memory for all source/receiver combinations */
+    for (s=0; s<pSimulation->nSources; s++)
+    {        
+        for (r=0; r<pSimulation->nReceivers; r++)
+        {
+            i = r * pSimulation->nSources + s; /* s*pSimulation->nReceivers + r; */
+            
+            pSimulation->brir[i].fs = pSetup->options.fs;
+                        
+            pSimulation->brir[i].nChannels = pSimulation->receiver[r].definition->nChannels; 
+            pSimulation->brir[i].nSamples  = pSimulation->length;
+            
+            /* allocate memory for impulse response and set to zero, or its chunks on demand */
+            if (pSimulation->chunk)
+                pSimulation->chunk[i] = (SAMPLE **) ArenaCalloc(&pSimulation->arena, pSimulation->brir[i].nChannels * pSimulation->nChunks, sizeof(SAMPLE *));
+            else
+            {
+                pSimulation->brir[i].sample = (SAMPLE *) MemCalloc(pSimulation->brir[i].nChannels * pSimulation->brir[i].nSamples, sizeof(SAMPLE));
+                storage += pSimulation->brir[i].nChannels * pSimulation->brir[i].nSamples * sizeof(SAMPLE);
+            }
+        }
+    }
+
+	return storage;
+}
+
+/** Prepares the spatial bins of the diffuse histograms. The default 6 bins lie
+ *  around the room axes; other numbers of bins lie around the vertices of a 
+ *  subdivided icosahedron, and rays find their bin in a cube map of the 
+ *  nearest bin per direction.
+ */
+static void InitDirectionGrid(const CRoomSetup *pSetup, CRoomsimInternal *pSimulation)
+{
+	CRayGenerator  *grid;
+	XYZ            *center;
+	unsigned short *lookup;
+	double d[3], dot, best;
+	char   msg[256];
+	int    face, a, iu, iv, i, nearest;
+
+	if (pSetup->options.diffusedirections == 6)
+	{
+		pSimulation->nDirections     = 6;
+		pSimulation->directioncenter = SpaceBinCenter;
+		pSimulation->directionlookup = NULL;
+		pSimulation->gridnoise       = NULL;
+		return;
+	}
+	if (pSetup->options.diffusedirections < 1 || pSetup->options.diffusedirections > MAXDIRECTIONS)
+	{
+		sprintf(msg, "invalid number of diffuse directions %d (expected 1 to %d)", pSetup->options.diffusedirections, MAXDIRECTIONS);
+		MsgErrorExit(msg);
+	}
+
+	grid   = AllocRayGenerator("icosahedron", pSetup->options.diffusedirections);
+	center = (XYZ *) ArenaMalloc(&pSimulation->arena, grid->nRays * sizeof(XYZ));
+	if (GetRayDirections(grid, 0, grid->nRays, center) < 0)
+		MsgErrorExit("INTERNAL ERROR: unknown ray generator type");
+	pSimulation->nDirections     = grid->nRays;
+	pSimulation->directioncenter = center;
+	FreeRayGenerator(grid);
+
+	/* find the nearest bin of each texel center of the cube faces +x,-x,+y,-y,+z,-z */
+	lookup = (unsigned short *) ArenaMalloc(&pSimulation->arena, 6 * DIRECTION_LOOKUP * DIRECTION_LOOKUP * sizeof(unsigned short));
+	for (face=0; face<6; face++)
+	{
+		a = face >> 1;
+		d[a] = (face & 1) ? -1.0 : 1.0;
+		for (iu=0; iu<DIRECTION_LOOKUP; iu++)
+		{
+			d[a==0] = (iu + 0.5) * (2.0 / DIRECTION_LOOKUP) - 1.0;
+			for (iv=0; iv<DIRECTION_LOOKUP; iv++)
+			{
+				d[a==2 ? 1 : 2] = (iv + 0.5) * (2.0 / DIRECTION_LOOKUP) - 1.0;
+				best = -HUGE_VAL;
+				nearest = 0;
+				for (i=0; i<pSimulation->nDirections; i++)
+				{
+					dot = d[0] * center[i].x + d[1] * center[i].y + d[2] * center[i].z;
+					if (dot > best)
+					{
+						best = dot;
+						nearest = i;
+					}
+				}
+				lookup[(face * DIRECTION_LOOKUP + iu) * DIRECTION_LOOKUP + iv] = (unsigned short) nearest;
+			}
+		}
+	}
+	pSimulation->directionlookup = lookup;
+	pSimulation->gridnoise       = (SAMPLE *) ArenaMalloc(&pSimulation->arena, 2 * pSimulation->length * sizeof(SAMPLE));
+}
+
+/** Quantizes a receiver-to-ray direction to a bin of the direction grid. */
+static int DirectionGridBin(const CRoomsimInternal *pSimulation, const XYZ *recvrayvector)
+{
+	double d[3], m[3];
+	int    a, iu, iv;
+
+	d[0] = recvrayvector->x; m[0] = fabs(d[0]);
+	d[1] = recvrayvector->y; m[1] = fabs(d[1]);
+	d[2] = recvrayvector->z; m[2] = fabs(d[2]);
+
+	/* project onto the cube face of the dominant axis */
+	a = m[0] >= m[1] ? (m[0] >= m[2] ? 0 : 2) : (m[1] >= m[2] ? 1 : 2);
+	if (m[a] == 0)
+		return 0;
+	iu = (int) ((d[a==0]         / m[a] + 1.0) * (0.5 * DIRECTION_LOOKUP));
+	iv = (int) ((d[a==2 ? 1 : 2] / m[a] + 1.0) * (0.5 * DIRECTION_LOOKUP));
+	iu = MIN(iu, DIRECTION_LOOKUP - 1);
+	iv = MIN(iv, DIRECTION_LOOKUP - 1);
+
+	return pSimulation->directionlookup[((2 * a + (d[a] < 0)) * DIRECTION_LOOKUP + iu) * DIRECTION_LOOKUP + iv];
+}
+
+/** Checks that a loaded sensor can be simulated as a source or receiver
+ *  at sampling frequency \a fs; sensors with signed gains per channel, 
+ *  such as ambisonics, and arrays only receive.
+ *  @return	0 if so, or -1 with the reason in \a error (at least 256 characters).
+ */
+static int CheckSensor(const CSensorDefinition *definition, const char *description, int source, double fs, char *error)
+{
+	if (!(definition->fs == ANY_FS || definition->fs == fs))
+	{
+		sprintf(error, "sampling frequency mismatch for %s '%.100s'\n(simulation Fs=%g Hz, %s Fs=%g Hz)", 
+			source ? "source" : "receiver", description, fs, source ? "source" : "receiver", definition->fs);
+		return -1;
+	}
+	if (source && (definition->type == ST_GAINS || definition->type == ST_ARRAY))
+	{
+		sprintf(error, "source '%.200s' can only be used as a receiver", description);
+		return -1;
+	}
+	return 0;
+}
+
+CRoomsimInternal *RoomsimInit(const CRoomSetup *pSetup, sfmt_t *sfmt)
+{
+    char msg[256];
+    int  i, s, r;
+	int  nTimebin, nFreqbin, nSpacebin;
+	int  length, maxfilterlength;
+	size_t cellsize;
+	double *dense;
+	size_t storage = 0;
+
+	/* check simulation sample frequency */
+	if (pSetup->options.fs < 44100)
+	{
+		sprintf(msg, "warning: the sample rate of the simulation is low, should be at least 44100Hz\n");
+		MsgPrintf("%s", msg);
 	}
 
 	/* allocate memory for internal simulation data structure */
 	CRoomsimInternal *pSimulation = (CRoomsimInternal *) MemMalloc(sizeof(CRoomsimInternal));
-
-	/* copy setup variable to global variable */
-	g_fs = pSetup->options.fs;
+	ArenaInit(&pSimulation->arena, 0);
+	pSimulation->track      = NULL;
+	pSimulation->firstorder = 0;
 
 	/* copy setup variables to simulation structure */
 	pSimulation->fs				 = pSetup->options.fs;
@@ -761,9 +1597,25 @@ CRoomsimInternal *RoomsimInit(const CRoomSetup *pSetup, sfmt_t *sfmt)
 	pSimulation->length			 = length;
 	pSimulation->diffusetimestep = pSetup->options.diffusetimestep;
 
+	/* hybrid simulation: transition from image sources to diffuse tail, given or
+	   estimated as the mixing time sqrt(V) ms of a room of volume V (Polack) */
+	pSimulation->transitiontime  = 0;
+	pSimulation->transitionwidth = pSetup->options.diffusetimestep;
+	if (pSetup->options.transitiontime != 0 && pSetup->options.simulatespecular && pSetup->options.simulatediffuse)
+	{
+		if (pSetup->options.transitiontime > 0)
+			pSimulation->transitiontime = pSetup->options.transitiontime;
+		else
+			pSimulation->transitiontime = 0.001 * sqrt(pSetup->room.dimension[0] * pSetup->room.dimension[1] * pSetup->room.dimension[2]);
+		pSimulation->transitiontime = MAX(pSimulation->transitiontime, pSimulation->transitionwidth);
+		if (pSetup->options.verbose)
+			MsgPrintf("Hybrid simulation: transition at %.1f ms\n", 1000 * pSimulation->transitiontime);
+	}
+
     /* compute speed of sound at given room temperature */
     pSimulation->c       = 331 * sqrt(1 + 0.0036 * pSetup->room.temperature);
     pSimulation->csample = pSimulation->c / pSetup->options.fs;
+	pSimulation->distanceattenuation = pSetup->options.distanceattenuation;
 
     /* prepare simulation band frequencies */
     ComputeBandFrequencies(pSetup, pSimulation);
@@ -775,32 +1627,31 @@ CRoomsimInternal *RoomsimInit(const CRoomSetup *pSetup, sfmt_t *sfmt)
     InterpolateAbsorptionAndDiffusion(pSetup, pSimulation);
     /*PrintAbsorptionAndDiffusion(pSetup, pSimulation); */
 
+	/* prepare spatial bins of diffuse histograms */
+	InitDirectionGrid(pSetup, pSimulation);
+
 	/* init local variables */
 	nTimebin  = (int) ceil( pSetup->options.responseduration / pSetup->options.diffusetimestep);
 	nFreqbin  = pSimulation->nBands;
-	nSpacebin = 6; /* front,back,left,right,up,down */
-	nBins     = nTimebin * nFreqbin * nSpacebin;
+	nSpacebin = pSimulation->nDirections;
+	cellsize  = (size_t) nTimebin * nFreqbin;
 
     /* allocate memory for internal source and receiver data */
     pSimulation->nSources   = pSetup->nSources;
-    pSimulation->source     = (CSensorInternal *) MemMalloc(pSimulation->nSources * sizeof(CSensorInternal));
+    pSimulation->source     = (CSensorInternal *) ArenaMalloc(&pSimulation->arena, pSimulation->nSources * sizeof(CSensorInternal));
     pSimulation->nReceivers = pSetup->nReceivers;
-    pSimulation->receiver   = (CSensorInternal *) MemMalloc(pSimulation->nReceivers * sizeof(CSensorInternal));
+    pSimulation->receiver   = (CSensorInternal *) ArenaMalloc(&pSimulation->arena, pSimulation->nReceivers * sizeof(CSensorInternal));
     
     /* load sources, filling probe callback functions and associated data, and  */
     /* prepare yaw-pitch-roll transformation matrices */
     for (s=0; s<pSetup->nSources; s++)
     {
-		pSimulation->source[s].definition = LoadSensor(pSetup->source[s].description);
+		pSimulation->source[s].definition = LoadSensor(pSetup->source[s].description, pSetup->options.fs);
+		pSimulation->source[s].response   = AllocSensorResponse(&pSimulation->arena, pSimulation->source[s].definition);
 
-		/* verify that source sampling frequency matches simulation sampling frequency */
-        if (!(pSimulation->source[s].definition->fs == ANY_FS 
-			|| pSimulation->source[s].definition->fs == pSimulation->fs))
-        {
-            sprintf(msg,"sampling frequency mismatch for source '%s'\n(simulation Fs=%.f Hz, source Fs=%.f Hz)", 
-                            pSetup->source[s].description, pSetup->options.fs, pSimulation->source[s].definition->fs);
-            MsgErrorExit(msg);
-        }
+		/* verify sampling frequency and role of the source */
+		if (CheckSensor(pSimulation->source[s].definition, pSetup->source[s].description, 1, pSetup->options.fs, msg) < 0)
+			MsgErrorExit(msg);
 
 		/* compute coordinate transformation matrices */
         ComputeRoom2SensorYPRT((YPR *)pSetup->source[s].orientation, (YPRT *)&pSimulation->source[s].r2s_yprt);
@@ -810,60 +1661,81 @@ CRoomsimInternal *RoomsimInit(const CRoomSetup *pSetup, sfmt_t *sfmt)
 		InitSimulationWeights(pSimulation, pSimulation->source[s].definition);
     }
 
+    /* allocate time-frequency-space histograms of all receivers; the bins of a
+       direction grid are allocated when they first receive energy, as most stay
+       empty at the usual ray counts (CheckSetup limits them to 2^32-1 bins) */
+	pSimulation->histogram.nPages   = (unsigned int) (pSetup->nReceivers * nSpacebin);
+	pSimulation->histogram.pagesize = (unsigned int) cellsize;
+	pSimulation->histogram.ondemand = pSimulation->directionlookup != NULL;
+	pSimulation->histogram.page     = (double **) ArenaCalloc(&pSimulation->arena, pSimulation->histogram.nPages, sizeof(double *));
+	if (!pSimulation->histogram.ondemand)
+	{
+		dense = (double *) ArenaCalloc(&pSimulation->arena, pSimulation->histogram.nPages, cellsize * sizeof(double));
+		for (i=0; i<(int) pSimulation->histogram.nPages; i++)
+			pSimulation->histogram.page[i] = dense + i * cellsize;
+	}
+
     /* load receivers, filling probe callback functions and associated data, and  */
     /* prepare yaw-pitch-roll transformation matrices */
     for (r=0; r<pSetup->nReceivers; r++)
     {
-        pSimulation->receiver[r].definition = LoadSensor(pSetup->receiver[r].description);
+        pSimulation->receiver[r].definition = LoadSensor(pSetup->receiver[r].description, pSetup->options.fs);
+        pSimulation->receiver[r].response   = AllocSensorResponse(&pSimulation->arena, pSimulation->receiver[r].definition);
 
 		/* verify that receiver sampling frequency matches simulation sampling frequency */
-        if (!(pSimulation->receiver[r].definition->fs == ANY_FS 
-			|| pSimulation->receiver[r].definition->fs == pSimulation->fs))
-        {
-            sprintf(msg,"sampling frequency mismatch for receiver '%s'\n(simulation Fs=%.f Hz, receiver Fs=%.f Hz)", 
-                            pSetup->receiver[r].description, pSetup->options.fs, pSimulation->receiver[r].definition->fs);
-            MsgErrorExit(msg);
-        }
+		if (CheckSensor(pSimulation->receiver[r].definition, pSetup->receiver[r].description, 0, pSetup->options.fs, msg) < 0)
+			MsgErrorExit(msg);
 
 		/* compute coordinate transformation matrices */
         ComputeRoom2SensorYPRT((YPR *)pSetup->receiver[r].orientation, (YPRT *)&pSimulation->receiver[r].r2s_yprt);
         ComputeSensor2RoomYPRT((YPR *)pSetup->receiver[r].orientation, (YPRT *)&pSimulation->receiver[r].s2r_yprt);
 
 		/* prepare receiver's simulation frequency band weights */
-		/* workaround, not used for impulse response */
-		if (pSimulation->receiver[r].definition->type == ST_IMPULSERESPONSE)
-		{
-			pSimulation->receiver[r].definition->simulationfrequency = NULL;
-			pSimulation->receiver[r].definition->simulationlogweights = NULL;
-			pSimulation->receiver[r].definition->nSimulationBands = -1;
-		}
-		else
-			InitSimulationWeights(pSimulation, pSimulation->receiver[r].definition);
+		InitReceiverWeights(pSimulation, pSimulation->receiver[r].definition);
 
 		/* allocate and initialize time-frequency-space histogram */
 		pSimulation->receiver[r].nTbin = nTimebin;
 		pSimulation->receiver[r].nFbin = nFreqbin;
 		pSimulation->receiver[r].nSbin = nSpacebin;
-		pSimulation->receiver[r].TFShist = (double *) MemCalloc(nBins, sizeof(double));
+		pSimulation->receiver[r].TFScell = pSimulation->histogram.page + r * nSpacebin;
 
 		/* allocate and initialize first time-of-arrival array */
-		pSimulation->receiver[r].FirstTOA = (double *) MemMalloc(nSpacebin * sizeof(double));
+		pSimulation->receiver[r].FirstTOA = (double *) ArenaMalloc(&pSimulation->arena, nSpacebin * sizeof(double));
 		for (i=0; i<nSpacebin; i++)
 			pSimulation->receiver[r].FirstTOA[i] = 10000.0;
     }
     
-    /* allocate plan for converting log magnitude frequency response to minimum phase filter */
-    pSimulation->minphaseplan = AllocMinPhaseFIRplan(NFFT_SIZE, pSimulation->frequency, pSimulation->nBands);
-    pSimulation->h = MemMalloc(NFFT_SIZE * sizeof(double));
+    /* configure FFTW planning, and allocate plans for converting log magnitude 
+       frequency response to minimum phase filter, one per filter stage */
+    if (!ConfigureFFTW(pSetup->options.fftwwisdom, pSetup->options.fftwplanning, ThreadCount(pSetup->options.fftwthreads)))
+    {
+        sprintf(msg, "unknown FFTW planning effort '%.100s' (use 'estimate', 'measure', or 'patient')", pSetup->options.fftwplanning);
+        MsgErrorExit(msg);
+    }
+    pSimulation->nStages      = MAX(1, pSetup->options.nFilterLengths);
+    pSimulation->filterlength = (int *) ArenaMalloc(&pSimulation->arena, pSimulation->nStages * sizeof(int));
+    pSimulation->minphaseplan = (CMinPhaseFIRplan **) ArenaMalloc(&pSimulation->arena, pSimulation->nStages * sizeof(CMinPhaseFIRplan *));
+    maxfilterlength = 0;
+    for (i=0; i<pSimulation->nStages; i++)
+    {
+        pSimulation->filterlength[i] = pSetup->options.nFilterLengths > 0 ? (int) pSetup->options.filterlength[i] : NFFT_SIZE;
+        if (pSimulation->filterlength[i] < MINFILTERLENGTH || pSimulation->filterlength[i] > MAXFILTERLENGTH)
+        {
+            sprintf(msg, "filter length %d out of range (%d to %d samples)", pSimulation->filterlength[i], MINFILTERLENGTH, MAXFILTERLENGTH);
+            MsgErrorExit(msg);
+        }
+        pSimulation->minphaseplan[i] = AllocMinPhaseFIRplan(pSimulation->filterlength[i], pSimulation->frequency, pSimulation->nBands);
+        maxfilterlength = MAX(maxfilterlength, pSimulation->filterlength[i]);
+    }
+    pSimulation->h = ArenaMalloc(&pSimulation->arena, maxfilterlength * sizeof(double));
     
     /* allocate internal attenuation vectors */
-    pSimulation->surfaceattenuation = (double *)MemMalloc(pSimulation->nBands * sizeof(double));
-    pSimulation->attenuation		= (double *)MemMalloc(pSimulation->nBands * sizeof(double));
+    pSimulation->attenuation		= (double *)ArenaMalloc(&pSimulation->arena, pSimulation->nBands * sizeof(double));
 
     /* allocate memory for convolution results */
     { 
         int maxslen = 0, maxrlen = 0;
-        int len   = NFFT_SIZE;
+        int len   = maxfilterlength;
         int total = 0;
         
         for (s=0; s<pSimulation->nSources; s++)
@@ -877,42 +1749,41 @@ CRoomsimInternal *RoomsimInit(const CRoomSetup *pSetup, sfmt_t *sfmt)
         if (maxslen > 0) { len += maxslen; total += len;   }
         if (maxrlen > 0) { len += maxrlen; total += len*2; }
         
-        pSimulation->convbuf = MemMalloc(total * sizeof(double));
+        pSimulation->convbuf = ArenaMalloc(&pSimulation->arena, total * sizeof(double));
     }
 
 	/* allocate memory for time-varying filter */
-	pSimulation->htv = (double *)MemMalloc(nTimebin * NFFT_SIZE * sizeof(double));
+	pSimulation->htv = (SAMPLE *)ArenaMalloc(&pSimulation->arena, (size_t) nTimebin * pSimulation->filterlength[pSimulation->nStages-1] * sizeof(SAMPLE));
 
 	/* setup time-varying index array */
-	pSimulation->htvidx = (int *)MemMalloc(nTimebin * sizeof(int));
+	pSimulation->htvidx = (int *)ArenaMalloc(&pSimulation->arena, nTimebin * sizeof(int));
 	for (i=0; i<nTimebin; i++)
 		pSimulation->htvidx[i] = ROUND(i * pSimulation->diffusetimestep * pSimulation->fs);
 
 	/* allocate memory for noise signal and processed versions */
 	/* uses factor of 2 to accomodate stereo signals */
-	pSimulation->noise                  = MemMalloc(((2*length+3)&-4) * sizeof(unsigned int));
-	pSimulation->shapednoise            = MemMalloc(2*length * sizeof(double));
-	pSimulation->directionalshapednoise = MemMalloc(2*length * sizeof(double));
+	pSimulation->noise                  = ArenaMalloc(&pSimulation->arena, ((2*length+3)&-4) * sizeof(unsigned int));
+	pSimulation->shapednoise            = ArenaMalloc(&pSimulation->arena, 2*length * sizeof(SAMPLE));
+	pSimulation->directionalshapednoise = ArenaMalloc(&pSimulation->arena, 2*length * sizeof(SAMPLE));
+
+	/* sparse responses are stored in chunks, allocated when first written */
+	pSimulation->verbose = pSetup->options.verbose;
+	pSimulation->chunk   = NULL;
+	if (pSetup->options.responsefloordB < 0)
+	{
+		pSimulation->responsefloor = pow(10.0, pSetup->options.responsefloordB / 10);
+		pSimulation->nChunks       = (length + BRIR_CHUNK - 1) / BRIR_CHUNK;
+	}
+	else
+		pSimulation->nChunks = 0;
+    storage = AllocBRIR(pSetup, pSimulation);
 
-    /* allocate memory for BRIR matrix */
-    pSimulation->brir = (BRIR *)MemCalloc(pSimulation->nSources * pSimulation->nReceivers + 1, sizeof(BRIR));
-    
-    /* initialize structure and allocate memory for all source/receiver combinations */
-    for (s=0; s<pSimulation->nSources; s++)
-    {        
-        for (r=0; r<pSimulation->nReceivers; r++)
-        {
-            i = r * pSimulation->nSources + s; /* s*pSimulation->nReceivers + r; */
-            
-            pSimulation->brir[i].fs = pSetup->options.fs;
-                        
-            pSimulation->brir[i].nChannels = pSimulation->receiver[r].definition->nChannels; 
-            pSimulation->brir[i].nSamples  = pSimulation->length;
-            
-            /* allocate memory for impulse response and set to zero */
-            pSimulation->brir[i].sample = (double *) MemCalloc(pSimulation->brir[i].nChannels * pSimulation->brir[i].nSamples, sizeof(double));
-        }
-    }
+	if (pSetup->options.verbose && !pSimulation->chunk)
+	{
+		storage += ((size_t) nTimebin * pSimulation->filterlength[pSimulation->nStages-1] + 4*length) * sizeof(SAMPLE);
+		MsgPrintf("Storing responses in %s precision (%.1f MB)\n",
+			sizeof(SAMPLE) == sizeof(float) ? "single" : "double", storage / 1048576.0);
+	}
 
 	/* initialize random number generator */
 	RngInit(sfmt);
@@ -920,39 +1791,106 @@ CRoomsimInternal *RoomsimInit(const CRoomSetup *pSetup, sfmt_t *sfmt)
 	return pSimulation;
 }
 
+/** Turns the chunks of a sparse response into its active span: from its
+ *  first nonzero sample up to where its remaining energy falls below the
+ *  response floor. Returns the size of the stored samples.
+ */
+size_t FinalizeSparseBRIR(CRoomsimInternal *pSimulation, int sr)
+{
+	BRIR   *brir  = &pSimulation->brir[sr];
+	SAMPLE **chunk = pSimulation->chunk[sr];
+	int    nChunks = pSimulation->nChunks;
+	double energy, total = 0, floor;
+	int    c, i, k, first = brir->nSamples, end = 0, length;
+	size_t size;
+
+	/* find first nonzero sample and total energy */
+	for (c=0; c<brir->nChannels; c++)
+		for (k=0; k<nChunks; k++)
+			if (chunk[c*nChunks + k])
+				for (i=0; i<BRIR_CHUNK && k*BRIR_CHUNK+i < brir->nSamples; i++)
+				{
+					energy = chunk[c*nChunks + k][i] * chunk[c*nChunks + k][i];
+					if (energy > 0 && k*BRIR_CHUNK+i < first)
+						first = k*BRIR_CHUNK+i;
+					total += energy;
+				}
+
+	/* find end of span, beyond which the energy is below the floor */
+	if (total > 0)
+	{
+		floor  = total * pSimulation->responsefloor;
+		energy = 0;
+		for (end=brir->nSamples; end>first; end--)
+		{
+			k = (end - 1) / BRIR_CHUNK;
+			for (c=0; c<brir->nChannels; c++)
+				if (chunk[c*nChunks + k])
+					energy += chunk[c*nChunks + k][(end - 1) % BRIR_CHUNK] * chunk[c*nChunks + k][(end - 1) % BRIR_CHUNK];
+			if (energy > floor)
+				break;
+		}
+	}
+	else
+		first = 0;
+
+	/* copy span to contiguous storage, and release chunks */
+	/* one extra sample keeps empty responses allocated, for ReleaseBRIR */
+	length       = end - first;
+	size         = brir->nChannels * length + 1;
+	brir->offset = first;
+	brir->sample = (SAMPLE *) MemCalloc(size, sizeof(SAMPLE));
+	for (c=0; c<brir->nChannels; c++)
+		for (i=first; i<end; i++)
+			if (chunk[c*nChunks + i/BRIR_CHUNK])
+				brir->sample[c*length + i-first] = chunk[c*nChunks + i/BRIR_CHUNK][i % BRIR_CHUNK];
+	for (k=0; k<brir->nChannels*nChunks; k++)
+		if (chunk[k])
+			MemFree(chunk[k]);
+	brir->nSamples = length;
+
+	return size * sizeof(SAMPLE);
+}
+
+/** Stores sparse responses as their active spans. */
+void FinalizeBRIR(CRoomsimInternal *pSimulation)
+{
+	size_t stored = 0, dense = 0;
+	int    i;
+
+	if (!pSimulation->chunk)
+		return;
+
+	for (i=0; i<pSimulation->nSources*pSimulation->nReceivers; i++)
+	{
+		dense  += pSimulation->brir[i].nChannels * pSimulation->brir[i].nSamples * sizeof(SAMPLE);
+		stored += FinalizeSparseBRIR(pSimulation, i);
+	}
+	pSimulation->chunk = NULL;
+
+	if (pSimulation->verbose)
+		MsgPrintf("Storing sparse responses in %s precision (%.1f MB, %.1f MB when dense)\n",
+			sizeof(SAMPLE) == sizeof(float) ? "single" : "double", stored / 1048576.0, dense / 1048576.0);
+}
+
 BRIR *RoomsimRelease(CRoomsimInternal *pSimulation)
 {
 	int i;
 	BRIR *retval = pSimulation->brir;	/* save brir pointer  */
 
-    /* free minimum phase plan and all allocated memory */
-    FreeMinPhaseFIRplan(pSimulation->minphaseplan);
-
-	/* free simulation memory  */
-    MemFree(pSimulation->h);
-    MemFree(pSimulation->convbuf);
-    MemFree(pSimulation->frequency);
-    MemFree(pSimulation->logreflection);
-    MemFree(pSimulation->logabsorption);
-    MemFree(pSimulation->logdiffusion);
-    MemFree(pSimulation->logdiffusereflection);
-    MemFree(pSimulation->logspecularreflection);
-    MemFree(pSimulation->diffusioncoefficient);
-    MemFree(pSimulation->logairattenuation);
-	MemFree(pSimulation->surfaceattenuation);
-    MemFree(pSimulation->attenuation);
-	MemFree(pSimulation->htv);
-	MemFree(pSimulation->htvidx);
-	MemFree(pSimulation->noise);
-	MemFree(pSimulation->shapednoise);
-	MemFree(pSimulation->directionalshapednoise);
-
-	/* free receiver histogram memory */
-	for (i=0; i<pSimulation->nReceivers; i++)
-	{
-		MemFree(pSimulation->receiver[i].TFShist);
-		MemFree(pSimulation->receiver[i].FirstTOA);
-	}
+	/* store sparse responses as their active spans */
+	FinalizeBRIR(pSimulation);
+
+	/* free minimum phase plan and all allocated memory */
+	for (i=0; i<pSimulation->nStages; i++)
+		FreeMinPhaseFIRplan(pSimulation->minphaseplan[i]);
+	FreePagedHistogram(&pSimulation->histogram);
+
+	/* free simulation memory */
+	if (pSimulation->verbose)
+		MsgPrintf("Simulation memory: %.1f MB peak, %.1f MB in %d blocks\n",
+			pSimulation->arena.peak / 1048576.0, pSimulation->arena.reserved / 1048576.0, pSimulation->arena.nBlocks);
+	ArenaRelease(&pSimulation->arena);
 
 	/* free simulation structure */
 	MemFree(pSimulation);
@@ -970,228 +1908,217 @@ void ReleaseBRIR(BRIR *brir)
 	MemFree(brir);
 }
 
-/** Generates unit vectors equally distributed around a sphere. 
- *
- *	@param[in]  nDesiredRays	Number of desired rays.
- *	@param[out] pnActualRays	Number of rays actually generated.
- *	@return						XYZ array of unit vectors.
- *
- *  @note
- *     The number of rays N that is actually generated satisfies N = 20*k*k, where
- *     k is the smallest integer such that N >= nDesiredRays.
- *  @note
- *     The generating algorithm subdivides each face of a regular icosahedron into 
- *     a triangular grid, whose granularity is determined by the number of desired 
- *     rays. The algorithm then enumerates the triangular cells of the grid and 
- *     takes the center of the grid cell as a ray direction.
- * 
- *                C             Triangle ABC is one face of the icosahedron, which 
- *              ./_\.           is subdivided into a triangular grid. The grid is 
- *            ./_\./_\          enumerated from left-to-right, bottom-to-top, 
- *          ./_\./_\./_\.       starting at A.
- *         A             B
- */
-XYZ *GenerateRays(int nDesiredRays, int *pnActualRays)
-{
-	/** @todo Rotate vertices over small yaw,pitch,roll to avoid alignment with room axes. */
-
-	/* xyz-coordinates of vertices of regular icosahedron */
-	static const XYZ ico_vert[12] = 
-	{
-		{ 0.0000000000,  0.0000000000,  1.0000000000},
-		{ 0.8944271910,  0.0000000000,  0.4472135955},
-		{ 0.2763932023,  0.8506508084,  0.4472135955},
-		{-0.7236067977,  0.5257311121,  0.4472135955},
-		{-0.7236067977, -0.5257311121,  0.4472135955},
-		{ 0.2763932023, -0.8506508084,  0.4472135955},
-		{ 0.7236067977,  0.5257311121, -0.4472135955},
-		{-0.2763932023,  0.8506508084, -0.4472135955},
-		{-0.8944271910,  0.0000000000, -0.4472135955},
-		{-0.2763932023, -0.8506508084, -0.4472135955},
-		{ 0.7236067977, -0.5257311121, -0.4472135955},
-		{ 0.0000000000,  0.0000000000, -1.0000000000}
-	};
-	/* vertex indices of faces of regular icosahedron */
-	static const int ico_face[20][3] = 
-	{
-		{ 0,  1,  2}, { 0,  2,  3}, { 0,  3,  4}, { 0,  4,  5},
-		{ 0,  5,  1}, { 1,  2,  6}, { 2,  6,  7}, { 2,  3,  7},
-		{ 3,  7,  8}, { 3,  4,  8}, { 4,  8,  9}, { 4,  5,  9},
-		{ 5,  9, 10}, { 5,  1, 10}, { 1, 10,  6}, { 6,  7, 11},
-		{ 7,  8, 11}, { 8,  9, 11}, { 9, 10, 11}, {10,  6, 11}
-	};
-
-	int    rayorder = (int) ceil(sqrt(nDesiredRays / 20.0));
-	int    nRays = rayorder * rayorder * 20;
-	XYZ    *rayxyz;
-	XYZ    A, B, C, dAB, dAC;
-	XYZ    p1, p2, p3;
-	int	   f, nSteps, i1, i2, idx=0;
-	double norm;
-
-	/* allocate memory for ray vectors */
-	rayxyz = MemMalloc(nRays * sizeof(XYZ));
-	*pnActualRays = nRays;
-
-	/* loop over all faces of the icosahedron */
-	for (f=0; f<20; f++)
-	{
-		/* get xyz-coords of vertices of current face */
-		A = ico_vert[ico_face[f][0]];
-		B = ico_vert[ico_face[f][1]];
-		C = ico_vert[ico_face[f][2]];
-
-		/* A, B, and C are the coordinates of a triangle in 3D space */
-
-		/* determine grid spacing in A-B direction */
-		dAB.x = (B.x - A.x) / rayorder;
-		dAB.y = (B.y - A.y) / rayorder;
-		dAB.z = (B.z - A.z) / rayorder;
-
-		/* determine grid spacing in A-C direction */
-		dAC.x = (C.x - A.x) / rayorder;
-		dAC.y = (C.y - A.y) / rayorder;
-		dAC.z = (C.z - A.z) / rayorder;
-
-		/* initialize number of grid cells for enumeration */
-		nSteps = 2*rayorder - 1;
-
-		/** @todo Speed up algorithm by updating p = (p1+p2+p3)/3 
-		rather than updating p1, p2, and p3 individually */
-
-		for (i1=0; i1<rayorder; i1++)
-		{
-			/* initialize points p1, p2, and p3 */
-			p1.x = A.x + i1 * dAC.x;
-			p1.y = A.y + i1 * dAC.y;
-			p1.z = A.z + i1 * dAC.z;
-
-			p2.x = p1.x + dAB.x;
-			p2.y = p1.y + dAB.y;
-			p2.z = p1.z + dAB.z;
-
-			p3.x = p1.x + dAC.x;
-			p3.y = p1.y + dAC.y;
-			p3.z = p1.z + dAC.z;
-
-			/* p1, p2, and p3 are coordinates of grid cell in 3D space */
-
-			for (i2=0; i2<nSteps; i2++)
-			{
-				/* use center of triangular grid cell as ray's direction  */
-				rayxyz[idx].x = (p1.x + p2.x + p3.x) / 3;
-				rayxyz[idx].y = (p1.y + p2.y + p3.y) / 3;
-				rayxyz[idx].z = (p1.z + p2.z + p3.z) / 3;
-            
-				/* normalize length to unity */
-				norm = sqrt(rayxyz[idx].x * rayxyz[idx].x + 
-							rayxyz[idx].y * rayxyz[idx].y + 
-							rayxyz[idx].z * rayxyz[idx].z);
-
-				rayxyz[idx].x /= norm;
-				rayxyz[idx].y /= norm;
-				rayxyz[idx].z /= norm;
-
-				idx = idx + 1;
-            
-				/* update p1, p2, and p3 to move to next grid cell */
-				if ((i2 % 2) == 0)
-				{
-					p1 = p2;
-					p2.x = p3.x + dAB.x;
-					p2.y = p3.y + dAB.y;
-					p2.z = p3.z + dAB.z;
-				}
-				else
-				{
-					p3 = p2;
-					p2.x = p1.x + dAB.x;
-					p2.y = p1.y + dAB.y;
-					p2.z = p1.z + dAB.z;
-				}
-			}
-
-			/* for face's next level, reduce number of grid cells by 2 */
-			nSteps = nSteps - 2;
-		}
+/** Quantizes a receiver-to-ray direction to a spatial histogram bin. */
+int DiffuseSpaceBin(const XYZ *recvrayvector)
+{
+	double x2y2, z2;
 
-	} /* next face */
+	z2   = recvrayvector->z * recvrayvector->z;
+	x2y2 = recvrayvector->x * recvrayvector->x + recvrayvector->y * recvrayvector->y;
+	if (z2 > (4.0/9.0) * (x2y2 + z2))
+	{
+		/* pick vertical bin */
+		/* 4=lower, 5=upper */
+		return 4 + (recvrayvector->z > 0);
+	}
+	else
+	{
+		/* pick horizontal bin */
+		/* 0=back, 1=left, 2=right, 3=front; */
+		return 2*(recvrayvector->x > recvrayvector->y) + (recvrayvector->x > -recvrayvector->y);
+	}
+}
 
-#if 0
-/* DEBUG OUTPUT  */
-	{ 
-		int i;
-		char filename[256];
-		FILE *fid;
+/* Minimum number of receivers for which the diffuse rain uses the vectorized receiver path */
+#define DIFFUSE_FASTPATH_MINRECEIVERS 4
 
-		sprintf(filename,"rays%04d.txt", nRays);
-		fid = fopen(filename,"w");
+/** Receiver data for the vectorized diffuse rain, in structure-of-arrays layout.
+ *
+ *  For every surface, the receivers' distance to the surface plane and their
+ *  coordinates within the plane are stored, so that the geometry term of a 
+ *  diffuse reflection only depends on the in-plane location of the impact.
+ *  All arrays hold nPadded elements; padding elements are harmless dummies.
+ */
+typedef struct {
+	int    nReceivers;		/**< Number of receivers. */
+	int    nPadded;			/**< Number of receivers, rounded up to a multiple of the vector width. */
+	double *normal[6];		/**< Receiver distance to surface plane. */
+	double *normal3[6];		/**< Cube of receiver distance to surface plane. */
+	double *u[6];			/**< First in-plane receiver coordinate. */
+	double *v[6];			/**< Second in-plane receiver coordinate. */
+	double *r2s[9];			/**< Room-to-receiver transformation matrices, stored element-wise. */
+} CDiffuseReceivers;
+
+/** Per-receiver results of the vectorized diffuse rain, for one surface impact. */
+typedef struct {
+	double *toa;			/**< Time of arrival at receiver. */
+	double *energy;			/**< Energy at receiver (linear domain). */
+	double *x, *y, *z;		/**< Receiver-to-impact vector in receiver coordinates. */
+	int    *tbin;			/**< Temporal histogram bin of the arrival, or -1 outside the response. */
+} CDiffuseRainOutput;
+
+/* Room axis normal to surface s, and the two room axes that span it */
+#define SURFACEAXIS(s)   ((s)>>1)
+#define SURFACEAXISU(s)  (SURFACEAXIS(s)==0 ? 1 : 0)
+#define SURFACEAXISV(s)  (SURFACEAXIS(s)==2 ? 1 : 2)
+
+CDiffuseReceivers *AllocDiffuseReceivers(CArena *arena, const CRoomSetup *pSetup, const CRoomsimInternal *pSimulation)
+{
+	CDiffuseReceivers *dr;
+	double *block;
+	int    nReceivers = pSetup->nReceivers, nPadded = VDOUBLE_PAD(pSetup->nReceivers);
+	int    i, r, s, a;
+
+	dr = (CDiffuseReceivers *) ArenaMalloc(arena, sizeof(CDiffuseReceivers));
+	dr->nReceivers = nReceivers;
+	dr->nPadded    = nPadded;
+
+	/* carve all arrays from a single block */
+	block = (double *) ArenaMalloc(arena, (6*4 + 9) * nPadded * sizeof(double));
+	for (s=0; s<6; s++)
+	{
+		dr->normal[s]  = block; block += nPadded;
+		dr->normal3[s] = block; block += nPadded;
+		dr->u[s]       = block; block += nPadded;
+		dr->v[s]       = block; block += nPadded;
+	}
+	for (i=0; i<9; i++)
+	{
+		dr->r2s[i] = block; block += nPadded;
+	}
 
-		/* print vertices */
-		fprintf(fid,"12 12 12\n");
-		for (i=0; i<12; i++)
-		{
-			fprintf(fid,"%13.10f %13.10f %13.10f\n", ico_vert[i].x, ico_vert[i].y, ico_vert[i].z);
-		}
+	for (r=0; r<nPadded; r++)
+	{
+		const double *loc = r < nReceivers ? pSetup->receiver[r].location : NULL;
 
-		/* print faces */
-		fprintf(fid,"20 20 20\n");
-		for (i=0; i<20; i++)
+		for (s=0; s<6; s++)
 		{
-			fprintf(fid,"%2d %2d %2d\n", ico_face[i][0]+1, ico_face[i][1]+1, ico_face[i][2]+1);
+			a = SURFACEAXIS(s);
+			if (loc)
+			{
+				/* even surfaces are at coordinate 0, odd ones at the room dimension */
+				dr->normal[s][r] = (s & 1) ? pSetup->room.dimension[a] - loc[a] : loc[a];
+				dr->u[s][r]      = loc[SURFACEAXISU(s)];
+				dr->v[s][r]      = loc[SURFACEAXISV(s)];
+			}
+			else
+			{
+				/* padding receiver at unit distance from every surface */
+				dr->normal[s][r] = 1.0;
+				dr->u[s][r]      = 0.0;
+				dr->v[s][r]      = 0.0;
+			}
+			dr->normal3[s][r] = dr->normal[s][r] * dr->normal[s][r] * dr->normal[s][r];
 		}
 
-		/* print rays */
-		fprintf(fid,"%d %d 0\n", idx, nRays);
-		for (i=0; i<nRays; i++)
-		{
-			fprintf(fid,"%13.10f %13.10f %13.10f\n", rayxyz[i].x, rayxyz[i].y, rayxyz[i].z);
-		}
-		fclose(fid);
+		for (i=0; i<9; i++)
+			dr->r2s[i][r] = loc ? pSimulation->receiver[r].r2s_yprt[i/3][i%3] : 0.0;
 	}
-/* END DEBUG OUTPUT */
-#endif
 
-	return rayxyz;
+	return dr;
 }
 
-void AddDiffuseEnergy(CRoomsimInternal *pSimulation, int iReceiver, 
-					  double recv_timeofarrival, 
-					  XYZ    *recvrayvector, 
-					  int    iBand, 
-					  double recv_logenergy)
+void AllocDiffuseRainOutput(CArena *arena, CDiffuseRainOutput *out, const CDiffuseReceivers *dr)
 {
-	int    sbin, tbin;
-	double x2y2, z2;
-
-	/* quantize time of arrival to temporal receiver histogram bin */
-	tbin = (int) floor(recv_timeofarrival / pSimulation->diffusetimestep + 0.5);
-	/* ignore energy contributions that fall outside the histogram */
-	if (tbin >= pSimulation->receiver[iReceiver].nTbin)
-		return;
+	out->toa    = (double *) ArenaMalloc(arena, 5 * dr->nPadded * sizeof(double));
+	out->energy = out->toa    + dr->nPadded;
+	out->x      = out->energy + dr->nPadded;
+	out->y      = out->x      + dr->nPadded;
+	out->z      = out->y      + dr->nPadded;
+	out->tbin   = (int *) ArenaMalloc(arena, dr->nPadded * sizeof(int));
+}
 
-	/* quantize ray direction to spatial receiver histogram bin */
-	z2   = recvrayvector->z * recvrayvector->z;
-	x2y2 = recvrayvector->x * recvrayvector->x + recvrayvector->y * recvrayvector->y;
-	if (z2 > (4.0/9.0) * (x2y2 + z2))
-	{
-		/* pick vertical bin */
-		/* 4=lower, 5=upper */
-		sbin = 4 + (recvrayvector->z > 0);
-	}
-	else
+/** Evaluates the diffuse rain contribution of one surface impact at all receivers.
+ *
+ *	@param[in]  dr				Receiver data.
+ *	@param[out] out				Time of arrival, energy and direction per receiver.
+ *	@param[in]  s				Surface of impact.
+ *	@param[in]  impact			Location of impact.
+ *	@param[in]  ray_time		Time of impact.
+ *	@param[in]  energy			Diffusely reflected ray energy at impact, including air absorption up to the impact.
+ *	@param[in]  logairperm		Air attenuation per meter (log domain), or 0 for no air absorption.
+ *	@param[in]  c				Speed of sound.
+ *
+ *  @note
+ *     The geometry term (cos(theta)/d^2, with d clamped to at least 1 m) is 
+ *     computed in the linear domain; air absorption over the impact-to-receiver
+ *     path takes one vectorized exponentiation per receiver.
+ */
+void DiffuseRainReceivers(const CDiffuseReceivers *dr, CDiffuseRainOutput *out, int s, const XYZ *impact, 
+						  double ray_time, double energy, double logairperm, double c)
+{
+	const double *imp = &impact->x;
+	const vdouble u0 = VSET1(imp[SURFACEAXISU(s)]);
+	const vdouble v0 = VSET1(imp[SURFACEAXISV(s)]);
+	const vdouble t0 = VSET1(ray_time);
+	const vdouble vc = VSET1(c);
+	const vdouble e0 = VSET1(energy);
+	const vdouble ea = VSET1(logairperm);
+	const vdouble one = VSET1(1.0);
+	const int     a = SURFACEAXIS(s), au = SURFACEAXISU(s), av = SURFACEAXISV(s);
+	const double  *pn = dr->normal[s], *pn3 = dr->normal3[s], *pu = dr->u[s], *pv = dr->v[s];
+	vdouble vn, du, dv, d2, d, g, w[3];
+	int     r;
+
+	for (r=0; r<dr->nPadded; r+=VDOUBLE_WIDTH)
 	{
-		/* pick horizontal bin */
-		/* 0=back, 1=left, 2=right, 3=front; */
-		sbin = 2*(recvrayvector->x > recvrayvector->y) + (recvrayvector->x > -recvrayvector->y);
+		/* receiver-to-impact distance and time of arrival */
+		vn = VLOAD(pn + r);
+		du = VSUB(u0, VLOAD(pu + r));
+		dv = VSUB(v0, VLOAD(pv + r));
+		d2 = VADD(VMUL(vn, vn), VADD(VMUL(du, du), VMUL(dv, dv)));
+		d  = VSQRT(d2);
+		VSTORE(out->toa + r, VADD(t0, VDIV(d, vc)));
+
+		/* geometry term vn^3 / d^3 / max(d,1)^2 */
+		g = VDIV(VLOAD(pn3 + r), VMUL(VMUL(d2, d), VMAX(d2, one)));
+
+		/* ray energy, with air absorption over the impact-to-receiver path */
+		VSTORE(out->energy + r, VMUL(VMUL(e0, g), VEXP(VMUL(ea, d))));
+
+		/* receiver-to-impact vector in room coordinates */
+		w[a]  = (s & 1) ? vn : VNEG(vn);
+		w[au] = du;
+		w[av] = dv;
+
+		/* convert to receiver coordinates */
+		VSTORE(out->x + r, VADD(VADD(VMUL(VLOAD(dr->r2s[0] + r), w[0]), VMUL(VLOAD(dr->r2s[1] + r), w[1])), VMUL(VLOAD(dr->r2s[2] + r), w[2])));
+		VSTORE(out->y + r, VADD(VADD(VMUL(VLOAD(dr->r2s[3] + r), w[0]), VMUL(VLOAD(dr->r2s[4] + r), w[1])), VMUL(VLOAD(dr->r2s[5] + r), w[2])));
+		VSTORE(out->z + r, VADD(VADD(VMUL(VLOAD(dr->r2s[6] + r), w[0]), VMUL(VLOAD(dr->r2s[7] + r), w[1])), VMUL(VLOAD(dr->r2s[8] + r), w[2])));
 	}
+}
 
-	/* keep track of first arrival in each spatial bin */
-	if (recv_timeofarrival < pSimulation->receiver[iReceiver].FirstTOA[sbin])
-		pSimulation->receiver[iReceiver].FirstTOA[sbin] = recv_timeofarrival;
+/** Tabulated air attenuation (linear domain) as a function of distance, for one frequency band. */
+typedef struct {
+	int    n;				/**< Number of table entries. */
+	double invstep;			/**< Inverse of distance step between entries. */
+	double logairperm;		/**< Air attenuation per meter (log domain). */
+	double *factor;			/**< Attenuation factor at multiples of the distance step. */
+} CAirAttenuationTable;
 
-	/* add energy to receiver histogram bin */
-	RECV_TFS_BIN(pSimulation->receiver[iReceiver],tbin,iBand,sbin) += LINDOMAIN(recv_logenergy);
+/* Distance step of the air attenuation table (m) */
+#define AIRTABLE_STEP 0.01
+
+void FillAirAttenuationTable(CAirAttenuationTable *table, double logairperm)
+{
+	int i;
+
+	table->logairperm = logairperm;
+	for (i=0; i<table->n; i++)
+		table->factor[i] = LINDOMAIN(logairperm * i * AIRTABLE_STEP);
+}
+
+/** Returns the linear air attenuation over \a distance, interpolated from the table. */
+double AirAttenuation(const CAirAttenuationTable *table, double distance)
+{
+	double x = distance * table->invstep;
+	int    i = (int) x;
+
+	/* beyond the table, e.g. for receivers outside the room */
+	if (i >= table->n - 1)
+		return LINDOMAIN(table->logairperm * distance);
+
+	return table->factor[i] + (x - i) * (table->factor[i+1] - table->factor[i]);
 }
 
 void MakeUnitVector(XYZ *xyz)
@@ -1206,635 +2133,2575 @@ void MakeUnitVector(XYZ *xyz)
 	xyz->z /= norm;
 }
 
-void RoomsimDiffuse(const CRoomSetup *pSetup, CRoomsimInternal *pSimulation, sfmt_t *sfmt)
-{
-	XYZ     *ray;
-
-	/* loop counters */
-	int	iSource, iBand, iRay, iReceiver;
-	int iTimebin, iDirection;
-	int	nRays;
+/* Number of rays per work item in multithreaded ray tracing */
+#define DIFFUSE_RAYBATCH 32
 
-	/* ray-tracing variables */
-	XYZ		ray_xyz, ray_dxyz, impact_xyz;
-	XYZ		rayrecvvector, recvrayvector, rs, rd;
-	double	ray_time, timetoimpact, t, recv_timeofarrival, endtime;
-	double	ray_logenergy, ray_logenergymin, rayrecv_logenergy, recv_logenergy;
-	double  distance, d, vn=0.0, vf=0.0, v1, v2, v3, wd, ws, temp;
-	int		surfaceofimpact;
+/* Number of deposits buffered per thread in multithreaded ray tracing */
+#define DIFFUSE_DEPOSITLOG 32768
 
-	/* diffuse generation variables */
-	unsigned int noisethreshold;
-	double	*TFSbase;
-	int		nTimebin, nFreqbin, nBins, nRecvCh;
-	int		i, SRidx, length=0, receiverimpulselength;
-	const double *receiverimpulse;
-	double	gain;
-	CSensorResponse receiverresponse;
+struct CDiffuseWorker;
 
+/** State shared by all ray tracing threads, for tracing the rays of one source. */
+typedef struct {
+	const CRoomSetup		*pSetup;
+	CRoomsimInternal		*pSimulation;
+	const CDiffuseReceivers	*diffusereceivers;	/**< Receiver data for the vectorized path, or NULL. */
+	const CRayGenerator		*raygenerator;		/**< Initial ray directions, in source coordinates. */
+	int						nRays;
+	int						iSource;
+	double					endtime;
+	double					ray_logenergymin;
+	double					ray_energymin;
+	bool					lineardomain;
+	const double			*linreflection;		/**< Linear surface reflection, 6 per band. */
+	const double			*lindiffusion;		/**< Linear surface diffusion, 6 per band. */
+	const CAirAttenuationTable *airtable;		/**< Air attenuation table per band, or NULL. */
+	struct CDiffuseWorker	*worker;			/**< Per-thread state. */
+	int						nBatches;			/**< Number of ray batches per band. */
+	const int				*band;				/**< Frequency bands to trace in the current round. */
+	int						nRoundBands;		/**< Number of frequency bands in the current round. */
+	int						firstbatch;			/**< First ray batch of the current round. */
+	int						nRoundBatches;		/**< Number of ray batches per band in the current round. */
+	volatile long			nextitem;			/**< Counter distributing band/batch work items over threads. */
 #ifdef LOGRAYS
-	FILE *fid, *fidrecv;
+	FILE					*fid, *fidrecv;
 #endif
-
-#if 0
-	/* prepare internal room simulation data structure */
-	CRoomsimInternal *pSimulation = RoomsimInit(pSetup);
+} CDiffuseTrace;
+
+/** Per-thread ray tracing state. */
+typedef struct CDiffuseWorker {
+	sfmt_t				*sfmt;		/**< Random number generator. */
+	CDepositLog			*log;		/**< Deposit log, or NULL to write directly to the histograms. */
+	double				*FirstTOA;	/**< First arrival per receiver and space bin, used with deposit log. */
+	CDiffuseRainOutput	out;		/**< Output of vectorized receiver path. */
+	XYZ					ray[DIFFUSE_RAYBATCH];	/**< Initial ray directions of current batch. */
+	const char			*failure;	/**< Reason this worker stopped tracing rays, or NULL. */
+#ifdef LOGRAYS
+	int					iRay;		/**< Index of the ray being traced, for the ray log. */
 #endif
+} CDiffuseWorker;
+
+/** Adds diffuse energy arriving at a receiver to its histogram. */
+void DepositDiffuseEnergy(CRoomsimInternal *pSimulation, CDiffuseWorker *worker, int iReceiver, 
+						  double recv_timeofarrival, 
+						  const XYZ *recvrayvector, 
+						  int    iBand, 
+						  double recv_energy)
+{
+	CSensorInternal *receiver = &pSimulation->receiver[iReceiver];
+	double *firsttoa, *cell;
+	int    sbin, tbin;
 
-	/* generate rays */
-	ray = GenerateRays(pSetup->options.numberofrays,&nRays);
-	if (nRays != pSetup->options.numberofrays && pSetup->options.verbose)
-    {
-		MsgPrintf("ray tracing: number of rays changed to %d\n", nRays);
-        MsgRelax;
-    }
-
-/* TEMP 
-	{
-		CMinPhaseFIRplan *plan;
-		double F[] = {0,125,250,500,1000,2000,4000,8000,16000,22050};
-		double A[] = {0,  0,  0,  0,   0,   0,   0,   0,    0,    0};
-		unsigned int nF = sizeof(F)/sizeof(F[0]);
-		double h[512];
-		int i;
-		FILE *fid;
-
-		plan = AllocMinPhaseFIRplan(512, F, nF);
-		LogMagFreqResp2MinPhaseFIR(A, h, plan);
-		fid = fopen("hflat.txt","w");
-		for (i=0; i<512; i++)
-			fprintf(fid,"%13.10f\n", h[i]);
-		fclose(fid);
-		FreeMinPhaseFIRplan(plan);
-	}
-TEMP */
+	/* quantize time of arrival to temporal receiver histogram bin */
+	tbin = (int) floor(recv_timeofarrival / pSimulation->diffusetimestep + 0.5);
+	/* ignore energy contributions that fall outside the histogram */
+	if (tbin >= receiver->nTbin)
+		return;
 
-	ray_logenergymin = -LOGDOMAIN(nRays) + LOGDOMAIN(pow(10,pSetup->options.rayenergyfloordB/20));
-	endtime = pSetup->options.responseduration;
-	noisethreshold = (unsigned int) ((10000.0 / pSimulation->fs) * 4294967295.0);
+	/* quantize ray direction to spatial receiver histogram bin */
+	sbin = pSimulation->directionlookup ? DirectionGridBin(pSimulation, recvrayvector) : DiffuseSpaceBin(recvrayvector);
 
+	/* keep track of first arrival in each spatial bin */
+	firsttoa = worker->log ? &worker->FirstTOA[iReceiver * receiver->nSbin + sbin] : &receiver->FirstTOA[sbin];
+	if (recv_timeofarrival < *firsttoa)
+		*firsttoa = recv_timeofarrival;
 
-#ifdef LOGRAYS
-	fid = fopen("raylog.txt","w");
-	fidrecv = fopen("recvlog.txt","w");
-	fprintf(fidrecv,"%%ray   recv   ray->recv vector                factor      time        recv->ray vector                logenergy \n"
-		            "%%---   ----   -----------------------------   ---------   ---------   -----------------------------   ----------\n");
-#endif
+	/* add energy to receiver histogram bin */
+	if (worker->log)
+		DEPOSIT(worker->log, TFS_KEY(pSimulation,iReceiver,tbin,iBand,sbin), recv_energy);
+	else if ((cell = PagedHistogramPage(&pSimulation->histogram, iReceiver * receiver->nSbin + sbin)))
+		cell[iBand + (size_t) receiver->nFbin * tbin] += recv_energy;
+	else
+		worker->failure = "out of memory for diffuse histograms";
+}
 
-	/* loop over all sound sources */
-    for (iSource=0; iSource<pSimulation->nSources; iSource++)
+/** Adds the diffuse energy of one surface impact, evaluated at all receivers
+ *  by DiffuseRainReceivers, to the receiver histograms in one batch: the 
+ *  arrivals are first quantized to temporal bins, then those within the
+ *  response are binned by direction and deposited. */
+void DepositDiffuseReceivers(CRoomsimInternal *pSimulation, CDiffuseWorker *worker, int iBand, double endtime)
+{
+	CDiffuseRainOutput *out = &worker->out;
+	CSensorInternal    *receiver;
+	XYZ                recvrayvector;
+	double             *firsttoa, *cell;
+	int                nReceivers = pSimulation->nReceivers, nTbin = pSimulation->receiver[0].nTbin;
+	int                iReceiver, sbin, tbin;
+
+	/* quantize times of arrival to temporal histogram bins */
+	for (iReceiver=0; iReceiver<nReceivers; iReceiver++)
 	{
-		/* clear receivers' TFS histogram */
-		for (iReceiver=0; iReceiver<pSetup->nReceivers; iReceiver++)
+		tbin = -1;
+		if (out->toa[iReceiver] <= endtime)
 		{
-			nBins = pSimulation->receiver[iReceiver].nTbin * 
-					pSimulation->receiver[iReceiver].nFbin * 
-					pSimulation->receiver[iReceiver].nSbin;
-			memset(pSimulation->receiver[iReceiver].TFShist,0,nBins * sizeof(double));
+			tbin = (int) floor(out->toa[iReceiver] / pSimulation->diffusetimestep + 0.5);
+			if (tbin >= nTbin)
+				tbin = -1;
 		}
+		out->tbin[iReceiver] = tbin;
+	}
 
-		/************************
-		 * STAGE 1: RAY TRACING *
-		 ************************/
+	/* quantize directions to spatial bins, and deposit */
+	for (iReceiver=0; iReceiver<nReceivers; iReceiver++)
+	{
+		tbin = out->tbin[iReceiver];
+		if (tbin < 0)
+			continue;
+
+		receiver = &pSimulation->receiver[iReceiver];
+		recvrayvector.x = out->x[iReceiver];
+		recvrayvector.y = out->y[iReceiver];
+		recvrayvector.z = out->z[iReceiver];
+		sbin = pSimulation->directionlookup ? DirectionGridBin(pSimulation, &recvrayvector) : DiffuseSpaceBin(&recvrayvector);
+
+		/* keep track of first arrival in each spatial bin */
+		firsttoa = worker->log ? &worker->FirstTOA[iReceiver * receiver->nSbin + sbin] : &receiver->FirstTOA[sbin];
+		if (out->toa[iReceiver] < *firsttoa)
+			*firsttoa = out->toa[iReceiver];
+
+		if (worker->log)
+			DEPOSIT(worker->log, TFS_KEY(pSimulation,iReceiver,tbin,iBand,sbin), out->energy[iReceiver]);
+		else if ((cell = PagedHistogramPage(&pSimulation->histogram, iReceiver * receiver->nSbin + sbin)))
+			cell[iBand + (size_t) receiver->nFbin * tbin] += out->energy[iReceiver];
+		else
+			worker->failure = "out of memory for diffuse histograms";
+	}
+}
 
-		/* loop over all frequency bands */
-		for (iBand=0; iBand<pSimulation->nBands; iBand++)
-		{
-			/* loop over all sound rays */
-			for (iRay=0; iRay<nRays; iRay++)
-			{
-				/* load initial ray position */
-				ray_xyz.x = pSetup->source[iSource].location[0];
-				ray_xyz.y = pSetup->source[iSource].location[1];
-				ray_xyz.z = pSetup->source[iSource].location[2];
+/** Traces a single ray from a source, and deposits its diffuse reflections at all receivers. */
+void TraceDiffuseRay(const CDiffuseTrace *trace, CDiffuseWorker *worker, int iBand, const XYZ *direction)
+{
+	const CRoomSetup        *pSetup           = trace->pSetup;
+	CRoomsimInternal        *pSimulation      = trace->pSimulation;
+	const CDiffuseReceivers *diffusereceivers = trace->diffusereceivers;
+	const CAirAttenuationTable *airtable      = trace->airtable ? &trace->airtable[iBand] : NULL;
+	const double            *linreflection    = trace->linreflection + 6 * iBand;
+	const double            *lindiffusion     = trace->lindiffusion  + 6 * iBand;
+	const bool              lineardomain      = trace->lineardomain;
+	const int               iSource           = trace->iSource;
+	const double            endtime           = trace->endtime;
+	const double            ray_logenergymin  = trace->ray_logenergymin;
+	const double            ray_energymin     = trace->ray_energymin;
+	const bool              hybrid            = pSimulation->transitiontime > 0;
+
+	int		iReceiver;
+	XYZ		ray_xyz, ray_dxyz, impact_xyz;
+	XYZ		rayrecvvector, recvrayvector, rs, rd;
+	double	ray_time, timetoimpact, t, recv_timeofarrival;
+	double	ray_logenergy, rayrecv_logenergy = 0.0, recv_logenergy;
+	double	ray_energy=0.0, ray_air=1.0, rayrecv_energy, recv_energy;
+	double  distance, d, vn=0.0, vf=0.0, v1, v2, v3, wd, ws, temp, weight = 1.0, ray_specular = 1.0;
+	int		surfaceofimpact;
 
-				/* load initial ray direction */
-				ray_dxyz = ray[iRay];
+	/* load initial ray position */
+	ray_xyz.x = pSetup->source[iSource].location[0];
+	ray_xyz.y = pSetup->source[iSource].location[1];
+	ray_xyz.z = pSetup->source[iSource].location[2];
 
-				/* initialize ray time */
-				ray_time = 0;
+	/* load initial ray direction */
+	ray_dxyz = *direction;
 
-				/* initialize ray energy */
-				ray_logenergy = -LOGDOMAIN(nRays);
+	/* initialize ray time */
+	ray_time = 0;
 
-				/* apply source directivity to ray energy. */
-				ray_logenergy += SensorGetLogGain(pSimulation->source[iSource].definition, &ray_dxyz, iBand);
+	/* initialize ray energy */
+	ray_logenergy = -LOGDOMAIN(trace->nRays);
 
-				/* convert ray direction from source coords to room coords */
-				YawPitchRoll_InPlace(&ray_dxyz, &(pSimulation->source[iSource].s2r_yprt));
+	/* apply source directivity to ray energy. */
+	ray_logenergy += SensorGetLogGain(pSimulation->source[iSource].definition, &ray_dxyz, iBand);
 
-				/* inifinite loop, terminates when ray time exceeds */
-				/* response duration, or when ray energy drops below threshold */
-				for (;;)
-				{
-				/*
-				 * determine time and surface of impact
-				 */
-					timetoimpact = 1000.0;
+	/* convert ray direction from source coords to room coords */
+	YawPitchRoll_InPlace(&ray_dxyz, &(pSimulation->source[iSource].s2r_yprt));
 
-                    surfaceofimpact = -1;
+	if (lineardomain)
+	{
+		ray_energy = LINDOMAIN(ray_logenergy);
+		ray_air    = 1.0;
+	}
 
-					/* compute time to intersection with x-surfaces */
-					if (ray_dxyz.x < 0)
-					{
-						timetoimpact = -ray_xyz.x / ray_dxyz.x; 
-						surfaceofimpact = 0;
-					}
-					else if (ray_dxyz.x > 0)
-					{
-						timetoimpact = (pSetup->room.dimension[0] - ray_xyz.x) / ray_dxyz.x;
-						surfaceofimpact = 1;
-					}
-					/* compute time to intersection with y-surfaces */
-					if (ray_dxyz.y < 0)
-					{
-						t = -ray_xyz.y / ray_dxyz.y; 
-						if (t < timetoimpact)
-						{
-							surfaceofimpact = 2;
-							timetoimpact = t;
-						}
-					}
-					else if (ray_dxyz.y > 0)
-					{
-						t = (pSetup->room.dimension[1] - ray_xyz.y) / ray_dxyz.y;
-						if (t < timetoimpact)
-						{
-							surfaceofimpact = 3;
-							timetoimpact = t;
-						}
-					}
-					/* compute time to intersection with z-surfaces */
-					if (ray_dxyz.z < 0)
-					{
-						t = -ray_xyz.z / ray_dxyz.z; 
-						if (t < timetoimpact)
-						{
-							surfaceofimpact = 4;
-							timetoimpact = t;
-						}
-					}
-					else if (ray_dxyz.z > 0)
-					{
-						t = (pSetup->room.dimension[2] - ray_xyz.z) / ray_dxyz.z;
-						if (t < timetoimpact)
-						{
-							surfaceofimpact = 5;
-							timetoimpact = t;
-						}
-					}
+	/* inifinite loop, terminates when ray time exceeds */
+	/* response duration, or when ray energy drops below threshold */
+	for (;;)
+	{
+		/*
+		 * determine time and surface of impact
+		 */
+		timetoimpact = 1000.0;
+
+		surfaceofimpact = -1;
+
+		/* compute time to intersection with x-surfaces */
+		if (ray_dxyz.x < 0)
+		{
+			timetoimpact = -ray_xyz.x / ray_dxyz.x; 
+			surfaceofimpact = 0;
+		}
+		else if (ray_dxyz.x > 0)
+		{
+			timetoimpact = (pSetup->room.dimension[0] - ray_xyz.x) / ray_dxyz.x;
+			surfaceofimpact = 1;
+		}
+		/* compute time to intersection with y-surfaces */
+		if (ray_dxyz.y < 0)
+		{
+			t = -ray_xyz.y / ray_dxyz.y; 
+			if (t < timetoimpact)
+			{
+				surfaceofimpact = 2;
+				timetoimpact = t;
+			}
+		}
+		else if (ray_dxyz.y > 0)
+		{
+			t = (pSetup->room.dimension[1] - ray_xyz.y) / ray_dxyz.y;
+			if (t < timetoimpact)
+			{
+				surfaceofimpact = 3;
+				timetoimpact = t;
+			}
+		}
+		/* compute time to intersection with z-surfaces */
+		if (ray_dxyz.z < 0)
+		{
+			t = -ray_xyz.z / ray_dxyz.z; 
+			if (t < timetoimpact)
+			{
+				surfaceofimpact = 4;
+				timetoimpact = t;
+			}
+		}
+		else if (ray_dxyz.z > 0)
+		{
+			t = (pSetup->room.dimension[2] - ray_xyz.z) / ray_dxyz.z;
+			if (t < timetoimpact)
+			{
+				surfaceofimpact = 5;
+				timetoimpact = t;
+			}
+		}
 
-                    if (surfaceofimpact==-1)
-                        MsgErrorExit("INTERNAL ERROR: no surface of impact found for current ray");
+		/* report after the threads have joined, see TraceDiffuseRound */
+		if (surfaceofimpact==-1)
+		{
+			worker->failure = "INTERNAL ERROR: no surface of impact found for current ray";
+			return;
+		}
 
-					/* determine length of ray segment */
-					rs.x = timetoimpact * ray_dxyz.x;
-					rs.y = timetoimpact * ray_dxyz.y;
-					rs.z = timetoimpact * ray_dxyz.z;
-					distance = sqrt(rs.x*rs.x + rs.y*rs.y+rs.z*rs.z);
+		/* determine length of ray segment */
+		rs.x = timetoimpact * ray_dxyz.x;
+		rs.y = timetoimpact * ray_dxyz.y;
+		rs.z = timetoimpact * ray_dxyz.z;
+		distance = sqrt(rs.x*rs.x + rs.y*rs.y+rs.z*rs.z);
 
-					/* determine location of impact */
-					impact_xyz.x = ray_xyz.x + rs.x;
-					impact_xyz.y = ray_xyz.y + rs.y;
-					impact_xyz.z = ray_xyz.z + rs.z;
+		/* determine location of impact */
+		impact_xyz.x = ray_xyz.x + rs.x;
+		impact_xyz.y = ray_xyz.y + rs.y;
+		impact_xyz.z = ray_xyz.z + rs.z;
 
 #ifdef LOGRAYS
-					if (iSource==0 && iBand==0)
-					{
-						fprintf(fid,"%4d    %9.6f %9.6f %9.6f    %9.6f %9.6f %9.6f    %9.6f    %10.6f\n",
-							iRay, ray_xyz.x, ray_xyz.y, ray_xyz.z, ray_dxyz.x, ray_dxyz.y, ray_dxyz.z,
-							ray_time, ray_logenergy);
+		if (iSource==0 && iBand==0)
+		{
+			fprintf(trace->fid,"%4d    %9.6f %9.6f %9.6f    %9.6f %9.6f %9.6f    %9.6f    %10.6f\n",
+				worker->iRay, ray_xyz.x, ray_xyz.y, ray_xyz.z, ray_dxyz.x, ray_dxyz.y, ray_dxyz.z,
+				ray_time, ray_logenergy);
 #  ifdef LOGRAYS_EXTRA
-						fprintf(fid,"                                        %% soi %d   rs %9.6f %9.6f %9.6f   d %9.6f   imp %9.6f %9.6f %9.6f\n",
-							surfaceofimpact, rs.x, rs.y, rs.z, distance, impact_xyz.x, impact_xyz.y, impact_xyz.z);
+			fprintf(trace->fid,"                                        %% soi %d   rs %9.6f %9.6f %9.6f   d %9.6f   imp %9.6f %9.6f %9.6f\n",
+				surfaceofimpact, rs.x, rs.y, rs.z, distance, impact_xyz.x, impact_xyz.y, impact_xyz.z);
 #  endif
-					}
+		}
 #  ifdef LOGRAYS_EXTRA
-					if (distance==0.0) 
-					{
-						fprintf(fid,"%% DISTANCE FELL TO ZERO, BREAKING\n");
-						break;
-					}
+		if (distance==0.0) 
+		{
+			fprintf(trace->fid,"%% DISTANCE FELL TO ZERO, BREAKING\n");
+			break;
+		}
 #  endif
 #endif
 
-					/** @todo Apply air absorption? */
+		/** @todo Apply air absorption? */
 
-					/* update ray location */
-					ray_xyz = impact_xyz;
-
-					/* update ray time */
-					ray_time += distance / pSimulation->c;
-
-					/* quit ray when simulation time exceeded */
-					if (ray_time > endtime)
-					{
-#ifdef LOGRAYS
-						if (iSource==0 && iBand==0)
-							fprintf(fid,"%% ray time exceeded: %9.6f\n", ray_time);
-#endif
-						break;
-					}
+		/* update ray location */
+		ray_xyz = impact_xyz;
 
-					/* apply surface absorption to ray's energy */
-					ray_logenergy += SURFACELOGREFLECTION(pSimulation,surfaceofimpact,iBand);
+		/* update ray time */
+		ray_time += distance / pSimulation->c;
 
-					/* quit ray when energy drops below threshold */
-					if (ray_logenergy < ray_logenergymin)
-					{
+		/* quit ray when simulation time exceeded */
+		if (ray_time > endtime)
+		{
 #ifdef LOGRAYS
-						if (iSource==0 && iBand==0)
-							fprintf(fid,"%% ray energy depleted: %9.6f\n", ray_logenergy);
+			if (iSource==0 && iBand==0)
+				fprintf(trace->fid,"%% ray time exceeded: %9.6f\n", ray_time);
 #endif
-						break;
-					}
-
-					/* apply diffuse reflection to ray energy */
-					rayrecv_logenergy = ray_logenergy + SURFACELOGDIFFUSION(pSimulation,surfaceofimpact,iBand);
+			break;
+		}
 
-					/* extend ray to all receivers */
-					for (iReceiver=0; iReceiver<pSetup->nReceivers; iReceiver++)
-					{
-						/* determine ray->receiver vector */
-						rayrecvvector.x = pSetup->receiver[iReceiver].location[0] - impact_xyz.x;
-						rayrecvvector.y = pSetup->receiver[iReceiver].location[1] - impact_xyz.y;
-						rayrecvvector.z = pSetup->receiver[iReceiver].location[2] - impact_xyz.z;
-
-						/* determine ray's time of arrival at receiver */
-						distance = sqrt(rayrecvvector.x * rayrecvvector.x + 
-										rayrecvvector.y * rayrecvvector.y + 
-										rayrecvvector.z * rayrecvvector.z); 
-						recv_timeofarrival = ray_time + distance / pSimulation->c;
-
-						/* skip this receiver if ray arrives too late */
-						if (recv_timeofarrival > endtime)
-							continue;
-
-						/* determine amount of diffuse energy that reaches the receiver */
-						switch (surfaceofimpact)
-						{
-						case 0:
-							vn = rayrecvvector.x; 
-							vf = rayrecvvector.y*rayrecvvector.y + rayrecvvector.z*rayrecvvector.z;
-							break;
-						case 1:
-							vn = -rayrecvvector.x; 
-							vf = rayrecvvector.y*rayrecvvector.y + rayrecvvector.z*rayrecvvector.z;
-							break;
-						case 2:
-							vn = rayrecvvector.y; 
-							vf = rayrecvvector.x*rayrecvvector.x + rayrecvvector.z*rayrecvvector.z;
-							break;
-						case 3:
-							vn = -rayrecvvector.y; 
-							vf = rayrecvvector.x*rayrecvvector.x + rayrecvvector.z*rayrecvvector.z;
-							break;
-						case 4:
-							vn = rayrecvvector.z; 
-							vf = rayrecvvector.x*rayrecvvector.x + rayrecvvector.y*rayrecvvector.y;
-							break;
-						case 5:
-							vn = -rayrecvvector.z; 
-							vf = rayrecvvector.x*rayrecvvector.x + rayrecvvector.y*rayrecvvector.y;
-							break;
-						}
-						v1 = vn*vn;
-						v2 = v1 + vf;
-						v3 = v2 * sqrt(v2);
-						d = (distance < 1.0 ? 1.0 : distance);
-						recv_logenergy = rayrecv_logenergy + LOGDOMAIN(v1 * vn / v3 / (d * d));
-
-						/* apply air absorption if requested */
-						if (pSetup->options.airabsorption)
-						{
-							recv_logenergy += (recv_timeofarrival * pSimulation->c) * pSimulation->logairattenuation[iBand];
-						}
+		if (lineardomain)
+		{
+			/* apply surface absorption and air absorption to ray's energy */
+			ray_energy *= linreflection[surfaceofimpact];
+			if (airtable)
+				ray_air *= AirAttenuation(airtable, distance);
 
-						/* convert ray-receiver vector to receiver-ray vector */
-						recvrayvector.x = -rayrecvvector.x;
-						recvrayvector.y = -rayrecvvector.y;
-						recvrayvector.z = -rayrecvvector.z;
+			/* quit ray when energy drops below threshold */
+			if (ray_energy < ray_energymin)
+				break;
 
-						/* convert recv-ray vector from room coords to receiver coords */
-						YawPitchRoll_InPlace(&recvrayvector, &pSimulation->receiver[iReceiver].r2s_yprt);
+			/* apply diffuse reflection to ray energy, or weight it per arrival in a hybrid simulation */
+			rayrecv_energy = ray_energy * (hybrid ? 1.0 : lindiffusion[surfaceofimpact]) * ray_air;
+		}
+		else
+		{
+			/* apply surface absorption to ray's energy */
+			ray_logenergy += SURFACELOGREFLECTION(pSimulation,surfaceofimpact,iBand);
 
+			/* quit ray when energy drops below threshold */
+			if (ray_logenergy < ray_logenergymin)
+			{
 #ifdef LOGRAYS
-					if (iSource==0 && iBand==0)
-					{
-						fprintf(fidrecv,"%4d   %4d   %9.6f %9.6f %9.6f   %9.6f   %9.6f   %9.6f %9.6f %9.6f    %10.6f\n",
-							iRay, iReceiver, 
-							rayrecvvector.x, rayrecvvector.y, rayrecvvector.z, 
-							LOGDOMAIN(v1 * vn / v3 / (d * d)), recv_timeofarrival, 
-							recvrayvector.x, recvrayvector.y, recvrayvector.z, 
-							recv_logenergy);
-					}
-#endif
-						/* add ray energy to receiver histogram */
-						AddDiffuseEnergy(pSimulation, iReceiver, recv_timeofarrival, &recvrayvector, iBand, recv_logenergy);
-					}
-
-				/*
-				 * Pick new direction for current ray
-				 */
-					
-					/* select random unit vector from lambert distribution */
-					RngLambert(sfmt, &rd);
-					switch (surfaceofimpact)
-					{
-					case 0: temp = rd.x; rd.x =  rd.z; rd.z = temp; rs.x = -rs.x; break;
-					case 1: temp = rd.x; rd.x = -rd.z; rd.z = temp; rs.x = -rs.x; break;
-					case 2: temp = rd.y; rd.y =  rd.z; rd.z = temp; rs.y = -rs.y; break;
-					case 3: temp = rd.y; rd.y = -rd.z; rd.z = temp; rs.y = -rs.y; break;
-					case 4:											rs.z = -rs.z; break;
-					case 5: rd.z = -rd.z;							rs.z = -rs.z; break;
-					}
-					MakeUnitVector(&rd);
-					MakeUnitVector(&rs);
-
-					/* mix random/specular vectors using diffuse weighting */
-					wd = SURFACEDIFFUSIONCOEFFICIENT(pSimulation,surfaceofimpact,iBand);
-					ws = 1.0 - wd;
-					ray_dxyz.x = wd * rd.x + ws * rs.x;
-					ray_dxyz.y = wd * rd.y + ws * rs.y;
-					ray_dxyz.z = wd * rd.z + ws * rs.z;
-
-#ifdef LOGRAYS_EXTRA
-					if (iSource==0 && iBand==0)
-					{
-						fprintf(fid,"                                        "
-							"%% wd %9.6f   rd %9.6f %9.6f %9.6f\n", wd, rd.x, rd.y, rd.z);
-						fprintf(fid,"                                        "
-							"%% ws %9.6f   rs %9.6f %9.6f %9.6f\n", ws, rs.x, rs.y, rs.z);
-					}
+				if (iSource==0 && iBand==0)
+					fprintf(trace->fid,"%% ray energy depleted: %9.6f\n", ray_logenergy);
 #endif
-				} /* continue tracing current ray */
-
-			} /* next ray */
+				break;
+			}
 
-		} /* next frequency band */
+			/* apply diffuse reflection to ray energy, or weight it per arrival in a hybrid simulation */
+			rayrecv_logenergy = ray_logenergy;
+			if (!hybrid)
+				rayrecv_logenergy += SURFACELOGDIFFUSION(pSimulation,surfaceofimpact,iBand);
 
-#ifdef LOGTFS
-		if (iSource==0)
-		{
-			int i,j,k;
-			FILE *fidtfs;
-			fidtfs = fopen("tfslog.txt","w");
-			fprintf(fidtfs,"%d %d %d\n", 
-				pSimulation->receiver[0].nTbin,
-				pSimulation->receiver[0].nFbin,
-				pSimulation->receiver[0].nSbin);
-			for (i=0; i<pSimulation->receiver[0].nSbin; i++)
+			/* linear energy at impact, including air absorption, for the vectorized receiver path */
+			rayrecv_energy = 0.0;
+			if (diffusereceivers)
 			{
-				for (j=0; j<pSimulation->receiver[0].nFbin; j++)
-				{
-					for (k=0; k<pSimulation->receiver[0].nTbin; k++)
-					{
-						fprintf(fidtfs, "%13.10f ", RECV_TFS_BIN(pSimulation->receiver[0],k,j,i));
-					}
-					fprintf(fidtfs,"\n");
-				}
+				if (pSetup->options.airabsorption)
+					rayrecv_energy = LINDOMAIN(rayrecv_logenergy + ray_time * pSimulation->c * pSimulation->logairattenuation[iBand]);
+				else
+					rayrecv_energy = LINDOMAIN(rayrecv_logenergy);
 			}
-			fclose(fidtfs);
 		}
-#endif
 
-		/****************************************
-		 * STAGE 2: REVERBERANT TAIL GENERATION *
-		 ****************************************/
+		/* hybrid simulation: share of the ray that was specularly reflected throughout */
+		if (hybrid)
+			ray_specular *= 1.0 - lindiffusion[surfaceofimpact];
 
-#ifdef LOGTAIL
+		if (diffusereceivers)
 		{
-			FILE *fidtail = fopen("tail.bin", "wb");
-#endif
-		/* loop over receivers */
+			/* extend ray to all receivers at once */
+			DiffuseRainReceivers(diffusereceivers, &worker->out, surfaceofimpact, &impact_xyz, ray_time, rayrecv_energy,
+				pSetup->options.airabsorption ? pSimulation->logairattenuation[iBand] : 0.0, pSimulation->c);
+
+			/* hybrid simulation: weight the arrivals by their share of the diffuse tail */
+			if (hybrid)
+				for (iReceiver=0; iReceiver<pSetup->nReceivers; iReceiver++)
+					worker->out.energy[iReceiver] *= HybridDiffuseWeight(pSimulation, lindiffusion[surfaceofimpact], 
+						ray_specular, worker->out.toa[iReceiver]);
+
+			/* add ray energies to receiver histograms */
+			DepositDiffuseReceivers(pSimulation, worker, iBand, endtime);
+		}
+		else
+		/* extend ray to all receivers */
 		for (iReceiver=0; iReceiver<pSetup->nReceivers; iReceiver++)
 		{
-            if (pSetup->options.verbose)
-            {
-                MsgPrintf("Generating reverberant tail from source %d to receiver %d...\n",
-                    iSource+1, iReceiver+1);
-                MsgRelax;
-            }
-            
-			SRidx = iReceiver * pSimulation->nSources + iSource;
+			/* determine ray->receiver vector */
+			rayrecvvector.x = pSetup->receiver[iReceiver].location[0] - impact_xyz.x;
+			rayrecvvector.y = pSetup->receiver[iReceiver].location[1] - impact_xyz.y;
+			rayrecvvector.z = pSetup->receiver[iReceiver].location[2] - impact_xyz.z;
+
+			/* determine ray's time of arrival at receiver */
+			distance = sqrt(rayrecvvector.x * rayrecvvector.x + 
+							rayrecvvector.y * rayrecvvector.y + 
+							rayrecvvector.z * rayrecvvector.z); 
+			recv_timeofarrival = ray_time + distance / pSimulation->c;
+
+			/* skip this receiver if ray arrives too late */
+			if (recv_timeofarrival > endtime)
+				continue;
+			if (hybrid)
+				weight = HybridDiffuseWeight(pSimulation, lindiffusion[surfaceofimpact], ray_specular, recv_timeofarrival);
+
+			/* determine amount of diffuse energy that reaches the receiver */
+			switch (surfaceofimpact)
+			{
+			case 0:
+				vn = rayrecvvector.x; 
+				vf = rayrecvvector.y*rayrecvvector.y + rayrecvvector.z*rayrecvvector.z;
+				break;
+			case 1:
+				vn = -rayrecvvector.x; 
+				vf = rayrecvvector.y*rayrecvvector.y + rayrecvvector.z*rayrecvvector.z;
+				break;
+			case 2:
+				vn = rayrecvvector.y; 
+				vf = rayrecvvector.x*rayrecvvector.x + rayrecvvector.z*rayrecvvector.z;
+				break;
+			case 3:
+				vn = -rayrecvvector.y; 
+				vf = rayrecvvector.x*rayrecvvector.x + rayrecvvector.z*rayrecvvector.z;
+				break;
+			case 4:
+				vn = rayrecvvector.z; 
+				vf = rayrecvvector.x*rayrecvvector.x + rayrecvvector.y*rayrecvvector.y;
+				break;
+			case 5:
+				vn = -rayrecvvector.z; 
+				vf = rayrecvvector.x*rayrecvvector.x + rayrecvvector.y*rayrecvvector.y;
+				break;
+			}
+			v1 = vn*vn;
+			v2 = v1 + vf;
+			v3 = v2 * sqrt(v2);
+			d = (distance < 1.0 ? 1.0 : distance);
 
-			/* loop over spatial groups */
-			for (iDirection=0; iDirection<6; iDirection++)
+			if (lineardomain)
 			{
-				/* determine receiver response to current direction */
-				if (!SensorGetResponse(pSimulation->receiver[iReceiver].definition,
-					&SpaceBinCenter[iDirection],&receiverresponse))
-				{
-					/* skip direction if no receiver response defined */
-					continue;	
-				}
+				/* apply geometry term and air absorption from impact to receiver */
+				recv_energy = rayrecv_energy * (v1 * vn / v3 / (d * d)) * weight;
+				if (airtable)
+					recv_energy *= AirAttenuation(airtable, distance);
+
+				/* convert ray-receiver vector to receiver-ray vector, in receiver coords */
+				recvrayvector.x = -rayrecvvector.x;
+				recvrayvector.y = -rayrecvvector.y;
+				recvrayvector.z = -rayrecvvector.z;
+				YawPitchRoll_InPlace(&recvrayvector, &pSimulation->receiver[iReceiver].r2s_yprt);
+
+				DepositDiffuseEnergy(pSimulation, worker, iReceiver, recv_timeofarrival, &recvrayvector, iBand, recv_energy);
+				continue;
+			}
 
-				TFSbase  = &(RECV_TFS_BIN(pSimulation->receiver[iReceiver],0,0,iDirection));
-				nTimebin = pSimulation->receiver[iReceiver].nTbin;
-				nFreqbin = pSimulation->receiver[iReceiver].nFbin;
-				length   = pSimulation->length;
-				nRecvCh  = pSimulation->receiver[iReceiver].definition->nChannels;
+			recv_logenergy = rayrecv_logenergy + LOGDOMAIN(v1 * vn / v3 / (d * d));
 
-#ifdef LOGTAIL
-				fwrite(TFSbase,sizeof(double),nTimebin*nFreqbin,fidtail);
-#endif /* LOGTAIL */
+			/* apply air absorption if requested */
+			if (pSetup->options.airabsorption)
+			{
+				recv_logenergy += (recv_timeofarrival * pSimulation->c) * pSimulation->logairattenuation[iBand];
+			}
 
-				/* convert TFS histogram to log domain */
-				for (i=0; i<nTimebin*nFreqbin; i++)
-				{
-					TFSbase[i] = LOGDOMAINSAFE(TFSbase[i]);
-				}
+			/* convert ray-receiver vector to receiver-ray vector */
+			recvrayvector.x = -rayrecvvector.x;
+			recvrayvector.y = -rayrecvvector.y;
+			recvrayvector.z = -rayrecvvector.z;
 
-#ifdef LOGTAIL
-				fwrite(TFSbase,sizeof(double),nTimebin*nFreqbin,fidtail);
-#endif /* LOGTAIL */
+			/* convert recv-ray vector from room coords to receiver coords */
+			YawPitchRoll_InPlace(&recvrayvector, &pSimulation->receiver[iReceiver].r2s_yprt);
 
-				/* convert TFS histogram to time-varying filter */
-				for (iTimebin=0; iTimebin<nTimebin; iTimebin++)
-				{
-					LogMagFreqResp2MinPhaseFIR(TFSbase + iTimebin * nFreqbin,
-						&pSimulation->htv[iTimebin*NFFT_SIZE], pSimulation->minphaseplan);
-				}
-				
-#ifdef LOGTAIL
-				fwrite(pSimulation->htv,sizeof(double),nTimebin*NFFT_SIZE,fidtail);
-#endif /* LOGTAIL */
+#ifdef LOGRAYS
+		if (iSource==0 && iBand==0)
+		{
+			fprintf(trace->fidrecv,"%4d   %4d   %9.6f %9.6f %9.6f   %9.6f   %9.6f   %9.6f %9.6f %9.6f    %10.6f\n",
+				worker->iRay, iReceiver, 
+				rayrecvvector.x, rayrecvvector.y, rayrecvvector.z, 
+				LOGDOMAIN(v1 * vn / v3 / (d * d)), recv_timeofarrival, 
+				recvrayvector.x, recvrayvector.y, recvrayvector.z, 
+				recv_logenergy);
+		}
+#endif
+			/* add ray energy to receiver histogram */
+			DepositDiffuseEnergy(pSimulation, worker, iReceiver, recv_timeofarrival, &recvrayvector, iBand, LINDOMAIN(recv_logenergy) * weight);
+		}
 
-				/* generate noise signal */
-				RngFill_uint32(sfmt, pSimulation->noise, (nRecvCh*length+3)&-4);
+		/*
+		 * Pick new direction for current ray
+		 */
 
-#ifdef LOGTAIL
-				fwrite(pSimulation->noise,sizeof(pSimulation->noise[0]),nRecvCh*length,fidtail);
-#endif /* LOGTAIL */
+		/* select random unit vector from lambert distribution */
+		RngLambert(worker->sfmt, &rd);
+		switch (surfaceofimpact)
+		{
+		case 0: temp = rd.x; rd.x =  rd.z; rd.z = temp; rs.x = -rs.x; break;
+		case 1: temp = rd.x; rd.x = -rd.z; rd.z = temp; rs.x = -rs.x; break;
+		case 2: temp = rd.y; rd.y =  rd.z; rd.z = temp; rs.y = -rs.y; break;
+		case 3: temp = rd.y; rd.y = -rd.z; rd.z = temp; rs.y = -rs.y; break;
+		case 4:											rs.z = -rs.z; break;
+		case 5: rd.z = -rd.z;							rs.z = -rs.z; break;
+		}
+		MakeUnitVector(&rd);
+		MakeUnitVector(&rs);
 
-				/* apply time-varying filter to noise signal */
-				TimeVaryingConv(pSimulation->htv, NFFT_SIZE, 
-					 pSimulation->htvidx, nTimebin, 
-					 pSimulation->noise, length, 
-					 ROUND(pSimulation->receiver[iReceiver].FirstTOA[iDirection] * pSimulation->fs),
-					 noisethreshold, pSimulation->shapednoise);
+		/* mix random/specular vectors using diffuse weighting */
+		wd = SURFACEDIFFUSIONCOEFFICIENT(pSimulation,surfaceofimpact,iBand);
+		ws = 1.0 - wd;
+		ray_dxyz.x = wd * rd.x + ws * rs.x;
+		ray_dxyz.y = wd * rd.y + ws * rs.y;
+		ray_dxyz.z = wd * rd.z + ws * rs.z;
 
-				if (nRecvCh==2 && pSetup->options.uncorrelatednoise)
-				{
-					/* apply time-varying filter to second channel of noise signal */
-					TimeVaryingConv(pSimulation->htv, NFFT_SIZE, 
-						 pSimulation->htvidx, nTimebin, 
-						 pSimulation->noise+length, length, 
-						 ROUND(pSimulation->receiver[iReceiver].FirstTOA[iDirection] * pSimulation->fs),
-						 noisethreshold,pSimulation->shapednoise+length);
-				}
+#ifdef LOGRAYS_EXTRA
+		if (iSource==0 && iBand==0)
+		{
+			fprintf(trace->fid,"                                        "
+				"%% wd %9.6f   rd %9.6f %9.6f %9.6f\n", wd, rd.x, rd.y, rd.z);
+			fprintf(trace->fid,"                                        "
+				"%% ws %9.6f   rs %9.6f %9.6f %9.6f\n", ws, rs.x, rs.y, rs.z);
+		}
+#endif
+	} /* continue tracing current ray */
 
-#ifdef LOGTAIL
-				fwrite(pSimulation->shapednoise,sizeof(pSimulation->shapednoise[0]),length,fidtail);
-#endif /* LOGTAIL */
+}
 
-				receiverimpulse = NULL;
-				receiverimpulselength = 0;
-				switch (receiverresponse.type)
-				{
-				case SR_LOGGAIN:
-					gain = LINDOMAIN(receiverresponse.data.loggain);
+/** Traces one batch of rays of one frequency band. */
+void TraceDiffuseBatch(const CDiffuseTrace *trace, CDiffuseWorker *worker, int iBand, int iBatch)
+{
+	int iRay, iFirst = iBatch * DIFFUSE_RAYBATCH, nBatchRays = MIN(DIFFUSE_RAYBATCH, trace->nRays - iFirst);
 
-					for (i=0; i<length; i++)
-						pSimulation->directionalshapednoise[i] = pSimulation->shapednoise[i] * gain;
+	if (GetRayDirections(trace->raygenerator, iFirst, nBatchRays, worker->ray) < 0)
+	{
+		worker->failure = "INTERNAL ERROR: unknown ray generator type";
+		return;
+	}
+	for (iRay=0; iRay<nBatchRays && !worker->failure; iRay++)
+	{
+#ifdef LOGRAYS
+		worker->iRay = iFirst + iRay;
+#endif
+		TraceDiffuseRay(trace, worker, iBand, &worker->ray[iRay]);
+	}
+}
 
-					if (nRecvCh==2 && pSetup->options.uncorrelatednoise)
-					{
-						for (i=length; i<2*length; i++)
-							pSimulation->directionalshapednoise[i] = pSimulation->shapednoise[i] * gain;
-					}
-					break;
-
-				case SR_LOGWEIGHTS:
-					/* convert receiver weights to impulse response */
-					LogMagFreqResp2MinPhaseFIR(receiverresponse.data.logweights,
-						pSimulation->h, pSimulation->minphaseplan);
-					receiverimpulse = pSimulation->h;
-					receiverimpulselength = NFFT_SIZE;
-					break;
-
-				case SR_IMPULSERESPONSE:
-					receiverimpulse = receiverresponse.data.impulseresponse;
-					receiverimpulselength = pSimulation->receiver[iReceiver].definition->nSamples;
-					break;
-				}
+/** Ray tracing thread: traces batches of rays until all bands and batches of the round are done. */
+void TraceDiffuseWorker(int iThread, void *arg)
+{
+	CDiffuseTrace  *trace  = (CDiffuseTrace *) arg;
+	CDiffuseWorker *worker = &trace->worker[iThread];
+	int  nItems = trace->nRoundBands * trace->nRoundBatches;
+	int  iBand, iBatch;
+	long item;
 
-				if (receiverimpulse)
-				{
-					/* apply receiver directional filter to shaped noise signal */
-					FIRfilter(
-						receiverimpulse, receiverimpulselength,			/* filter */
-						pSimulation->shapednoise, length,				/* signal */
-						pSimulation->directionalshapednoise,			/* output */
-						NULL											/* state */
-					);
-
-					/* handle binaural receiver */
-					if (nRecvCh==2)
-					{
-						receiverimpulse += receiverimpulselength;
-						if (pSetup->options.uncorrelatednoise)
-						{
-							FIRfilter(
-								receiverimpulse, receiverimpulselength,			/* filter */
-								pSimulation->shapednoise+length, length,	    /* signal */
-								pSimulation->directionalshapednoise + length,	/* output */
-								NULL											/* state */
-							);
-						}
-						else
+	while ((item = AtomicIncrement(&trace->nextitem) - 1) < nItems)
+	{
+		iBand  = trace->band[item / trace->nRoundBatches];
+		iBatch = trace->firstbatch + (int) item % trace->nRoundBatches;
+
+		/* each batch has its own random stream, so the outcome does not depend on the number of threads */
+		RngInitStream(worker->sfmt, (unsigned int) 
+			((trace->iSource * trace->pSimulation->nBands + iBand) * trace->nBatches + iBatch));
+
+		TraceDiffuseBatch(trace, worker, iBand, iBatch);
+	}
+
+	FlushDepositLog(worker->log);
+}
+
+/** Traces a round of ray batches, for a set of frequency bands. 
+ *
+ *	@param[in,out] trace		Ray tracing state.
+ *	@param[in]     nThreads		Number of threads; with one thread, rays are traced in order.
+ *	@param[in]     band			Frequency bands to trace.
+ *	@param[in]     nBands		Number of frequency bands to trace.
+ *	@param[in]     firstbatch	First ray batch to trace, in each band.
+ *	@param[in]     nBatches		Number of ray batches to trace, in each band.
+ */
+void TraceDiffuseRound(CDiffuseTrace *trace, int nThreads, const int *band, int nBands, int firstbatch, int nBatches)
+{
+	int i, iBatch;
+
+	if (nThreads > 1)
+	{
+		trace->band          = band;
+		trace->nRoundBands   = nBands;
+		trace->firstbatch    = firstbatch;
+		trace->nRoundBatches = nBatches;
+		trace->nextitem      = 0;
+		ThreadRun(nThreads, TraceDiffuseWorker, trace);
+	}
+	else
+	{
+		for (i=0; i<nBands; i++)
+			for (iBatch=firstbatch; iBatch<firstbatch+nBatches; iBatch++)
+				TraceDiffuseBatch(trace, &trace->worker[0], band[i], iBatch);
+	}
+
+	/* workers must not exit, their failures are reported here */
+	for (i=0; i<nThreads; i++)
+	{
+		if (trace->worker[i].failure)
+			MsgErrorExit(trace->worker[i].failure);
+		if (trace->worker[i].log && trace->worker[i].log->failed)
+			MsgErrorExit("out of memory for diffuse histograms");
+	}
+}
+
+/* Minimum number of rounds before the adaptive ray count may stop tracing a band */
+#define DIFFUSE_MINROUNDS 4
+
+/* Range of the energy decay curve that has to converge in adaptive ray tracing (dB) */
+#define DIFFUSE_EDCRANGEDB 30.0
+
+/** Convergence statistics of the energy decay curves, for adaptive ray tracing. 
+ *
+ *	Each round adds an independent estimate of the energy decay curve (EDC) 
+ *	of every receiver and band. The spread of these estimates yields the 
+ *	standard error of their sum, i.e., of the EDC of the histogram.
+ */
+typedef struct {
+	int    nReceivers, nBands, nTbin;
+	int    *nRounds;	/**< Number of rounds per band. */
+	double *edc;		/**< EDC at end of previous round, per receiver, band, and time bin. */
+	double *sum;		/**< Sum of EDC increments over rounds. */
+	double *sumsq;		/**< Sum of squared EDC increments over rounds. */
+} CDiffuseConvergence;
+
+CDiffuseConvergence *AllocDiffuseConvergence(CArena *arena, const CRoomsimInternal *pSimulation)
+{
+	CDiffuseConvergence *conv = (CDiffuseConvergence *) ArenaMalloc(arena, sizeof(CDiffuseConvergence));
+	int n;
+
+	conv->nReceivers = pSimulation->nReceivers;
+	conv->nBands     = pSimulation->nBands;
+	conv->nTbin      = pSimulation->receiver[0].nTbin;
+	n = conv->nReceivers * conv->nBands * conv->nTbin;
+	conv->nRounds = (int *) ArenaMalloc(arena, conv->nBands * sizeof(int));
+	conv->edc     = (double *) ArenaMalloc(arena, 3 * n * sizeof(double));
+	conv->sum     = conv->edc + n;
+	conv->sumsq   = conv->sum + n;
+	return conv;
+}
+
+void ResetDiffuseConvergence(CDiffuseConvergence *conv)
+{
+	memset(conv->nRounds, 0, conv->nBands * sizeof(int));
+	memset(conv->edc, 0, 3 * conv->nReceivers * conv->nBands * conv->nTbin * sizeof(double));
+}
+
+/** Updates the convergence statistics of a band after a round of ray tracing.
+ *
+ *	@return Largest standard error of the EDC over all receivers, in dB, 
+ *			or a negative value when too few rounds have been traced.
+ */
+double UpdateDiffuseConvergence(CDiffuseConvergence *conv, const CRoomsimInternal *pSimulation, int iBand)
+{
+	const CSensorInternal *receiver;
+	double *edc, *sum, *sumsq;
+	double energy, increment, mean, variance, threshold, error, maxerror = 0.0;
+	int    iReceiver, t, s, k;
+
+	k = ++conv->nRounds[iBand];
+	for (iReceiver=0; iReceiver<conv->nReceivers; iReceiver++)
+	{
+		receiver = &pSimulation->receiver[iReceiver];
+		edc   = conv->edc   + (iReceiver * conv->nBands + iBand) * conv->nTbin;
+		sum   = conv->sum   + (iReceiver * conv->nBands + iBand) * conv->nTbin;
+		sumsq = conv->sumsq + (iReceiver * conv->nBands + iBand) * conv->nTbin;
+
+		/* backward integration of histogram, summed over space bins */
+		energy = 0.0;
+		for (t=conv->nTbin-1; t>=0; t--)
+		{
+			for (s=0; s<receiver->nSbin; s++)
+				if (receiver->TFScell[s])
+					energy += RECV_TFS_BIN(*receiver,t,iBand,s);
+			increment = energy - edc[t];
+			edc[t]    = energy;
+			sum[t]   += increment;
+			sumsq[t] += increment * increment;
+		}
+
+		if (k < DIFFUSE_MINROUNDS || sum[0] <= 0.0)
+			continue;
+
+		/* standard error of the EDC, relative to its value, over the evaluation range */
+		threshold = sum[0] * pow(10, -DIFFUSE_EDCRANGEDB/10);
+		for (t=0; t<conv->nTbin && sum[t] >= threshold; t++)
+		{
+			mean     = sum[t] / k;
+			variance = MAX(sumsq[t] - k * mean * mean, 0.0) / (k - 1);
+			error    = 10 * log10(1.0 + sqrt(variance * k) / sum[t]);
+			if (error > maxerror)
+				maxerror = error;
+		}
+	}
+
+	return k < DIFFUSE_MINROUNDS ? -1.0 : maxerror;
+}
+
+/** Multiplies the histogram energies of one frequency band of all receivers by a factor. */
+void ScaleDiffuseBand(CRoomsimInternal *pSimulation, int iBand, double factor)
+{
+	CSensorInternal *receiver;
+	int iReceiver, t, s;
+
+	for (iReceiver=0; iReceiver<pSimulation->nReceivers; iReceiver++)
+	{
+		receiver = &pSimulation->receiver[iReceiver];
+		for (s=0; s<receiver->nSbin; s++)
+			if (receiver->TFScell[s])
+				for (t=0; t<receiver->nTbin; t++)
+					RECV_TFS_BIN(*receiver,t,iBand,s) *= factor;
+	}
+}
+
+#ifdef LOGTAIL
+static FILE *g_fidtail;
+#endif
+
+/** Shapes noise with the time-varying spectrum \a TFSbase of a spatial bin of the
+ *  diffuse histogram of receiver \a iReceiver, converting that bin to the log 
+ *  domain, from the first arrival \a firsttoa on. Writes a channel of 
+ *  pSimulation->length samples to \a shapednoise, and a second one for 
+ *  uncorrelated noise at binaural receivers.
+ */
+void ShapeDiffuseNoise(const CRoomSetup *pSetup, CRoomsimInternal *pSimulation, sfmt_t *sfmt, int iReceiver, 
+					   double *TFSbase, double firsttoa, double *hbatch, SAMPLE *shapednoise)
+{
+	int		L = pSimulation->filterlength[pSimulation->nStages-1];	/* tail filter length */
+	CMinPhaseFIRplan *minphaseplan = pSimulation->minphaseplan[pSimulation->nStages-1];
+	unsigned int noisethreshold = (unsigned int) ((10000.0 / pSimulation->fs) * 4294967295.0);
+	int		nTimebin, nFreqbin, nRecvCh, length;
+	int		i, n, iTimebin;
+
+	nTimebin = pSimulation->receiver[iReceiver].nTbin;
+	nFreqbin = pSimulation->receiver[iReceiver].nFbin;
+	length   = pSimulation->length;
+	nRecvCh  = pSimulation->receiver[iReceiver].definition->nChannels;
+
+#ifdef LOGTAIL
+	fwrite(TFSbase,sizeof(double),nTimebin*nFreqbin,g_fidtail);
+#endif /* LOGTAIL */
+
+	/* convert TFS histogram to log domain */
+	for (i=0; i<nTimebin*nFreqbin; i++)
+	{
+		TFSbase[i] = LOGDOMAINSAFE(TFSbase[i]);
+	}
+
+#ifdef LOGTAIL
+	fwrite(TFSbase,sizeof(double),nTimebin*nFreqbin,g_fidtail);
+#endif /* LOGTAIL */
+
+	/* convert TFS histogram to time-varying filter, a batch of time bins at a time */
+	for (iTimebin=0; iTimebin<nTimebin; iTimebin+=MINPHASE_BATCH)
+	{
+		n = MIN(MINPHASE_BATCH, nTimebin - iTimebin);
+		LogMagFreqResp2MinPhaseFIRs(TFSbase + iTimebin * nFreqbin, nFreqbin,
+			hbatch, L, n, minphaseplan);
+		for (i=0; i<n*L; i++)
+			pSimulation->htv[iTimebin*L + i] = (SAMPLE) hbatch[i];
+	}
+	
+#ifdef LOGTAIL
+	fwrite(pSimulation->htv,sizeof(pSimulation->htv[0]),nTimebin*L,g_fidtail);
+#endif /* LOGTAIL */
+
+	/* generate noise signal */
+	RngFill_uint32(sfmt, pSimulation->noise, (MIN(nRecvCh,2)*length+3)&-4);
+
+#ifdef LOGTAIL
+	fwrite(pSimulation->noise,sizeof(pSimulation->noise[0]),MIN(nRecvCh,2)*length,g_fidtail);
+#endif /* LOGTAIL */
+
+	/* apply time-varying filter to noise signal */
+	TimeVaryingConv(pSimulation->htv, L, 
+		 pSimulation->htvidx, nTimebin, 
+		 pSimulation->noise, length, 
+		 ROUND(firsttoa * pSimulation->fs),
+		 noisethreshold, shapednoise);
+
+	if (nRecvCh==2 && pSetup->options.uncorrelatednoise)
+	{
+		/* apply time-varying filter to second channel of noise signal */
+		TimeVaryingConv(pSimulation->htv, L, 
+			 pSimulation->htvidx, nTimebin, 
+			 pSimulation->noise+length, length, 
+			 ROUND(firsttoa * pSimulation->fs),
+			 noisethreshold,shapednoise+length);
+	}
+
+#ifdef LOGTAIL
+	fwrite(shapednoise,sizeof(shapednoise[0]),length,g_fidtail);
+#endif /* LOGTAIL */
+}
+
+/** Filters shaped noise with the response of receiver \a iReceiver to one
+ *  direction, and adds it to response \a SRidx.
+ */
+void AddDirectionalNoise(const CRoomSetup *pSetup, CRoomsimInternal *pSimulation, int iReceiver, int SRidx,
+						 const CSensorResponse *receiverresponse, const SAMPLE *shapednoise)
+{
+	int		L = pSimulation->filterlength[pSimulation->nStages-1];	/* tail filter length */
+	CMinPhaseFIRplan *minphaseplan = pSimulation->minphaseplan[pSimulation->nStages-1];
+	const double *receiverimpulse;
+	double	gain, delay, frac, value;
+	SAMPLE	*noise, *span;
+	int		nRecvCh, length, receiverimpulselength;
+	int		i, c, k, n, first, offset;
+
+	length  = pSimulation->length;
+	nRecvCh = pSimulation->receiver[iReceiver].definition->nChannels;
+
+	receiverimpulse = NULL;
+	receiverimpulselength = 0;
+	switch (receiverresponse->type)
+	{
+	case SR_LOGGAIN:
+		gain = LINDOMAIN(receiverresponse->data.loggain);
+
+		for (i=0; i<length; i++)
+			pSimulation->directionalshapednoise[i] = (SAMPLE) (shapednoise[i] * gain);
+
+		if (nRecvCh==2 && pSetup->options.uncorrelatednoise)
+		{
+			for (i=length; i<2*length; i++)
+				pSimulation->directionalshapednoise[i] = (SAMPLE) (shapednoise[i] * gain);
+		}
+		break;
+
+	case SR_LOGWEIGHTS:
+		/* convert receiver weights to impulse response */
+		LogMagFreqResp2MinPhaseFIR(receiverresponse->data.logweights,
+			pSimulation->h, minphaseplan);
+		receiverimpulse = pSimulation->h;
+		receiverimpulselength = L;
+		break;
+
+	case SR_IMPULSERESPONSE:
+		receiverimpulse = receiverresponse->data.impulseresponse;
+		receiverimpulselength = pSimulation->receiver[iReceiver].definition->nSamples;
+		break;
+
+	case SR_GAINS:
+		/* encode the shaped noise of this direction into every channel */
+		for (first=0; first<length && shapednoise[first]==0; first++)
+			;
+		for (c=0; c<nRecvCh; c++)
+		{
+			gain = receiverresponse->data.gains[c];
+			if (gain == 0)
+				continue;
+			for (i=first; i<length; i+=n)
+			{
+				n = length - i;
+				span = BRIRSpan(pSimulation, SRidx, c, i, &n);
+				for (k=0; k<n; k++)
+					span[k] += (SAMPLE) (shapednoise[i+k] * gain);
+			}
+		}
+		return;
+
+	case SR_ELEMENTS:
+		/* delay the plane wave of this direction to every array element */
+		noise = pSimulation->directionalshapednoise;
+		for (c=0; c<nRecvCh; c++)
+		{
+			gain = receiverresponse->data.elements[c];
+			if (gain == 0)
+				continue;
+			delay  = receiverresponse->data.elements[nRecvCh+c] / pSimulation->csample;
+			offset = (int) floor(delay);
+			frac   = delay - offset;
+			for (i=0; i<length; i++)
+			{
+				k = i - offset;
+				value = (k >= 0 && k < length) ? (1 - frac) * shapednoise[k] : 0;
+				if (k >= 1 && k <= length)
+					value += frac * shapednoise[k-1];
+				noise[i] = (SAMPLE) (gain * value);
+			}
+			for (first=0; first<length && noise[first]==0; first++)
+				;
+			for (i=first; i<length; i+=n)
+			{
+				n = length - i;
+				span = BRIRSpan(pSimulation, SRidx, c, i, &n);
+				for (k=0; k<n; k++)
+					span[k] += noise[i+k];
+			}
+		}
+		return;
+	}
+
+	if (receiverimpulse)
+	{
+		/* apply receiver directional filter to shaped noise signal */
+		FIRfilter(
+			receiverimpulse, receiverimpulselength,			/* filter */
+			shapednoise, length,							/* signal */
+			pSimulation->directionalshapednoise,			/* output */
+			NULL											/* state */
+		);
+
+		/* handle binaural receiver */
+		if (nRecvCh==2)
+		{
+			receiverimpulse += receiverimpulselength;
+			if (pSetup->options.uncorrelatednoise)
+			{
+				FIRfilter(
+					receiverimpulse, receiverimpulselength,			/* filter */
+					shapednoise+length, length,					    /* signal */
+					pSimulation->directionalshapednoise + length,	/* output */
+					NULL											/* state */
+				);
+			}
+			else
+			{
+				FIRfilter(
+					receiverimpulse, receiverimpulselength,			/* filter */
+					shapednoise, length,							/* signal */
+					pSimulation->directionalshapednoise + length,	/* output */
+					NULL											/* state */
+				);
+			}
+		}
+	}
+
+#ifdef LOGTAIL
+	n = nRecvCh * length;
+	fwrite(&n,sizeof(n),1,g_fidtail);
+	fwrite(pSimulation->directionalshapednoise,sizeof(pSimulation->directionalshapednoise[0]),n,g_fidtail);
+#endif /* LOGTAIL */
+
+	/* add directional shaped noise signal to (B)RIR, from its first nonzero sample */
+	for (c=0; c<nRecvCh; c++)
+	{
+		noise = pSimulation->directionalshapednoise + c*length;
+		for (first=0; first<length && noise[first]==0; first++)
+			;
+		for (i=first; i<length; i+=n)
+		{
+			n = length - i;
+			span = BRIRSpan(pSimulation, SRidx, c, i, &n);
+			for (k=0; k<n; k++)
+				span[k] += noise[i+k];
+		}
+	}
+}
+
+/** Diffuse tails of all responses, kept to render them at several receiver orientations. 
+ *  Bins without arrivals are NULL. */
+typedef struct {
+	SAMPLE **noise;				/**< Shaped noise of 2 channels per response and axes bin. */
+	SAMPLE **gridnoise;			/**< With a direction grid, shaped noise of 2 channels per response. */
+	double **share;				/**< With a direction grid, energy share per response, bin, and time bin. */
+} CDiffuseTails;
+
+/** Computes the share of one bin of a direction grid in the energy \a energy
+ *  of all bins, per time bin. Time bins without energy keep the share of the
+ *  nearest earlier time bin, or of the first time bin with energy, so that 
+ *  the shares of all bins add up to one.
+ */
+static void DirectionShare(const double *TFSbase, int nTimebin, int nFreqbin, const double *energy, double *share)
+{
+	double e;
+	int    t, f, first = -1;
+
+	for (t=0; t<nTimebin; t++)
+	{
+		if (energy[t] > 0)
+		{
+			for (f=0, e=0; f<nFreqbin; f++)
+				e += TFSbase[t * nFreqbin + f];
+			share[t] = e / energy[t];
+			if (first < 0)
+				first = t;
+		}
+		else
+			share[t] = t > 0 ? share[t-1] : 0;
+	}
+	for (t=0; t<first; t++)
+		share[t] = share[first];
+}
+
+/** Weights the shaped noise of a direction grid with the energy share of one
+ *  bin, interpolated between the centers of the time bins.
+ */
+static void WeightDiffuseNoise(const CRoomSetup *pSetup, const CRoomsimInternal *pSimulation, int iReceiver,
+							   const double *share, const SAMPLE *shapednoise, SAMPLE *noise)
+{
+	int    nTimebin = pSimulation->receiver[iReceiver].nTbin;
+	int    length   = pSimulation->length;
+	bool   stereo   = pSimulation->receiver[iReceiver].definition->nChannels == 2 && pSetup->options.uncorrelatednoise;
+	double step     = 1.0 / (pSimulation->diffusetimestep * pSimulation->fs);
+	double pos, gain;
+	int    i, t;
+
+	for (i=0; i<length; i++)
+	{
+		pos  = i * step;
+		t    = (int) pos;
+		gain = t+1 < nTimebin ? share[t] + (pos - t) * (share[t+1] - share[t]) : share[nTimebin-1];
+		noise[i] = (SAMPLE) (shapednoise[i] * gain);
+		if (stereo)
+			noise[length+i] = (SAMPLE) (shapednoise[length+i] * gain);
+	}
+}
+
+/** Generates the diffuse tail of receiver \a iReceiver on a direction grid. 
+ *  The bins of a fine grid receive too few rays to estimate a spectrum each,
+ *  so noise is shaped once with the spectrum of all bins, and every bin adds
+ *  its energy share of that noise, filtered with the receiver response to the 
+ *  bin direction. With \a tails, the shaped noise and shares are stored instead.
+ */
+static void DiffuseGridTail(const CRoomSetup *pSetup, CRoomsimInternal *pSimulation, sfmt_t *sfmt,
+							int iReceiver, int SRidx, double *hbatch, CDiffuseTails *tails)
+{
+	CSensorInternal *receiver = &pSimulation->receiver[iReceiver];
+	CSensorResponse receiverresponse;
+	CArena     *arena = &pSimulation->arena;
+	CArenaMark mark   = ArenaGetMark(arena);
+	int    nTimebin = receiver->nTbin, nFreqbin = receiver->nFbin;
+	size_t nBins    = (size_t) nTimebin * nFreqbin, k;
+	double *histogram, *energy, *share, *TFSbase;
+	double firsttoa = 10000.0;
+	SAMPLE *shapednoise;
+	int    i;
+
+	/* sum the histograms of all bins, and their energy per time bin */
+	histogram = (double *) ArenaCalloc(arena, nBins, sizeof(double));
+	energy    = (double *) ArenaCalloc(arena, nTimebin, sizeof(double));
+	for (i=0; i<pSimulation->nDirections; i++)
+	{
+		if (receiver->FirstTOA[i] >= 10000.0 || !receiver->TFScell[i])
+			continue;
+		firsttoa = MIN(firsttoa, receiver->FirstTOA[i]);
+		TFSbase  = &RECV_TFS_BIN(*receiver,0,0,i);
+		for (k=0; k<nBins; k++)
+			histogram[k] += TFSbase[k];
+	}
+	if (firsttoa >= 10000.0)
+	{
+		ArenaRewind(arena, mark);
+		return;
+	}
+	for (k=0; k<nBins; k++)
+		energy[k / nFreqbin] += histogram[k];
+
+	if (tails)
+	{
+		shapednoise = tails->gridnoise[SRidx] = (SAMPLE *) MemMalloc(2 * pSimulation->length * sizeof(SAMPLE));
+		if (!shapednoise)
+			MsgErrorExit("out of memory for diffuse tails");
+	}
+	else
+		shapednoise = pSimulation->shapednoise;
+	ShapeDiffuseNoise(pSetup, pSimulation, sfmt, iReceiver, histogram, firsttoa, hbatch, shapednoise);
+
+	share = (double *) ArenaMalloc(arena, nTimebin * sizeof(double));
+	for (i=0; i<pSimulation->nDirections; i++)
+	{
+		/* skip directions without arrivals */
+		if (receiver->FirstTOA[i] >= 10000.0 || !receiver->TFScell[i])
+			continue;
+
+		if (tails)
+		{
+			share = tails->share[SRidx * pSimulation->nDirections + i] = (double *) MemMalloc(nTimebin * sizeof(double));
+			if (!share)
+				MsgErrorExit("out of memory for diffuse tails");
+			DirectionShare(&RECV_TFS_BIN(*receiver,0,0,i), nTimebin, nFreqbin, energy, share);
+			continue;
+		}
+
+		/* skip direction if no receiver response defined */
+		receiverresponse.buffer   = receiver->response;
+		receiverresponse.distance = 0;	/* plane wave */
+		if (!SensorGetResponse(receiver->definition, &pSimulation->directioncenter[i], &receiverresponse))
+			continue;
+
+		DirectionShare(&RECV_TFS_BIN(*receiver,0,0,i), nTimebin, nFreqbin, energy, share);
+		WeightDiffuseNoise(pSetup, pSimulation, iReceiver, share, shapednoise, pSimulation->gridnoise);
+		AddDirectionalNoise(pSetup, pSimulation, iReceiver, SRidx, &receiverresponse, pSimulation->gridnoise);
+	}
+
+	ArenaRewind(arena, mark);
+}
+
+/** Simulates the diffuse reflections of a setup, adding their tails to the
+ *  responses, or, when \a tails is not NULL, storing the shaped noise of 
+ *  every response there.
+ */
+void RoomsimDiffuse(const CRoomSetup *pSetup, CRoomsimInternal *pSimulation, sfmt_t *sfmt, CDiffuseTails *tails)
+{
+	CRayGenerator *raygenerator;
+	CDiffuseReceivers *diffusereceivers = NULL;
+	CAirAttenuationTable *airtable = NULL;
+	CDiffuseTrace   trace;
+	CDiffuseWorker  *worker;
+	CMutex  histogramlock;
+	CDiffuseConvergence *convergence = NULL;
+	double  *linreflection, *lindiffusion, error;
+	bool    lineardomain = pSetup->options.diffuselineardomain;
+	bool    adaptive = pSetup->options.diffusetolerancedB > 0;
+	int     nThreads, nActiveBands, nRoundBatches, nTraced, iBatch;
+	int     *band;
+
+	/* loop counters */
+	int	iSource, iBand, iReceiver, iThread;
+	int iDirection;
+	int	nRays;
+
+	/* diffuse generation variables */
+	int		i, SRidx;
+	double	*hbatch;
+	int		L = pSimulation->filterlength[pSimulation->nStages-1];	/* tail filter length */
+	CSensorResponse receiverresponse;
+	CArena  *arena = &pSimulation->arena;
+	CArenaMark mark = ArenaGetMark(arena);
+
+#if 0
+	/* prepare internal room simulation data structure */
+	CRoomsimInternal *pSimulation = RoomsimInit(pSetup);
+#endif
+
+	/* prepare ray directions */
+	raygenerator = AllocRayGenerator(pSetup->options.raygenerator, pSetup->options.numberofrays);
+	nRays = raygenerator->nRays;
+	if (nRays != pSetup->options.numberofrays && pSetup->options.verbose)
+    {
+		MsgPrintf("ray tracing: number of rays changed to %d\n", nRays);
+        MsgRelax;
+    }
+
+	/* adaptive ray count: trace rays in an order that covers the sphere at every stage */
+	if (adaptive)
+	{
+		InterleaveRayGenerator(raygenerator);
+		convergence = AllocDiffuseConvergence(arena, pSimulation);
+	}
+	band = (int *) ArenaMalloc(arena, pSimulation->nBands * sizeof(int));
+	hbatch = (double *) ArenaMalloc(arena, MINPHASE_BATCH * L * sizeof(double));
+
+/* TEMP 
+	{
+		CMinPhaseFIRplan *plan;
+		double F[] = {0,125,250,500,1000,2000,4000,8000,16000,22050};
+		double A[] = {0,  0,  0,  0,   0,   0,   0,   0,    0,    0};
+		unsigned int nF = sizeof(F)/sizeof(F[0]);
+		double h[512];
+		int i;
+		FILE *fid;
+
+		plan = AllocMinPhaseFIRplan(512, F, nF);
+		LogMagFreqResp2MinPhaseFIR(A, h, plan);
+		fid = fopen("hflat.txt","w");
+		for (i=0; i<512; i++)
+			fprintf(fid,"%13.10f\n", h[i]);
+		fclose(fid);
+		FreeMinPhaseFIRplan(plan);
+	}
+TEMP */
+
+	/* many receivers: evaluate diffuse rain for all receivers at once */
+	if (pSetup->nReceivers >= DIFFUSE_FASTPATH_MINRECEIVERS)
+		diffusereceivers = AllocDiffuseReceivers(arena, pSetup, pSimulation);
+
+	trace.pSetup           = pSetup;
+	trace.pSimulation      = pSimulation;
+	trace.diffusereceivers = diffusereceivers;
+	trace.raygenerator     = raygenerator;
+	trace.nRays            = nRays;
+	trace.endtime          = pSetup->options.responseduration;
+	trace.ray_logenergymin = -LOGDOMAIN(nRays) + LOGDOMAIN(pow(10,pSetup->options.rayenergyfloordB/20));
+	trace.ray_energymin    = LINDOMAIN(trace.ray_logenergymin);
+	trace.lineardomain     = lineardomain;
+	trace.nBatches         = (nRays + DIFFUSE_RAYBATCH - 1) / DIFFUSE_RAYBATCH;
+
+	/* linear energies: precompute linear reflection and diffusion factors */
+	linreflection = (double *) ArenaMalloc(arena, 2 * 6 * pSimulation->nBands * sizeof(double));
+	lindiffusion  = linreflection + 6 * pSimulation->nBands;
+	for (iBand=0; iBand<pSimulation->nBands; iBand++)
+	{
+		for (i=0; i<6; i++)
+		{
+			linreflection[6*iBand + i] = LINDOMAIN(SURFACELOGREFLECTION(pSimulation,i,iBand));
+			lindiffusion[6*iBand + i]  = LINDOMAIN(SURFACELOGDIFFUSION(pSimulation,i,iBand));
+		}
+	}
+	trace.linreflection = linreflection;
+	trace.lindiffusion  = lindiffusion;
+
+	/* linear energies: tabulate air attenuation up to the room diagonal, 
+	   which bounds ray segments and impact-to-receiver distances */
+	if (lineardomain && pSetup->options.airabsorption)
+	{
+		airtable = (CAirAttenuationTable *) ArenaMalloc(arena, pSimulation->nBands * sizeof(CAirAttenuationTable));
+		for (iBand=0; iBand<pSimulation->nBands; iBand++)
+		{
+			airtable[iBand].n = 2 + (int) ceil(sqrt(
+				pSetup->room.dimension[0] * pSetup->room.dimension[0] + 
+				pSetup->room.dimension[1] * pSetup->room.dimension[1] + 
+				pSetup->room.dimension[2] * pSetup->room.dimension[2]) / AIRTABLE_STEP);
+			airtable[iBand].invstep = 1.0 / AIRTABLE_STEP;
+			airtable[iBand].factor  = (double *) ArenaMalloc(arena, airtable[iBand].n * sizeof(double));
+			FillAirAttenuationTable(&airtable[iBand], pSimulation->logairattenuation[iBand]);
+		}
+	}
+	trace.airtable = airtable;
+
+	/* prepare per-thread state; all memory is allocated here, because worker 
+	   threads may not call the memory management or message routines */
+	nThreads  = ThreadCount(pSetup->options.numberofthreads);
+	nThreads  = MIN(nThreads, pSimulation->nBands * trace.nBatches);
+	worker = (CDiffuseWorker *) ArenaCalloc(arena, nThreads, sizeof(CDiffuseWorker));
+	trace.worker = worker;
+	if (nThreads > 1)
+	{
+		MutexInit(&histogramlock);
+		for (iThread=0; iThread<nThreads; iThread++)
+		{
+			worker[iThread].sfmt     = (sfmt_t *) ArenaMalloc(arena, sizeof(sfmt_t));
+			worker[iThread].log      = AllocDepositLog(DIFFUSE_DEPOSITLOG, &pSimulation->histogram, &histogramlock);
+			worker[iThread].FirstTOA = (double *) ArenaMalloc(arena, pSetup->nReceivers * pSimulation->receiver[0].nSbin * sizeof(double));
+			if (diffusereceivers)
+				AllocDiffuseRainOutput(arena, &worker[iThread].out, diffusereceivers);
+		}
+		if (pSetup->options.verbose)
+		{
+			MsgPrintf("ray tracing: %d threads, %.1f MB deposit buffers\n", 
+				nThreads, nThreads * DepositLogMemory(DIFFUSE_DEPOSITLOG) / 1048576.0);
+			MsgRelax;
+		}
+	}
+	else
+	{
+		/* single thread: trace rays in order, and update histograms directly */
+		worker[0].sfmt     = sfmt;
+		worker[0].log      = NULL;
+		worker[0].FirstTOA = NULL;
+		if (diffusereceivers)
+			AllocDiffuseRainOutput(arena, &worker[0].out, diffusereceivers);
+	}
+
+
+#ifdef LOGRAYS
+	trace.fid = fopen("raylog.txt","w");
+	trace.fidrecv = fopen("recvlog.txt","w");
+	fprintf(trace.fidrecv,"%%ray   recv   ray->recv vector                factor      time        recv->ray vector                logenergy \n"
+		            "%%---   ----   -----------------------------   ---------   ---------   -----------------------------   ----------\n");
+#endif
+
+	/* loop over all sound sources */
+    for (iSource=0; iSource<pSimulation->nSources; iSource++)
+	{
+		/* clear receivers' TFS histogram */
+		ClearPagedHistogram(&pSimulation->histogram);
+
+		/************************
+		 * STAGE 1: RAY TRACING *
+		 ************************/
+
+		trace.iSource = iSource;
+		if (nThreads > 1)
+		{
+			for (iThread=0; iThread<nThreads; iThread++)
+				for (i=0; i<pSetup->nReceivers * pSimulation->receiver[0].nSbin; i++)
+					worker[iThread].FirstTOA[i] = 10000.0;
+		}
+
+		for (iBand=0; iBand<pSimulation->nBands; iBand++)
+			band[iBand] = iBand;
+		nActiveBands = pSimulation->nBands;
+
+		if (!adaptive)
+		{
+			/* trace all rays of all frequency bands */
+			TraceDiffuseRound(&trace, nThreads, band, nActiveBands, 0, trace.nBatches);
+		}
+		else
+		{
+			/* trace rounds of ray batches, until each band has converged 
+			   or used up the ray budget */
+			ResetDiffuseConvergence(convergence);
+			for (iBatch=0; nActiveBands>0; iBatch+=nRoundBatches)
+			{
+				nRoundBatches = MIN(nThreads, trace.nBatches - iBatch);
+				TraceDiffuseRound(&trace, nThreads, band, nActiveBands, iBatch, nRoundBatches);
+
+				for (i=0; i<nActiveBands; )
+				{
+					iBand = band[i];
+					error = UpdateDiffuseConvergence(convergence, pSimulation, iBand);
+					if ((error >= 0 && error <= pSetup->options.diffusetolerancedB) || iBatch + nRoundBatches == trace.nBatches)
+					{
+						/* rays were traced with energy 1/nRays, compensate for rays not traced */
+						nTraced = MIN((iBatch + nRoundBatches) * DIFFUSE_RAYBATCH, nRays);
+						ScaleDiffuseBand(pSimulation, iBand, (double) nRays / nTraced);
+						if (pSetup->options.verbose)
 						{
-							FIRfilter(
-								receiverimpulse, receiverimpulselength,			/* filter */
-								pSimulation->shapednoise, length,				/* signal */
-								pSimulation->directionalshapednoise + length,	/* output */
-								NULL											/* state */
-							);
+							MsgPrintf("ray tracing: %.0f Hz band, %d rays (estimated error %.2f dB)\n", 
+								pSimulation->frequency[iBand], nTraced, MAX(error, 0.0));
+							MsgRelax;
 						}
+						band[i] = band[--nActiveBands];
+					}
+					else
+						i++;
+				}
+			}
+		}
+
+		if (nThreads > 1)
+		{
+			/* merge first arrivals */
+			for (iReceiver=0; iReceiver<pSetup->nReceivers; iReceiver++)
+			{
+				for (iThread=0; iThread<nThreads; iThread++)
+				{
+					for (i=0; i<pSimulation->receiver[iReceiver].nSbin; i++)
+					{
+						double toa = worker[iThread].FirstTOA[iReceiver * pSimulation->receiver[iReceiver].nSbin + i];
+						if (toa < pSimulation->receiver[iReceiver].FirstTOA[i])
+							pSimulation->receiver[iReceiver].FirstTOA[i] = toa;
+					}
+				}
+			}
+		}
+
+#ifdef LOGTFS
+		if (iSource==0)
+		{
+			int i,j,k;
+			FILE *fidtfs;
+			fidtfs = fopen("tfslog.txt","w");
+			fprintf(fidtfs,"%d %d %d\n", 
+				pSimulation->receiver[0].nTbin,
+				pSimulation->receiver[0].nFbin,
+				pSimulation->receiver[0].nSbin);
+			for (i=0; i<pSimulation->receiver[0].nSbin; i++)
+			{
+				for (j=0; j<pSimulation->receiver[0].nFbin; j++)
+				{
+					for (k=0; k<pSimulation->receiver[0].nTbin; k++)
+					{
+						fprintf(fidtfs, "%13.10f ", pSimulation->receiver[0].TFScell[i] ? RECV_TFS_BIN(pSimulation->receiver[0],k,j,i) : 0.0);
+					}
+					fprintf(fidtfs,"\n");
+				}
+			}
+			fclose(fidtfs);
+		}
+#endif
+
+		/****************************************
+		 * STAGE 2: REVERBERANT TAIL GENERATION *
+		 ****************************************/
+
+#ifdef LOGTAIL
+		g_fidtail = fopen("tail.bin", "wb");
+#endif
+		/* loop over receivers */
+		for (iReceiver=0; iReceiver<pSetup->nReceivers; iReceiver++)
+		{
+            if (pSetup->options.verbose)
+            {
+                MsgPrintf("Generating reverberant tail from source %d to receiver %d...\n",
+                    iSource+1, iReceiver+1);
+                MsgRelax;
+            }
+            
+			SRidx = iReceiver * pSimulation->nSources + iSource;
+
+			/* bins of a direction grid share their shaped noise */
+			if (pSimulation->directionlookup)
+			{
+				DiffuseGridTail(pSetup, pSimulation, sfmt, iReceiver, SRidx, hbatch, tails);
+				continue;
+			}
+
+			/* loop over spatial groups */
+			for (iDirection=0; iDirection<6; iDirection++)
+			{
+				/* skip directions without arrivals, whose tail is silent */
+				if (pSimulation->receiver[iReceiver].FirstTOA[iDirection] >= 10000.0)
+					continue;
+
+				if (tails)
+				{
+					/* keep the shaped noise of every direction, to render it at every receiver orientation */
+					i = SRidx * pSimulation->nDirections + iDirection;
+					tails->noise[i] = (SAMPLE *) MemMalloc(2 * pSimulation->length * sizeof(SAMPLE));
+					if (!tails->noise[i])
+						MsgErrorExit("out of memory for diffuse tails");
+					ShapeDiffuseNoise(pSetup, pSimulation, sfmt, iReceiver, 
+						&RECV_TFS_BIN(pSimulation->receiver[iReceiver],0,0,iDirection), 
+						pSimulation->receiver[iReceiver].FirstTOA[iDirection], hbatch, tails->noise[i]);
+					continue;
+				}
+
+				/* determine receiver response to current direction */
+				receiverresponse.buffer   = pSimulation->receiver[iReceiver].response;
+				receiverresponse.distance = 0;	/* plane wave */
+				if (!SensorGetResponse(pSimulation->receiver[iReceiver].definition,
+					&SpaceBinCenter[iDirection],&receiverresponse))
+				{
+					/* skip direction if no receiver response defined */
+					continue;	
+				}
+
+				ShapeDiffuseNoise(pSetup, pSimulation, sfmt, iReceiver, 
+					&RECV_TFS_BIN(pSimulation->receiver[iReceiver],0,0,iDirection), 
+					pSimulation->receiver[iReceiver].FirstTOA[iDirection], hbatch, pSimulation->shapednoise);
+				AddDirectionalNoise(pSetup, pSimulation, iReceiver, SRidx, &receiverresponse, pSimulation->shapednoise);
+
+			} /* next direction */
+
+#ifdef LOGTAIL
+			if (pSimulation->brir[SRidx].sample)
+				fwrite(pSimulation->brir[SRidx].sample,sizeof(pSimulation->brir[SRidx].sample[0]),pSimulation->length,g_fidtail);
+#endif /* LOGTAIL */
+
+		} /* next receiver */
+
+#ifdef LOGTAIL
+		fclose(g_fidtail);
+#endif
+	} /* next source */
+
+#ifdef LOGRAYS
+	fclose(trace.fid);
+	fclose(trace.fidrecv);
+#endif
+
+	if (nThreads > 1)
+	{
+		for (iThread=0; iThread<nThreads; iThread++)
+			FreeDepositLog(worker[iThread].log);
+		MutexDestroy(&histogramlock);
+	}
+	FreeRayGenerator(raygenerator);
+
+	/* release the memory of the ray tracing state */
+	ArenaRewind(arena, mark);
+}
+
+
+/** Simulates the specular reflections of a setup, adding them to the responses,
+ *  or, when \a arrivals is not NULL, collecting their arrivals there.
+ */
+void RoomsimSpecular(const CRoomSetup *pSetup, CRoomsimInternal *pSimulation, CImageArrivals *arrivals)
+{
+	CArenaMark mark = ArenaGetMark(&pSimulation->arena);
+	int        maxorder[3], i;
+
+	/* hybrid simulation: an image of order k along a dimension of length L 
+	   is at least (k-1) L away, skip the orders that arrive after the transition */
+	for (i=0; i<3; i++)
+	{
+		maxorder[i] = pSetup->options.reflectionorder[i];
+		if (pSimulation->transitiontime > 0)
+			maxorder[i] = MIN(maxorder[i], 1 + (int) floor((pSimulation->transitiontime + 0.5 * pSimulation->transitionwidth) 
+				* pSimulation->c / pSetup->room.dimension[i]));
+	}
+
+    if (pSetup->options.verbose)
+    {
+        MsgPrintf("Simulating specular reflections (xyz-order %d,%d,%d)...\n", 
+            maxorder[0], maxorder[1], maxorder[2]);
+        MsgRelax; /* let MATLAB process events */
+    }
+    
+	/* generate specular reflections, and release the memory of the passes */
+	SpecularImages(AllocSpecularPass(&pSimulation->arena, pSetup, pSimulation, arrivals), maxorder);
+	ArenaRewind(&pSimulation->arena, mark);
+}
+
+/** Simulates a setup, reusing the image source filters of the previous 
+ *  frame of a trajectory from \a track, if not NULL, and leaving out the
+ *  image sources below reflection order \a firstorder. */
+static BRIR *RoomsimTracked(const CRoomSetup *pSetup, CImageTrack *track, int firstorder)
+{
+	/* This structure holds the state of SFMT, a library that
+	   generates random numbers */
+	sfmt_t sfmt;
+
+	/* prepare internal room simulation data structure */
+	CRoomsimInternal *pSimulation = RoomsimInit(pSetup, &sfmt);
+	pSimulation->firstorder = firstorder;
+	if (track)
+	{
+		pSimulation->track = track;
+		BeginImageTrackFrame(track, pSimulation);
+	}
+    
+	if (pSetup->options.simulatespecular)
+		RoomsimSpecular(pSetup, pSimulation, NULL);
+
+	if (pSetup->options.simulatediffuse)
+	{
+        if (pSetup->options.verbose)
+        {
+    		MsgPrintf("Simulating diffuse reflections (%d rays)...\n", pSetup->options.numberofrays);
+            MsgRelax; /* let MATLAB process events */
+        }
+		RoomsimDiffuse(pSetup, pSimulation, &sfmt, NULL);
+	}
+
+	/* release internal data structure, return BRIR */
+	return RoomsimRelease(pSimulation);
+}
+
+BRIR *Roomsim(const CRoomSetup *pSetup)
+{
+	return RoomsimTracked(pSetup, NULL, 0);
+}
+
+/** Simulates a setup at several orientations of its receivers.
+ *
+ *	Image source arrivals and the diffuse tails do not depend on the 
+ *	orientation of the receivers: they are simulated once, and only the 
+ *	receivers' directional responses are applied per orientation. The 
+ *	diffuse energy is histogrammed in spatial bins along the room axes, 
+ *	which the receiver then sees from the orientation; at orientation 
+ *	(0,0,0), the responses equal those of Roomsim.
+ *
+ *	@param[in] pSetup		Setup, of which the receiver orientations are ignored.
+ *	@param[in] orientation	Yaw, pitch and roll of every receiver at every orientation [deg],
+ *							3 values per receiver, nReceivers*3 per orientation.
+ *	@param[in] nOrientations Number of orientations.
+ *	@param[in] callback		Receives the responses of each orientation, which are
+ *							released afterwards, or NULL to return all responses.
+ *	@param[in] arg			Argument passed to the callback.
+ *	@return					Responses of each orientation in turn, each ordered as
+ *							those of Roomsim, to be released with ReleaseBRIR, 
+ *							or NULL when passed to the callback.
+ */
+BRIR *RoomsimOrientations(const CRoomSetup *pSetup, const double *orientation, int nOrientations,
+						  CSweepCallback callback, void *arg)
+{
+	sfmt_t sfmt;
+	CRoomSetup setup = *pSetup;
+	CSensor    *receiver;
+	CImageArrivals arrivals;
+	CImageArrival  *arrival;
+	CRoomsimInternal *pSimulation;
+	CSensorResponse receiverresponse, sourceresponse;
+	CDiffuseTails tails;
+	SAMPLE *noise;
+	BRIR   *brir;
+	XYZ    direction;
+	int    nSR = pSetup->nSources * pSetup->nReceivers;
+	int    o, r, a, sr, k, iDirection, skipimage = -1, skipsource = -1;
+
+	/* simulate with receivers in their reference orientation */
+	receiver = (CSensor *) MemMalloc(pSetup->nReceivers * sizeof(CSensor));
+	for (r=0; r<pSetup->nReceivers; r++)
+	{
+		receiver[r] = pSetup->receiver[r];
+		receiver[r].orientation[0] = receiver[r].orientation[1] = receiver[r].orientation[2] = 0;
+	}
+	setup.receiver = receiver;
+	pSimulation = RoomsimInit(&setup, &sfmt);
+
+	memset(&arrivals, 0, sizeof(arrivals));
+	memset(&tails, 0, sizeof(tails));
+	arrivals.nBands = pSimulation->nBands;
+	if (setup.options.simulatespecular)
+		RoomsimSpecular(&setup, pSimulation, &arrivals);
+
+	if (setup.options.simulatediffuse)
+	{
+        if (setup.options.verbose)
+        {
+    		MsgPrintf("Simulating diffuse reflections (%d rays)...\n", setup.options.numberofrays);
+            MsgRelax; /* let MATLAB process events */
+        }
+		tails.noise     = (SAMPLE **) ArenaCalloc(&pSimulation->arena, nSR * pSimulation->nDirections, sizeof(SAMPLE *));
+		tails.gridnoise = (SAMPLE **) ArenaCalloc(&pSimulation->arena, nSR, sizeof(SAMPLE *));
+		tails.share     = (double **) ArenaCalloc(&pSimulation->arena, nSR * pSimulation->nDirections, sizeof(double *));
+		RoomsimDiffuse(&setup, pSimulation, &sfmt, &tails);
+	}
+
+	brir = callback ? NULL : (BRIR *) MemCalloc((size_t) nOrientations * nSR + 1, sizeof(BRIR));
+	for (o=0; o<nOrientations; o++)
+	{
+        if (setup.options.verbose)
+        {
+    		MsgPrintf("Rendering receiver orientation %d of %d...\n", o+1, nOrientations);
+            MsgRelax;
+        }
+
+		/* orient receivers */
+		for (r=0; r<pSetup->nReceivers; r++)
+		{
+			memcpy(receiver[r].orientation, &orientation[3 * ((size_t) o * pSetup->nReceivers + r)], 3 * sizeof(double));
+			ComputeRoom2SensorYPRT((YPR *)receiver[r].orientation, (YPRT *)&pSimulation->receiver[r].r2s_yprt);
+			ComputeSensor2RoomYPRT((YPR *)receiver[r].orientation, (YPRT *)&pSimulation->receiver[r].s2r_yprt);
+		}
+		if (o > 0)
+			AllocBRIR(&setup, pSimulation);
+
+		/* render image source arrivals; as in SpecularRender, a receiver without 
+		   response skips the remaining receivers of that image and source */
+		for (a=0; a<arrivals.nArrivals; a++)
+		{
+			arrival = &arrivals.arrival[a];
+			if (arrival->image == skipimage && arrival->si == skipsource)
+				continue;
+			memcpy(pSimulation->attenuation, &arrivals.attenuation[(size_t) a * arrivals.nBands], arrivals.nBands * sizeof(double));
+			if (arrival->sourceimpulse)
+			{
+				/* probe the source again, its response buffer is shared by all arrivals */
+				sourceresponse.buffer = pSimulation->source[arrival->si].response;
+				SensorGetResponse(pSimulation->source[arrival->si].definition, &arrival->sourcedirection, &sourceresponse);
+				arrival->sourceimpulse = sourceresponse.data.impulseresponse;
+			}
+			if (!RenderImageArrival(pSimulation, arrival))
+			{
+				skipimage  = arrival->image;
+				skipsource = arrival->si;
+			}
+		}
+
+		/* render diffuse tails, seen from the receiver orientation */
+		for (sr=0; tails.noise && sr<nSR; sr++)
+		{
+			r = sr / pSetup->nSources;
+			for (iDirection=0; iDirection<pSimulation->nDirections; iDirection++)
+			{
+				k = sr * pSimulation->nDirections + iDirection;
+				if (!tails.noise[k] && !tails.share[k])
+					continue;
+				YawPitchRoll(&pSimulation->directioncenter[iDirection], &pSimulation->receiver[r].r2s_yprt, &direction);
+				receiverresponse.buffer   = pSimulation->receiver[r].response;
+				receiverresponse.distance = 0;	/* plane wave */
+				if (!SensorGetResponse(pSimulation->receiver[r].definition, &direction, &receiverresponse))
+					continue;
+				noise = tails.noise[k];
+				if (tails.share[k])
+				{
+					WeightDiffuseNoise(&setup, pSimulation, r, tails.share[k], tails.gridnoise[sr], pSimulation->gridnoise);
+					noise = pSimulation->gridnoise;
+				}
+				AddDirectionalNoise(&setup, pSimulation, r, sr, &receiverresponse, noise);
+			}
+		}
+
+		/* pass responses of this orientation on, or move them to the result */
+		FinalizeBRIR(pSimulation);
+		if (callback)
+		{
+			callback(o, &setup, pSimulation->brir, arg);
+			ReleaseBRIR(pSimulation->brir);
+		}
+		else
+		{
+			memcpy(&brir[(size_t) o * nSR], pSimulation->brir, nSR * sizeof(BRIR));
+			MemFree(pSimulation->brir);
+		}
+		pSimulation->brir = NULL;
+	}
 
-						/* double length to account for second channel */
-						length *= 2;
-					}
-				}
+	if (arrivals.maxArrivals > 0)
+	{
+		MemFree(arrivals.arrival);
+		MemFree(arrivals.attenuation);
+	}
+	for (k=0; tails.noise && k<nSR*pSimulation->nDirections; k++)
+	{
+		if (tails.noise[k])
+			MemFree(tails.noise[k]);
+		if (tails.share[k])
+			MemFree(tails.share[k]);
+		if (k < nSR && tails.gridnoise[k])
+			MemFree(tails.gridnoise[k]);
+	}
+	MemFree(receiver);
 
-#ifdef LOGTAIL
-				fwrite(&length,sizeof(length),1,fidtail);
-				fwrite(pSimulation->directionalshapednoise,sizeof(pSimulation->directionalshapednoise[0]),length,fidtail);
-#endif /* LOGTAIL */
+	pSimulation->brir = brir;
+	RoomsimRelease(pSimulation);
+	return brir;
+}
 
-				/* add directional shaped noise signal to (B)RIR */
-				for (i=0; i<length; i++)
-					pSimulation->brir[SRidx].sample[i] += pSimulation->directionalshapednoise[i];
+/** Loads the sources and receivers of a setup and prepares their simulation 
+ *  weights, or returns -1 with the reason in \a error if a sensor fails to load
+ *  or cannot be simulated.
+ */
+static int PrepareSensors(const CRoomSetup *pSetup, char *error)
+{
+	CRoomsimInternal  simulation;
+	CSensorDefinition *pSensor;
+	int i, result = 0;
 
-			} /* next direction */
+	memset(&simulation, 0, sizeof(simulation));
+	ArenaInit(&simulation.arena, 0);
+	simulation.fs = pSetup->options.fs;
+	ComputeBandFrequencies(pSetup, &simulation);
 
-#ifdef LOGTAIL
-			fwrite(pSimulation->brir[SRidx].sample,sizeof(pSimulation->brir[SRidx].sample[0]),length,fidtail);
-#endif /* LOGTAIL */
+	for (i=0; result == 0 && i<pSetup->nSources; i++)
+	{
+		if (!(pSensor = TryLoadSensor(pSetup->source[i].description, pSetup->options.fs, error)))
+			result = -1;
+		else if ((result = CheckSensor(pSensor, pSetup->source[i].description, 1, pSetup->options.fs, error)) == 0)
+			InitSimulationWeights(&simulation, pSensor);
+	}
+	for (i=0; result == 0 && i<pSetup->nReceivers; i++)
+	{
+		if (!(pSensor = TryLoadSensor(pSetup->receiver[i].description, pSetup->options.fs, error)))
+			result = -1;
+		else if ((result = CheckSensor(pSensor, pSetup->receiver[i].description, 0, pSetup->options.fs, error)) == 0)
+			InitReceiverWeights(&simulation, pSensor);
+	}
 
-		} /* next receiver */
+	ArenaRelease(&simulation.arena);
+	return result;
+}
 
-#ifdef LOGTAIL
-	fclose(fidtail);
+/** Loads the sources and receivers of a setup and prepares their simulation 
+ *  weights. Simulations of setups with the same sensors and sampling rate
+ *  then only read the shared sensor definitions, and can run concurrently.
+ */
+void RoomsimPrepareSensors(const CRoomSetup *pSetup)
+{
+	char error[256];
+
+	if (PrepareSensors(pSetup, error) < 0)
+		MsgErrorExit(error);
+}
+
+/* The sensor cache is shared by concurrent simulations of independent setups.
+   Simulations only read prepared sensors; loading sensors or changing their
+   weights for other frequency bands waits until no simulation uses them. */
+static CMutex     g_sensorgate    = MUTEX_INITIALIZER;
+static CCondition g_sensoridle    = CONDITION_INITIALIZER;
+static int        g_nSensorUsers  = 0;	/**< Number of simulations using the sensor cache. */
+static int        g_nSensorWaits  = 0;	/**< Number of setups waiting to prepare sensors. */
+
+/** Returns nonzero if all sensors of a setup are loaded and prepared for its frequency bands. */
+static int SensorsPrepared(const CRoomSetup *pSetup)
+{
+	CRoomsimInternal  simulation;
+	CSensorDefinition *pSensor;
+	int i, prepared = 1;
+
+	memset(&simulation, 0, sizeof(simulation));
+	ArenaInit(&simulation.arena, 0);
+	simulation.fs = pSetup->options.fs;
+	ComputeBandFrequencies(pSetup, &simulation);
+
+	for (i=0; prepared && i<pSetup->nSources + pSetup->nReceivers; i++)
+	{
+		if (i < pSetup->nSources)
+			pSensor = FindLoadedSensor(pSetup->source[i].description, pSetup->options.fs);
+		else
+			pSensor = FindLoadedSensor(pSetup->receiver[i - pSetup->nSources].description, pSetup->options.fs);
+
+		if (!pSensor)
+			prepared = 0;
+		else if (i >= pSetup->nSources && pSensor->type == ST_IMPULSERESPONSE)
+			prepared = pSensor->nSimulationBands == -1;
+		else
+			prepared = SimulationWeightsValid(&simulation, pSensor);
+	}
+
+	ArenaRelease(&simulation.arena);
+	return prepared;
+}
+
+/** Prepares the sensors of a setup for a simulation that runs concurrently
+ *  with simulations of other setups, and marks them in use until
+ *  RoomsimReleaseSensors. Not available in MEX builds.
+ *
+ *	@param[in]  pSetup	Setup to simulate.
+ *	@param[out] error	Reason of failure, at least 256 characters.
+ *	@return				0 if the sensors are in use, or -1 if a sensor fails 
+ *						to load or cannot be simulated; they are not in use then.
+ */
+int RoomsimAcquireSensors(const CRoomSetup *pSetup, char *error)
+{
+	CSensorDefinition *pSensor;
+	int prepared, result = 0, i;
+
+	MutexLock(&g_sensorgate);
+	for (;;)
+	{
+		prepared = SensorsPrepared(pSetup);
+
+		/* share prepared sensors, unless setups wait to prepare theirs */
+		if (prepared && g_nSensorWaits == 0)
+			break;
+
+		/* prepare sensors when no simulation uses them */
+		if (!prepared && g_nSensorUsers == 0)
+		{
+			result = PrepareSensors(pSetup, error);
+			ConditionBroadcast(&g_sensoridle);
+			break;
+		}
+
+		if (!prepared)
+			g_nSensorWaits++;
+		ConditionWait(&g_sensoridle, &g_sensorgate);
+		if (!prepared && --g_nSensorWaits == 0)
+			ConditionBroadcast(&g_sensoridle);
+	}
+
+	/* sensors prepared for another setup may not suit the sampling frequency of this one */
+	for (i=0; result == 0 && i<pSetup->nSources + pSetup->nReceivers; i++)
+	{
+		if (i < pSetup->nSources)
+		{
+			pSensor = FindLoadedSensor(pSetup->source[i].description, pSetup->options.fs);
+			result  = CheckSensor(pSensor, pSetup->source[i].description, 1, pSetup->options.fs, error);
+		}
+		else
+		{
+			pSensor = FindLoadedSensor(pSetup->receiver[i - pSetup->nSources].description, pSetup->options.fs);
+			result  = CheckSensor(pSensor, pSetup->receiver[i - pSetup->nSources].description, 0, pSetup->options.fs, error);
+		}
+	}
+	if (result == 0)
+		g_nSensorUsers++;
+	MutexUnlock(&g_sensorgate);
+	return result;
+}
+
+/** Ends the use of sensors acquired with RoomsimAcquireSensors. */
+void RoomsimReleaseSensors(void)
+{
+	MutexLock(&g_sensorgate);
+	if (--g_nSensorUsers == 0)
+		ConditionBroadcast(&g_sensoridle);
+	MutexUnlock(&g_sensorgate);
+}
+
+/** Shared state of a sweep. */
+typedef struct {
+	const CRoomSetup  *pSetup;
+	const CSweepTable *table;
+	CSweepCallback    callback;
+	void              *arg;
+	CRoomSetup        *setups;		/**< Per-thread copies of the setup. */
+	CSensor           *sensors;		/**< Per-thread sources and receivers. */
+	volatile long     next;			/**< Number of configurations taken. */
+	CMutex            lock;			/**< Serializes callbacks. */
+} CSweep;
+
+static void RoomsimSweepWorker(int iThread, void *arg)
+{
+	CSweep     *sweep  = (CSweep *) arg;
+	CRoomSetup *pSetup = &sweep->setups[iThread];
+	int        nSensors = pSetup->nSources + pSetup->nReceivers;
+	CSensor    *sensors = &sweep->sensors[iThread * nSensors];
+	const double *pose;
+	BRIR       *brir;
+	long       i;
+	int        s;
+
+	while ((i = AtomicIncrement(&sweep->next) - 1) < sweep->table->nConfigs)
+	{
+		/* set sensor locations and orientations of this configuration */
+		pose = &sweep->table->pose[(size_t) i * sweep->table->nCols];
+		for (s=0; s<nSensors; s++, pose+=6)
+		{
+			memcpy(sensors[s].location,    &pose[0], 3 * sizeof(double));
+			memcpy(sensors[s].orientation, &pose[3], 3 * sizeof(double));
+		}
+
+		brir = Roomsim(pSetup);
+
+		MutexLock(&sweep->lock);
+		sweep->callback((int) i, pSetup, brir, sweep->arg);
+		MutexUnlock(&sweep->lock);
+
+		ReleaseBRIR(brir);
+	}
+}
+
+/** Simulates a sweep whose configurations differ in receiver orientations 
+ *  only, rendering them from a single simulation with RoomsimOrientations.
+ *  Returns 0, without simulating, if the configurations differ otherwise.
+ */
+static int RoomsimOrientationSweep(const CRoomSetup *pSetup, const CSweepTable *table, CSweepCallback callback, void *arg)
+{
+	int    nSensors = pSetup->nSources + pSetup->nReceivers;
+	const double *first = table->pose, *pose;
+	double *orientation;
+	CRoomSetup setup = *pSetup;
+	CSensor    *sensors;
+	int    i, s, k;
+
+	if (table->nConfigs < 2)
+		return 0;
+	for (i=1; i<table->nConfigs; i++)
+	{
+		pose = &table->pose[(size_t) i * table->nCols];
+		for (s=0; s<nSensors; s++)
+			for (k=0; k<6; k++)
+				if ((s < pSetup->nSources || k < 3) && pose[6*s+k] != first[6*s+k])
+					return 0;
 	}
+
+	/* sensor poses of the first configuration, receiver orientations of all */
+	sensors     = (CSensor *) MemMalloc(nSensors * sizeof(CSensor));
+	orientation = (double *) MemMalloc((size_t) table->nConfigs * pSetup->nReceivers * 3 * sizeof(double));
+	for (s=0; s<nSensors; s++)
+	{
+		sensors[s] = s < pSetup->nSources ? pSetup->source[s] : pSetup->receiver[s - pSetup->nSources];
+		memcpy(sensors[s].location,    &first[6*s],   3 * sizeof(double));
+		memcpy(sensors[s].orientation, &first[6*s+3], 3 * sizeof(double));
+	}
+	for (i=0; i<table->nConfigs; i++)
+		for (s=0; s<pSetup->nReceivers; s++)
+			memcpy(&orientation[3 * ((size_t) i * pSetup->nReceivers + s)], 
+				&table->pose[(size_t) i * table->nCols + 6 * (pSetup->nSources + s) + 3], 3 * sizeof(double));
+	setup.source   = sensors;
+	setup.receiver = sensors + pSetup->nSources;
+
+	if (pSetup->options.verbose)
+		MsgPrintf("Configurations differ in receiver orientations only, simulating once...\n");
+	RoomsimOrientations(&setup, orientation, table->nConfigs, callback, arg);
+
+	MemFree(orientation);
+	MemFree(sensors);
+	return 1;
+}
+
+/** Simulates every configuration of a sweep table.
+ *
+ *	The setup is simulated once per row of the table, with the locations and
+ *	orientations of its sources and receivers taken from that row. Sensors
+ *	are loaded once, and configurations are distributed over
+ *	options.numberofthreads threads; each simulation itself then runs on a
+ *	single thread. Results are passed to the callback as they complete.
+ *	When the configurations differ in receiver orientations only, they are
+ *	rendered from a single simulation instead, see RoomsimOrientations.
+ *
+ *	@param[in] pSetup	Setup, of which all but the sensor poses are used.
+ *	@param[in] table	Sweep table, with 6 values per source and receiver.
+ *	@param[in] callback	Receives the responses of each configuration.
+ *	@param[in] arg		Argument passed to the callback.
+ */
+void RoomsimSweep(const CRoomSetup *pSetup, const CSweepTable *table, CSweepCallback callback, void *arg)
+{
+	CSweep sweep;
+	int    nSensors = pSetup->nSources + pSetup->nReceivers;
+	int    nThreads, t, s;
+
+	if (table->nCols != 6 * nSensors)
+		MsgErrorExit("sweep table does not match number of sources and receivers");
+
+	if (RoomsimOrientationSweep(pSetup, table, callback, arg))
+		return;
+
+	/* load sensors and prepare their weights before simulations share them */
+	RoomsimPrepareSensors(pSetup);
+
+#ifdef MEX
+	/* simulations allocate memory, which the MATLAB API only allows on the main thread */
+	nThreads = 1;
+#else
+	nThreads = ThreadCount(pSetup->options.numberofthreads);
+	if (nThreads > table->nConfigs)
+		nThreads = table->nConfigs;
 #endif
-	} /* next source */
 
-#ifdef LOGRAYS
-	fclose(fid);
-	fclose(fidrecv);
+	sweep.pSetup   = pSetup;
+	sweep.table    = table;
+	sweep.callback = callback;
+	sweep.arg      = arg;
+	sweep.next     = 0;
+	sweep.setups   = (CRoomSetup *) MemMalloc(nThreads * sizeof(CRoomSetup));
+	sweep.sensors  = (CSensor *) MemMalloc(nThreads * nSensors * sizeof(CSensor));
+	MutexInit(&sweep.lock);
+
+	for (t=0; t<nThreads; t++)
+	{
+		CRoomSetup *setup   = &sweep.setups[t];
+		CSensor    *sensors = &sweep.sensors[t * nSensors];
+
+		for (s=0; s<pSetup->nSources; s++)
+			sensors[s] = pSetup->source[s];
+		for (s=0; s<pSetup->nReceivers; s++)
+			sensors[pSetup->nSources + s] = pSetup->receiver[s];
+
+		*setup = *pSetup;
+		setup->source   = sensors;
+		setup->receiver = sensors + pSetup->nSources;
+		if (nThreads > 1)
+		{
+			/* parallelize over configurations, not within simulations */
+			setup->options.numberofthreads = 1;
+			setup->options.verbose         = false;
+		}
+	}
+
+	ThreadRun(nThreads, RoomsimSweepWorker, &sweep);
+
+	MutexDestroy(&sweep.lock);
+	MemFree(sweep.sensors);
+	MemFree(sweep.setups);
+}
+
+/** Shared state of a trajectory simulation. */
+typedef struct {
+	const CSweepTable *frames;
+	CSweepCallback    callback;
+	void              *arg;
+	int               nThreads;
+	CRoomSetup        *setups;		/**< Per-thread copies of the setup. */
+	CSensor           *sensors;		/**< Per-thread sources and receivers. */
+	CImageTrack       *tracks;		/**< Per-thread image source filters. */
+	CMutex            lock;			/**< Serializes callbacks. */
+} CTrajectory;
+
+static void RoomsimTrajectoryWorker(int iThread, void *arg)
+{
+	CTrajectory *trajectory = (CTrajectory *) arg;
+	CRoomSetup  *pSetup  = &trajectory->setups[iThread];
+	int         nSensors = pSetup->nSources + pSetup->nReceivers;
+	CSensor     *sensors = &trajectory->sensors[iThread * nSensors];
+	int         nFrames  = trajectory->frames->nConfigs;
+	const double *pose;
+	BRIR        *brir;
+	int         i, s, first, last;
+
+	/* every thread follows a contiguous part of the trajectory, frame by frame */
+	first = (int) ((long long) nFrames * iThread / trajectory->nThreads);
+	last  = (int) ((long long) nFrames * (iThread + 1) / trajectory->nThreads);
+	for (i=first; i<last; i++)
+	{
+		/* set sensor locations and orientations of this frame, after its time */
+		pose = &trajectory->frames->pose[(size_t) i * trajectory->frames->nCols + 1];
+		for (s=0; s<nSensors; s++, pose+=6)
+		{
+			memcpy(sensors[s].location,    &pose[0], 3 * sizeof(double));
+			memcpy(sensors[s].orientation, &pose[3], 3 * sizeof(double));
+		}
+
+		brir = RoomsimTracked(pSetup, &trajectory->tracks[iThread], 0);
+
+		MutexLock(&trajectory->lock);
+		trajectory->callback(i, pSetup, brir, trajectory->arg);
+		MutexUnlock(&trajectory->lock);
+
+		ReleaseBRIR(brir);
+	}
+}
+
+/** Simulates the frames of a trajectory.
+ *
+ *	Each frame is simulated with the locations and orientations of the 
+ *	sources and receivers at its time, as with RoomsimSweep. Images are
+ *	tracked from frame to frame: the filter of an image whose attenuation
+ *	changed by at most options.trajectorytolerancedB since the filter was
+ *	designed is reused, placed at the delay of the current frame. The
+ *	frames are divided into as many contiguous parts as there are threads,
+ *	options.numberofthreads, each followed frame by frame on one thread.
+ *	Results are passed to the callback as they complete.
+ *
+ *	@param[in] pSetup	Setup, of which all but the sensor poses are used.
+ *	@param[in] frames	Trajectory, with the time of each frame followed by 
+ *						6 values per source and receiver, see ResampleTrajectory.
+ *	@param[in] callback	Receives the responses of each frame.
+ *	@param[in] arg		Argument passed to the callback.
+ */
+void RoomsimTrajectory(const CRoomSetup *pSetup, const CSweepTable *frames, CSweepCallback callback, void *arg)
+{
+	CTrajectory trajectory;
+	int    nSensors = pSetup->nSources + pSetup->nReceivers;
+	long   nDesigned = 0, nReused = 0;
+	int    nThreads, t, s;
+
+	if (frames->nCols != 1 + 6 * nSensors)
+		MsgErrorExit("trajectory does not match number of sources and receivers");
+
+	/* load sensors and prepare their weights before simulations share them */
+	RoomsimPrepareSensors(pSetup);
+
+#ifdef MEX
+	/* simulations allocate memory, which the MATLAB API only allows on the main thread */
+	nThreads = 1;
+#else
+	nThreads = ThreadCount(pSetup->options.numberofthreads);
+	if (nThreads > frames->nConfigs)
+		nThreads = frames->nConfigs;
 #endif
 
-	MemFree(ray);
+	trajectory.frames   = frames;
+	trajectory.callback = callback;
+	trajectory.arg      = arg;
+	trajectory.nThreads = nThreads;
+	trajectory.setups   = (CRoomSetup *) MemMalloc(nThreads * sizeof(CRoomSetup));
+	trajectory.sensors  = (CSensor *) MemMalloc(nThreads * nSensors * sizeof(CSensor));
+	trajectory.tracks   = (CImageTrack *) MemCalloc(nThreads, sizeof(CImageTrack));
+	MutexInit(&trajectory.lock);
+
+	for (t=0; t<nThreads; t++)
+	{
+		CRoomSetup *setup   = &trajectory.setups[t];
+		CSensor    *sensors = &trajectory.sensors[t * nSensors];
+
+		for (s=0; s<pSetup->nSources; s++)
+			sensors[s] = pSetup->source[s];
+		for (s=0; s<pSetup->nReceivers; s++)
+			sensors[pSetup->nSources + s] = pSetup->receiver[s];
+
+		*setup = *pSetup;
+		setup->source   = sensors;
+		setup->receiver = sensors + pSetup->nSources;
+		if (nThreads > 1)
+		{
+			/* parallelize over frames, not within simulations */
+			setup->options.numberofthreads = 1;
+			setup->options.verbose         = false;
+		}
+
+		/* tolerance in dB of magnitude, attenuations are natural logarithms */
+		trajectory.tracks[t].tolerance = pSetup->options.trajectorytolerancedB * log(10.0) / 20;
+	}
+
+	ThreadRun(nThreads, RoomsimTrajectoryWorker, &trajectory);
+
+	for (t=0; t<nThreads; t++)
+	{
+		nDesigned += trajectory.tracks[t].nDesigned;
+		nReused   += trajectory.tracks[t].nReused;
+		FreeImageFilters(&trajectory.tracks[t].frame[0]);
+		FreeImageFilters(&trajectory.tracks[t].frame[1]);
+	}
+	if (pSetup->options.verbose && nDesigned + nReused > 0)
+		MsgPrintf("Trajectory: %ld of %ld image source filters reused from the previous frame\n", 
+			nReused, nDesigned + nReused);
+
+	MutexDestroy(&trajectory.lock);
+	MemFree(trajectory.tracks);
+	MemFree(trajectory.sensors);
+	MemFree(trajectory.setups);
 }
 
+#define REALTIME_FRESH	4			/**< Mailbox flag of an update not yet taken by the audio thread. */
 
-BRIR *Roomsim(const CRoomSetup *pSetup)
+/** Image source parameters of a real-time update. Every virtual room, 
+ *  source and receiver has a slot, (image-1)*nSR + ri*nSources + si. */
+typedef struct {
+	double *delay;					/**< Delay of each slot [samples]. */
+	double *gain;					/**< Band gains of each slot, nBands per channel of its receiver. */
+	char   *active;					/**< Nonzero for the slots of arriving images. */
+} CRealtimeParams;
+
+/** Real-time renderer. */
+struct CRealtime {
+	/* control thread */
+	CRoomSetup       setup;			/**< Copy of the setup, with the current receiver poses. */
+	CSensor          *receiver;		/**< Receivers of the setup copy. */
+	CRoomsimInternal *simulation;	/**< Simulation of the image sources. */
+	CImageArrivals   arrivals;		/**< Image source arrivals of an update, preallocated. */
+	CSpecularPass    *specular;		/**< Specular stage collecting the arrivals. */
+	int              maxorder[3];	/**< Reflection orders of the image sources. */
+	int              nImages;		/**< Number of arriving images of the last update. */
+	int              write;			/**< Parameters being written by the control thread. */
+
+	/* shared */
+	CRealtimeParams  params[3];		/**< Parameters passed between the threads, as a triple buffer. */
+	volatile long    mailbox;		/**< Latest complete parameters, with REALTIME_FRESH until taken. */
+	int    blocksize, nSources, nReceivers, nBands;
+	int    nSlots;					/**< Number of image source slots. */
+	int    stride;					/**< Number of gains per slot. */
+	int    *channel;				/**< First output channel of each receiver, and the number of channels. */
+	int    latency;					/**< Delay of the band-splitting filters [samples]. */
+
+	/* audio thread */
+	int              read;			/**< Parameters taken by the audio thread. */
+	CRealtimeParams  current;		/**< Parameters at the end of the previous block. */
+	CPartitionedConv *bank;			/**< Band-splitting filters of every source. */
+	CPartitionedConv **tail;		/**< Diffuse tail of each receiver, or NULL. */
+	double           *bands;		/**< Band signals of a block, per source and band. */
+	double           *line;			/**< Delay line of each band of each source. */
+	int              linemask;		/**< Length of the delay lines, a power of 2, minus 1. */
+	long long        written;		/**< Number of samples written to the delay lines. */
+	double           *g, *dg, *s;	/**< Gains of a slot and their increments per sample, and band samples. */
+};
+
+static void CountVirtualRoom(const CRoomCallbackArg *arg)
 {
-	/* This structure holds the state of SFMT, a library that
-	   generates random numbers */
-	sfmt_t sfmt;
+	(void) arg;
+}
 
-	/* prepare internal room simulation data structure */
-	CRoomsimInternal *pSimulation = RoomsimInit(pSetup, &sfmt);
-    
-	if (pSetup->options.simulatespecular)
+static void AllocRealtimeParams(CRealtimeParams *p, int nSlots, int stride)
+{
+	p->delay  = (double *) MemCalloc(nSlots + 1, sizeof(double));
+	p->gain   = (double *) MemCalloc((size_t) nSlots * stride + 1, sizeof(double));
+	p->active = (char *) MemCalloc(nSlots + 1, sizeof(char));
+}
+
+static void FreeRealtimeParams(CRealtimeParams *p)
+{
+	MemFree(p->delay);
+	MemFree(p->gain);
+	MemFree(p->active);
+}
+
+/** Computes the image sources at the current receiver poses and passes 
+ *  them to the audio thread. Runs on the control thread, without allocating. */
+static void RealtimeUpdate(CRealtime *rt)
+{
+	CRoomsimInternal *pSimulation = rt->simulation;
+	CRealtimeParams  *p = &rt->params[rt->write];
+	CSensorResponse  response;
+	CImageArrival    *arrival;
+	XYZ              xyz;
+	double           *gain, g;
+	int              nSR = rt->nSources * rt->nReceivers;
+	int              a, b, c, ri, slot, nChannels, skipimage = -1, skipsource = -1;
+
+	rt->arrivals.nArrivals = 0;
+	SpecularImages(rt->specular, rt->maxorder);
+
+	memset(p->active, 0, rt->nSlots);
+	rt->nImages = 0;
+	for (a=0; a<rt->arrivals.nArrivals; a++)
 	{
-        if (pSetup->options.verbose)
-        {
-            MsgPrintf("Simulating specular reflections (xyz-order %d,%d,%d)...\n", 
-                pSetup->options.reflectionorder[0],
-                pSetup->options.reflectionorder[1],
-                pSetup->options.reflectionorder[2]);
-            MsgRelax; /* let MATLAB process events */
-        }
-        
-		/* generate specular reflections */
-		EnumerateVirtualRooms(pSetup, pSimulation,
-				pSetup->options.reflectionorder[0],
-				pSetup->options.reflectionorder[1],
-				pSetup->options.reflectionorder[2],
-				roomcallback);
+		/* as in SpecularRender, a receiver without response skips the 
+		   remaining receivers of that image and source */
+		arrival = &rt->arrivals.arrival[a];
+		ri      = arrival->ri;
+		if (arrival->image == skipimage && arrival->si == skipsource)
+			continue;
+		memcpy(pSimulation->attenuation, &rt->arrivals.attenuation[(size_t) a * rt->nBands], rt->nBands * sizeof(double));
+
+		/* directional response of the receiver, as in RenderImageArrival */
+		YawPitchRoll(&arrival->direction, &pSimulation->receiver[ri].r2s_yprt, &xyz);
+		response.buffer   = pSimulation->receiver[ri].response;
+		response.distance = sqrt(arrival->direction.x*arrival->direction.x + arrival->direction.y*arrival->direction.y 
+			+ arrival->direction.z*arrival->direction.z);
+		if (!SensorGetResponse(pSimulation->receiver[ri].definition, &xyz, &response))
+		{
+			skipimage  = arrival->image;
+			skipsource = arrival->si;
+			continue;
+		}
+		if (response.type == SR_LOGGAIN)
+			for (b=0; b<rt->nBands; b++)
+				pSimulation->attenuation[b] += response.data.loggain;
+		else if (response.type == SR_LOGWEIGHTS)
+			for (b=0; b<rt->nBands; b++)
+				pSimulation->attenuation[b] += response.data.logweights[b];
+
+		/* band gains per channel; signed gains encode the response into every channel */
+		slot      = (arrival->image - 1) * nSR + ri * rt->nSources + arrival->si;
+		gain      = &p->gain[(size_t) slot * rt->stride];
+		nChannels = rt->channel[ri+1] - rt->channel[ri];
+		for (c=0; c<nChannels; c++)
+		{
+			g = response.type == SR_GAINS ? response.data.gains[c] : 1.0;
+			for (b=0; b<rt->nBands; b++)
+				gain[c * rt->nBands + b] = g * exp(pSimulation->attenuation[b]);
+		}
+		p->delay[slot]  = response.distance / pSimulation->csample;
+		p->active[slot] = 1;
+		rt->nImages++;
 	}
 
-	if (pSetup->options.simulatediffuse)
+	/* publish the update, and write the next one where the audio thread left off */
+	rt->write = (int) (AtomicExchange(&rt->mailbox, rt->write | REALTIME_FRESH) & 3);
+}
+
+/** Creates a real-time renderer of a setup.
+ *
+ *	The image sources up to reflection order \a maxorder (and at most
+ *	options.reflectionorder) follow the receivers as they move; the other 
+ *	image sources and the diffuse reflections, as far as the setup 
+ *	simulates them, form the diffuse tail of the initial receiver poses.
+ *	Sources must have a gain or band weights per direction, and receivers 
+ *	as well, or signed gains per channel, such as ambisonics receivers.
+ *
+ *	@param[in] pSetup		Setup, of which the receivers can move.
+ *	@param[in] blocksize	Number of samples per block; powers of 2 are fastest.
+ *	@param[in] maxorder		Maximum reflection order of the moving image sources.
+ *	@return					Renderer, to be released with RealtimeFree.
+ */
+CRealtime *RealtimeInit(const CRoomSetup *pSetup, int blocksize, int maxorder)
+{
+	CRealtime        *rt;
+	CRoomsimInternal *pSimulation;
+	sfmt_t           sfmt;
+	BRIR             *tail;
+	double           *h;
+	SAMPLE           *hs;
+	char             msg[256];
+	int              nSR = pSetup->nSources * pSetup->nReceivers, maxChannels = 1;
+	int              i, si, ri, b, k, length, hlen;
+
+	if (blocksize < 1 || maxorder < 0)
+		MsgErrorExit("invalid block size or reflection order of real-time renderer");
+
+	rt = (CRealtime *) MemCalloc(1, sizeof(CRealtime));
+	rt->blocksize  = blocksize;
+	rt->nSources   = pSetup->nSources;
+	rt->nReceivers = pSetup->nReceivers;
+	rt->setup      = *pSetup;
+	rt->receiver   = (CSensor *) MemMalloc(pSetup->nReceivers * sizeof(CSensor));
+	memcpy(rt->receiver, pSetup->receiver, pSetup->nReceivers * sizeof(CSensor));
+	rt->setup.receiver = rt->receiver;
+	for (i=0; i<3; i++)
+		rt->maxorder[i] = pSetup->options.simulatespecular ? MIN(pSetup->options.reflectionorder[i], maxorder) : -1;
+
+	/* simulation of the image sources, which must have gains per band */
+	pSimulation = rt->simulation = RoomsimInit(&rt->setup, &sfmt);
+	for (si=0; si<rt->nSources; si++)
 	{
-        if (pSetup->options.verbose)
-        {
-    		MsgPrintf("Simulating diffuse reflections (%d rays)...\n", pSetup->options.numberofrays);
-            MsgRelax; /* let MATLAB process events */
-        }
-		RoomsimDiffuse(pSetup, pSimulation, &sfmt);
+		if (pSimulation->source[si].definition->type != ST_LOGGAIN && pSimulation->source[si].definition->type != ST_LOGWEIGHTS)
+		{
+			sprintf(msg, "source '%.200s' cannot be rendered in real time", pSetup->source[si].description);
+			MsgErrorExit(msg);
+		}
+	}
+	rt->channel = (int *) MemMalloc((rt->nReceivers + 1) * sizeof(int));
+	rt->channel[0] = 0;
+	for (ri=0; ri<rt->nReceivers; ri++)
+	{
+		switch (pSimulation->receiver[ri].definition->type)
+		{
+		case ST_LOGGAIN:
+		case ST_LOGWEIGHTS:
+			rt->channel[ri+1] = rt->channel[ri] + 1;
+			break;
+		case ST_GAINS:
+			rt->channel[ri+1] = rt->channel[ri] + pSimulation->receiver[ri].definition->nChannels;
+			break;
+		default:
+			sprintf(msg, "receiver '%.200s' cannot be rendered in real time", pSetup->receiver[ri].description);
+			MsgErrorExit(msg);
+		}
+		maxChannels = MAX(maxChannels, rt->channel[ri+1] - rt->channel[ri]);
 	}
 
-	/* release internal data structure, return BRIR */
-	return RoomsimRelease(pSimulation);
+	/* one slot per virtual room, source and receiver, and room for all their arrivals */
+	rt->nBands = pSimulation->nBands;
+	rt->stride = maxChannels * rt->nBands;
+	rt->nSlots = nSR * EnumerateVirtualRooms(&rt->setup, pSimulation, rt->maxorder[0], rt->maxorder[1], rt->maxorder[2], 
+		CountVirtualRoom, NULL);
+	for (i=0; i<3; i++)
+		AllocRealtimeParams(&rt->params[i], rt->nSlots, rt->stride);
+	AllocRealtimeParams(&rt->current, rt->nSlots, rt->stride);
+	rt->arrivals.nBands      = rt->nBands;
+	rt->arrivals.maxArrivals = rt->nSlots;
+	rt->arrivals.arrival     = (CImageArrival *) MemMalloc((rt->nSlots + 1) * sizeof(CImageArrival));
+	rt->arrivals.attenuation = (double *) MemMalloc(((size_t) rt->nSlots + 1) * rt->nBands * sizeof(double));
+	rt->specular = AllocSpecularPass(&pSimulation->arena, &rt->setup, pSimulation, &rt->arrivals);
+
+	/* band-splitting filters of each source, whose delay of at most 10 ms is the latency of the renderer */
+	length      = BandSplitFilterLength(pSimulation->frequency, rt->nBands, pSimulation->fs, 2 * ROUND(0.01 * pSimulation->fs) + 1);
+	rt->latency = (length - 1) / 2;
+	h  = (double *) MemMalloc((size_t) rt->nBands * length * sizeof(double));
+	hs = (SAMPLE *) MemMalloc(length * sizeof(SAMPLE));
+	BandSplitFilters(pSimulation->frequency, rt->nBands, pSimulation->fs, length, h);
+	rt->bank = AllocPartitionedConv(blocksize, rt->nSources, rt->nSources * rt->nBands, length);
+	for (si=0; si<rt->nSources; si++)
+		for (b=0; b<rt->nBands; b++)
+		{
+			for (k=0; k<length; k++)
+				hs[k] = (SAMPLE) h[(size_t) b * length + k];
+			SetPartitionedConvFilter(rt->bank, si, si * rt->nBands + b, hs, length, 0);
+		}
+	MemFree(hs);
+	MemFree(h);
+
+	/* delay lines reach back to the end of the responses */
+	for (k=1; k < pSimulation->length + 2 * blocksize + 2; k*=2)
+		;
+	rt->linemask = k - 1;
+	rt->line  = (double *) MemCalloc((size_t) rt->nSources * rt->nBands * k, sizeof(double));
+	rt->bands = (double *) MemMalloc((size_t) rt->nSources * rt->nBands * blocksize * sizeof(double));
+	rt->g     = (double *) MemMalloc(rt->stride * sizeof(double));
+	rt->dg    = (double *) MemMalloc(rt->stride * sizeof(double));
+	rt->s     = (double *) MemMalloc(rt->nBands * sizeof(double));
+
+	/* diffuse tail, delayed as the band signals */
+	rt->tail = (CPartitionedConv **) MemCalloc(rt->nReceivers, sizeof(CPartitionedConv *));
+	if (pSetup->options.simulatediffuse || (pSetup->options.simulatespecular && (maxorder < pSetup->options.reflectionorder[0] 
+		|| maxorder < pSetup->options.reflectionorder[1] || maxorder < pSetup->options.reflectionorder[2])))
+	{
+		if (pSetup->options.verbose)
+			MsgPrintf("Simulating the diffuse tail of the real-time renderer...\n");
+		tail = RoomsimTracked(pSetup, NULL, maxorder + 1);
+		for (ri=0; ri<rt->nReceivers; ri++)
+		{
+			for (si=0, hlen=1; si<rt->nSources; si++)
+				hlen = MAX(hlen, tail[ri * rt->nSources + si].offset + tail[ri * rt->nSources + si].nSamples);
+			rt->tail[ri] = AllocPartitionedConv(blocksize, rt->nSources, rt->channel[ri+1] - rt->channel[ri], hlen + rt->latency);
+			for (si=0; si<rt->nSources; si++)
+			{
+				const BRIR *brir = &tail[ri * rt->nSources + si];
+				for (k=0; k<brir->nChannels && k<rt->channel[ri+1]-rt->channel[ri]; k++)
+					SetPartitionedConvFilter(rt->tail[ri], si, k, &brir->sample[(size_t) k * brir->nSamples], 
+						brir->nSamples, brir->offset + rt->latency);
+			}
+		}
+		ReleaseBRIR(tail);
+	}
+
+	/* image sources at the initial receiver poses, taken as those of the previous block */
+	rt->write   = 0;
+	rt->mailbox = 1;
+	rt->read    = 2;
+	RealtimeUpdate(rt);
+	rt->read = (int) (AtomicExchange(&rt->mailbox, rt->read) & 3);
+	memcpy(rt->current.delay,  rt->params[rt->read].delay,  rt->nSlots * sizeof(double));
+	memcpy(rt->current.gain,   rt->params[rt->read].gain,   (size_t) rt->nSlots * rt->stride * sizeof(double));
+	memcpy(rt->current.active, rt->params[rt->read].active, rt->nSlots);
+	return rt;
 }
 
-#define VALIDATE(a,s) if (!(a)) { MsgErrorExit("invalid setup: " s); }
- 
-void ValidateSetup(CRoomSetup *pSetup)
+/** Moves receiver \a ri to \a location, and turns it to \a orientation, 
+ *  either of which may be NULL to leave it. The image sources are 
+ *  recomputed, and reach the output from the next block on. Call from the 
+ *  control thread. */
+void RealtimeMoveReceiver(CRealtime *rt, int ri, const double *location, const double *orientation)
+{
+	CSensorInternal *receiver = &rt->simulation->receiver[ri];
+
+	if (location)
+		memcpy(rt->receiver[ri].location, location, 3 * sizeof(double));
+	if (orientation)
+	{
+		memcpy(rt->receiver[ri].orientation, orientation, 3 * sizeof(double));
+		ComputeRoom2SensorYPRT((YPR *) rt->receiver[ri].orientation, (YPRT *) &receiver->r2s_yprt);
+		ComputeSensor2RoomYPRT((YPR *) rt->receiver[ri].orientation, (YPRT *) &receiver->s2r_yprt);
+	}
+	RealtimeUpdate(rt);
+}
+
+/** Renders the next block: \a x holds blocksize samples of each source, 
+ *  one after the other, and \a y receives blocksize samples of each 
+ *  channel of each receiver likewise, see RealtimeChannels. Call from the 
+ *  audio thread; it neither allocates memory nor waits for the control thread.
+ */
+void RealtimeProcess(CRealtime *rt, const double *x, double *y)
+{
+	CRealtimeParams *from = &rt->current, *to = &rt->current;
+	const double    *line, *l;
+	double          *out, d0, dd, t, frac, v;
+	long long       pos, i0, i1, start;
+	int B = rt->blocksize, nBands = rt->nBands, L = rt->linemask + 1;
+	int slot, si, ri, b, c, k, n, nGains, nChannels;
+
+	/* take the latest update of the control thread, if any */
+	if (rt->mailbox & REALTIME_FRESH)
+	{
+		rt->read = (int) (AtomicExchange(&rt->mailbox, rt->read) & 3);
+		to = &rt->params[rt->read];
+	}
+
+	/* split the sources into bands, appended to the delay lines */
+	PartitionedConvProcess(rt->bank, x, rt->bands);
+	start = rt->written;
+	for (k=0; k<rt->nSources*nBands; k++)
+		for (n=0; n<B; n++)
+			rt->line[(size_t) k * L + ((start + n) & rt->linemask)] = rt->bands[(size_t) k * B + n];
+	rt->written += B;
+
+	/* diffuse tails */
+	for (ri=0; ri<rt->nReceivers; ri++)
+	{
+		out = &y[(size_t) rt->channel[ri] * B];
+		if (rt->tail[ri])
+			PartitionedConvProcess(rt->tail[ri], x, out);
+		else
+			memset(out, 0, (size_t) (rt->channel[ri+1] - rt->channel[ri]) * B * sizeof(double));
+	}
+
+	/* image sources, of which delays and gains glide from the previous to 
+	   the current parameters over the block; appearing images take their 
+	   delay at once and fade in, disappearing images fade out */
+	for (slot=0; slot<rt->nSlots; slot++)
+	{
+		if (!from->active[slot] && !to->active[slot])
+			continue;
+		si        = slot % rt->nSources;
+		ri        = (slot / rt->nSources) % rt->nReceivers;
+		nChannels = rt->channel[ri+1] - rt->channel[ri];
+		nGains    = nChannels * nBands;
+		for (k=0; k<nGains; k++)
+		{
+			rt->g[k]  = from->active[slot] ? from->gain[(size_t) slot * rt->stride + k] : 0.0;
+			rt->dg[k] = ((to->active[slot] ? to->gain[(size_t) slot * rt->stride + k] : 0.0) - rt->g[k]) / B;
+		}
+		d0 = from->active[slot] ? from->delay[slot] : to->delay[slot];
+		dd = ((to->active[slot] ? to->delay[slot] : d0) - d0) / B;
+
+		line = &rt->line[(size_t) si * nBands * L];
+		out  = &y[(size_t) rt->channel[ri] * B];
+		for (n=0; n<B; n++)
+		{
+			/* read each band between the samples around the delay */
+			t    = (double) (start + n) - (d0 + dd * (n + 1));
+			pos  = (long long) floor(t);
+			frac = t - pos;
+			i0   = pos & rt->linemask;
+			i1   = (pos + 1) & rt->linemask;
+			for (b=0, l=line; b<nBands; b++, l+=L)
+				rt->s[b] = l[i0] + frac * (l[i1] - l[i0]);
+
+			for (c=0, k=0; c<nChannels; c++)
+			{
+				for (b=0, v=0.0; b<nBands; b++, k++)
+				{
+					rt->g[k] += rt->dg[k];
+					v += rt->g[k] * rt->s[b];
+				}
+				out[(size_t) c * B + n] += v;
+			}
+		}
+	}
+
+	/* the parameters of this block are those the next block starts from */
+	if (to != from)
+	{
+		memcpy(rt->current.delay,  to->delay,  rt->nSlots * sizeof(double));
+		memcpy(rt->current.gain,   to->gain,   (size_t) rt->nSlots * rt->stride * sizeof(double));
+		memcpy(rt->current.active, to->active, rt->nSlots);
+	}
+}
+
+/** Returns the total number of output channels, of all receivers. */
+int RealtimeChannels(const CRealtime *rt)
+{
+	return rt->channel[rt->nReceivers];
+}
+
+/** Returns the delay of the output, in samples, beyond that of the responses. */
+int RealtimeLatency(const CRealtime *rt)
+{
+	return rt->latency;
+}
+
+/** Returns the number of image source arrivals of the last update. Call from the control thread. */
+int RealtimeImageCount(const CRealtime *rt)
+{
+	return rt->nImages;
+}
+
+/** Releases a real-time renderer. */
+void RealtimeFree(CRealtime *rt)
+{
+	int i;
+
+	for (i=0; i<rt->nReceivers; i++)
+		if (rt->tail[i])
+			FreePartitionedConv(rt->tail[i]);
+	MemFree(rt->tail);
+	FreePartitionedConv(rt->bank);
+	MemFree(rt->line);
+	MemFree(rt->bands);
+	MemFree(rt->g);
+	MemFree(rt->dg);
+	MemFree(rt->s);
+	for (i=0; i<3; i++)
+		FreeRealtimeParams(&rt->params[i]);
+	FreeRealtimeParams(&rt->current);
+	MemFree(rt->arrivals.arrival);
+	MemFree(rt->arrivals.attenuation);
+	MemFree(rt->channel);
+	ReleaseBRIR(RoomsimRelease(rt->simulation));
+	MemFree(rt->receiver);
+	MemFree(rt);
+}
+
+#define VALIDATE(a,s) if (!(a)) { strcpy(error, "invalid setup: " s); return -1; }
+
+/** Checks a setup for errors that would terminate its simulation, apart
+ *  from those of its sources and receivers.
+ *
+ *	@param[in]  pSetup	Setup to check.
+ *	@param[out] error	Reason the setup is invalid, at least 256 characters.
+ *	@return				0 if the setup is valid, -1 otherwise.
+ */
+int CheckSetup(const CRoomSetup *pSetup, char *error)
 {
+	double nBins;
+	int    i;
+
 	VALIDATE(pSetup->room.surface.nRowsAbsorption == 6, "surface absorption not defined for 6 surfaces");
 	VALIDATE(pSetup->room.surface.nColsAbsorption == pSetup->room.surface.nBands,
 		"surface absorption not defined for all surface frequency bands");
@@ -1845,4 +4712,62 @@ void ValidateSetup(CRoomSetup *pSetup)
 		VALIDATE(pSetup->room.surface.nColsDiffusion == pSetup->room.surface.nBands,
 			"surface diffusion not defined for all surface frequency bands");
 	}
+
+	VALIDATE(pSetup->options.fs > 0, "sampling frequency not positive");
+	VALIDATE(pSetup->options.outputname, "output name not defined");
+	for (i=0; i<pSetup->nSources; i++)
+		VALIDATE(pSetup->source[i].description, "source description not defined");
+	for (i=0; i<pSetup->nReceivers; i++)
+		VALIDATE(pSetup->receiver[i].description, "receiver description not defined");
+
+	if (pSetup->options.diffusedirections != 6 
+		&& (pSetup->options.diffusedirections < 1 || pSetup->options.diffusedirections > MAXDIRECTIONS))
+	{
+		sprintf(error, "invalid number of diffuse directions %d (expected 1 to %d)", pSetup->options.diffusedirections, MAXDIRECTIONS);
+		return -1;
+	}
+	VALIDATE(pSetup->options.responseduration > 0, "response duration not positive");
+	VALIDATE(pSetup->options.diffusetimestep > 0, "diffuse time step not positive");
+	VALIDATE(pSetup->options.referencefrequency > 0 && pSetup->options.bandsperoctave > 0, 
+		"simulation frequency bands not defined");
+
+	/* the diffuse histograms are indexed by 32 bits: receivers x directions x time bins x bands (as in ComputeBandFrequencies) */
+	nBins = (double) MAX(pSetup->nReceivers, 1)
+		  * (pSetup->options.diffusedirections == 6 ? 6 : CountIcosahedronRays(pSetup->options.diffusedirections))
+		  * ceil(pSetup->options.responseduration / pSetup->options.diffusetimestep)
+		  * (floor(LOG2(pSetup->options.fs / 2.22 / pSetup->options.referencefrequency) * pSetup->options.bandsperoctave)
+			 - ceil(LOG2(30.0 / pSetup->options.referencefrequency) * pSetup->options.bandsperoctave) + 3);
+	if (nBins > 4294967295.0)
+	{
+		sprintf(error, "diffuse histograms of %.3g bins exceed 2^32-1 bins (increase diffusetimestep, or reduce diffusedirections or bandsperoctave)", nBins);
+		return -1;
+	}
+	if (FindRayGenerator(pSetup->options.raygenerator) < 0)
+	{
+		sprintf(error, "unknown ray generator '%.100s'\n(expected icosahedron, icosphere, fibonacci, or sobol)", pSetup->options.raygenerator);
+		return -1;
+	}
+	if (FFTWPlanningFlags(pSetup->options.fftwplanning) < 0)
+	{
+		sprintf(error, "unknown FFTW planning effort '%.100s' (use 'estimate', 'measure', or 'patient')", pSetup->options.fftwplanning);
+		return -1;
+	}
+	for (i=0; i<pSetup->options.nFilterLengths; i++)
+	{
+		if ((int) pSetup->options.filterlength[i] < MINFILTERLENGTH || (int) pSetup->options.filterlength[i] > MAXFILTERLENGTH)
+		{
+			sprintf(error, "filter length %d out of range (%d to %d samples)", (int) pSetup->options.filterlength[i], MINFILTERLENGTH, MAXFILTERLENGTH);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void ValidateSetup(const CRoomSetup *pSetup)
+{
+	char error[256];
+
+	if (CheckSetup(pSetup, error) < 0)
+		MsgErrorExit(error);
 }
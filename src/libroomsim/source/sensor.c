@@ -4,6 +4,7 @@
  **********************************************************************/
 
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -13,8 +14,8 @@
 #include "msg.h"
 #include "types.h"
 #include "sensor.h"
+#include "thread.h"
 #include "mysofa.h"
-#include "global.h"
 
 /* disable warnings about unsafe CRT functions */
 #ifdef _MSC_VER
@@ -24,6 +25,21 @@
 /* function prototypes */
 void MexAtExitCallback(void);
 
+/* serializes probes of impulse response sensors, which write into the sensor definition */
+static CMutex g_sensorlock = MUTEX_INITIALIZER;
+
+/* reason of the last failed sensor initialization; sensors are loaded by one thread at a time */
+static char g_sensorerror[256];
+
+/** Records why a sensor initializer failed, for TryLoadSensor.
+ *  @return	-1, to be returned by the initializer. */
+static int SensorFailure(const char *msg)
+{
+	strncpy(g_sensorerror, msg, sizeof(g_sensorerror) - 1);
+	g_sensorerror[sizeof(g_sensorerror) - 1] = '\0';
+	return -1;
+}
+
 int SensorGetResponse(const CSensorDefinition *sensor, const XYZ *xyz, CSensorResponse *response)
 {
 	int idx;
@@ -47,10 +63,45 @@ int SensorGetResponse(const CSensorDefinition *sensor, const XYZ *xyz, CSensorRe
 		
 		case ST_IMPULSERESPONSE:
 		{
-			if (sensor->probe.xyz2idx(sensor, xyz) < 0)
-				return 0;
+			if (!response->buffer)
+			{
+				if (sensor->probe.xyz2idx(sensor, xyz) < 0)
+					return 0;
+				response->data.impulseresponse = sensor->responsedata;
+			}
+			else
+			{
+				/* copy the probed response, so that concurrent simulations can share the sensor */
+				MutexLock(&g_sensorlock);
+				idx = sensor->probe.xyz2idx(sensor, xyz);
+				if (idx >= 0)
+					memcpy(response->buffer, sensor->responsedata, sensor->nChannels * sensor->nSamples * sizeof(double));
+				MutexUnlock(&g_sensorlock);
+				if (idx < 0)
+					return 0;
+				response->data.impulseresponse = response->buffer;
+			}
 			response->type = SR_IMPULSERESPONSE;
-			response->data.impulseresponse = sensor->responsedata;
+			return 1;
+		}
+
+		case ST_GAINS:
+		{
+			/* gains are evaluated into the caller's buffer */
+			if (!response->buffer || !sensor->probe.gains(sensor, xyz, response->buffer))
+				return 0;
+			response->type = SR_GAINS;
+			response->data.gains = response->buffer;
+			return 1;
+		}
+
+		case ST_ARRAY:
+		{
+			/* element gains and path lengths are evaluated into the caller's buffer */
+			if (!response->buffer || !sensor->probe.elements(sensor, xyz, response->distance, response->buffer))
+				return 0;
+			response->type = SR_ELEMENTS;
+			response->data.elements = response->buffer;
 			return 1;
 		}
 	}
@@ -83,6 +134,259 @@ void SensorInitDefault(CSensorDefinition *definition)
  * sensor functions
  **********************************************/
 
+/***** ambisonics *****************************/
+#define AMBISONICS_MAXORDER 7	/**< Highest order of ambisonics receivers, 64 channels. */
+
+/** Recurrence tables of the real spherical harmonics of an ambisonics receiver, 
+ *  indexed by ACN channel l*l+l+m for orders m >= 0. */
+typedef struct {
+	int    order;
+	double *norm;		/**< Normalization, including the (2m-1)!! of the Legendre function P(m,m). */
+	double *a, *b;		/**< Legendre recurrence P(l,m) = a z P(l-1,m) - b P(l-2,m). */
+} CAmbisonicsTables;
+
+/** Evaluates the real spherical harmonics up to the receiver order in a 
+ *  direction, in ACN channel order. Avoids trigonometry by evaluating the 
+ *  Legendre functions divided by (1-z^2)^(m/2), and the azimuthal terms as 
+ *  the powers (x+iy)^m.
+ */
+int sensor_ambisonics_probe(const CSensorDefinition *sensor, const XYZ *xyz, double *gains)
+{
+	const CAmbisonicsTables *tables = (const CAmbisonicsTables *) sensor->sensordata;
+	double r, x, y, z, cm, sm, tmp, p0, p1, p2;
+	int    l, m, k;
+
+	r = sqrt(xyz->x * xyz->x + xyz->y * xyz->y + xyz->z * xyz->z);
+	if (r == 0)
+		return 0;
+	x = xyz->x / r;
+	y = xyz->y / r;
+	z = xyz->z / r;
+
+	cm = 1.0;	/* real and imaginary parts of (x+iy)^m */
+	sm = 0.0;
+	for (m=0; m<=tables->order; m++)
+	{
+		p0 = 0.0;
+		p1 = 1.0;
+		for (l=m; l<=tables->order; l++)
+		{
+			k = l*l + l;
+			if (l > m)
+			{
+				p2 = tables->a[k+m] * z * p1 - tables->b[k+m] * p0;
+				p0 = p1;
+				p1 = p2;
+			}
+			gains[k+m] = tables->norm[k+m] * p1 * cm;
+			if (m > 0)
+				gains[k-m] = tables->norm[k+m] * p1 * sm;
+		}
+		tmp = cm * x - sm * y;
+		sm  = cm * y + sm * x;
+		cm  = tmp;
+	}
+	return 1;
+}
+
+/** Initializes an ambisonics receiver from 'ORDER [sn3d|n3d]', by default
+ *  first order with SN3D normalization (AmbiX). */
+int sensor_ambisonics_init(const char *datafile, CSensorDefinition *definition, double fs)
+{
+	CAmbisonicsTables *tables;
+	double norm, dfact;
+	char   msg[256];
+	int    order = 1, n3d = 0, nChannels, l, m, i;
+
+	if (datafile)
+	{
+		order = (int) strtol(datafile, NULL, 10);
+		n3d   = strstr(datafile, "n3d") != NULL || strstr(datafile, "N3D") != NULL;
+	}
+	if (order < 0 || order > AMBISONICS_MAXORDER)
+	{
+		sprintf(msg, "invalid ambisonics order %d (expected 0 to %d)", order, AMBISONICS_MAXORDER);
+		return SensorFailure(msg);
+	}
+	nChannels = (order + 1) * (order + 1);
+
+	/* tables share one allocation, released with the sensor data */
+	tables = (CAmbisonicsTables *) MemMalloc(sizeof(CAmbisonicsTables) + 3 * nChannels * sizeof(double));
+	tables->order = order;
+	tables->norm  = (double *) (tables + 1);
+	tables->a     = tables->norm + nChannels;
+	tables->b     = tables->a + nChannels;
+	for (l=0; l<=order; l++)
+	{
+		for (m=0, dfact=1.0; m<=l; dfact*=2*m+1, m++)
+		{
+			/* SN3D: sqrt((2-delta(m)) (l-m)!/(l+m)!), N3D: sqrt(2l+1) SN3D */
+			for (i=l-m+1, norm=(m > 0 ? 2.0 : 1.0); i<=l+m; i++)
+				norm /= i;
+			norm = sqrt(n3d ? (2*l+1) * norm : norm);
+			tables->norm[l*l+l+m] = norm * dfact;
+			tables->a[l*l+l+m]    = l > m ? (2.0*l - 1) / (l - m) : 0.0;
+			tables->b[l*l+l+m]    = l > m ? (l + m - 1.0) / (l - m) : 0.0;
+		}
+	}
+
+	definition->type        = ST_GAINS;
+	definition->probe.gains = sensor_ambisonics_probe;
+	definition->nChannels   = nChannels;
+	definition->sensordata  = tables;
+
+#ifdef MEX
+	mexMakeMemoryPersistent(definition->sensordata);
+#endif
+	return 0;
+}
+
+/***** array **********************************/
+#define ARRAY_MAXELEMENTS 1024	/**< Largest number of elements of array sensors. */
+
+/** Element of an array sensor. */
+typedef struct {
+	XYZ    offset;					/**< Position relative to the array origin, in array coordinates [m]. */
+	YPRT   r2e_yprt;				/**< Array-to-element coordinate transformation matrix. */
+	CSensorDefinition directivity;	/**< Directional response of the element, a log gain sensor. */
+} CArrayElement;
+
+/** Elements of an array sensor, in the order of its channels. */
+typedef struct {
+	int           nElements;
+	CArrayElement element[1];
+} CSensorArray;
+
+/** Evaluates the gain of every array element for a source in direction \a xyz,
+ *  at \a distance from the array origin, or a plane wave if \a distance is 0,
+ *  and the difference of its path length to that of the origin. */
+int sensor_array_probe(const CSensorDefinition *sensor, const XYZ *xyz, double distance, double *elements)
+{
+	const CSensorArray  *array = (const CSensorArray *) sensor->sensordata;
+	const CArrayElement *element;
+	double r, loggain;
+	XYZ    p, d, e;
+	int    i, n = array->nElements;
+
+	r = sqrt(xyz->x * xyz->x + xyz->y * xyz->y + xyz->z * xyz->z);
+	if (r == 0)
+		return 0;
+	r = (distance > 0 ? distance : 1.0) / r;
+	p.x = xyz->x * r;
+	p.y = xyz->y * r;
+	p.z = xyz->z * r;
+
+	for (i=0; i<n; i++)
+	{
+		element = &array->element[i];
+		if (distance > 0)
+		{
+			/* point source: direction and distance from the element */
+			d.x = p.x - element->offset.x;
+			d.y = p.y - element->offset.y;
+			d.z = p.z - element->offset.z;
+			elements[n+i] = sqrt(d.x * d.x + d.y * d.y + d.z * d.z) - distance;
+		}
+		else
+		{
+			/* plane wave: same direction, advanced by the projection of the offset */
+			d = p;
+			elements[n+i] = -(p.x * element->offset.x + p.y * element->offset.y + p.z * element->offset.z);
+		}
+		YawPitchRoll(&d, &element->r2e_yprt, &e);
+		loggain = element->directivity.probe.loggain(&element->directivity, &e);
+		elements[i] = loggain == EMPTY_GAIN ? 0.0 : LINDOMAIN(loggain);
+	}
+	return 1;
+}
+
+/* sensor list, defined below */
+extern CSensorListItem sensor[];
+int FindSensor(const char *description);
+
+/** Initializes an array sensor from a text file, with one element per line:
+ *  its offset x y z [m] from the array origin, optionally followed by its 
+ *  orientation yaw pitch roll [deg] and directivity (omnidirectional by default),
+ *  in array coordinates. Directivities are sensors with a gain per direction.
+ */
+int sensor_array_init(const char *datafile, CSensorDefinition *definition, double fs)
+{
+	CSensorArray  *array;
+	CArrayElement *element;
+	YPR    ypr;
+	FILE   *fid;
+	char   line[256], type[64], msg[512];
+	int    nElements, iLine, n, s;
+
+	if (!datafile || !(fid = fopen(datafile, "r")))
+	{
+		sprintf(msg, "unable to open array definition '%.200s'", datafile ? datafile : "");
+		return SensorFailure(msg);
+	}
+
+	/* count elements, skipping comments and empty lines */
+	for (nElements=0; fgets(line, sizeof(line), fid); )
+	{
+		n = (int) strspn(line, " \t\r\n");
+		if (line[n] != '\0' && line[n] != '%' && line[n] != '#')
+			nElements++;
+	}
+	if (nElements < 1 || nElements > ARRAY_MAXELEMENTS)
+	{
+		fclose(fid);
+		sprintf(msg, "array definition '%.200s' has %d elements (expected 1 to %d)", datafile, nElements, ARRAY_MAXELEMENTS);
+		return SensorFailure(msg);
+	}
+
+	array = (CSensorArray *) MemCalloc(1, sizeof(CSensorArray) + (nElements - 1) * sizeof(CArrayElement));
+	array->nElements = nElements;
+	rewind(fid);
+	for (iLine=1, element=array->element; element < array->element + nElements && fgets(line, sizeof(line), fid); iLine++)
+	{
+		n = (int) strspn(line, " \t\r\n");
+		if (line[n] == '\0' || line[n] == '%' || line[n] == '#')
+			continue;
+
+		ypr.yaw = ypr.pitch = ypr.roll = 0;
+		strcpy(type, "omnidirectional");
+		n = sscanf(line, "%lf %lf %lf %lf %lf %lf %63s", &element->offset.x, &element->offset.y, &element->offset.z,
+				   &ypr.yaw, &ypr.pitch, &ypr.roll, type);
+		s = FindSensor(type);
+		if ((n != 3 && n != 6 && n != 7) || s < 0)
+		{
+			fclose(fid);
+			MemFree(array);
+			sprintf(msg, "array definition '%.200s', line %d: expected x y z [yaw pitch roll [directivity]]", datafile, iLine);
+			return SensorFailure(msg);
+		}
+		ComputeRoom2SensorYPRT(&ypr, &element->r2e_yprt);
+
+		/* element directivities are private gain sensors, without data of their own */
+		SensorInitDefault(&element->directivity);
+		if (sensor[s].init(NULL, &element->directivity, fs) < 0 || element->directivity.type != ST_LOGGAIN)
+		{
+			if (element->directivity.sensordata)
+				MemFree(element->directivity.sensordata);
+			fclose(fid);
+			MemFree(array);
+			sprintf(msg, "array definition '%.200s', line %d: directivity '%s' is not a gain sensor", datafile, iLine, type);
+			return SensorFailure(msg);
+		}
+		element++;
+	}
+	fclose(fid);
+
+	definition->type           = ST_ARRAY;
+	definition->probe.elements = sensor_array_probe;
+	definition->nChannels      = nElements;
+	definition->sensordata     = array;
+
+#ifdef MEX
+	mexMakeMemoryPersistent(definition->sensordata);
+#endif
+	return 0;
+}
+
 /***** bidirectional **************************/
 double sensor_bidirectional_probe(const CSensorDefinition *sensor, const XYZ *xyz)
 {
@@ -99,12 +403,13 @@ double sensor_bidirectional_probe(const CSensorDefinition *sensor, const XYZ *xy
     return EMPTY_GAIN;
 }
 
-void sensor_bidirectional_init(const char *datafile, CSensorDefinition *definition)
+int sensor_bidirectional_init(const char *datafile, CSensorDefinition *definition, double fs)
 {
 	UNREFERENCED_PARAMETER(datafile);
 
     definition->type = ST_LOGGAIN;
     definition->probe.loggain = sensor_bidirectional_probe;
+    return 0;
 }
 
 /***** cardioid *******************************/
@@ -127,12 +432,13 @@ double sensor_cardioid_probe(const CSensorDefinition *sensor, const XYZ *xyz)
 		return loggain;
 }
 
-void sensor_cardioid_init(const char *datafile, CSensorDefinition *definition)
+int sensor_cardioid_init(const char *datafile, CSensorDefinition *definition, double fs)
 {
 	UNREFERENCED_PARAMETER(datafile);
 
     definition->type = ST_LOGGAIN;
     definition->probe.loggain = sensor_cardioid_probe;
+    return 0;
 }
 
 /***** dipole *******************************/
@@ -155,12 +461,13 @@ double sensor_dipole_probe(const CSensorDefinition *sensor, const XYZ *xyz)
 		return loggain;
 }
 
-void sensor_dipole_init(const char *datafile, CSensorDefinition *definition)
+int sensor_dipole_init(const char *datafile, CSensorDefinition *definition, double fs)
 {
 	UNREFERENCED_PARAMETER(datafile);
 
     definition->type = ST_LOGGAIN;
     definition->probe.loggain = sensor_dipole_probe;
+    return 0;
 }
 
 /***** hemisphere *******************************/
@@ -174,12 +481,13 @@ double sensor_hemisphere_probe(const CSensorDefinition *sensor, const XYZ *xyz)
     return EMPTY_GAIN;
 }
 
-void sensor_hemisphere_init(const char *datafile, CSensorDefinition *definition)
+int sensor_hemisphere_init(const char *datafile, CSensorDefinition *definition, double fs)
 {
 	UNREFERENCED_PARAMETER(datafile);
 
     definition->type = ST_LOGGAIN;
     definition->probe.loggain = sensor_hemisphere_probe;
+    return 0;
 }
 
 /***** hypercardioid *******************************/
@@ -202,12 +510,13 @@ double sensor_hypercardioid_probe(const CSensorDefinition *sensor, const XYZ *xy
 		return loggain;
 }
 
-void sensor_hypercardioid_init(const char *datafile, CSensorDefinition *definition)
+int sensor_hypercardioid_init(const char *datafile, CSensorDefinition *definition, double fs)
 {
 	UNREFERENCED_PARAMETER(datafile);
 
     definition->type = ST_LOGGAIN;
     definition->probe.loggain = sensor_hypercardioid_probe;
+    return 0;
 }
 
 /***** omnidirectional *******************************/
@@ -219,12 +528,13 @@ double sensor_omnidirectional_probe(const CSensorDefinition *sensor, const XYZ *
     return 0.0; /* = LOGDOMAIN(1.0) */
 }
 
-void sensor_omnidirectional_init(const char *datafile, CSensorDefinition *definition)
+int sensor_omnidirectional_init(const char *datafile, CSensorDefinition *definition, double fs)
 {
     UNREFERENCED_PARAMETER(datafile);
 
 	definition->type = ST_LOGGAIN;
     definition->probe.loggain = sensor_omnidirectional_probe;
+    return 0;
 }
 
 /***** subcardioid *******************************/
@@ -248,12 +558,13 @@ double sensor_subcardioid_probe(const CSensorDefinition *sensor, const XYZ *xyz)
 
 }
 
-void sensor_subcardioid_init(const char *datafile, CSensorDefinition *definition)
+int sensor_subcardioid_init(const char *datafile, CSensorDefinition *definition, double fs)
 {
 	UNREFERENCED_PARAMETER(datafile);
 
     definition->type = ST_LOGGAIN;
     definition->probe.loggain = sensor_subcardioid_probe;
+    return 0;
 }
 
 /***** supercardioid *******************************/
@@ -276,12 +587,13 @@ double sensor_supercardioid_probe(const CSensorDefinition *sensor, const XYZ *xy
 		return loggain;
 }
 
-void sensor_supercardioid_init(const char *datafile, CSensorDefinition *definition)
+int sensor_supercardioid_init(const char *datafile, CSensorDefinition *definition, double fs)
 {
 	UNREFERENCED_PARAMETER(datafile);
 
     definition->type = ST_LOGGAIN;
     definition->probe.loggain = sensor_supercardioid_probe;
+    return 0;
 }
 
 /***** unidirectional *******************************/
@@ -302,12 +614,13 @@ double sensor_unidirectional_probe(const CSensorDefinition *sensor, const XYZ *x
     return EMPTY_GAIN;
 }
 
-void sensor_unidirectional_init(const char *datafile, CSensorDefinition *definition)
+int sensor_unidirectional_init(const char *datafile, CSensorDefinition *definition, double fs)
 {
 	UNREFERENCED_PARAMETER(datafile);
 
     definition->type = ST_LOGGAIN;
     definition->probe.loggain = sensor_unidirectional_probe;
+    return 0;
 }
 
 /***** SOFA *******************************/
@@ -483,7 +796,7 @@ void getOptions(char *options, CSensorDefinition *definition)
 	}
 }
 
-void sensor_SOFA_init(const char *datafile, CSensorDefinition *definition)
+int sensor_SOFA_init(const char *datafile, CSensorDefinition *definition, double fs)
 {
 	char msg[512], mysofaerror[64], *datafilecopy, *path, *options;
 	int err;
@@ -491,7 +804,7 @@ void sensor_SOFA_init(const char *datafile, CSensorDefinition *definition)
 	/* test that a datafile name is provided */
 	if (!datafile)
 	{
-		MsgErrorExit("no SOFA datafile specified\n");
+		return SensorFailure("no SOFA datafile specified");
 	}
     
     /* getting options */
@@ -528,7 +841,7 @@ void sensor_SOFA_init(const char *datafile, CSensorDefinition *definition)
 		getMysofaErrorString(err, mysofaerror);
 		sprintf(msg, "unable to allocate memory for SOFA data file '%s' (error %d: %s)", path, err, mysofaerror);
 		MemFree(datafilecopy);
-		MsgErrorExit(msg);
+		return SensorFailure(msg);
 	}
 
 	/* set all values of struct to their default "0" (to avoid freeing unallocated
@@ -550,7 +863,7 @@ void sensor_SOFA_init(const char *datafile, CSensorDefinition *definition)
 		getMysofaErrorString(err, mysofaerror);
 		sprintf(msg, "unable to load SOFA data file '%s' (error %d: %s)", path, err, mysofaerror);
 		MemFree(datafilecopy);
-		MsgErrorExit(msg);
+		return SensorFailure(msg);
 	}
 	sprintf(msg, "completed\n");
 	MsgPrintf("%s", msg);
@@ -573,7 +886,7 @@ void sensor_SOFA_init(const char *datafile, CSensorDefinition *definition)
 			getMysofaErrorString(err, mysofaerror);
 			sprintf(msg, "error in SOFA hrtf data '%s' (error %d: %s)", path, err, mysofaerror);
 			MemFree(datafilecopy);
-			MsgErrorExit(msg);
+			return SensorFailure(msg);
 		}
 		sprintf(msg, "completed\n");
 		MsgPrintf("%s", msg);
@@ -583,17 +896,17 @@ void sensor_SOFA_init(const char *datafile, CSensorDefinition *definition)
 	MemFree(datafilecopy);
 
 	/* SOFA data resampling */
-	if (definition->resampling && g_fs > 0)
+	if (definition->resampling && fs != ANY_FS)
 	{
 		sprintf(msg, "resampling HRTF data... ");
 		MsgPrintf("%s", msg);
-		err = mysofa_resample(definition->sofahandle->hrtf, (float)g_fs);
+		err = mysofa_resample(definition->sofahandle->hrtf, (float)fs);
 		if (err != MYSOFA_OK) 
 		{
 			getMysofaErrorString(err, mysofaerror);
 			ClearSofaSensor(definition);
 			sprintf(msg, "an error occurred during the resampling of HRTF data\n (error %d: %s)", err, mysofaerror);
-			MsgErrorExit(msg);
+			return SensorFailure(msg);
 		}
 		sprintf(msg, "completed\n");
 		MsgPrintf("%s", msg);
@@ -622,7 +935,7 @@ void sensor_SOFA_init(const char *datafile, CSensorDefinition *definition)
 		getMysofaErrorString(err, mysofaerror);
 		ClearSofaSensor(definition);
 		sprintf(msg, "unable to initialize lookup (error %d: %s)", err, mysofaerror);
-		MsgErrorExit(msg);
+		return SensorFailure(msg);
 	}
 
 	/* SOFA neighborhood initialization */
@@ -633,7 +946,7 @@ void sensor_SOFA_init(const char *datafile, CSensorDefinition *definition)
 		getMysofaErrorString(err, mysofaerror);
 		ClearSofaSensor(definition);
 		sprintf(msg, "unable to initialize neighborhood (error %d: %s)", err, mysofaerror);
-		MsgErrorExit(msg);
+		return SensorFailure(msg);
 	}
 
 	/* SOFA FIR initialization */
@@ -644,7 +957,7 @@ void sensor_SOFA_init(const char *datafile, CSensorDefinition *definition)
 		getMysofaErrorString(err, mysofaerror);
 		ClearSofaSensor(definition);
 		sprintf(msg, "unable to initialize fir filter memory (error %d: %s)", err, mysofaerror);
-		MsgErrorExit(msg);
+		return SensorFailure(msg);
 	}
 
 	/* allocate memory for sensor temporary float response data */
@@ -653,7 +966,7 @@ void sensor_SOFA_init(const char *datafile, CSensorDefinition *definition)
 	{
 		ClearSofaSensor(definition);
 		sprintf(msg, "unable to allocate memory for impulse response");
-		MsgErrorExit(msg);
+		return SensorFailure(msg);
 	}
 
 	memset(definition->responsedatafloat, 0, definition->sofahandle->hrtf->N * definition->sofahandle->hrtf->R * sizeof(float));
@@ -664,7 +977,7 @@ void sensor_SOFA_init(const char *datafile, CSensorDefinition *definition)
 	{
 		ClearSofaSensor(definition);
 		sprintf(msg, "unable to allocate memory for delays");
-		MsgErrorExit(msg);
+		return SensorFailure(msg);
 	}
 	
 	/* allocate memory for sensor response data */
@@ -673,7 +986,7 @@ void sensor_SOFA_init(const char *datafile, CSensorDefinition *definition)
 	{
 		ClearSofaSensor(definition);
 		sprintf(msg, "unable to allocate memory for impulse response");
-		MsgErrorExit(msg);
+		return SensorFailure(msg);
 	}
 
 	memset(definition->responsedata, 0, definition->sofahandle->hrtf->N* definition->sofahandle->hrtf->R * sizeof(double));
@@ -687,7 +1000,7 @@ void sensor_SOFA_init(const char *datafile, CSensorDefinition *definition)
 	{
 		ClearSofaSensor(definition);
 		sprintf(msg, "multichannel sensors are not yet supported\n");
-		MsgErrorExit(msg);
+		return SensorFailure(msg);
 	}
 	else if (definition->interpolation) //R <= 2
 	{
@@ -698,9 +1011,9 @@ void sensor_SOFA_init(const char *datafile, CSensorDefinition *definition)
 		definition->probe.xyz2idx = sensor_SOFA_probe_nointerp;
 	}
 
-	if (definition->resampling && g_fs > 0)
+	if (definition->resampling && fs != ANY_FS)
 	{
-		definition->fs = g_fs;
+		definition->fs = fs;
 	}
 	else
 	{
@@ -724,12 +1037,15 @@ void sensor_SOFA_init(const char *datafile, CSensorDefinition *definition)
 	mexMakeMemoryPersistent(definition->responsedata);
 	mexMakeMemoryPersistent(definition->delays);
 #endif
+	return 0;
 }
 
 /********************************************** 
  * sensor list
  **********************************************/
 CSensorListItem sensor[] = {
+    {"ambisonics",      sensor_ambisonics_init      },
+    {"array",           sensor_array_init           },
     {"bidirectional",   sensor_bidirectional_init   },
     {"cardioid",        sensor_cardioid_init        },
     {"dipole",          sensor_dipole_init          },
@@ -776,12 +1092,15 @@ struct CSensorDefinitionListItem {
     CSensorDefinitionListItem *next, *prev;
     char                sensorid[32];
     char                subid[256];
+    double              fs;             /* sampling frequency the sensor was resampled to, or ANY_FS */
     CSensorDefinition   definition;
 };
 
 CSensorDefinitionListItem *g_pSensordefinitionlist = NULL;
 
-CSensorDefinitionListItem *FindSensorData(const char *name, const char *subid)
+/* finds a loaded sensor usable at sampling frequency fs; sensors that resample
+   their data are loaded once per frequency, and fs < 0 matches any of them */
+CSensorDefinitionListItem *FindSensorData(const char *name, const char *subid, double fs)
 {
     CSensorDefinitionListItem *pItem = g_pSensordefinitionlist;
     
@@ -789,7 +1108,8 @@ CSensorDefinitionListItem *FindSensorData(const char *name, const char *subid)
     {
         if (strnicmp(name,pItem->sensorid,strlen(pItem->sensorid))==0)
             if (!subid || strnicmp(subid,pItem->subid,strlen(pItem->subid))==0)
-                break;
+                if (fs < 0 || !pItem->definition.resampling || pItem->fs == fs)
+                    break;
 
         pItem = pItem->next;
     }
@@ -797,7 +1117,27 @@ CSensorDefinitionListItem *FindSensorData(const char *name, const char *subid)
     return pItem;
 }
 
-CSensorDefinition *LoadSensor(const char *description)
+/** Returns the definition of a sensor loaded for sampling frequency \a fs, or NULL if it is not loaded. */
+CSensorDefinition *FindLoadedSensor(const char *description, double fs)
+{
+    CSensorDefinitionListItem *sensordefinitionlistitem;
+    int s = FindSensor(description);
+
+    if (s<0)
+        return NULL;
+    sensordefinitionlistitem = FindSensorData(sensor[s].name, FindSubID(description), fs);
+    return sensordefinitionlistitem ? &sensordefinitionlistitem->definition : NULL;
+}
+
+/** Loads a source/receiver, or finds it if already loaded.
+ *
+ *	@param[in]  description	Sensor name, optionally followed by its data file and options.
+ *	@param[in]  fs			Sampling frequency of the simulation, to which SOFA data 
+ *							are resampled if requested, or ANY_FS to keep their own.
+ *	@param[out] error		Reason of failure, at least 256 characters.
+ *	@return					Sensor definition, or NULL if the sensor is unknown or fails to load.
+ */
+CSensorDefinition *TryLoadSensor(const char *description, double fs, char *error)
 {
     CSensorDefinitionListItem *sensordefinitionlistitem;
     char *subid, msg[256];
@@ -805,25 +1145,25 @@ CSensorDefinition *LoadSensor(const char *description)
     
     s = FindSensor(description);
 
-    /* when no matching sensor found, terminate */
+    /* when no matching sensor found, fail */
     if (s<0) 
     {
-        sprintf(msg,"unknown source/receiver '%s'", description);
-        MsgErrorExit(msg);
+        sprintf(error,"unknown source/receiver '%.200s'", description);
+        return NULL;
     }
 
     /* determine datafile for this sensor */
     subid = FindSubID(description);
     
     /* see if sensor is already loaded  */
-    sensordefinitionlistitem = FindSensorData(sensor[s].name, subid);
+    sensordefinitionlistitem = FindSensorData(sensor[s].name, subid, fs);
     if (sensordefinitionlistitem)
         return &sensordefinitionlistitem->definition;
     
     /* provide feedback because this may take a while */
     /* (esp. loading HRTF data over a network) */
     if (subid)
-        sprintf(msg,"Loading source/receiver %s (%s)...\n", sensor[s].name, subid);
+        sprintf(msg,"Loading source/receiver %s (%.200s)...\n", sensor[s].name, subid);
     else
         sprintf(msg,"Loading source/receiver %s...\n", sensor[s].name);
     MsgPrintf("%s", msg);
@@ -832,9 +1172,16 @@ CSensorDefinition *LoadSensor(const char *description)
     /* allocate new SensorDefinitionListItem */
     sensordefinitionlistitem = (CSensorDefinitionListItem *) MemMalloc(sizeof(CSensorDefinitionListItem));
     
-    /* invoke sensor initializer */
+    /* invoke sensor initializer, which releases its own data when it fails */
 	SensorInitDefault(&sensordefinitionlistitem->definition);
-    sensor[s].init(subid,&sensordefinitionlistitem->definition);
+    if (sensor[s].init(subid,&sensordefinitionlistitem->definition,fs) < 0)
+    {
+        if (sensordefinitionlistitem->definition.responsedata)
+            MemFree(sensordefinitionlistitem->definition.responsedata);
+        MemFree(sensordefinitionlistitem);
+        strcpy(error, g_sensorerror);
+        return NULL;
+    }
 
     /* populate SensorDefinitionListItem fields */
     memset(sensordefinitionlistitem->sensorid,0,sizeof(sensordefinitionlistitem->sensorid));
@@ -842,6 +1189,7 @@ CSensorDefinition *LoadSensor(const char *description)
     memset(sensordefinitionlistitem->subid, 0, sizeof(sensordefinitionlistitem->subid));
     if (subid)
         strncpy(sensordefinitionlistitem->subid, subid, sizeof(sensordefinitionlistitem->subid)-1);
+    sensordefinitionlistitem->fs = sensordefinitionlistitem->definition.resampling ? fs : ANY_FS;
     
     /* put sensor definition first in linked list */
     sensordefinitionlistitem->prev = NULL;
@@ -860,6 +1208,17 @@ CSensorDefinition *LoadSensor(const char *description)
     return &sensordefinitionlistitem->definition;
 }
 
+CSensorDefinition *LoadSensor(const char *description, double fs)
+{
+    CSensorDefinition *definition;
+    char error[256];
+
+    definition = TryLoadSensor(description, fs, error);
+    if (!definition)
+        MsgErrorExit(error);
+    return definition;
+}
+
 void ClearSensor(CSensorDefinitionListItem *item)
 {
     char msg[512];
@@ -946,9 +1305,7 @@ void CmdListSensors(void)
 
 void CmdLoadSensor(const char *description)
 {
-	/* workaround for MATLAB */
-	g_fs = -1;
-    LoadSensor(description);
+    LoadSensor(description, ANY_FS);
 }
 
 void CmdWhosSensors(void)
@@ -988,7 +1345,7 @@ void CmdClearSensor(const char *description)
     
     /* see if sensor is loaded  */
     subid = FindSubID(description);
-    sensordefinitionlistitem = FindSensorData(sensor[s].name, subid);
+    sensordefinitionlistitem = FindSensorData(sensor[s].name, subid, -1);
     if (!sensordefinitionlistitem)
     {
         if (subid)
@@ -998,7 +1355,10 @@ void CmdClearSensor(const char *description)
         MsgErrorExit(msg);
     }
     
-    ClearSensor(sensordefinitionlistitem);
+    /* clear the sensor at every sampling frequency it was loaded for */
+    do
+        ClearSensor(sensordefinitionlistitem);
+    while ((sensordefinitionlistitem = FindSensorData(sensor[s].name, subid, -1)));
 }
 
 void CmdClearAllSensors(void)
@@ -1,10 +1,15 @@
 /*********************************************************************//**
  * @file setup.c
  * @brief Setup routines.
+ *
+ * Setup files are read in chunks, so their size is not limited. Numeric 
+ * arrays are parsed while reading, directly into binary form. Fields of 
+ * large structs are found through a hash table.
  **********************************************************************/
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "setup.h"
 #include "defs.h"
@@ -14,43 +19,119 @@
 #  pragma warning( disable : 4996)
 #endif
 
-/** @todo: accept (single/double) quotes around strings */
-/** @todo: accept semicolons after values */
-/** @todo: accept comments (marked by %) */
 /** @todo: accept (1) array indexing */
 
-CFileSetupItem *SetupFindStruct(CFileSetupItem *item, char *name)
+#define SETUP_READSIZE	65536	/**< Size of chunks read from setup file. */
+#define SETUP_BLOCKSIZE	65536	/**< Size of memory blocks holding the setup. */
+#define SETUP_MINHASH	8		/**< Number of fields above which a struct gets a hash table. */
+#define SETUP_MAXTOKEN	64		/**< Maximum length of a number in an array. */
+
+/** Memory block holding setup items, names, and values. */
+struct CSetupBlock {
+	struct CSetupBlock *next;
+	size_t size, used;
+	double data[1];				/**< Block contents; double for alignment. */
+};
+
+/** State of the setup file reader. */
+typedef struct {
+	CFileSetup	*setup;
+	FILE		*fid;
+	size_t		pos, len;		/**< Read position and number of valid bytes in buf. */
+	int			line;			/**< Current line number, for error messages. */
+	char		*text;			/**< Scratch space for names and values. */
+	size_t		textlen, textsize;
+	double		*number;		/**< Scratch space for numeric arrays. */
+	size_t		numberlen, numbersize;
+	unsigned char buf[SETUP_READSIZE];
+} CSetupReader;
+
+static void *SetupAlloc(CFileSetup *pSetup, size_t size)
 {
-	if (!item || item->type != SI_STRUCT) 
-		return NULL;
+	struct CSetupBlock *block = pSetup->blocks;
 
-	item = item->data.field;
-	while (item)
+	/* round up to multiple of double size, for alignment */
+	size = (size + sizeof(double) - 1) & ~(sizeof(double) - 1);
+
+	if (!block || block->used + size > block->size)
 	{
-		if (item->type == SI_STRUCT && stricmp(item->name, name)==0)
-			break;
-		item = item->next;
+		size_t blocksize = size > SETUP_BLOCKSIZE / 4 ? size : SETUP_BLOCKSIZE;
+		block = (struct CSetupBlock *) malloc(sizeof(struct CSetupBlock) + blocksize);
+		if (!block)
+			return NULL;
+		block->size = blocksize;
+		block->used = 0;
+
+		/* dedicated blocks for large requests go behind the current block */
+		if (blocksize > SETUP_BLOCKSIZE && pSetup->blocks)
+		{
+			block->next = pSetup->blocks->next;
+			pSetup->blocks->next = block;
+		}
+		else
+		{
+			block->next = pSetup->blocks;
+			pSetup->blocks = block;
+		}
 	}
 
-	return item;
+	block->used += size;
+	return (char *) block->data + block->used - size;
 }
 
-CFileSetupItem *SetupFindField(CFileSetupItem *item, char *name)
+static char *SetupStrdup(CFileSetup *pSetup, const char *str, size_t len)
+{
+	char *copy = (char *) SetupAlloc(pSetup, len + 1);
+	if (copy)
+	{
+		memcpy(copy, str, len);
+		copy[len] = '\0';
+	}
+	return copy;
+}
+
+/** Case-insensitive FNV-1a hash of a field name. */
+static unsigned int SetupHash(const char *name)
+{
+	unsigned int h = 2166136261U;
+	while (*name)
+	{
+		h ^= (unsigned char) tolower((unsigned char) *name++);
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static CFileSetupItem *SetupFindItem(CFileSetupItem *item, char *name, int type)
 {
 	if (!item || item->type != SI_STRUCT) 
 		return NULL;
 
-	item = item->data.field;
+	if (item->hash)
+		item = item->hash[SetupHash(name) & (item->hashsize - 1)];
+	else
+		item = item->data.field;
+
 	while (item)
 	{
-		if (item->type == SI_FIELD && stricmp(item->name, name)==0)
+		if ((int) item->type == type && stricmp(item->name, name)==0)
 			break;
-		item = item->next;
+		item = item->parent->hash ? item->hashnext : item->next;
 	}
 
 	return item;
 }
 
+CFileSetupItem *SetupFindStruct(CFileSetupItem *item, char *name)
+{
+	return SetupFindItem(item, name, SI_STRUCT);
+}
+
+CFileSetupItem *SetupFindField(CFileSetupItem *item, char *name)
+{
+	return SetupFindItem(item, name, SI_FIELD);
+}
+
 void SetupPrintItem(CFileSetupItem *item)
 {
 	/* don't print invalid items */
@@ -61,7 +142,9 @@ void SetupPrintItem(CFileSetupItem *item)
 	if (!item->parent)	return;
 
 	/* print field */
-	if (item->type == SI_FIELD)
+	if (item->type == SI_FIELD && item->number)
+		printf("%s = [%dx%d array]\n", item->name, item->nRows, item->nCols);
+	else if (item->type == SI_FIELD)
 		printf("%s = %s\n", item->name, item->data.value);
 	else if (item->data.field)
 		printf("%s.", item->name);
@@ -85,298 +168,477 @@ void SetupPrintItemName(CFileSetupItem *item)
 		printf("%s.", item->name);
 }
 
-static CFileSetupItem *AddItem(CFileSetupItem *item, char *name, char *value)
+static void SetupHashItem(CFileSetupItem *item, CFileSetupItem *field)
 {
-	CFileSetupItem *newitem, *lastitem;
+	unsigned int h = SetupHash(field->name) & (item->hashsize - 1);
+	field->hashnext = item->hash[h];
+	item->hash[h]   = field;
+}
+
+static CFileSetupItem *AddItem(CFileSetup *pSetup, CFileSetupItem *item, const char *name, size_t namelen, int type)
+{
+	CFileSetupItem *newitem, *field;
 
 	/* can't add field to empty or non-struct item */
 	if (!item || item->type != SI_STRUCT) 
 		return NULL;
 
-	/* allocate new item */
-	newitem = (CFileSetupItem *) malloc(sizeof(CFileSetupItem));
+	/* allocate and clear new item */
+	newitem = (CFileSetupItem *) SetupAlloc(pSetup, sizeof(CFileSetupItem));
+	if (!newitem)
+		return NULL;
+	memset(newitem, 0, sizeof(CFileSetupItem));
+	newitem->type   = type;
+	newitem->name   = SetupStrdup(pSetup, name, namelen);
+	newitem->parent = item;
 
-	/* adding name/value pair? */
-	if (value)
-	{
-		/* fill item data */
-		newitem->type = SI_FIELD;
-		newitem->name = name;
-		newitem->data.value = value;
-	}
+	/* append to fields of struct */
+	newitem->prev = item->last;
+	if (item->last)
+		item->last->next = newitem;
 	else
-	{
-		/* fill item data */
-		newitem->type = SI_STRUCT;
-		newitem->name = name;
-		newitem->data.field = NULL;
-	}
+		item->data.field = newitem;
+	item->last = newitem;
+	item->count++;
 
-	/* find last field of this struct */
-	if (!item->data.field) 
+	/* grow hash table when load factor exceeds one */
+	if (item->count > SETUP_MINHASH && item->count > item->hashsize)
 	{
-		lastitem = NULL;
+		item->hashsize = item->hashsize ? 2 * item->hashsize : 2 * SETUP_MINHASH;
+		item->hash = (CFileSetupItem **) SetupAlloc(pSetup, item->hashsize * sizeof(CFileSetupItem *));
+		if (!item->hash)
+			return NULL;
+		memset(item->hash, 0, item->hashsize * sizeof(CFileSetupItem *));
+		for (field=item->data.field; field; field=field->next)
+			SetupHashItem(item, field);
 	}
-	else
+	else if (item->hash)
 	{
-		lastitem = item->data.field;
-		while (lastitem->next)
-			lastitem = lastitem->next;
+		SetupHashItem(item, newitem);
 	}
 
-	/* fill item pointers */
-	newitem->prev   = lastitem;
-	newitem->next   = NULL;
-	newitem->parent = item;
+	return newitem;
+}
 
-	/* link into existing setup structure */
-	if (!item->data.field)
-		item->data.field = newitem;
-	else
-		lastitem->next = newitem;
+/** Returns next character without consuming it, or EOF at end of file. */
+static int FillReader(CSetupReader *r)
+{
+	r->pos = 0;
+	r->len = fread(r->buf, 1, SETUP_READSIZE, r->fid);
+	return r->len ? r->buf[0] : EOF;
+}
 
-	return newitem;
+#define PEEKCHAR(r)	((r)->pos < (r)->len ? (int) (r)->buf[(r)->pos] : FillReader(r))
+#define SKIPCHAR(r)	((r)->buf[(r)->pos++] == '\n' ? (r)->line++ : 0)
+
+static int SkipWhite(CSetupReader *r)
+{
+	int ch;
+	while ((ch = PEEKCHAR(r)) != EOF && ch <= ' ')
+		SKIPCHAR(r);
+	return ch;
 }
 
-static char *SkipWhite(char *p)
+static void SkipLine(CSetupReader *r)
 {
-	while (*p>'\0' && *p<=' ')
-		p++;
-	return p;
+	int ch;
+	while ((ch = PEEKCHAR(r)) != EOF && ch != '\n')
+		SKIPCHAR(r);
+}
+
+static int SetupError(CSetupReader *r, const char *msg, const char *detail)
+{
+	sprintf(r->setup->error, "line %d: %s%.200s", r->line, msg, detail ? detail : "");
+	return -3;
 }
 
-static char *ParseField(char *p, CFileSetupItem *pRootSetupItem)
+/** Appends a character to the text buffer. Returns 1, or negative when out of memory. */
+static int AppendText(CSetupReader *r, int ch)
 {
-	enum { 
-		READFIELDNAME,
-		READSUBFIELDNAME,
-		FINDEQUALS,
-		READVALUE,
-		COMMENT,
-		ERRORINCOMPLETE,
-		ERRORINSTRUCTURE,
-		ERRORDUPLICATEFIELD,
-		DONE
-	} state = READFIELDNAME;
-/*
-	static const struct CMatching 
+	char   *text;
+	size_t size;
+
+	if (r->textlen == r->textsize)
 	{
-		char left, right;
-		int skip;
-	} matching = {
-		{'[',']',0},
-		{'\'','\'',1},
-	};
-*/
-	char *pname = NULL, *pvalue, ch;
-	int skip;
-	CFileSetupItem *pItem = pRootSetupItem, *pNextItem;
+		size = r->textsize ? 2 * r->textsize : 256;
+		text = (char *) realloc(r->text, size);
+		if (!text)
+			return SetupError(r, "out of memory", NULL);
+		r->text     = text;
+		r->textsize = size;
+	}
+	r->text[r->textlen++] = (char) ch;
+	return 1;
+}
 
-	while (state != DONE)
+/** Appends a number to the number buffer. Returns 1, or negative when out of memory. */
+static int AppendNumber(CSetupReader *r, double x)
+{
+	double *number;
+	size_t size;
+
+	if (r->numberlen == r->numbersize)
+	{
+		size   = r->numbersize ? 2 * r->numbersize : 256;
+		number = (double *) realloc(r->number, size * sizeof(double));
+		if (!number)
+			return SetupError(r, "out of memory", NULL);
+		r->number     = number;
+		r->numbersize = size;
+	}
+	r->number[r->numberlen++] = x;
+	return 1;
+}
+
+/** Parses a decimal number.
+ *
+ *	@note
+ *     Numbers with up to 15 significant digits and a decimal exponent of 
+ *     at most 22 are converted exactly with a single multiplication or 
+ *     division. Other numbers, as well as inf and nan, go through strtod.
+ *     Either way, the result is identical to that of strtod.
+ */
+static int ParseNumber(const char *str, double *x)
+{
+	static const double pow10[] = {
+		1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	const char *p = str;
+	char   *end;
+	double mantissa = 0.0;
+	int    negative = 0, ndigits = 0, nsignificant = 0, exponent = 0, e = 0, esign = 1;
+
+	if (*p=='+' || *p=='-')
+		negative = (*p++ == '-');
+	for (; *p>='0' && *p<='9'; p++, ndigits++)
+	{
+		if (mantissa != 0.0 || *p != '0') nsignificant++;
+		mantissa = mantissa * 10 + (*p - '0');
+	}
+	if (*p=='.')
 	{
-		switch (state)
+		for (p++; *p>='0' && *p<='9'; p++, ndigits++, exponent--)
 		{
-		case READFIELDNAME:
-			p = SkipWhite(p);
-			if (*p=='\0') return NULL;
-			if (*p=='%') 
-			{
-				state = COMMENT; 
-				break;
-			}
+			if (mantissa != 0.0 || *p != '0') nsignificant++;
+			mantissa = mantissa * 10 + (*p - '0');
+		}
+	}
+	if (ndigits > 0 && (*p=='e' || *p=='E'))
+	{
+		p++;
+		if (*p=='+' || *p=='-')
+			esign = (*p++ == '-') ? -1 : 1;
+		if (*p<'0' || *p>'9')
+			ndigits = 0;
+		for (; *p>='0' && *p<='9' && e < 10000; p++)
+			e = e * 10 + (*p - '0');
+		exponent += esign * e;
+	}
 
-		case READSUBFIELDNAME:
-			pname = p;
-			while ((*p!='.') && (*p!='=')  && (*p!='(')  && (*p!=')')
-				&& (*p!=' ') && (*p!='\t') && (*p!='\n') && (*p!='\r') 
-				&& (*p!='\0'))
-			{
-				p++;
-			}
+	if (ndigits > 0 && *p=='\0' && nsignificant <= 15 && exponent >= -22 && exponent <= 22)
+	{
+		*x = exponent < 0 ? mantissa / pow10[-exponent] : mantissa * pow10[exponent];
+		if (negative) *x = -*x;
+		return 1;
+	}
 
-			switch (*p)
-			{
-			case ')':
-				if (*(p+1)=='.')
-					*p++ = '\0';
-
-			case '(':
-			case '.':
-				*p++ = '\0';
-				pNextItem = SetupFindStruct(pItem, pname);
-				if (!pNextItem) pNextItem = AddItem(pItem, pname, NULL);
-				if (!pNextItem) 
-				{
-					state = ERRORINSTRUCTURE;
-				}
-				else
-				{
-					pItem = pNextItem;
-					state = READSUBFIELDNAME;
-				}
-				break;
+	/* slow path */
+	*x = strtod(str, &end);
+	return end != str && *end == '\0';
+}
 
-			case '=':
-				*p++ = '\0';
-				pNextItem = SetupFindField(pItem,pname);
-				if (pNextItem) 
-				{
-					state = ERRORDUPLICATEFIELD;
-				}
-				else
-				{
-					state = READVALUE;
-				}
-				break;
+/** Parses a numeric array value, rows separated by semicolons, up to and including the closing bracket. */
+static int ParseArray(CSetupReader *r, CFileSetupItem *item)
+{
+	char token[SETUP_MAXTOKEN];
+	int  ch, len, nRows = 0, nCols = 0;
+	size_t rowstart = 0;
+	double x;
 
-			case ' ':
-			case '\t':
-			case '\n':
-				*p++ = '\0';
-				pNextItem = SetupFindField(pItem,pname);
-				if (pNextItem) 
-				{
-					state = ERRORDUPLICATEFIELD;
-				}
-				else
-				{
-					state = FINDEQUALS;
-				}
-				break;
+	r->numberlen = 0;
+	for (;;)
+	{
+		/* skip white space and column separators */
+		while ((ch = PEEKCHAR(r)) != EOF && (ch <= ' ' || ch == ','))
+			SKIPCHAR(r);
 
-			case '\0':
-				state = ERRORINCOMPLETE;
-				break;
-			}
-			break;
+		if (ch == EOF)
+			return SetupError(r, "missing closing bracket in array ", item->name);
 
-		case FINDEQUALS:
-			while ((*p!='=') && (*p!='\0'))
-				p++;
-			if (*p=='=')
-			{
-				p++;
-				state = READVALUE;
-			}
-			else
+		if (ch == '%')
+		{
+			SkipLine(r);
+			continue;
+		}
+
+		if (ch == ';' || ch == ']')
+		{
+			/* complete current row, if not empty */
+			if (r->numberlen > rowstart)
 			{
-				state = ERRORINCOMPLETE;
+				if (nRows == 0)
+					nCols = (int) (r->numberlen - rowstart);
+				else if ((int) (r->numberlen - rowstart) != nCols)
+					return SetupError(r, "inconsistent row lengths in array ", item->name);
+				nRows++;
+				rowstart = r->numberlen;
 			}
-			break;
-
-		case READVALUE:
-			p = SkipWhite(p);
+			SKIPCHAR(r);
+			if (ch == ']')
+				break;
+			continue;
+		}
 
-			ch = 0; skip = 0;
-			if      (*p=='[' ) { ch = ']';            }
-			else if (*p=='\'') { ch = '\''; skip = 1; }
+		/* read number */
+		len = 0;
+		while ((ch = PEEKCHAR(r)) != EOF && ch > ' ' && ch != ',' && ch != ';' && ch != ']' && ch != '%')
+		{
+			if (len == SETUP_MAXTOKEN-1)
+				return SetupError(r, "number too long in array ", item->name);
+			token[len++] = (char) ch;
+			SKIPCHAR(r);
+		}
+		token[len] = '\0';
 
-			/*else if (*p=='"')  { ch = '"';  pvalue = ++p; } */
+		/* ignore line continuation */
+		if (strcmp(token, "...") == 0)
+		{
+			SkipLine(r);
+			continue;
+		}
 
-			/* skip over opening bracket */
-			p += skip;
-			pvalue = p;
+		if (!ParseNumber(token, &x))
+			return SetupError(r, "invalid number in array: ", token);
+		if (AppendNumber(r, x) < 0)
+			return -3;
+	}
 
-			/* find closing bracket? */
-			if (ch)
-			{
-				while ((*p!=ch) && (*p!='\0'))
-					p++;
+	item->nRows  = nRows;
+	item->nCols  = nCols;
+	item->number = (double *) SetupAlloc(r->setup, (r->numberlen ? r->numberlen : 1) * sizeof(double));
+	if (!item->number)
+		return SetupError(r, "out of memory", NULL);
+	memcpy(item->number, r->number, r->numberlen * sizeof(double));
+	item->data.value = "";
 
-				/* matching closing bracket not found? */
-				if (*p!=ch)
-				{
-					state = ERRORINCOMPLETE;
-					break;
-				}
+	return 1;
+}
 
-				/* skip over closing bracket if necessary */
-				p += 1-skip;
+/** Parses the value of a field, up to its terminator. */
+static int ParseValue(CSetupReader *r, CFileSetupItem *item)
+{
+	int ch = SkipWhite(r);
 
-				/* zero-terminate string */
-				*p++ = '\0';
+	r->textlen = 0;
+	if (ch == '[')
+	{
+		SKIPCHAR(r);
+		if (ParseArray(r, item) < 0)
+			return -3;
+	}
+	else if (ch == '\'')
+	{
+		/* quoted string */
+		SKIPCHAR(r);
+		while ((ch = PEEKCHAR(r)) != EOF && ch != '\'')
+		{
+			if (AppendText(r, ch) < 0)
+				return -3;
+			SKIPCHAR(r);
+		}
+		if (ch == EOF)
+			return SetupError(r, "missing closing quote in field ", item->name);
+		SKIPCHAR(r);
+		item->data.value = SetupStrdup(r->setup, r->text, r->textlen);
+	}
+	else
+	{
+		/* copy till end-of-line, semi-colon, or end-of-file, without trailing white space */
+		while ((ch = PEEKCHAR(r)) != EOF && ch != '\n' && ch != '\r' && ch != ';')
+		{
+			if (AppendText(r, ch) < 0)
+				return -3;
+			SKIPCHAR(r);
+		}
+		while (r->textlen > 0 && (unsigned char) r->text[r->textlen-1] <= ' ')
+			r->textlen--;
+		item->data.value = SetupStrdup(r->setup, r->text, r->textlen);
+	}
 
-				/* skip trailing whitespace and semi-colons */
-				while (((*p<=' ') && (*p!=0)) || (*p==';'))
-					p++;
-			}
+	/* skip trailing white space and semi-colons on the same line */
+	while ((ch = PEEKCHAR(r)) != EOF && ((ch <= ' ' && ch != '\n') || ch == ';'))
+		SKIPCHAR(r);
 
-			/* copy till end-of-line, semi-colon, or end-of-ile */
-			else
-			{
-				while ((*p!='\n') && (*p!='\r') && (*p!=';') && (*p!='\0'))
-					p++;
+	return item->data.value ? 1 : SetupError(r, "out of memory", NULL);
+}
 
-				/* zero-terminate string */
-				*p++ = '\0';
-			}
+/** Parses one statement of the form name(.name|(index))* = value. 
+ *
+ *	@return 1 if a statement was parsed, 0 at end of file, or negative on error.
+ */
+static int ParseStatement(CSetupReader *r)
+{
+	CFileSetupItem *pItem = &r->setup->root, *pNextItem;
+	int ch;
 
-			/* add item to setup */
-			AddItem(pItem,pname,pvalue);
-			state = DONE;
+	/* skip white space, stray semicolons, and comments */
+	for (;;)
+	{
+		ch = SkipWhite(r);
+		if (ch == EOF)
+			return 0;
+		if (ch == '%')
+			SkipLine(r);
+		else if (ch == ';')
+			SKIPCHAR(r);
+		else
 			break;
+	}
 
-		case COMMENT:
-			while (*p!='\r' && *p!='\n' && *p!=0) 
-				p++;
-			state = READFIELDNAME;
-			break;
+	for (;;)
+	{
+		/* read (sub)field name */
+		r->textlen = 0;
+		while ((ch = PEEKCHAR(r)) != EOF && ch > ' ' && ch != '.' && ch != '=' && ch != '(' && ch != ')')
+		{
+			if (AppendText(r, ch) < 0)
+				return -3;
+			SKIPCHAR(r);
+		}
+		if (AppendText(r, '\0') < 0)
+			return -3;
+
+		if (ch == '(' || ch == '.' || ch == ')')
+		{
+			/* struct name, closing parenthesis may be followed by a period */
+			SKIPCHAR(r);
+			if (ch == ')' && PEEKCHAR(r) == '.')
+				SKIPCHAR(r);
+
+			pNextItem = SetupFindStruct(pItem, r->text);
+			if (!pNextItem) pNextItem = AddItem(r->setup, pItem, r->text, r->textlen-1, SI_STRUCT);
+			if (!pNextItem) 
+				return SetupError(r, "invalid structure of field ", r->text);
+			pItem = pNextItem;
+			continue;
+		}
+
+		/* field name, followed by equals sign */
+		if (SkipWhite(r) != '=')
+			return SetupError(r, "missing '=' after field ", r->text);
+		SKIPCHAR(r);
+		if (r->textlen == 1)
+			return SetupError(r, "missing field name", NULL);
+		if (SetupFindField(pItem, r->text))
+			return SetupError(r, "duplicate field ", r->text);
+
+		pNextItem = AddItem(r->setup, pItem, r->text, r->textlen-1, SI_FIELD);
+		if (!pNextItem)
+			return SetupError(r, "invalid structure of field ", r->text);
+		return ParseValue(r, pNextItem);
+	}
+}
+
+/** Initializes an empty setup tree. */
+void InitSetup(CFileSetup *pSetup)
+{
+	memset(pSetup,0,sizeof(*pSetup));
+	pSetup->root.type = SI_STRUCT;
+	pSetup->root.name = "setup";
+}
+
+/** Adds a field to a setup tree, creating the structs on its path.
+ *
+ *	@param[in]  pSetup		Setup tree.
+ *	@param[in]  path		Field path, such as room.surface.frequency or receiver(1).location.
+ *	@return					New field, without value, or NULL if the field exists or
+ *							its path is invalid.
+ */
+CFileSetupItem *SetupAddField(CFileSetup *pSetup, const char *path)
+{
+	CFileSetupItem *pItem = &pSetup->root, *pNextItem;
+	char   name[256];
+	size_t len;
 
-		case ERRORINCOMPLETE:
-		case ERRORINSTRUCTURE:
-		case ERRORDUPLICATEFIELD:
-			state = DONE;
-			p = NULL;
+	for (;;)
+	{
+		len = strcspn(path, ".()");
+		if (len == 0 || len >= sizeof(name))
+			return NULL;
+		memcpy(name, path, len);
+		name[len] = '\0';
+		path += len;
+
+		if (*path == '\0')
 			break;
 
-        case DONE:
-            break;
-		}
+		/* struct name, closing parenthesis may be followed by a period */
+		path++;
+		if (path[-1] == ')' && *path == '.')
+			path++;
+		pNextItem = SetupFindStruct(pItem, name);
+		if (!pNextItem) pNextItem = AddItem(pSetup, pItem, name, len, SI_STRUCT);
+		if (!pNextItem)
+			return NULL;
+		pItem = pNextItem;
 	}
-	return p;
+
+	if (SetupFindField(pItem, name))
+		return NULL;
+	return AddItem(pSetup, pItem, name, len, SI_FIELD);
 }
 
+/** Reads a setup file.
+ *
+ *	@param[in]  filename	Name of setup file.
+ *	@param[out] pSetup		Setup tree, to be released with FreeSetup.
+ *	@return					1 on success, -1 if the file cannot be opened, 
+ *							-3 on a parse error, described in pSetup->error.
+ */
 int ReadSetup(char *filename, CFileSetup *pSetup)
 {
-	FILE *fid;
-	unsigned long flen;
-	char *p;
-	size_t fread_bytes = 0;
+	CSetupReader *r;
+	int result;
 
 	/* clear output variable */
-	memset(pSetup,0,sizeof(*pSetup));
+	InitSetup(pSetup);
 
-	fid = fopen(filename,"rb");
-	if (!fid) 
+	r = (CSetupReader *) calloc(1, sizeof(CSetupReader));
+	if (!r)
 		return -1;
+	r->setup = pSetup;
+	r->line  = 1;
+	r->fid   = fopen(filename,"rb");
+	if (!r->fid) 
+	{
+		sprintf(pSetup->error, "unable to open file");
+		free(r);
+		return -1;
+	}
 
-	/* determine file length */
-	fseek(fid,0,SEEK_END);
-	flen = ftell(fid);
-	fseek(fid,0,SEEK_SET);
-
-	/* limit file size to 1M */
-	if (flen > 1024*1024) 
-		return -2;
+	while ((result = ParseStatement(r)) > 0)
+		;
 
-	/* allocate and clear buffer to hold file plus a little more */
-	pSetup->buf    = calloc(flen+4,1);
-	pSetup->buflen = flen;
+	fclose(r->fid);
+	free(r->text);
+	free(r->number);
+	free(r);
 
-	/* read file into buffer, close file */
-	fread_bytes = fread(pSetup->buf,1,flen,fid);
-	fclose(fid);
+	return result < 0 ? result : 1;
+}
 
-	pSetup->root.type = SI_STRUCT;
-	pSetup->root.name = "setup";
+/** Releases the memory of a setup tree, including all names and values. */
+void FreeSetup(CFileSetup *pSetup)
+{
+	struct CSetupBlock *block, *next;
 
-	p = pSetup->buf;
-	do
+	for (block=pSetup->blocks; block; block=next)
 	{
-		p = ParseField(p,&pSetup->root);
-	} while (p);
-
-	return 1;
+		next = block->next;
+		free(block);
+	}
+	memset(pSetup,0,sizeof(*pSetup));
 }
 
 void PrintSetup(CFileSetupItem *item)
@@ -0,0 +1,344 @@
+/*********************************************************************//**
+ * @file sweep.c
+ * @brief Sweep table input and output.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "mem.h"
+#include "sweep.h"
+
+/* disable warnings about unsafe CRT functions */
+#ifdef _MSC_VER
+#  pragma warning( disable : 4996)
+#endif
+
+#define SWEEP_HEADERSIZE	24		/**< Size of binary sweep table header. */
+
+static int SweepError(CSweepTable *table, const char *msg, int line)
+{
+	if (line > 0)
+		sprintf(table->error, "line %d: %.200s", line, msg);
+	else
+		sprintf(table->error, "%.200s", msg);
+	MemFree(table->pose);
+	table->pose     = NULL;
+	table->nConfigs = 0;
+	return -3;
+}
+
+static uint64_t GetLE(const unsigned char *p, int nBytes)
+{
+	uint64_t x = 0;
+	while (nBytes--)
+		x = (x << 8) | p[nBytes];
+	return x;
+}
+
+static void PutLE(unsigned char *p, uint64_t x, int nBytes)
+{
+	int i;
+	for (i=0; i<nBytes; i++, x>>=8)
+		p[i] = (unsigned char) x;
+}
+
+/** Grows the table to hold at least \a nConfigs rows. */
+static int GrowSweepTable(CSweepTable *table, int nConfigs, int *maxConfigs)
+{
+	double *pose;
+
+	if (nConfigs <= *maxConfigs)
+		return 1;
+	*maxConfigs = 2 * nConfigs + 64;
+	pose = (double *) MemMalloc((size_t) *maxConfigs * table->nCols * sizeof(double));
+	if (!pose)
+		return 0;
+	if (table->pose)
+	{
+		memcpy(pose, table->pose, (size_t) table->nConfigs * table->nCols * sizeof(double));
+		MemFree(table->pose);
+	}
+	table->pose = pose;
+	return 1;
+}
+
+static int ReadBinarySweepTable(FILE *fid, int nCols, CSweepTable *table)
+{
+	unsigned char header[SWEEP_HEADERSIZE], value[sizeof(double)];
+	uint64_t      nRows, bits;
+	size_t        i, count;
+
+	if (fread(header, 1, SWEEP_HEADERSIZE, fid) != SWEEP_HEADERSIZE)
+		return SweepError(table, "truncated binary sweep table", 0);
+	if (GetLE(header + 8, 4) != SWEEP_VERSION)
+		return SweepError(table, "unsupported binary sweep table version", 0);
+	if ((int) GetLE(header + 12, 4) != nCols)
+		return SweepError(table, "number of columns does not match number of sources and receivers", 0);
+	nRows = GetLE(header + 16, 8);
+	if (nRows > 0x7fffffff / (uint64_t) (nCols > 0 ? nCols : 1))
+		return SweepError(table, "binary sweep table too large", 0);
+
+	table->nConfigs = (int) nRows;
+	count = (size_t) nRows * nCols;
+	table->pose = (double *) MemMalloc((count + 1) * sizeof(double));
+	if (!table->pose)
+		return SweepError(table, "out of memory", 0);
+	for (i=0; i<count; i++)
+	{
+		if (fread(value, 1, sizeof(value), fid) != sizeof(value))
+			return SweepError(table, "truncated binary sweep table", 0);
+		bits = GetLE(value, 8);
+		memcpy(&table->pose[i], &bits, sizeof(double));
+	}
+	return 1;
+}
+
+static int ReadTextSweepTable(FILE *fid, int nCols, CSweepTable *table)
+{
+	char   *line = NULL, *p, *end, *newline;
+	size_t len, size = 0;
+	int    iLine = 0, maxConfigs = 0, n;
+	double x;
+
+	for (;;)
+	{
+		/* read a complete line */
+		len = 0;
+		for (;;)
+		{
+			if (size - len < 256)
+			{
+				size = 2 * size + 256;
+				newline = (char *) realloc(line, size);
+				if (!newline)
+				{
+					free(line);
+					return SweepError(table, "out of memory", iLine);
+				}
+				line = newline;
+			}
+			if (!fgets(line + len, (int) (size - len), fid))
+				break;
+			len += strlen(line + len);
+			if (len > 0 && line[len-1] == '\n')
+				break;
+		}
+		if (len == 0)
+			break;
+		iLine++;
+
+		/* skip comments, empty lines, and a leading header line */
+		p = line + strspn(line, " \t\r\n,");
+		if (*p == '\0' || *p == '%' || *p == '#')
+			continue;
+		if (table->nConfigs == 0 && strtod(p, &end) == 0.0 && end == p)
+			continue;
+
+		if (!GrowSweepTable(table, table->nConfigs + 1, &maxConfigs))
+		{
+			free(line);
+			return SweepError(table, "out of memory", iLine);
+		}
+		for (n=0; ; n++)
+		{
+			p += strspn(p, " \t\r\n,;");
+			if (*p == '\0' || *p == '%' || *p == '#')
+				break;
+			x = strtod(p, &end);
+			if (end == p || n >= nCols)
+			{
+				char msg[128];
+				sprintf(msg, end == p ? "invalid value" : "expected %d values per configuration", nCols);
+				free(line);
+				return SweepError(table, msg, iLine);
+			}
+			table->pose[(size_t) table->nConfigs * nCols + n] = x;
+			p = end;
+		}
+		if (n != nCols)
+		{
+			char msg[128];
+			sprintf(msg, "expected %d values per configuration", nCols);
+			free(line);
+			return SweepError(table, msg, iLine);
+		}
+		table->nConfigs++;
+	}
+
+	free(line);
+	return 1;
+}
+
+/** Reads a sweep table, in text or binary form.
+ *
+ *	@param[in]  filename	Name of sweep table file.
+ *	@param[in]  nCols		Expected number of values per configuration, 6 per source and receiver.
+ *	@param[out] table		Sweep table, to be released with FreeSweepTable.
+ *	@return					1 on success, -1 if the file cannot be opened, or
+ *							-3 if the file is invalid, described in table->error.
+ */
+int ReadSweepTable(const char *filename, int nCols, CSweepTable *table)
+{
+	char magic[sizeof(SWEEP_MAGIC) - 1];
+	FILE *fid;
+	int  result;
+
+	memset(table, 0, sizeof(*table));
+	table->nCols = nCols;
+
+	fid = fopen(filename, "rb");
+	if (!fid)
+	{
+		sprintf(table->error, "unable to open file");
+		return -1;
+	}
+
+	/* binary tables are recognized by their signature */
+	if (fread(magic, 1, sizeof(magic), fid) == sizeof(magic) && memcmp(magic, SWEEP_MAGIC, sizeof(magic)) == 0)
+	{
+		rewind(fid);
+		result = ReadBinarySweepTable(fid, nCols, table);
+	}
+	else
+	{
+		rewind(fid);
+		result = ReadTextSweepTable(fid, nCols, table);
+	}
+	fclose(fid);
+
+	if (result > 0 && table->nConfigs == 0)
+		result = SweepError(table, "no configurations in sweep table", 0);
+	return result;
+}
+
+/** Writes a sweep table in binary form.
+ *
+ *	@return		1 on success, or -1 if the file cannot be written.
+ */
+int WriteSweepTable(const char *filename, const CSweepTable *table)
+{
+	unsigned char header[SWEEP_HEADERSIZE], value[sizeof(double)];
+	uint64_t      bits;
+	size_t        i, count = (size_t) table->nConfigs * table->nCols;
+	FILE          *fid = fopen(filename, "wb");
+	int           failed;
+
+	if (!fid)
+		return -1;
+
+	memcpy(header, SWEEP_MAGIC, 8);
+	PutLE(header + 8,  SWEEP_VERSION, 4);
+	PutLE(header + 12, (uint64_t) table->nCols, 4);
+	PutLE(header + 16, (uint64_t) table->nConfigs, 8);
+	fwrite(header, 1, SWEEP_HEADERSIZE, fid);
+	for (i=0; i<count; i++)
+	{
+		memcpy(&bits, &table->pose[i], sizeof(double));
+		PutLE(value, bits, 8);
+		fwrite(value, 1, sizeof(value), fid);
+	}
+
+	failed = ferror(fid);
+	return fclose(fid) == 0 && !failed ? 1 : -1;
+}
+
+/** Releases a sweep table. */
+void FreeSweepTable(CSweepTable *table)
+{
+	if (table->pose)
+		MemFree(table->pose);
+	table->pose     = NULL;
+	table->nConfigs = 0;
+}
+
+/** Returns the angle \a b - \a a, wrapped to [-180,180) degrees. */
+static double AngleDifference(double a, double b)
+{
+	double d = fmod(b - a + 180.0, 360.0);
+	return (d < 0 ? d + 360.0 : d) - 180.0;
+}
+
+/** Samples a trajectory at a fixed time step.
+ *
+ *	A trajectory is a table whose rows hold a time [s], in increasing order,
+ *	followed by the location and orientation (x y z yaw pitch roll) of every
+ *	source and receiver at that time. The frames are taken every \a timestep
+ *	seconds from the first time to the last, with locations interpolated 
+ *	linearly between the rows around them, and orientations along the 
+ *	shorter way around.
+ *
+ *	@param[in]  trajectory	Trajectory, read with ReadSweepTable.
+ *	@param[in]  timestep	Time between frames [s], or 0 to take the rows as frames.
+ *	@param[out] frames		Frames of the trajectory, in the same form, 
+ *							to be released with FreeSweepTable.
+ *	@return					1 on success, or -3 if the trajectory is invalid, 
+ *							described in frames->error.
+ */
+int ResampleTrajectory(const CSweepTable *trajectory, double timestep, CSweepTable *frames)
+{
+	const double *row0, *row1;
+	double *frame, t, w;
+	int    nCols = trajectory->nCols, nFrames, i, j, k;
+
+	memset(frames, 0, sizeof(*frames));
+	frames->nCols = nCols;
+	if (nCols < 7 || (nCols - 1) % 6 != 0)
+		return SweepError(frames, "trajectory rows must hold a time and 6 values per source and receiver", 0);
+	for (i=1; i<trajectory->nConfigs; i++)
+	{
+		if (!(trajectory->pose[(size_t) i * nCols] > trajectory->pose[(size_t) (i-1) * nCols]))
+		{
+			char msg[128];
+			sprintf(msg, "time of row %d does not follow that of the previous row", i+1);
+			return SweepError(frames, msg, 0);
+		}
+	}
+
+	if (timestep > 0 && trajectory->nConfigs > 1)
+	{
+		t = trajectory->pose[(size_t) (trajectory->nConfigs - 1) * nCols] - trajectory->pose[0];
+		if (t / timestep > 0x7ffffffe)
+			return SweepError(frames, "too many trajectory frames", 0);
+		nFrames = 1 + (int) floor(t / timestep + 1e-9);
+	}
+	else
+		nFrames = trajectory->nConfigs;
+
+	frames->pose = (double *) MemMalloc(((size_t) nFrames * nCols + 1) * sizeof(double));
+	if (!frames->pose)
+		return SweepError(frames, "out of memory", 0);
+	frames->nConfigs = nFrames;
+	if (nFrames == trajectory->nConfigs && !(timestep > 0))
+	{
+		memcpy(frames->pose, trajectory->pose, (size_t) nFrames * nCols * sizeof(double));
+		return 1;
+	}
+
+	for (i=0, j=0; i<nFrames; i++)
+	{
+		/* find the rows around the time of this frame */
+		t = trajectory->pose[0] + i * timestep;
+		while (j + 2 < trajectory->nConfigs && trajectory->pose[(size_t) (j+1) * nCols] <= t)
+			j++;
+		row0  = &trajectory->pose[(size_t) j * nCols];
+		row1  = trajectory->nConfigs > 1 ? row0 + nCols : row0;
+		w     = row1[0] > row0[0] ? (t - row0[0]) / (row1[0] - row0[0]) : 0.0;
+		if (w > 1)
+			w = 1;
+		frame = &frames->pose[(size_t) i * nCols];
+
+		frame[0] = t;
+		for (k=1; k<nCols; k++)
+		{
+			if ((k - 1) % 6 < 3)
+				frame[k] = row0[k] + w * (row1[k] - row0[k]);
+			else
+				frame[k] = row0[k] + w * AngleDifference(row0[k], row1[k]);
+		}
+	}
+	return 1;
+}
@@ -0,0 +1,191 @@
+/*********************************************************************//**
+ * @file thread.c
+ * @brief Portable threading primitives.
+ **********************************************************************/
+
+#include <stdlib.h>
+
+#include "thread.h"
+
+#ifndef _WIN32
+#  include <unistd.h>
+#endif
+
+/* maximum number of threads started by ThreadRun */
+#define MAXTHREADS 256
+
+/** Determines the number of threads to use.
+ *
+ *	@param[in]  nRequested	Requested number of threads, or 0 (or less) for one per logical processor.
+ *	@return					Number of threads, between 1 and MAXTHREADS.
+ */
+int ThreadCount(int nRequested)
+{
+	int n = nRequested;
+
+	if (n <= 0)
+	{
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		n = (int) info.dwNumberOfProcessors;
+#else
+		n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	}
+	if (n < 1) n = 1;
+	if (n > MAXTHREADS) n = MAXTHREADS;
+	return n;
+}
+
+typedef struct {
+	CThreadFunction function;
+	void            *arg;
+	int             iThread;
+} CThreadStart;
+
+#ifdef _WIN32
+static DWORD WINAPI ThreadMain(LPVOID p)
+#else
+static void *ThreadMain(void *p)
+#endif
+{
+	CThreadStart *start = (CThreadStart *) p;
+	start->function(start->iThread, start->arg);
+	return 0;
+}
+
+/** Runs \a function on \a nThreads threads and waits until all have returned.
+ *
+ *	@param[in]  nThreads	Number of threads; the calling thread acts as thread 0.
+ *	@param[in]  function	Worker function.
+ *	@param[in]  arg			Argument passed to every call of \a function.
+ *
+ *  @note
+ *     If a thread cannot be created, its share of the work is run on the 
+ *     calling thread afterwards, so \a function is always called for every
+ *     thread index.
+ */
+void ThreadRun(int nThreads, CThreadFunction function, void *arg)
+{
+	CThreadStart start[MAXTHREADS];
+	int          created[MAXTHREADS];
+#ifdef _WIN32
+	HANDLE       thread[MAXTHREADS];
+#else
+	pthread_t    thread[MAXTHREADS];
+#endif
+	int i;
+
+	if (nThreads > MAXTHREADS) nThreads = MAXTHREADS;
+
+	for (i=1; i<nThreads; i++)
+	{
+		start[i].function = function;
+		start[i].arg      = arg;
+		start[i].iThread  = i;
+#ifdef _WIN32
+		thread[i]  = CreateThread(NULL, 0, ThreadMain, &start[i], 0, NULL);
+		created[i] = thread[i] != NULL;
+#else
+		created[i] = pthread_create(&thread[i], NULL, ThreadMain, &start[i]) == 0;
+#endif
+	}
+
+	function(0, arg);
+
+	for (i=1; i<nThreads; i++)
+	{
+		if (!created[i])
+		{
+			function(i, arg);
+			continue;
+		}
+#ifdef _WIN32
+		WaitForSingleObject(thread[i], INFINITE);
+		CloseHandle(thread[i]);
+#else
+		pthread_join(thread[i], NULL);
+#endif
+	}
+}
+
+void MutexInit(CMutex *mutex)
+{
+#ifdef _WIN32
+	InitializeSRWLock(mutex);
+#else
+	pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void MutexDestroy(CMutex *mutex)
+{
+#ifndef _WIN32
+	pthread_mutex_destroy(mutex);
+#else
+	(void) mutex;
+#endif
+}
+
+void MutexLock(CMutex *mutex)
+{
+#ifdef _WIN32
+	AcquireSRWLockExclusive(mutex);
+#else
+	pthread_mutex_lock(mutex);
+#endif
+}
+
+void MutexUnlock(CMutex *mutex)
+{
+#ifdef _WIN32
+	ReleaseSRWLockExclusive(mutex);
+#else
+	pthread_mutex_unlock(mutex);
+#endif
+}
+
+/** Releases the locked \a mutex, waits until \a condition is signalled, and
+ *  locks \a mutex again. Waits may end spuriously; recheck the condition. */
+void ConditionWait(CCondition *condition, CMutex *mutex)
+{
+#ifdef _WIN32
+	SleepConditionVariableSRW(condition, mutex, INFINITE, 0);
+#else
+	pthread_cond_wait(condition, mutex);
+#endif
+}
+
+/** Wakes all threads waiting for \a condition. */
+void ConditionBroadcast(CCondition *condition)
+{
+#ifdef _WIN32
+	WakeAllConditionVariable(condition);
+#else
+	pthread_cond_broadcast(condition);
+#endif
+}
+
+/** Atomically increments \a value and returns the incremented value. */
+long AtomicIncrement(volatile long *value)
+{
+#ifdef _WIN32
+	return InterlockedIncrement(value);
+#else
+	return __sync_add_and_fetch(value, 1);
+#endif
+}
+
+/** Atomically replaces \a value by \a x and returns its previous value, 
+ *  with a full memory barrier: writes before the exchange are visible to 
+ *  the thread that takes \a x. */
+long AtomicExchange(volatile long *value, long x)
+{
+#ifdef _WIN32
+	return InterlockedExchange(value, x);
+#else
+	__sync_synchronize();
+	return __sync_lock_test_and_set(value, x);
+#endif
+}
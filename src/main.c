@@ -5,10 +5,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "libroomsim.h"
 #include "interface.h"
+#include "binsetup.h"
+#include "dsp.h"
 #include "setup.h"
+#include "sweep.h"
+#include "thread.h"
 #include "msg.h"
 #include "build.h"
 #include "wavwriter.h"
@@ -20,47 +25,24 @@
 
 #if !defined(UNITTEST)
 
-int main(int argc, char **argv)
+/** Writes the responses of all source-receiver pairs to WAVE files named
+ *  <prefix>_receiver_<i>.wav. Sparse responses hold only their active span;
+ *  the sample offset of each file is written to <prefix>_offsets.txt.
+ *
+ *	@return		0 on success, 1 if out of memory.
+ */
+static int WriteResponses(const CRoomSetup *pSetup, const BRIR *response, const char *prefix, int verbose)
 {
-	CRoomSetup setup;
-    BRIR	   *response;
-    FILE	   *fid;
-	int		   i, j, k;
-	CFileSetup filesetup;
-	char	   filename[256];
+	int		   i, j, k, nChannels = 1;
+	char	   filename[512];
 	Wave	   w;
 	float      *sample;
+	FILE       *offsets = NULL;
 
-	printf(SOFAMYROOM_NAME " v" SOFAMYROOM_VERSION ", built %s %s\n", builddate, buildtime);
-
-	if (argc<=1)
-	{
-		MsgPrintf("Usage: sofamyroom setup\n");
-		return 0;
-	}
-
-	MsgPrintf("Reading setup file '%s'...\n", argv[1]);
-	if (ReadSetup(argv[1],&filesetup) < 0)
-	{
-		char msg[256];
-		sprintf(msg,"error reading setup file '%s'\n",argv[1]);
-		MsgErrorExit(msg);
-	}
-
-	//PrintSetup(&filesetup.root); 
-	LoadCRoomSetup(&filesetup.root,&setup);
-	//Roomsetup(&setup);
-	ValidateSetup(&setup);
-
-	/* run the simulator */
-    response = Roomsim(&setup);
-
-#define FWVAR(v) fwrite(&(v),sizeof(v),1,fid)
-#define FWDBLARR(v,c) fwrite(v,sizeof((v)[0]),c,fid)
-
-	fid = NULL;
-
-	sample = (float*)malloc(response[0].nChannels * sizeof(float));
+	for (i = 0; i < pSetup->nSources*pSetup->nReceivers; i++)
+		if (response[i].nChannels > nChannels)
+			nChannels = response[i].nChannels;
+	sample = (float*)malloc(nChannels * sizeof(float));
 
 	if (!sample)
 	{
@@ -68,11 +50,20 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	for (i = 0; i < setup.nSources*setup.nReceivers; i++)
+	if (pSetup->options.responsefloordB < 0)
 	{
-		sprintf(filename, "%s_receiver_%d.wav", setup.options.outputname, i);
+		sprintf(filename, "%.480s_offsets.txt", prefix);
+		offsets = fopen(filename, "w");
+		if (!offsets)
+			MsgPrintf("Unable to write offsets file '%s'\n", filename);
+	}
 
-		MsgPrintf("Writing output file '%s'\n", filename);
+	for (i = 0; i < pSetup->nSources*pSetup->nReceivers; i++)
+	{
+		sprintf(filename, "%.480s_receiver_%d.wav", prefix, i);
+
+		if (verbose)
+			MsgPrintf("Writing output file '%s'\n", filename);
 
 		w = makeWave(3, (int)response[i].fs, (short int)response[i].nChannels, (short int)32);
 		waveSetDuration(&w, (float)(response[i].nSamples / response[i].fs));
@@ -87,22 +78,572 @@ int main(int argc, char **argv)
 		waveToFile(&w, filename);
 		waveDestroy(&w);
 
+		if (offsets)
+			fprintf(offsets, "%s %d\n", filename, response[i].offset);
 	}
 
+	if (offsets)
+		fclose(offsets);
 	free(sample);
-    
-	/* release BRIR memory */
+	return 0;
+}
+
+/** Sweep state of the command line program. */
+typedef struct {
+	int nConfigs;
+	int nDone;
+	int failed;
+} CSweepOutput;
+
+/** Writes the responses of a sweep configuration as soon as it completes. */
+static void WriteSweepResponses(int iConfig, const CRoomSetup *pSetup, const BRIR *brir, void *arg)
+{
+	CSweepOutput *output = (CSweepOutput *) arg;
+	char         prefix[300];
+
+	sprintf(prefix, "%.280s_%d", pSetup->options.outputname, iConfig);
+	output->failed |= WriteResponses(pSetup, brir, prefix, 0);
+	output->nDone++;
+	MsgPrintf("Configuration %d done (%d of %d), written to '%s_receiver_*.wav'\n",
+		iConfig, output->nDone, output->nConfigs, prefix);
+}
+
+/** Trajectory state of the command line program. */
+typedef struct {
+	const CSweepTable *frames;
+	int nDone;
+	int failed;
+} CTrajectoryOutput;
+
+/** Writes the responses of a trajectory frame as soon as it completes. */
+static void WriteTrajectoryResponses(int iFrame, const CRoomSetup *pSetup, const BRIR *brir, void *arg)
+{
+	CTrajectoryOutput *output = (CTrajectoryOutput *) arg;
+	char              prefix[300];
+
+	sprintf(prefix, "%.270s_frame_%d", pSetup->options.outputname, iFrame);
+	output->failed |= WriteResponses(pSetup, brir, prefix, 0);
+	output->nDone++;
+	MsgPrintf("Frame %d at %.3f s done (%d of %d), written to '%s_receiver_*.wav'\n",
+		iFrame, output->frames->pose[(size_t) iFrame * output->frames->nCols], 
+		output->nDone, output->frames->nConfigs, prefix);
+}
+
+/** Simulates the frames of a trajectory file, sampled every \a timestep seconds,
+ *  and lists the time of each frame in <outputname>_frames.txt.
+ *
+ *	@return		0 on success, 1 if the responses cannot be written.
+ */
+static int RunTrajectory(const CRoomSetup *pSetup, const char *filename, double timestep)
+{
+	CSweepTable       trajectory, frames;
+	CTrajectoryOutput output;
+	char              name[512];
+	FILE              *fid;
+	int               i;
+
+	if (ReadSweepTable(filename, 1 + 6 * (pSetup->nSources + pSetup->nReceivers), &trajectory) < 0
+		|| ResampleTrajectory(&trajectory, timestep, &frames) < 0)
+	{
+		char msg[512];
+		sprintf(msg,"error reading trajectory '%.200s'\n%s",filename,trajectory.pose ? frames.error : trajectory.error);
+		MsgErrorExit(msg);
+	}
+	FreeSweepTable(&trajectory);
+
+	sprintf(name, "%.490s_frames.txt", pSetup->options.outputname);
+	fid = fopen(name, "w");
+	if (!fid)
+	{
+		FreeSweepTable(&frames);
+		return 1;
+	}
+	for (i=0; i<frames.nConfigs; i++)
+		fprintf(fid, "%d %.9g\n", i, frames.pose[(size_t) i * frames.nCols]);
+	fclose(fid);
+
+	MsgPrintf("Simulating %d trajectory frames...\n", frames.nConfigs);
+	output.frames = &frames;
+	output.nDone  = 0;
+	output.failed = 0;
+	RoomsimTrajectory(pSetup, &frames, WriteTrajectoryResponses, &output);
+
+	FreeSweepTable(&frames);
+	return output.failed;
+}
+
+#define AURALIZE_BLOCKSIZE	4096	/**< Block size of the auralization convolution. */
+
+/** Convolves a dry mono WAVE file per source with the responses of the setup,
+ *  writing the sum over sources at each receiver to 
+ *  <outputname>_auralized_receiver_<r>.wav. The inputs are streamed in blocks, 
+ *  so memory does not grow with their length.
+ *
+ *	@return		0 on success, 1 if an output cannot be written.
+ */
+static int RunAuralization(const CRoomSetup *pSetup, char **filename, int nFiles)
+{
+	int              nSources = pSetup->nSources, nReceivers = pSetup->nReceivers;
+	int              B = AURALIZE_BLOCKSIZE, failed = 0;
+	int              si, ri, c, i, n, maxlength, maxchannels = 1;
+	long long        length, done, inputlength = 0;
+	WaveStream       *input, *output;
+	CPartitionedConv **conv;
+	BRIR             *response;
+	double           *x, *y;
+	float            *block, *frame;
+	char             name[512];
+
+	if (nFiles != nSources)
+	{
+		char msg[256];
+		sprintf(msg,"expected one input file per source (%d), got %d\n",nSources,nFiles);
+		MsgErrorExit(msg);
+	}
+
+	/* open the inputs, which must match the sample rate of the simulation */
+	input = (WaveStream *) malloc(nSources * sizeof(WaveStream));
+	for (si=0; si<nSources; si++)
+	{
+		char msg[512];
+		if (!waveOpenRead(&input[si], filename[si]))
+		{
+			sprintf(msg,"unable to read WAVE file '%.200s'\n",filename[si]);
+			MsgErrorExit(msg);
+		}
+		if (input[si].numChannels != 1 || input[si].sampleRate != (int) pSetup->options.fs)
+		{
+			sprintf(msg,"input '%.200s' must be mono at %g Hz\n",filename[si],pSetup->options.fs);
+			MsgErrorExit(msg);
+		}
+		if (input[si].nFrames > inputlength)
+			inputlength = input[si].nFrames;
+	}
+
+	MsgPrintf("Simulating responses for auralization...\n");
+	response = Roomsim(pSetup);
+
+	/* one convolution per receiver, of all sources into its channels */
+	conv   = (CPartitionedConv **) malloc(nReceivers * sizeof(CPartitionedConv *));
+	output = (WaveStream *) malloc(nReceivers * sizeof(WaveStream));
+	length = 0;
+	for (ri=0; ri<nReceivers; ri++)
+	{
+		const BRIR *h = &response[ri * nSources];
+
+		for (si=0, maxlength=1; si<nSources; si++)
+			if (h[si].offset + h[si].nSamples > maxlength)
+				maxlength = h[si].offset + h[si].nSamples;
+		if (h[0].nChannels > maxchannels)
+			maxchannels = h[0].nChannels;
+		if (inputlength + maxlength - 1 > length)
+			length = inputlength + maxlength - 1;
+
+		conv[ri] = AllocPartitionedConv(B, nSources, h[0].nChannels, maxlength);
+		for (si=0; si<nSources; si++)
+			for (c=0; c<h[si].nChannels; c++)
+				SetPartitionedConvFilter(conv[ri], si, c, &h[si].sample[(size_t) c * h[si].nSamples], 
+					h[si].nSamples, h[si].offset);
+
+		sprintf(name, "%.470s_auralized_receiver_%d.wav", pSetup->options.outputname, ri);
+		if (!waveOpenWrite(&output[ri], name, (int) pSetup->options.fs, (short int) h[0].nChannels))
+		{
+			char msg[600];
+			sprintf(msg,"unable to write WAVE file '%s'\n",name);
+			MsgErrorExit(msg);
+		}
+		MsgPrintf("Writing output file '%s'\n", name);
+	}
 	ReleaseBRIR(response);
 
-	/* release sensors */
+	x     = (double *) malloc((size_t) nSources * B * sizeof(double));
+	y     = (double *) malloc((size_t) maxchannels * B * sizeof(double));
+	block = (float *) malloc((size_t) maxchannels * B * sizeof(float));
+
+	/* stream the inputs, zero padded, until the tails of the responses end */
+	for (done=0; done<length; done+=B)
+	{
+		for (si=0; si<nSources; si++)
+		{
+			n = (int) waveReadFloat(&input[si], block, B);
+			for (i=0; i<n; i++)
+				x[(size_t) si * B + i] = block[i];
+			for (; i<B; i++)
+				x[(size_t) si * B + i] = 0.0;
+		}
+
+		n = length - done < B ? (int) (length - done) : B;
+		for (ri=0; ri<nReceivers; ri++)
+		{
+			int nChannels = output[ri].numChannels;
+			PartitionedConvProcess(conv[ri], x, y);
+			for (i=0, frame=block; i<n; i++, frame+=nChannels)
+				for (c=0; c<nChannels; c++)
+					frame[c] = (float) y[(size_t) c * B + i];
+			if (!waveWriteFloat(&output[ri], block, n))
+				failed = 1;
+		}
+	}
+
+	for (ri=0; ri<nReceivers; ri++)
+	{
+		if (!waveClose(&output[ri]))
+			failed = 1;
+		FreePartitionedConv(conv[ri]);
+	}
+	for (si=0; si<nSources; si++)
+		waveClose(&input[si]);
+	free(block);
+	free(y);
+	free(x);
+	free(output);
+	free(conv);
+	free(input);
+	return failed;
+}
+
+#define BATCH_MAXPATH	1024	/**< Maximum length of a setup file name in a manifest. */
+
+/** Batch state of the command line program. */
+typedef struct {
+	char          **job;		/**< Setup file names, in manifest order. */
+	int           nJobs;
+	int           nRemaining;	/**< Number of jobs not completed by earlier runs. */
+	char          **done;		/**< Sorted setup file names completed by earlier runs. */
+	int           nDone;
+	FILE          *progress;	/**< Progress file, to which completed setups are appended. */
+	int           nWorkers;
+	volatile long next;			/**< Number of jobs taken, in manifest order by all workers. */
+	int           nCompleted, nFailed;
+	CMutex        lock;			/**< Serializes progress output. */
+} CBatch;
+
+static char *CopyString(const char *s)
+{
+	char *copy = (char *) malloc(strlen(s) + 1);
+	if (copy)
+		strcpy(copy, s);
+	return copy;
+}
+
+static int CompareStrings(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/** Reads the lines of a list file, skipping blank lines and comments.
+ *
+ *	@return		Number of lines, or -1 if the file cannot be opened.
+ */
+static int ReadFileList(const char *filename, char ***list)
+{
+	char line[BATCH_MAXPATH], *p, *end, **grown;
+	int  n = 0, size = 0;
+	FILE *fid = fopen(filename, "r");
+
+	*list = NULL;
+	if (!fid)
+		return -1;
+	while (fgets(line, sizeof(line), fid))
+	{
+		/* trim white space */
+		for (p = line; *p == ' ' || *p == '\t'; p++);
+		for (end = p + strlen(p); end > p && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'); end--);
+		*end = '\0';
+		if (*p == '\0' || *p == '#' || *p == '%')
+			continue;
+
+		if (n == size)
+		{
+			size  = 2 * size + 64;
+			grown = (char **) realloc(*list, size * sizeof(char *));
+			if (!grown)
+				break;
+			*list = grown;
+		}
+		if (((*list)[n] = CopyString(p)) == NULL)
+			break;
+		n++;
+	}
+	fclose(fid);
+	return n;
+}
+
+static void FreeFileList(char **list, int n)
+{
+	while (n-- > 0)
+		free(list[n]);
+	free(list);
+}
+
+/** Simulates the next setup of the manifest not taken by another worker, until none is left. */
+static void BatchWorker(int iThread, void *arg)
+{
+	CBatch       *batch = (CBatch *) arg;
+	CRoomSetup   setup;
+	CFileSetup   filesetup;
+	CBinarySetup binsetup;
+	BRIR         *response;
+	char         *filename;
+	char         *error, message[256];
+	long         i;
+	int          binary, result;
+
+	(void) iThread;
+
+	while ((i = AtomicIncrement(&batch->next) - 1) < batch->nJobs)
+	{
+		filename = batch->job[i];
+		if (batch->nDone > 0 && bsearch(&filename, batch->done, batch->nDone, sizeof(char *), CompareStrings))
+			continue;
+
+		/* each worker reads its setup just in time, and holds one simulation at a time;
+		   fields missing from a setup file stay zero, and fail the checks below */
+		memset(&setup, 0, sizeof(setup));
+		binary = IsBinarySetup(filename);
+		if (binary)
+		{
+			result = ReadBinarySetup(filename, &binsetup, &setup);
+			error  = binsetup.error;
+		}
+		else
+		{
+			result = ReadSetup(filename, &filesetup);
+			error  = filesetup.error;
+			if (result >= 0)
+				LoadCRoomSetup(&filesetup.root, &setup);
+		}
+
+		/* a setup that cannot be simulated fails, and the batch goes on */
+		if (result >= 0 && CheckSetup(&setup, message) < 0)
+		{
+			result = -1;
+			error  = message;
+		}
+		if (result >= 0 && batch->nWorkers > 1)
+		{
+			/* parallelize over setups, not within simulations */
+			setup.options.numberofthreads = 1;
+			setup.options.verbose         = false;
+		}
+
+		/* simulate, sharing sensors with the other workers */
+		if (result >= 0 && RoomsimAcquireSensors(&setup, message) < 0)
+		{
+			result = -1;
+			error  = message;
+		}
+		if (result < 0)
+		{
+			MutexLock(&batch->lock);
+			MsgPrintf("error in setup file '%s'\n%s\n", filename, error);
+			batch->nFailed++;
+			MutexUnlock(&batch->lock);
+			if (binary)
+				FreeBinarySetup(&binsetup);
+			else
+				FreeSetup(&filesetup);
+			continue;
+		}
+		response = Roomsim(&setup);
+		RoomsimReleaseSensors();
+
+		result = WriteResponses(&setup, response, setup.options.outputname, 0);
+		ReleaseBRIR(response);
+
+		MutexLock(&batch->lock);
+		if (result == 0)
+		{
+			batch->nCompleted++;
+			if (batch->progress)
+			{
+				fprintf(batch->progress, "%s\n", filename);
+				fflush(batch->progress);
+			}
+			MsgPrintf("[%d/%d] %s -> %s_receiver_*.wav\n", batch->nCompleted + batch->nFailed,
+				batch->nRemaining, filename, setup.options.outputname);
+		}
+		else
+			batch->nFailed++;
+		MutexUnlock(&batch->lock);
+
+		if (binary)
+			FreeBinarySetup(&binsetup);
+		else
+			FreeSetup(&filesetup);
+	}
+}
+
+/** Simulates all setups listed in a manifest, on \a nWorkers threads.
+ *
+ *	Setups listed in the progress file <manifest>.progress have been completed
+ *	by an earlier run and are skipped; completed setups are appended to it.
+ *
+ *	@return		0 if all setups were simulated, 1 otherwise.
+ */
+static int RunBatch(const char *manifest, int nWorkers)
+{
+	CBatch batch;
+	char   progress[BATCH_MAXPATH + 16];
+	int    i;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.nJobs = ReadFileList(manifest, &batch.job);
+	if (batch.nJobs < 0)
+	{
+		MsgPrintf("error reading manifest '%s'\n", manifest);
+		return 1;
+	}
+
+	/* resume from the setups completed by earlier runs */
+	sprintf(progress, "%.*s.progress", BATCH_MAXPATH, manifest);
+	batch.nDone = ReadFileList(progress, &batch.done);
+	if (batch.nDone < 0)
+		batch.nDone = 0;
+	qsort(batch.done, batch.nDone, sizeof(char *), CompareStrings);
+	batch.nRemaining = batch.nJobs;
+	for (i=0; i<batch.nJobs; i++)
+		if (batch.nDone > 0 && bsearch(&batch.job[i], batch.done, batch.nDone, sizeof(char *), CompareStrings))
+			batch.nRemaining--;
+	batch.progress = fopen(progress, "a");
+	if (!batch.progress)
+		MsgPrintf("warning: unable to write progress file '%s'\n", progress);
+
+	batch.nWorkers = ThreadCount(nWorkers);
+	if (batch.nWorkers > batch.nJobs)
+		batch.nWorkers = batch.nJobs > 0 ? batch.nJobs : 1;
+	MutexInit(&batch.lock);
+
+	MsgPrintf("Simulating %d setups on %d threads (%d completed before)...\n",
+		batch.nRemaining, batch.nWorkers, batch.nJobs - batch.nRemaining);
+	ThreadRun(batch.nWorkers, BatchWorker, &batch);
+	MsgPrintf("%d setups simulated, %d failed\n", batch.nCompleted, batch.nFailed);
+
+	MutexDestroy(&batch.lock);
+	if (batch.progress)
+		fclose(batch.progress);
+	FreeFileList(batch.job, batch.nJobs);
+	FreeFileList(batch.done, batch.nDone);
+	return batch.nFailed > 0;
+}
+
+int main(int argc, char **argv)
+{
+	CRoomSetup setup;
+    BRIR	   *response;
+	CFileSetup filesetup;
+	CBinarySetup binsetup;
+	CSweepTable table;
+	CSweepOutput output;
+	int        binary, result;
+
+	printf(SOFAMYROOM_NAME " v" SOFAMYROOM_VERSION ", built %s %s\n", builddate, buildtime);
+
+	if (argc<=1)
+	{
+		MsgPrintf("Usage: sofamyroom setup [sweeptable]\n");
+		MsgPrintf("       sofamyroom setup -trajectory trajectory [timestep]\n");
+		MsgPrintf("       sofamyroom setup -auralize source1.wav [source2.wav ...]\n");
+		MsgPrintf("       sofamyroom -batch manifest [threads]\n");
+		return 0;
+	}
+
+	if (strcmp(argv[1], "-batch") == 0)
+	{
+		if (argc<=2)
+		{
+			MsgPrintf("Usage: sofamyroom -batch manifest [threads]\n");
+			return 1;
+		}
+		result = RunBatch(argv[2], argc>3 ? atoi(argv[3]) : 0);
+		ClearAllSensors();
+		CleanupFFTW();
+		return result;
+	}
+
+	MsgPrintf("Reading setup file '%s'...\n", argv[1]);
+	binary = IsBinarySetup(argv[1]);
+	if (binary)
+	{
+		/* binary setup, mapped into memory */
+		if (ReadBinarySetup(argv[1],&binsetup,&setup) < 0)
+		{
+			char msg[512];
+			sprintf(msg,"error reading binary setup file '%.200s'\n%s",argv[1],binsetup.error);
+			MsgErrorExit(msg);
+		}
+	}
+	else
+	{
+		if (ReadSetup(argv[1],&filesetup) < 0)
+		{
+			char msg[512];
+			sprintf(msg,"error reading setup file '%.200s'\n%s",argv[1],filesetup.error);
+			MsgErrorExit(msg);
+		}
+
+		//PrintSetup(&filesetup.root); 
+		LoadCRoomSetup(&filesetup.root,&setup);
+	}
+	//Roomsetup(&setup);
+	ValidateSetup(&setup);
+
+	if (argc>3 && strcmp(argv[2], "-trajectory") == 0)
+	{
+		/* trajectory: simulate moving sources and receivers frame by frame */
+		result = RunTrajectory(&setup, argv[3], argc>4 ? atof(argv[4]) : 0);
+	}
+	else if (argc>2 && strcmp(argv[2], "-auralize") == 0)
+	{
+		/* auralization: convolve dry source signals with the responses */
+		result = RunAuralization(&setup, &argv[3], argc - 3);
+	}
+	else if (argc>2)
+	{
+		/* sweep: simulate every configuration of the sweep table */
+		if (ReadSweepTable(argv[2], 6 * (setup.nSources + setup.nReceivers), &table) < 0)
+		{
+			char msg[512];
+			sprintf(msg,"error reading sweep table '%.200s'\n%s",argv[2],table.error);
+			MsgErrorExit(msg);
+		}
+		MsgPrintf("Simulating %d configurations...\n", table.nConfigs);
+
+		output.nConfigs = table.nConfigs;
+		output.nDone    = 0;
+		output.failed   = 0;
+		RoomsimSweep(&setup, &table, WriteSweepResponses, &output);
+		result = output.failed;
+
+		FreeSweepTable(&table);
+	}
+	else
+	{
+		/* run the simulator */
+		response = Roomsim(&setup);
+
+		result = WriteResponses(&setup, response, setup.options.outputname, 1);
+
+		/* release BRIR memory */
+		ReleaseBRIR(response);
+	}
+
+	/* release sensors and cached FFTW plans */
 	ClearAllSensors();
+	CleanupFFTW();
+
+	/* release setup, which holds the strings of the room setup */
+	if (binary)
+		FreeBinarySetup(&binsetup);
+	else
+		FreeSetup(&filesetup);
 
 #ifdef DEBUG
 	printf("Press return to exit...\n");
 	getchar();
 #endif
 
-    return 0;
+    return result;
 }
 
 #else /* defined(UNITTEST) */
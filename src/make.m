@@ -5,6 +5,9 @@ function make(varargin)
 %
 %   MAKE TEST builds the unit tests of the sofamyroom project and updates the
 %   sofamyroomTEST function in MATLAB.
+%
+%   MAKE SINGLE stores the responses in single precision, halving their
+%   memory; sofamyroom then returns single matrices.
 
 %Check MATLAB version
 [~, maxArraySize] = computer; 
@@ -64,6 +67,10 @@ for i = 1:nargin
                         '-g'
                         ];
             debug = true;
+        case 'single'
+            switches = [switches 
+                        '-DFLOAT_STORAGE'
+                        ];
         otherwise
             switches = [switches 
                         varargin{i}
@@ -130,12 +137,16 @@ elseif isunix
 end
 
 mexfiles = { [src_path filesep 'libroomsim' filesep 'source' filesep '3D.c']
+             [src_path filesep  'libroomsim'  filesep  'source'  filesep  'deposit.c']
              [src_path filesep  'libroomsim'  filesep  'source'  filesep  'dsp.c']
              [src_path filesep  'libroomsim'  filesep  'source'  filesep  'interface.c']
              [src_path filesep  'libroomsim'  filesep  'source'  filesep  'interp.c']
+             [src_path filesep  'libroomsim'  filesep  'source'  filesep  'mem.c']
+             [src_path filesep  'libroomsim'  filesep  'source'  filesep  'rays.c']
              [src_path filesep  'libroomsim'  filesep  'source'  filesep  'roomsim.c']
              [src_path filesep  'libroomsim'  filesep  'source'  filesep  'rng.c']
              [src_path filesep  'libroomsim'  filesep  'source'  filesep  'sensor.c']
+             [src_path filesep  'libroomsim'  filesep  'source'  filesep  'thread.c']
              [src_path filesep  'libsfmt'  filesep  'SFMT.c']
              [src_path filesep  'mexmain.c']
              [src_path filesep  'build.c']
@@ -40,6 +40,7 @@
 
 /* local includes */
 #include "build.h"
+#include "dsp.h"
 #include "interface.h"
 #include "libroomsim.h"
 #include "msg.h"
@@ -76,6 +77,21 @@ bool IsMexString(const mxArray *pm)
            dimensions[1]>0;
 }
 
+/* Wraps a response in a MATLAB matrix, which takes over its samples. 
+   Responses stored in single precision become single matrices. */
+mxArray *CreateResponseMatrix(const BRIR *brir)
+{
+#ifdef FLOAT_STORAGE
+    mxArray *h = mxCreateNumericMatrix(0, 0, mxSINGLE_CLASS, mxREAL);
+#else
+    mxArray *h = mxCreateDoubleMatrix(0, 0, mxREAL);
+#endif
+    mxSetM(h, brir->nSamples);
+    mxSetN(h, brir->nChannels);
+    mxSetData(h, brir->sample);
+    return h;
+}
+
 #if !defined(UNIT_TEST)
 
 /* gateway function */
@@ -86,6 +102,9 @@ void mexFunction(
     CRoomSetup roomsetup;
     BRIR       *brir;
     
+    /* cached FFTW plans persist across calls, until the MEX file is cleared */
+    mexAtExit(CleanupFFTW);
+
     /* accept call sofamyroom(par) */
     if (nrhs==1 && mxIsStruct(prhs[0]))
     {
@@ -102,8 +121,13 @@ void mexFunction(
             char	   filename[256];
             Wave	   w;
             float      *sample;
-            
-            sample = (float*)malloc(brir[0].nChannels * sizeof(float));
+            int        nChannels = 1;
+
+            /* receivers may differ in their number of channels */
+            for (int i = 0; i < roomsetup.nSources*roomsetup.nReceivers; i++)
+                if (brir[i].nChannels > nChannels)
+                    nChannels = brir[i].nChannels;
+            sample = (float*)malloc(nChannels * sizeof(float));
 
             if (!sample)
             {
@@ -146,9 +170,7 @@ void mexFunction(
                         MsgRelax;
                     }
 
-                    plhs[0] = mxCreateDoubleMatrix(brir[0].nSamples, brir[0].nChannels, mxREAL);
-                    mxFree(mxGetPr(plhs[0]));
-                    mxSetPr(plhs[0],brir[0].sample);
+                    plhs[0] = CreateResponseMatrix(&brir[0]);
                 }
                 else
                 {
@@ -159,12 +181,19 @@ void mexFunction(
                     plhs[0] = mxCreateCellMatrix(roomsetup.nSources, roomsetup.nReceivers);
                     for (i=0; i<roomsetup.nSources*roomsetup.nReceivers; i++)
                     {
-                        h = mxCreateDoubleMatrix(brir[i].nSamples, brir[i].nChannels, mxREAL);
-                        mxFree(mxGetPr(h)); 
-                        mxSetPr(h,brir[i].sample);
+                        h = CreateResponseMatrix(&brir[i]);
                         mxSetCell(plhs[0],i,h);
                     }
                 }
+
+                /* sample offsets of the responses, nonzero for sparse responses */
+                if (nlhs>1)
+                {
+                    int i;
+                    plhs[1] = mxCreateDoubleMatrix(roomsetup.nSources, roomsetup.nReceivers, mxREAL);
+                    for (i=0; i<roomsetup.nSources*roomsetup.nReceivers; i++)
+                        mxGetPr(plhs[1])[i] = brir[i].offset;
+                }
             }
         }
     }
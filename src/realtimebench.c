@@ -0,0 +1,104 @@
+/*********************************************************************//**
+ * @file realtimebench.c
+ * @brief Real-time renderer benchmark.
+ *
+ * Renders white noise through the real-time renderer of a setup, with
+ * its first receiver circling around its location and the image sources
+ * updated every block, for every reflection order of the moving image
+ * sources up to a maximum. Reports the number of image source arrivals,
+ * the real-time factor of block processing (seconds of audio per second
+ * of processing), and the time per update.
+ *
+ * Usage: sofamyroomrtbench setup [maximum order] [block size] [seconds]
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "libroomsim.h"
+#include "interface.h"
+#include "dsp.h"
+#include "mem.h"
+#include "msg.h"
+#include "realtime.h"
+#include "setup.h"
+
+/* disable warnings about unsafe CRT functions */
+#ifdef _MSC_VER
+#  pragma warning( disable : 4996)
+#endif
+
+int main(int argc, char **argv)
+{
+	CFileSetup filesetup;
+	CRoomSetup setup;
+	CRealtime  *rt;
+	double     *x, *y, location[3], angle, seconds;
+	clock_t    t0, tprocess, tupdate;
+	int        maxorder, blocksize, nBlocks, order, i, k;
+
+	if (argc < 2)
+	{
+		MsgPrintf("Usage: sofamyroomrtbench setup [maximum order] [block size] [seconds]\n");
+		return 0;
+	}
+	maxorder  = argc > 2 ? atoi(argv[2]) : 6;
+	blocksize = argc > 3 ? atoi(argv[3]) : 256;
+	seconds   = argc > 4 ? atof(argv[4]) : 10.0;
+
+	if (ReadSetup(argv[1], &filesetup) < 0)
+	{
+		MsgPrintf("error reading setup file: %s\n", filesetup.error);
+		return 1;
+	}
+	LoadCRoomSetup(&filesetup.root, &setup);
+	ValidateSetup(&setup);
+	setup.options.verbose = false;
+
+	nBlocks = (int) ceil(seconds * setup.options.fs / blocksize);
+	x = (double *) MemMalloc((size_t) setup.nSources * blocksize * sizeof(double));
+	srand(1);
+
+	MsgPrintf("%d sources, %d receivers, blocks of %d samples at %.0f Hz, %.1f s\n",
+		setup.nSources, setup.nReceivers, blocksize, setup.options.fs, nBlocks * blocksize / setup.options.fs);
+	MsgPrintf("order   images   real-time factor   update [ms]   latency [samples]\n");
+	for (order=0; order<=maxorder; order++)
+	{
+		rt = RealtimeInit(&setup, blocksize, order);
+		y  = (double *) MemMalloc((size_t) RealtimeChannels(rt) * blocksize * sizeof(double));
+
+		tprocess = tupdate = 0;
+		for (k=0; k<nBlocks; k++)
+		{
+			/* circle around the initial location, once every 4 seconds */
+			angle = 2 * 3.14159265358979323846 * k * blocksize / setup.options.fs / 4;
+			location[0] = setup.receiver[0].location[0] + 0.5 * cos(angle) - 0.5;
+			location[1] = setup.receiver[0].location[1] + 0.5 * sin(angle);
+			location[2] = setup.receiver[0].location[2];
+			t0 = clock();
+			RealtimeMoveReceiver(rt, 0, location, NULL);
+			tupdate += clock() - t0;
+
+			for (i=0; i<setup.nSources*blocksize; i++)
+				x[i] = rand() / (double) RAND_MAX - 0.5;
+			t0 = clock();
+			RealtimeProcess(rt, x, y);
+			tprocess += clock() - t0;
+		}
+
+		MsgPrintf("%5d %8d %18.1f %13.3f %19d\n", order, RealtimeImageCount(rt),
+			nBlocks * blocksize / setup.options.fs / ((double) (tprocess + 1) / CLOCKS_PER_SEC),
+			1000.0 * tupdate / CLOCKS_PER_SEC / nBlocks, RealtimeLatency(rt));
+		MemFree(y);
+		RealtimeFree(rt);
+	}
+
+	MemFree(x);
+	ClearAllSensors();
+	CleanupFFTW();
+	FreeSetup(&filesetup);
+	return 0;
+}
@@ -4,13 +4,21 @@
  **********************************************************************/
 
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "binsetup.h"
 #include "defs.h"
 #include "dsp.h"
 #include "interp.h"
+#include "mem.h"
 #include "msg.h"
+#include "rays.h"
+#include "realtime.h"
 #include "sensor.h"
+#include "setup.h"
+#include "sweep.h"
+#include "thread.h"
 #include "libroomsim.h"
 
 /* disable warnings about depricated unsafe CRT functions */
@@ -21,6 +29,14 @@
 #define EPSILON     1e-10
 #define EPSEQ(x,y)  (fabs((x)-(y))<EPSILON)
 
+/* relative accuracy of responses stored in single precision */
+#ifdef FLOAT_STORAGE
+#  define SAMPLE_EPSILON  1e-5
+#else
+#  define SAMPLE_EPSILON  0
+#endif
+#define SAMPLEEQ(x,y)   (fabs((x)-(y))<EPSILON+SAMPLE_EPSILON*fabs(y))
+
 #define CLEAROUTPUT memset(out,0,sizeof(out))
 #define ASSERTOUTPUT(out,r) \
     for (i=0; i<LENGTH(r); i++) if (!EPSEQ(out[i],r[i])) { char msg[64]; sprintf(msg,"incorrect output (%d,%.10f,%.10f)",i,out[i],r[i]); ERROR(msg); } \
@@ -98,6 +114,126 @@ void testConvolution(void)
     for (i=DBLLEN(x3)+DBLLEN(h3)-1; i<DBLLEN(y); i++) if (y[i]!=0.0) ERROR("output out of bounds");
 }
 
+/* Reference convolution, summing the terms of every output in order */
+static double RefConvOutput(const double *h, int hlen, const double *x, int xlen, int i)
+{
+    double acc = 0.0;
+    int    k;
+
+    for (k=0; k<hlen; k++)
+        if (i-k >= 0 && i-k < xlen)
+            acc += x[i-k] * h[k];
+    return acc;
+}
+
+/* Vectorized convolution kernels, against the reference for all block boundaries */
+void testConvolutionKernels(void)
+{
+    static const int hlens[] = { 1, 2, 7, 8, 9, 33, 512 };
+    static const int xlens[] = { 1, 5, 8, 17, 600 };
+    double h[512], x[600], y[1200], state[511], ref;
+    SAMPLE xs[600], ys[600];
+    int    a, b, i, hlen, xlen, half;
+
+    for (i=0; i<512; i++)
+        h[i] = sin(0.37 * i) / (1 + 0.01 * i);
+    for (i=0; i<600; i++)
+        xs[i] = (SAMPLE) (x[i] = cos(1.13 * i) - 0.5 * sin(0.21 * i));
+
+    for (a=0; a<LENGTH(hlens); a++)
+        for (b=0; b<LENGTH(xlens); b++)
+        {
+            /* full convolution, either argument order */
+            hlen = hlens[a];
+            xlen = xlens[b];
+            Conv(h, hlen, x, xlen, y);
+            for (i=0; i<hlen+xlen-1; i++)
+                if (!EPSEQ(y[i], RefConvOutput(x, xlen, h, hlen, i)))
+                    ERROR("incorrect convolution output");
+            Conv(x, xlen, h, hlen, y);
+            for (i=0; i<hlen+xlen-1; i++)
+                if (!EPSEQ(y[i], RefConvOutput(x, xlen, h, hlen, i)))
+                    ERROR("incorrect convolution output");
+
+            /* filtering in two parts, carrying the state over */
+            if (xlen <= 2*hlen)
+                continue;
+            half = xlen / 2;
+            memset(state, 0, sizeof(state));
+            FIRfilter(h, hlen, xs, half, ys, state);
+            FIRfilter(h, hlen, xs + half, xlen - half, ys + half, state);
+            for (i=0; i<xlen; i++)
+            {
+                ref = RefConvOutput(h, hlen, x, xlen, i);
+                if (fabs(ys[i] - ref) > (SAMPLE_EPSILON + EPSILON) * (1 + fabs(ref)))
+                    ERROR("incorrect filter output");
+            }
+            FIRfilter(h, hlen, xs, xlen, ys, NULL);
+            for (i=0; i<xlen; i++)
+            {
+                ref = RefConvOutput(h, hlen, x, xlen, i);
+                if (fabs(ys[i] - ref) > (SAMPLE_EPSILON + EPSILON) * (1 + fabs(ref)))
+                    ERROR("incorrect filter output");
+            }
+        }
+}
+
+/* Partitioned convolution of 2 inputs into 2 outputs, against the reference, 
+   with filters that start late, span several partitions, or are absent */
+void testPartitionedConv(void)
+{
+    enum { B = 16, XLEN = 100, NBLOCKS = 10 };
+    static const int hlen[2][2]   = { { 40, 3 }, { 21, 0 } };
+    static const int offset[2][2] = { { 5, 0 }, { 30, 0 } };
+    CPartitionedConv *conv;
+    SAMPLE h[2][2][40];
+    double x[2][XLEN], hd[40], xblock[2*B], y[2][NBLOCKS*B], yblock[2*B], ref;
+    int    i, o, n, k;
+
+    for (i=0; i<2; i++)
+        for (n=0; n<XLEN; n++)
+            x[i][n] = cos(1.13 * n + i) - 0.5 * sin(0.21 * n);
+
+    conv = AllocPartitionedConv(B, 2, 2, 60);
+    for (i=0; i<2; i++)
+        for (o=0; o<2; o++)
+        {
+            for (k=0; k<hlen[i][o]; k++)
+                h[i][o][k] = (SAMPLE) (k < 4 && i == 1 ? 0.0 : sin(0.37 * k + o) / (1 + 0.1 * k));
+            if (hlen[i][o] > 0 && !SetPartitionedConvFilter(conv, i, o, h[i][o], hlen[i][o], offset[i][o]))
+                ERROR("filter rejected");
+        }
+    if (SetPartitionedConvFilter(conv, 0, 0, h[0][0], 40, 30))
+        ERROR("filter longer than the maximum length accepted");
+    SetPartitionedConvFilter(conv, 0, 0, h[0][0], 40, 5);
+
+    for (n=0; n<NBLOCKS; n++)
+    {
+        for (i=0; i<2; i++)
+            for (k=0; k<B; k++)
+                xblock[i*B + k] = n*B + k < XLEN ? x[i][n*B + k] : 0.0;
+        PartitionedConvProcess(conv, xblock, yblock);
+        for (o=0; o<2; o++)
+            memcpy(&y[o][n*B], &yblock[o*B], B * sizeof(double));
+    }
+    FreePartitionedConv(conv);
+
+    for (o=0; o<2; o++)
+        for (n=0; n<NBLOCKS*B; n++)
+        {
+            ref = 0.0;
+            for (i=0; i<2; i++)
+            {
+                memset(hd, 0, sizeof(hd));
+                for (k=0; k<hlen[i][o]; k++)
+                    hd[k] = h[i][o][k];
+                ref += RefConvOutput(hd, hlen[i][o], x[i], XLEN, n - offset[i][o]);
+            }
+            if (fabs(y[o][n] - ref) > 1e-12)
+                ERROR("incorrect partitioned convolution output");
+        }
+}
+
 /*******************************************************************************/
 void testLinearInterpolation(void)
 {
@@ -178,6 +314,89 @@ void testMinPhaseFIR(void)
 #define NORMFREQ (2*PI/44100.0)
 
 
+/* Batched minimum phase design, against single filters, for partial batches and strides */
+void testMinPhaseFIRBatch(void)
+{
+    CMinPhaseFIRplan *plan;
+    double F[]      = {0,125,250,500,1000,2000,4000,8000,16000,22050};
+    double logmag[13*12], h[13*520], href[512], peak;
+    int    nFilters[] = { 1, MINPHASE_BATCH, 13 };
+    int    a, f, i;
+
+    for (f=0; f<13; f++)
+        for (i=0; i<DBLLEN(F); i++)
+            logmag[f*12 + i] = -0.3 * f - 0.05 * i * (1 + f % 3) + 0.2 * sin(i + f);
+
+    plan = AllocMinPhaseFIRplan(512, F, DBLLEN(F));
+    for (a=0; a<INTLEN(nFilters); a++)
+    {
+        memset(h, 0, sizeof(h));
+        LogMagFreqResp2MinPhaseFIRs(logmag, 12, h, 520, nFilters[a], plan);
+        for (f=0; f<nFilters[a]; f++)
+        {
+            LogMagFreqResp2MinPhaseFIR(&logmag[f*12], href, plan);
+            peak = 0;
+            for (i=0; i<512; i++)
+                peak = MAX(peak, fabs(href[i]));
+            for (i=0; i<512; i++)
+                if (fabs(h[f*520 + i] - href[i]) > 1e-12 * peak)
+                    ERROR("batched filter differs from single filter");
+            for (i=512; i<520; i++)
+                if (h[f*520 + i] != 0.0)
+                    ERROR("output beyond filter length");
+        }
+        for (i=nFilters[a]*520; i<DBLLEN(h); i++)
+            if (h[i] != 0.0)
+                ERROR("output beyond last filter");
+    }
+    FreeMinPhaseFIRplan(plan);
+}
+
+/* FFTW plan cache and wisdom file: plans are shared by design plans of the same
+   size and planning effort, and measured plans are exported as wisdom */
+void testFFTWPlanCache(void)
+{
+    CMinPhaseFIRplan *plan1, *plan2;
+    double F[]      = {0,125,250,500,1000,2000,4000,8000,16000,22050};
+    double logmag[] = {-1,-2,-3,-1,0,-4,-6,-10,-20,-30};
+    double h1[256], h2[256];
+    int    nPlans, i;
+    FILE   *fid;
+
+    if (ConfigureFFTW("", "exhaustive", 1))
+        ERROR("unknown planning effort accepted");
+
+    remove("unittest_wisdom.txt");
+    ConfigureFFTW("unittest_wisdom.txt", "measure", 1);
+    plan1  = AllocMinPhaseFIRplan(256, F, DBLLEN(F));
+    nPlans = CountFFTWPlans();
+    plan2  = AllocMinPhaseFIRplan(256, F, DBLLEN(F));
+    if (CountFFTWPlans() != nPlans)
+        ERROR("FFTW plans not shared");
+
+    /* a cached plan executes on the buffers of every design plan */
+    LogMagFreqResp2MinPhaseFIR(logmag, h1, plan1);
+    FreeMinPhaseFIRplan(plan1);
+    LogMagFreqResp2MinPhaseFIR(logmag, h2, plan2);
+    FreeMinPhaseFIRplan(plan2);
+    for (i=0; i<256; i++)
+        if (h1[i] != h2[i])
+            ERROR("shared FFTW plans give different filters");
+
+    fid = fopen("unittest_wisdom.txt", "r");
+    if (!fid)
+        ERROR("FFTW wisdom not exported");
+    fclose(fid);
+    remove("unittest_wisdom.txt");
+
+    /* back to the defaults */
+    ConfigureFFTW(NULL, "estimate", 1);
+    plan1 = AllocMinPhaseFIRplan(256, F, DBLLEN(F));
+    if (CountFFTWPlans() <= nPlans)
+        ERROR("planning effort not part of the FFTW plan cache key");
+    FreeMinPhaseFIRplan(plan1);
+}
+
 /*******************************************************************************/
 void testFreqzLogMagnitude(void)
 {
@@ -252,6 +471,20 @@ void Roomsetup(CRoomSetup* par)
     par->options.numberofrays = 20 * RAYORDER * RAYORDER;
     par->options.rayenergyfloordB = -80;
     par->options.diffusetimestep = 0.010;
+    par->options.uncorrelatednoise = true;
+    par->options.diffuselineardomain = false;
+    par->options.numberofthreads = 1;
+    par->options.diffusetolerancedB = 0;
+    par->options.diffusedirections = 6;
+    par->options.raygenerator = "icosahedron";
+    par->options.responsefloordB = 0;
+    par->options.fftwwisdom = "";
+    par->options.fftwplanning = "estimate";
+    par->options.fftwthreads = 1;
+    par->options.filterlength = NULL;
+    par->options.nFilterLengths = 0;
+    par->options.transitiontime = 0;
+    par->options.trajectorytolerancedB = 0.1;
 
     par->room.dimension[0] = 1000;
     par->room.dimension[1] = 1000;
@@ -278,7 +511,9 @@ void Roomsetup(CRoomSetup* par)
 
     /* Output */
     par->options.outputname = "brir";
+#ifdef MEX
     par->options.mex_saveaswav = false;
+#endif
 
     /* read absorption and diffusion data if exists */
     fid = fopen("abscoeff.txt", "r");
@@ -305,6 +540,7 @@ void testEmptyRoom(void)
     BRIR* brir;
     CSensorDefinition *definition;
     CSensorResponse response;
+    double *h;
     int error;
     XYZ xyz = { 0 };
     int i;
@@ -325,7 +561,12 @@ void testEmptyRoom(void)
     for (i = 0; i < setup.room.surface.nBands; i++)
         frequencies[i] *= 2 * PI / setup.options.fs;
 
-    FreqzLogMagnitude (brir->sample, brir->nSamples, frequencies, setup.room.surface.nBands, &brirLogmag[0]);
+    /* responses may be stored in single precision */
+    h = (double *) malloc(brir->nSamples * sizeof(double));
+    for (i = 0; i < brir->nSamples; i++)
+        h[i] = brir->sample[i];
+    FreqzLogMagnitude (h, brir->nSamples, frequencies, setup.room.surface.nBands, &brirLogmag[0]);
+    free(h);
 
     MsgPrintf("Extracting HRTF from SOFA file...\n");
     definition = LoadSensor(
@@ -334,7 +575,8 @@ void testEmptyRoom(void)
 #	else
 		"SOFA ../data/MIT_KEMAR_normal_pinna.sofa"
 #	endif
-    );
+    , setup.options.fs);
+    response.buffer = NULL;
     if (!SensorGetResponse(definition, &xyz, &response))
         MsgErrorExit("didn't get response from sensor");
 
@@ -342,7 +584,7 @@ void testEmptyRoom(void)
 
     for (int i = 0; i < setup.room.surface.nBands; ++i)
     {
-        if (!EPSEQ(brirLogmag[i], hrtfLogmag[i]))
+        if (!SAMPLEEQ(brirLogmag[i], hrtfLogmag[i]))
          {
              char msg[64];
              sprintf(msg, "incorrect logmag output (%d,%.10f,%.10f)", i, brirLogmag[i], hrtfLogmag[i]);
@@ -360,7 +602,7 @@ void testEmptyRoom(void)
         hrtfEnergy += (definition->responsedata[i] * definition->responsedata[i]);
     }
 
-    if (!EPSEQ(brirEnergy, hrtfEnergy))
+    if (!SAMPLEEQ(brirEnergy, hrtfEnergy))
     {
         char msg[64];
         sprintf(msg, "incorrect energy output (%.10f,%.10f)", brirEnergy, hrtfEnergy);
@@ -371,6 +613,1290 @@ void testEmptyRoom(void)
     CmdClearAllSensors();
 }
 
+/* Small reverberant room with omnidirectional sensors, for the diffuse rain tests */
+void DiffuseRoomsetup(CRoomSetup* par, int nReceivers)
+{
+    static double surfaceabsorption[36];
+    static const CSensor source[] = {
+        {{4.0,1.5,1.6}, {180,0,0}, "omnidirectional"}
+    };
+    static const CSensor receiver[] = {
+        {{2.0,3.0,1.2}, {  0,  0, 0}, "cardioid"},
+        {{1.0,1.0,2.0}, { 45, 10, 0}, "omnidirectional"},
+        {{5.0,3.5,0.8}, {-90,  0,20}, "cardioid"},
+        {{3.0,2.5,2.5}, {180,-30, 0}, "subcardioid"},
+        {{0.5,3.8,1.5}, { 90,  0, 0}, "cardioid"},
+    };
+    int i;
+
+    Roomsetup(par);
+    for (i=0; i<36; i++)
+        surfaceabsorption[i] = 0.2 + 0.01 * i;
+    par->room.surface.absorption = surfaceabsorption;
+
+    par->room.dimension[0] = 6;
+    par->room.dimension[1] = 4;
+    par->room.dimension[2] = 3;
+    par->options.responseduration = 0.25;
+    par->options.airabsorption = true;
+    par->options.verbose = false;
+    par->options.simulatespecular = false;
+    par->options.simulatediffuse = true;
+    par->options.numberofrays = 500;
+
+    par->source = source;
+    par->nSources = 1;
+    par->receiver = receiver;
+    par->nReceivers = nReceivers;
+}
+
+/* Compares the first BRIR of two simulations, relative to peak amplitude and energy */
+void CompareBRIR(const BRIR *a, const BRIR *b, double tolerance)
+{
+    double peak = 0, maxdiff = 0, ea = 0, eb = 0;
+    int i;
+
+    if (tolerance < SAMPLE_EPSILON)
+        tolerance = SAMPLE_EPSILON;
+
+    if (a->nSamples != b->nSamples || a->nChannels != b->nChannels)
+        ERROR("BRIR dimensions differ");
+
+    for (i=0; i<a->nChannels * a->nSamples; i++)
+    {
+        if (fabs(a->sample[i]) > peak) peak = fabs(a->sample[i]);
+        if (fabs(a->sample[i] - b->sample[i]) > maxdiff) maxdiff = fabs(a->sample[i] - b->sample[i]);
+        ea += a->sample[i] * a->sample[i];
+        eb += b->sample[i] * b->sample[i];
+    }
+
+    if (peak == 0.0 || maxdiff > tolerance * peak || fabs(eb - ea) > tolerance * ea)
+    {
+        char msg[128];
+        sprintf(msg, "BRIRs differ (peak %.3g, max difference %.3g, energy %.10g, %.10g)", peak, maxdiff, ea, eb);
+        ERROR(msg);
+    }
+}
+
+void testDiffuseReceivers(void)
+{
+    CRoomSetup setup;
+    BRIR *reference, *brir;
+
+    /* rays do not depend on the receivers, so the first receiver of the scalar 
+       path (one receiver) and of the vectorized path (five receivers) agree */
+    DiffuseRoomsetup(&setup, 1);
+    ValidateSetup(&setup);
+    reference = Roomsim(&setup);
+
+    DiffuseRoomsetup(&setup, 5);
+    ValidateSetup(&setup);
+    brir = Roomsim(&setup);
+
+    CompareBRIR(&reference[0], &brir[0], 1e-9);
+
+    ReleaseBRIR(reference);
+    ReleaseBRIR(brir);
+    CmdClearAllSensors();
+}
+
+void testDiffuseLinearDomain(void)
+{
+    CRoomSetup setup;
+    BRIR *reference, *brir;
+    int  nReceivers[] = { 1, 5 };
+    int  i;
+
+    /* single receiver exercises the scalar path, five receivers the vectorized path */
+    for (i=0; i<INTLEN(nReceivers); i++)
+    {
+        DiffuseRoomsetup(&setup, nReceivers[i]);
+        ValidateSetup(&setup);
+        reference = Roomsim(&setup);
+
+        setup.options.diffuselineardomain = true;
+        brir = Roomsim(&setup);
+
+        CompareBRIR(&reference[nReceivers[i]-1], &brir[nReceivers[i]-1], 1e-6);
+
+        ReleaseBRIR(reference);
+        ReleaseBRIR(brir);
+    }
+    CmdClearAllSensors();
+}
+
+void testDiffuseThreads(void)
+{
+    CRoomSetup setup;
+    BRIR *reference, *brir;
+    int  nReceivers[] = { 1, 5 };
+    int  i;
+
+    /* rays are traced in batches with their own random streams, so the outcome
+       must not depend on the number of threads, apart from rounding */
+    for (i=0; i<INTLEN(nReceivers); i++)
+    {
+        DiffuseRoomsetup(&setup, nReceivers[i]);
+        ValidateSetup(&setup);
+        setup.options.numberofthreads = 2;
+        reference = Roomsim(&setup);
+
+        setup.options.numberofthreads = 5;
+        brir = Roomsim(&setup);
+
+        CompareBRIR(&reference[nReceivers[i]-1], &brir[nReceivers[i]-1], 1e-9);
+
+        ReleaseBRIR(reference);
+        ReleaseBRIR(brir);
+    }
+    CmdClearAllSensors();
+}
+
+void testDiffuseAdaptive(void)
+{
+    CRoomSetup setup;
+    BRIR *reference, *brir;
+    double ea = 0, eb = 0;
+    int  i;
+
+    /* adaptive ray count must reproduce the energy of a fixed, large ray count */
+    DiffuseRoomsetup(&setup, 5);
+    ValidateSetup(&setup);
+    setup.options.numberofrays = 5000;
+    reference = Roomsim(&setup);
+
+    setup.options.diffusetolerancedB = 0.2;
+    brir = Roomsim(&setup);
+
+    for (i=0; i<reference[4].nChannels * reference[4].nSamples; i++)
+    {
+        ea += reference[4].sample[i] * reference[4].sample[i];
+        eb += brir[4].sample[i] * brir[4].sample[i];
+    }
+    if (fabs(10 * log10(eb / ea)) > 0.5)
+    {
+        char msg[64];
+        sprintf(msg, "incorrect energy output (%.10f,%.10f)", ea, eb);
+        ERROR(msg);
+    }
+
+    ReleaseBRIR(reference);
+    ReleaseBRIR(brir);
+    CmdClearAllSensors();
+}
+
+/* Finer direction bins of the diffuse tail redistribute its energy over 
+   directions: the omnidirectional receiver keeps the energy of the axes bins,
+   and the cardioid receiver does not depend on the number of bins */
+void testDiffuseDirections(void)
+{
+    static const int directions[] = { 6, 20, 320 };
+    static const double orientation[6] = { 0 };
+    CRoomSetup setup;
+    CSensor    receivers[2];
+    BRIR   *brir;
+    double energy[LENGTH(directions)][2];
+    char   msg[128];
+    int    i, j, k;
+
+    DiffuseRoomsetup(&setup, 2);
+    receivers[0] = setup.receiver[0];
+    receivers[1] = setup.receiver[1];
+    for (j=0; j<2; j++)
+        memset(receivers[j].orientation, 0, sizeof(receivers[j].orientation));
+    setup.receiver = receivers;
+    ValidateSetup(&setup);
+
+    for (k=0; k<INTLEN(directions); k++)
+    {
+        setup.options.diffusedirections = directions[k];
+        brir = Roomsim(&setup);
+        for (j=0; j<2; j++)
+            for (i=0, energy[k][j]=0; i<brir[j].nChannels * brir[j].nSamples; i++)
+                energy[k][j] += brir[j].sample[i] * brir[j].sample[i];
+        ReleaseBRIR(brir);
+
+        if (fabs(10 * log10(energy[k][1] / energy[0][1])) > 1 || (k > 1 && fabs(10 * log10(energy[k][0] / energy[1][0])) > 0.5))
+        {
+            sprintf(msg, "energy of %d direction bins differs (%.10f,%.10f)", directions[k], energy[k][0], energy[k][1]);
+            ERROR(msg);
+        }
+    }
+
+    /* bins of a direction grid render the same from a single orientation */
+    brir = RoomsimOrientations(&setup, orientation, 1, NULL, NULL);
+    for (j=0; j<2; j++)
+    {
+        for (i=0, energy[0][j]=0; i<brir[j].nChannels * brir[j].nSamples; i++)
+            energy[0][j] += brir[j].sample[i] * brir[j].sample[i];
+        if (fabs(energy[0][j] - energy[k-1][j]) > 1e-9 * energy[k-1][j])
+            ERROR("response of direction grid differs at reference orientation");
+    }
+    ReleaseBRIR(brir);
+    CmdClearAllSensors();
+}
+
+/* Ambisonics receivers: real spherical harmonics in ACN order, whose channels
+   of each order add up to one in energy (SN3D) or to 2l+1 (N3D), and whose W 
+   channel renders like an omnidirectional receiver */
+void testAmbisonics(void)
+{
+    static const char *description[] = { "ambisonics 3", "ambisonics 2 n3d" };
+    CRoomSetup setup;
+    CSensor    receivers[2];
+    CSensorDefinition *sensor;
+    CSensorResponse   response;
+    BRIR   *brir, w;
+    double gains[16], sum, r, dx, dy, dz;
+    XYZ    xyz;
+    char   msg[128];
+    int    i, j, k, l, m, order;
+
+    for (k=0; k<LENGTH(description); k++)
+    {
+        sensor = LoadSensor(description[k], ANY_FS);
+        order  = (int) sqrt((double) sensor->nChannels) - 1;
+        response.buffer = gains;
+        for (i=0; i<20; i++)
+        {
+            xyz.x = cos(1.3 * i);
+            xyz.y = sin(2.1 * i);
+            xyz.z = 0.1 * i - 1;
+            r = sqrt(xyz.x * xyz.x + xyz.y * xyz.y + xyz.z * xyz.z);
+            if (!SensorGetResponse(sensor, &xyz, &response) || response.type != SR_GAINS)
+                ERROR("no ambisonics response");
+            for (l=0; l<=order; l++)
+            {
+                for (m=-l, sum=0; m<=l; m++)
+                    sum += gains[l*l+l+m] * gains[l*l+l+m];
+                if (!EPSEQ(sum, k == 0 ? 1.0 : 2*l+1))
+                {
+                    sprintf(msg, "incorrect energy of order %d (%.10f)", l, sum);
+                    ERROR(msg);
+                }
+            }
+            sum = k == 0 ? 1.0 : sqrt(3.0);
+            if (!EPSEQ(gains[0], 1.0) || !EPSEQ(gains[1], sum * xyz.y / r) || !EPSEQ(gains[2], sum * xyz.z / r) || !EPSEQ(gains[3], sum * xyz.x / r))
+                ERROR("incorrect first order ambisonics gains");
+        }
+    }
+
+    DiffuseRoomsetup(&setup, 2);
+    receivers[0] = setup.receiver[1];
+    receivers[1] = setup.receiver[1];
+    receivers[0].description = "ambisonics 1";
+    setup.receiver = receivers;
+    setup.options.simulatespecular   = true;
+    setup.options.reflectionorder[0] = 3;
+    setup.options.reflectionorder[1] = 3;
+    setup.options.reflectionorder[2] = 3;
+    ValidateSetup(&setup);
+
+    brir = Roomsim(&setup);
+    if (brir[0].nChannels != 4)
+        ERROR("incorrect number of ambisonics channels");
+    w = brir[0];
+    w.nChannels = 1;
+    CompareBRIR(&brir[1], &w, 1e-12);
+    ReleaseBRIR(brir);
+
+    /* the direct sound arrives from the source direction */
+    for (j=0; j<3; j++)
+        receivers[0].orientation[j] = 0;
+    setup.options.simulatediffuse    = false;
+    setup.options.reflectionorder[0] = 0;
+    setup.options.reflectionorder[1] = 0;
+    setup.options.reflectionorder[2] = 0;
+    brir = Roomsim(&setup);
+    dx = setup.source[0].location[0] - receivers[0].location[0];
+    dy = setup.source[0].location[1] - receivers[0].location[1];
+    dz = setup.source[0].location[2] - receivers[0].location[2];
+    r  = sqrt(dx * dx + dy * dy + dz * dz);
+    for (i=0, j=0; i<brir[0].nSamples; i++)
+        if (fabs(brir[0].sample[i]) > fabs(brir[0].sample[j]))
+            j = i;
+    if (!SAMPLEEQ(brir[0].sample[j + brir[0].nSamples], brir[0].sample[j] * dy / r)
+        || !SAMPLEEQ(brir[0].sample[j + 2 * brir[0].nSamples], brir[0].sample[j] * dz / r)
+        || !SAMPLEEQ(brir[0].sample[j + 3 * brir[0].nSamples], brir[0].sample[j] * dx / r))
+        ERROR("incorrect direction of direct sound");
+    ReleaseBRIR(brir);
+    CmdClearAllSensors();
+}
+
+/* Amplitude-weighted mean time of a channel, in samples, and its sum */
+static double MeanTime(const BRIR *brir, int c, double *sum)
+{
+    const SAMPLE *x = brir->sample + c * brir->nSamples;
+    double moment = 0;
+    int i;
+
+    for (i=0, *sum=0; i<brir->nSamples; i++)
+    {
+        *sum   += x[i];
+        moment += i * x[i];
+    }
+    return moment / *sum;
+}
+
+/* Array receivers: a single element at the origin renders the diffuse tail of
+   an omnidirectional receiver, and elements receive the direct sound with the
+   delay and attenuation of their own path */
+void testArraySensor(void)
+{
+    static const double offset[3] = { 0.3, -0.2, 0.1 };
+    CRoomSetup setup;
+    CSensor    receivers[2];
+    BRIR   *brir;
+    FILE   *fid;
+    double d, path, csample, t[3], sum[3], dx, dy, dz;
+    int    j;
+
+    fid = fopen("unittest_array.txt", "w");
+    fprintf(fid, "%% x y z yaw pitch roll directivity\n0 0 0\n");
+    fclose(fid);
+
+    DiffuseRoomsetup(&setup, 2);
+    receivers[0] = setup.receiver[1];
+    receivers[1] = setup.receiver[1];
+    receivers[0].description = "array unittest_array.txt";
+    setup.receiver = receivers;
+    ValidateSetup(&setup);
+
+    brir = Roomsim(&setup);
+    if (brir[0].nChannels != 1)
+        ERROR("incorrect number of array channels");
+    CompareBRIR(&brir[0], &brir[1], 1e-12);
+    ReleaseBRIR(brir);
+    CmdClearAllSensors();
+
+    /* direct sound of a second element, displaced by offset */
+    fid = fopen("unittest_array.txt", "w");
+    fprintf(fid, "0 0 0\n%g %g %g 0 0 0 omnidirectional\n", offset[0], offset[1], offset[2]);
+    fclose(fid);
+
+    for (j=0; j<3; j++)
+        receivers[0].orientation[j] = receivers[1].orientation[j] = 0;
+    setup.options.simulatediffuse     = false;
+    setup.options.simulatespecular    = true;
+    setup.options.distanceattenuation = true;
+    setup.options.reflectionorder[0]  = 0;
+    setup.options.reflectionorder[1]  = 0;
+    setup.options.reflectionorder[2]  = 0;
+    brir = Roomsim(&setup);
+    if (brir[0].nChannels != 2)
+        ERROR("incorrect number of array channels");
+
+    dx = setup.source[0].location[0] - receivers[0].location[0];
+    dy = setup.source[0].location[1] - receivers[0].location[1];
+    dz = setup.source[0].location[2] - receivers[0].location[2];
+    d  = sqrt(dx * dx + dy * dy + dz * dz);
+    dx -= offset[0];
+    dy -= offset[1];
+    dz -= offset[2];
+    path    = sqrt(dx * dx + dy * dy + dz * dz) - d;
+    csample = 331 * sqrt(1 + 0.0036 * setup.room.temperature) / setup.options.fs;
+
+    t[0] = MeanTime(&brir[0], 0, &sum[0]);
+    t[1] = MeanTime(&brir[0], 1, &sum[1]);
+    t[2] = MeanTime(&brir[1], 0, &sum[2]);
+    if (fabs(t[0] - t[2] - (d / csample - floor(d / csample + 0.5))) > 1e-3 || fabs(sum[0] - sum[2]) > 1e-5 * fabs(sum[2]))
+        ERROR("array element at origin differs from omnidirectional receiver");
+    if (fabs(t[1] - t[0] - path / csample) > 1e-3)
+        ERROR("incorrect delay of array element");
+    if (fabs(sum[1] / sum[0] - d / (d + path)) > 1e-5)
+        ERROR("incorrect attenuation of array element");
+    ReleaseBRIR(brir);
+    CmdClearAllSensors();
+    remove("unittest_array.txt");
+}
+
+void testRayGenerators(void)
+{
+    static const char *name[] = { "icosahedron", "icosphere", "fibonacci", "sobol" };
+    CRayGenerator *generator;
+    XYZ    ray[100];
+    double mean[3], norm;
+    int    octant[8];
+    int    i, j, k;
+
+    /* directions must be unit vectors, and spread evenly over the sphere */
+    for (i=0; i<(int) LENGTH(name); i++)
+    {
+        generator = AllocRayGenerator(name[i], 2000);
+        if (generator->nRays != 2000)
+            ERROR("incorrect number of rays");
+
+        memset(mean, 0, sizeof(mean));
+        memset(octant, 0, sizeof(octant));
+        for (j=0; j<generator->nRays; j+=LENGTH(ray))
+        {
+            if (GetRayDirections(generator, j, LENGTH(ray), ray) < 0)
+                ERROR("ray generator type not handled");
+            for (k=0; k<(int) LENGTH(ray); k++)
+            {
+                norm = ray[k].x * ray[k].x + ray[k].y * ray[k].y + ray[k].z * ray[k].z;
+                if (!EPSEQ(norm, 1.0))
+                    ERROR("ray direction is not a unit vector");
+                mean[0] += ray[k].x; mean[1] += ray[k].y; mean[2] += ray[k].z;
+                octant[4*(ray[k].x > 0) + 2*(ray[k].y > 0) + (ray[k].z > 0)]++;
+            }
+        }
+
+        if (sqrt(mean[0]*mean[0] + mean[1]*mean[1] + mean[2]*mean[2]) > 0.01 * generator->nRays)
+            ERROR("ray directions are biased");
+        for (j=0; j<8; j++)
+            if (abs(octant[j] - generator->nRays/8) > generator->nRays/40)
+                ERROR("ray directions are not spread evenly");
+
+        FreeRayGenerator(generator);
+    }
+}
+
+void testSetupParser(void)
+{
+    static const char *number[] = { "1", "-2.5", "0.1", "1e-3", "6.02214076e23", 
+        "123456789012345678", "0.30000000000000004", "-0", "1E+22", "4.9e-324", "inf" };
+    const char *filename = "unittest_setup.txt";
+    CFileSetup filesetup;
+    CFileSetupItem *item, *array;
+    char name[32];
+    FILE *fid;
+    int  i;
+
+    fid = fopen(filename, "w");
+    fprintf(fid, "%% comment\nroom.surface.absorption = [");
+    for (i=0; i<LENGTH(number); i++)
+        fprintf(fid, " %s,", number[i]);
+    fprintf(fid, " ;\n");
+    for (i=0; i<LENGTH(number); i++)
+        fprintf(fid, " %s", number[i]);
+    fprintf(fid, " ];  %% trailing comment\noptions.outputname = 'a b;c';\noptions.fs = 44100 \n");
+    for (i=1; i<=100; i++)
+        fprintf(fid, "receiver(%d).location = [ %d 0 0 ];\n", i, i);
+    fclose(fid);
+
+    if (ReadSetup((char *) filename, &filesetup) < 0)
+        ERROR(filesetup.error);
+    remove(filename);
+
+    /* numbers must be parsed exactly as strtod does */
+    array = SetupFindField(SetupFindStruct(SetupFindStruct(&filesetup.root, "room"), "surface"), "absorption");
+    if (!array || array->nRows != 2 || array->nCols != LENGTH(number))
+        ERROR("incorrect array dimensions");
+    for (i=0; i<2*LENGTH(number); i++)
+        if (array->number[i] != strtod(number[i % LENGTH(number)], NULL))
+            ERROR("incorrect array element");
+
+    item = SetupFindField(SetupFindStruct(&filesetup.root, "options"), "outputname");
+    if (!item || strcmp(item->data.value, "a b;c") != 0)
+        ERROR("incorrect string value");
+    item = SetupFindField(SetupFindStruct(&filesetup.root, "OPTIONS"), "fs");
+    if (!item || strcmp(item->data.value, "44100") != 0)
+        ERROR("incorrect scalar value");
+
+    /* fields of large structs are found through a hash table */
+    item = SetupFindStruct(&filesetup.root, "receiver");
+    if (!item || item->count != 100)
+        ERROR("incorrect number of receivers");
+    for (i=100; i>=1; i--)
+    {
+        sprintf(name, "%d", i);
+        array = SetupFindField(SetupFindStruct(item, name), "location");
+        if (!array || array->number[0] != i)
+            ERROR("incorrect receiver location");
+    }
+
+    FreeSetup(&filesetup);
+}
+
+/* returns nonzero if two files have identical contents */
+int SameFiles(const char *filename1, const char *filename2)
+{
+    FILE *fid1 = fopen(filename1, "rb"), *fid2 = fopen(filename2, "rb");
+    int  ch1 = 0, ch2 = 0;
+
+    if (fid1 && fid2)
+        do {
+            ch1 = fgetc(fid1);
+            ch2 = fgetc(fid2);
+        } while (ch1 == ch2 && ch1 != EOF);
+    if (fid1) fclose(fid1);
+    if (fid2) fclose(fid2);
+    return fid1 && fid2 && ch1 == ch2;
+}
+
+void testBinarySetup(void)
+{
+    CRoomSetup   setup, binary, text;
+    CBinarySetup binsetup;
+    CFileSetup   filesetup;
+    CSensor      receiver[3];
+    double       filterlength[] = { 1024, 256 };
+    uint32_t     dimension[2] = { 0x80000000u, 0x80000000u };
+    CBinarySetupHeader *header;
+    CBinarySetupField  *field;
+    FILE         *fid;
+    int          i;
+
+    Roomsetup(&setup);
+    for (i=0; i<LENGTH(receiver); i++)
+    {
+        receiver[i] = setup.receiver[0];
+        receiver[i].location[0] = 0.1 * (i + 1);
+        receiver[i].orientation[1] = 1.0 / 3.0;
+    }
+    receiver[1].description = "omnidirectional";
+    setup.receiver   = receiver;
+    setup.nReceivers = LENGTH(receiver);
+    setup.options.filterlength   = filterlength;
+    setup.options.nFilterLengths = LENGTH(filterlength);
+
+    /* write setup as text and as binary file */
+    if (WriteTextSetup("unittest_setup.txt", &setup) < 0 || WriteBinarySetup("unittest_setup.smr", &setup) < 0)
+        ERROR("unable to write setup files");
+
+    /* the setups read back must be written identically */
+    if (ReadBinarySetup("unittest_setup.smr", &binsetup, &binary) < 0)
+        ERROR(binsetup.error);
+    if (binary.nReceivers != LENGTH(receiver) || binary.receiver[2].location[0] != receiver[2].location[0] ||
+        binary.receiver[1].orientation[1] != 1.0 / 3.0 || strcmp(binary.receiver[1].description, "omnidirectional") != 0)
+        ERROR("incorrect receivers in binary setup");
+    if (WriteTextSetup("unittest_binary.txt", &binary) < 0)
+        ERROR("unable to write setup file");
+    FreeBinarySetup(&binsetup);
+
+    if (ReadSetup("unittest_setup.txt", &filesetup) < 0)
+        ERROR(filesetup.error);
+    LoadCRoomSetup(&filesetup.root, &text);
+    if (WriteTextSetup("unittest_text.txt", &text) < 0)
+        ERROR("unable to write setup file");
+    FreeSetup(&filesetup);
+
+    if (!SameFiles("unittest_setup.txt", "unittest_binary.txt") || !SameFiles("unittest_setup.txt", "unittest_text.txt"))
+        ERROR("setup changed by writing and reading");
+
+    /* a numeric field whose size in bytes wraps around must be rejected */
+    if (ReadBinarySetup("unittest_setup.smr", &binsetup, &binary) < 0)
+        ERROR(binsetup.error);
+    header = (CBinarySetupHeader *) binsetup.map;
+    field  = (CBinarySetupField *) ((char *) binsetup.map + header->fieldoffset);
+    for (i=0; i<(int) header->nFields && field[i].type != BS_NUMBER; i++)
+        ;
+    if (i == (int) header->nFields)
+        ERROR("no numeric field in binary setup");
+    fid = fopen("unittest_setup.smr", "r+b");
+    fseek(fid, (long) (header->fieldoffset + i * sizeof(CBinarySetupField) + offsetof(CBinarySetupField, nRows)), SEEK_SET);
+    fwrite(dimension, sizeof(uint32_t), 2, fid);
+    fclose(fid);
+    FreeBinarySetup(&binsetup);
+    if (ReadBinarySetup("unittest_setup.smr", &binsetup, &binary) >= 0)
+        ERROR("numeric field of wrapping size accepted");
+    FreeBinarySetup(&binsetup);
+
+    remove("unittest_setup.txt");
+    remove("unittest_setup.smr");
+    remove("unittest_binary.txt");
+    remove("unittest_text.txt");
+}
+
+/* Keeps a copy of the second receiver's response of each sweep configuration */
+void SweepCallback(int iConfig, const CRoomSetup *pSetup, const BRIR *brir, void *arg)
+{
+    BRIR *copy = &((BRIR *) arg)[iConfig];
+
+    *copy = brir[1];
+    copy->sample = (SAMPLE *) malloc(brir[1].nChannels * brir[1].nSamples * sizeof(SAMPLE));
+    memcpy(copy->sample, brir[1].sample, brir[1].nChannels * brir[1].nSamples * sizeof(SAMPLE));
+}
+
+void TrajectoryCallback(int iFrame, const CRoomSetup *pSetup, const BRIR *brir, void *arg)
+{
+    BRIR *copy = &((BRIR *) arg)[iFrame];
+
+    *copy = brir[0];
+    copy->sample = (SAMPLE *) malloc(brir[0].nChannels * brir[0].nSamples * sizeof(SAMPLE));
+    memcpy(copy->sample, brir[0].sample, brir[0].nChannels * brir[0].nSamples * sizeof(SAMPLE));
+}
+
+/* Trajectories: frames sampled between rows, simulated in parallel with image 
+   filters tracked from frame to frame, exactly without tolerance */
+void testTrajectory(void)
+{
+    static double pose[] = {
+        0.0,  4.0,1.5,1.6,  170,0,0,  1.0,1.0,2.0, 45,10,0,
+        1.0,  4.0,1.5,1.6, -170,0,0,  1.2,1.1,2.0, 45,10,0,
+    };
+    CRoomSetup  setup;
+    CSweepTable trajectory, frames, invalid;
+    CSensor     sensors[2];
+    BRIR        result[5], *brir;
+    double      e[2], tolerance[2] = { 0, 1 };
+    int         i, j, k, differs = 0;
+
+    trajectory.nConfigs = 2;
+    trajectory.nCols    = 13;
+    trajectory.pose     = pose;
+    if (ResampleTrajectory(&trajectory, 0.25, &frames) < 0)
+        ERROR(frames.error);
+    if (frames.nConfigs != 5 || !EPSEQ(frames.pose[2 * 13], 0.5) || !EPSEQ(fabs(frames.pose[2 * 13 + 4]), 180)
+        || !EPSEQ(frames.pose[2 * 13 + 7], 1.1) || !EPSEQ(frames.pose[2 * 13 + 8], 1.05) || !EPSEQ(frames.pose[4 * 13 + 7], 1.2))
+        ERROR("incorrect trajectory frames");
+    pose[13] = 0;
+    if (ResampleTrajectory(&trajectory, 0.25, &invalid) != -3)
+        ERROR("trajectory with decreasing time accepted");
+    pose[13] = 1;
+
+    DiffuseRoomsetup(&setup, 1);
+    sensors[0] = setup.source[0];
+    sensors[1] = setup.receiver[1];
+    setup.source     = &sensors[0];
+    setup.receiver   = &sensors[1];
+    setup.options.simulatediffuse    = false;
+    setup.options.simulatespecular   = true;
+    setup.options.reflectionorder[0] = 3;
+    setup.options.reflectionorder[1] = 3;
+    setup.options.reflectionorder[2] = 3;
+    ValidateSetup(&setup);
+
+    for (k=0; k<2; k++)
+    {
+        setup.options.numberofthreads       = 2;
+        setup.options.trajectorytolerancedB = tolerance[k];
+        RoomsimTrajectory(&setup, &frames, TrajectoryCallback, result);
+
+        setup.options.numberofthreads = 1;
+        for (i=0; i<frames.nConfigs; i++)
+        {
+            for (j=0; j<2; j++)
+            {
+                memcpy(sensors[j].location,    &frames.pose[13 * i + 1 + 6 * j],     3 * sizeof(double));
+                memcpy(sensors[j].orientation, &frames.pose[13 * i + 1 + 6 * j + 3], 3 * sizeof(double));
+            }
+            brir = Roomsim(&setup);
+            if (k == 0)
+                CompareBRIR(&brir[0], &result[i], 1e-12);
+            else
+            {
+                /* reused filters stay within the tolerance */
+                for (j=0, e[0]=e[1]=0; j<brir[0].nSamples; j++)
+                {
+                    e[0] += brir[0].sample[j] * brir[0].sample[j];
+                    e[1] += result[i].sample[j] * result[i].sample[j];
+                    differs |= brir[0].sample[j] != result[i].sample[j];
+                }
+                if (fabs(10 * log10(e[1] / e[0])) > tolerance[k])
+                    ERROR("tracked trajectory frame exceeds tolerance");
+            }
+            ReleaseBRIR(brir);
+            free(result[i].sample);
+        }
+    }
+    if (!differs)
+        ERROR("no image source filters reused");
+
+    FreeSweepTable(&frames);
+    CmdClearAllSensors();
+}
+
+/* Renders an impulse through a real-time renderer, for nSamples samples after its latency */
+static void RealtimeImpulse(CRealtime *rt, int blocksize, double *h, int nSamples)
+{
+    double x[64], y[64];
+    int    n, k, latency = RealtimeLatency(rt);
+
+    for (n=0; n<latency+nSamples; n+=blocksize)
+    {
+        memset(x, 0, sizeof(x));
+        if (n == 0)
+            x[0] = 1;
+        RealtimeProcess(rt, x, y);
+        for (k=0; k<blocksize; k++)
+            if (n+k >= latency && n+k < latency+nSamples)
+                h[n+k-latency] = y[k];
+    }
+}
+
+/* Compares the sum and the peak of a real-time impulse response with those of a simulation */
+static void CompareRealtimeImpulse(const double *h, const BRIR *brir)
+{
+    double sum[2] = { 0, 0 };
+    int    peak[2] = { 0, 0 }, n;
+
+    for (n=0; n<brir->nSamples; n++)
+    {
+        sum[0] += h[n];
+        sum[1] += brir->sample[n];
+        if (fabs(h[n]) > fabs(h[peak[0]]))
+            peak[0] = n;
+        if (fabs(brir->sample[n]) > fabs(brir->sample[peak[1]]))
+            peak[1] = n;
+    }
+    if (fabs(sum[0] / sum[1] - 1) > 0.01)
+        ERROR("real-time response gain differs from simulation");
+    if (abs(peak[0] - peak[1]) > 2)
+        ERROR("real-time direct sound differs from simulation");
+}
+
+typedef struct {
+    CRealtime *rt;
+    double    maxabs;
+} CRealtimeThreads;
+
+/* Thread 0 processes blocks while thread 1 moves the receiver */
+void RealtimeWorker(int iThread, void *arg)
+{
+    CRealtimeThreads *test = (CRealtimeThreads *) arg;
+    double x[64], y[64], location[3] = { 1.0, 1.0, 2.0 };
+    int    i, k;
+
+    for (i=0; i<200; i++)
+    {
+        if (iThread == 0)
+        {
+            for (k=0; k<64; k++)
+                x[k] = sin(0.1 * (64 * i + k));
+            RealtimeProcess(test->rt, x, y);
+            for (k=0; k<64; k++)
+                if (!(fabs(y[k]) <= test->maxabs))
+                    test->maxabs = fabs(y[k]);
+        }
+        else
+        {
+            location[0] = 1.0 + 0.005 * i;
+            RealtimeMoveReceiver(test->rt, 0, location, NULL);
+        }
+    }
+}
+
+void testRealtime(void)
+{
+    static const double moved[3] = { 2.5, 2.0, 1.5 };
+    CRoomSetup setup;
+    CSensor    sensors[2];
+    CRealtime  *rt;
+    CRealtimeThreads test;
+    BRIR       *brir;
+    double     *h;
+
+    DiffuseRoomsetup(&setup, 1);
+    sensors[0] = setup.source[0];
+    sensors[1] = setup.receiver[1];
+    setup.source     = &sensors[0];
+    setup.receiver   = &sensors[1];
+    setup.options.simulatediffuse    = false;
+    setup.options.simulatespecular   = true;
+    setup.options.reflectionorder[0] = 3;
+    setup.options.reflectionorder[1] = 3;
+    setup.options.reflectionorder[2] = 3;
+    ValidateSetup(&setup);
+
+    /* first order images move, higher orders are in the tail */
+    brir = Roomsim(&setup);
+    h    = (double *) malloc(brir[0].nSamples * sizeof(double));
+    rt   = RealtimeInit(&setup, 64, 1);
+    if (RealtimeChannels(rt) != 1 || RealtimeLatency(rt) <= 0 || RealtimeImageCount(rt) != 7)
+        ERROR("incorrect real-time renderer layout");
+    RealtimeImpulse(rt, 64, h, brir[0].nSamples);
+    CompareRealtimeImpulse(h, &brir[0]);
+    RealtimeFree(rt);
+    ReleaseBRIR(brir);
+
+    /* without a tail, the images follow the receiver */
+    setup.options.reflectionorder[0] = 1;
+    setup.options.reflectionorder[1] = 1;
+    setup.options.reflectionorder[2] = 1;
+    rt = RealtimeInit(&setup, 64, 2);
+    RealtimeMoveReceiver(rt, 0, moved, NULL);
+    memcpy(sensors[1].location, moved, sizeof(moved));
+    brir = Roomsim(&setup);
+    RealtimeImpulse(rt, 64, h, brir[0].nSamples);
+    CompareRealtimeImpulse(h, &brir[0]);
+    ReleaseBRIR(brir);
+
+    /* move the receiver while processing */
+    test.rt     = rt;
+    test.maxabs = 0;
+    ThreadRun(2, RealtimeWorker, &test);
+    if (!(test.maxabs > 0 && test.maxabs < 10))
+        ERROR("real-time output invalid while moving");
+    RealtimeFree(rt);
+
+    free(h);
+    CmdClearAllSensors();
+}
+
+void testSweep(void)
+{
+    static const char *table =
+        "% sweep test table\n"
+        "sx,sy,sz,syaw,spitch,sroll,r1x,r1y,r1z,r1yaw,r1pitch,r1roll,r2x,r2y,r2z,r2yaw,r2pitch,r2roll\n"
+        "4.0,1.5,1.6, 180,0,0,  2.0,3.0,1.2,   0,0,0,  1.0,1.0,2.0,  45,10,0\n"
+        "\n"
+        "1.0 3.0 2.0  90 0 0    5.0 1.0 1.5  -90 0 0   3.0 2.0 1.0 180, 0,0\n"
+        "2.5,2.0,1.0,   0,30,0, 0.5,0.5,0.5,  45,0,0,  4.5,3.5,2.5, -45,0,10\n"
+        "3.0,3.0,2.5,  10,0,0,  3.5,1.0,1.2,   0,0,0,  2.0,2.0,1.5,   0,0,0\n";
+    CRoomSetup  setup, single;
+    CSweepTable sweep, binary;
+    CSensor     sensors[3];
+    BRIR        result[4], *brir;
+    FILE        *fid;
+    int         i, j;
+
+    DiffuseRoomsetup(&setup, 2);
+    setup.options.simulatespecular   = true;
+    setup.options.reflectionorder[0] = 3;
+    setup.options.reflectionorder[1] = 3;
+    setup.options.reflectionorder[2] = 3;
+    setup.options.numberofthreads    = 3;
+    sensors[0] = setup.source[0];
+    sensors[1] = setup.receiver[0];
+    sensors[2] = setup.receiver[1];
+    sensors[2].description = "subcardioid";
+    ValidateSetup(&setup);
+
+    fid = fopen("unittest_sweep.csv", "w");
+    if (!fid)
+        ERROR("unable to write sweep table");
+    fputs(table, fid);
+    fclose(fid);
+
+    /* text and binary sweep tables must hold the same configurations */
+    if (ReadSweepTable("unittest_sweep.csv", 18, &sweep) < 0)
+        ERROR(sweep.error);
+    if (sweep.nConfigs != LENGTH(result) || sweep.pose[6 * 3 + 3] != 90 || sweep.pose[18 * 4 - 1] != 0)
+        ERROR("incorrect sweep table");
+    if (WriteSweepTable("unittest_sweep.bin", &sweep) < 0)
+        ERROR("unable to write binary sweep table");
+    if (ReadSweepTable("unittest_sweep.bin", 18, &binary) < 0)
+        ERROR(binary.error);
+    if (binary.nConfigs != sweep.nConfigs || memcmp(binary.pose, sweep.pose, 18 * sweep.nConfigs * sizeof(double)) != 0)
+        ERROR("binary sweep table differs");
+    FreeSweepTable(&binary);
+    if (ReadSweepTable("unittest_sweep.csv", 12, &binary) != -3)
+        ERROR("mismatching sweep table accepted");
+
+    /* a concurrent sweep must reproduce single simulations of each configuration */
+    setup.receiver = &sensors[1];
+    RoomsimSweep(&setup, &sweep, SweepCallback, result);
+
+    single = setup;
+    single.source   = &sensors[0];
+    single.options.numberofthreads = 1;
+    for (i=0; i<sweep.nConfigs; i++)
+    {
+        for (j=0; j<3; j++)
+        {
+            memcpy(sensors[j].location,    &sweep.pose[18 * i + 6 * j],     3 * sizeof(double));
+            memcpy(sensors[j].orientation, &sweep.pose[18 * i + 6 * j + 3], 3 * sizeof(double));
+        }
+        brir = Roomsim(&single);
+        CompareBRIR(&brir[1], &result[i], 1e-12);
+        ReleaseBRIR(brir);
+        free(result[i].sample);
+    }
+
+    FreeSweepTable(&sweep);
+    remove("unittest_sweep.csv");
+    remove("unittest_sweep.bin");
+    CmdClearAllSensors();
+}
+
+/* Receiver orientations rendered from one simulation match separate simulations */
+void testReceiverOrientations(void)
+{
+    static const double orientation[] = {
+          0, 0,0,    0,  0,0,
+         90, 0,0,   30, 20,0,
+        -45,10,5,  180,  0,0,
+    };
+    CRoomSetup  setup;
+    CSensor     receivers[2];
+    CSweepTable sweep;
+    BRIR        *brir, *ref, result[3];
+    int         i, j, k;
+
+    DiffuseRoomsetup(&setup, 2);
+    setup.options.simulatespecular   = true;
+    setup.options.reflectionorder[0] = 3;
+    setup.options.reflectionorder[1] = 3;
+    setup.options.reflectionorder[2] = 3;
+    receivers[0] = setup.receiver[0];
+    receivers[1] = setup.receiver[1];
+    setup.receiver = receivers;
+    ValidateSetup(&setup);
+
+    /* at the reference orientation, responses equal those of a single simulation */
+    brir = RoomsimOrientations(&setup, orientation, 3, NULL, NULL);
+    for (j=0; j<2; j++)
+        memset(receivers[j].orientation, 0, sizeof(receivers[j].orientation));
+    ref = Roomsim(&setup);
+    for (j=0; j<2; j++)
+        CompareBRIR(&ref[j], &brir[j], 1e-12);
+    ReleaseBRIR(ref);
+
+    /* the omnidirectional receiver does not depend on its orientation */
+    for (i=1; i<3; i++)
+        for (k=0; k<brir[1].nChannels * brir[1].nSamples; k++)
+            if (brir[2*i+1].sample[k] != brir[1].sample[k])
+                ERROR("response of omnidirectional receiver depends on orientation");
+    ReleaseBRIR(brir);
+
+    /* image sources are rendered exactly as at each orientation */
+    setup.options.simulatediffuse = false;
+    brir = RoomsimOrientations(&setup, orientation, 3, NULL, NULL);
+    for (i=0; i<3; i++)
+    {
+        for (j=0; j<2; j++)
+            memcpy(receivers[j].orientation, &orientation[6*i + 3*j], sizeof(receivers[j].orientation));
+        ref = Roomsim(&setup);
+        for (j=0; j<2; j++)
+            CompareBRIR(&ref[j], &brir[2*i+j], 1e-12);
+        ReleaseBRIR(ref);
+    }
+
+    /* a sweep of receiver orientations takes the same path */
+    sweep.nConfigs = 3;
+    sweep.nCols    = 18;
+    sweep.pose     = (double *) malloc(3 * 18 * sizeof(double));
+    for (i=0; i<3; i++)
+    {
+        memcpy(&sweep.pose[18*i], setup.source[0].location, 3 * sizeof(double));
+        memcpy(&sweep.pose[18*i + 3], setup.source[0].orientation, 3 * sizeof(double));
+        for (j=0; j<2; j++)
+        {
+            memcpy(&sweep.pose[18*i + 6 + 6*j], receivers[j].location, 3 * sizeof(double));
+            memcpy(&sweep.pose[18*i + 9 + 6*j], &orientation[6*i + 3*j], 3 * sizeof(double));
+        }
+    }
+    RoomsimSweep(&setup, &sweep, SweepCallback, result);
+    for (i=0; i<3; i++)
+    {
+        CompareBRIR(&brir[2*i+1], &result[i], 1e-12);
+        free(result[i].sample);
+    }
+    free(sweep.pose);
+    ReleaseBRIR(brir);
+
+    CmdClearAllSensors();
+}
+
+void testSparseResponses(void)
+{
+    CRoomSetup setup;
+    BRIR   *dense, *sparse;
+    double total, rest;
+    int    i, j, c;
+
+    DiffuseRoomsetup(&setup, 5);
+    setup.options.simulatespecular   = true;
+    setup.options.reflectionorder[0] = 3;
+    setup.options.reflectionorder[1] = 3;
+    setup.options.reflectionorder[2] = 3;
+    setup.options.responseduration   = 0.5;
+    ValidateSetup(&setup);
+    dense = Roomsim(&setup);
+
+    /* sparse responses must hold the active span of the dense ones */
+    setup.options.responsefloordB = -40;
+    sparse = Roomsim(&setup);
+    for (i=0; i<5; i++)
+    {
+        if (sparse[i].offset < 0 || sparse[i].nSamples <= 0 || sparse[i].offset + sparse[i].nSamples > dense[i].nSamples)
+            ERROR("invalid span of sparse response");
+
+        total = rest = 0;
+        for (c=0; c<dense[i].nChannels; c++)
+            for (j=0; j<dense[i].nSamples; j++)
+            {
+                double x = dense[i].sample[c*dense[i].nSamples + j];
+                total += x * x;
+                if (j < sparse[i].offset)
+                {
+                    if (x != 0.0)
+                        ERROR("nonzero samples before offset of sparse response");
+                }
+                else if (j < sparse[i].offset + sparse[i].nSamples)
+                {
+                    if (x != sparse[i].sample[c*sparse[i].nSamples + j - sparse[i].offset])
+                        ERROR("sparse response differs from dense response");
+                }
+                else
+                    rest += x * x;
+            }
+        if (rest > total * 1e-4)
+            ERROR("energy beyond sparse response exceeds floor");
+    }
+
+    ReleaseBRIR(dense);
+    ReleaseBRIR(sparse);
+    CmdClearAllSensors();
+}
+
+/* Returns the energy of a response. */
+double ResponseEnergy(const BRIR *brir)
+{
+    double energy = 0;
+    int    i;
+
+    for (i=0; i<brir->nChannels * brir->nSamples; i++)
+        energy += brir->sample[i] * brir->sample[i];
+    return energy;
+}
+
+/* Filter lengths per stage: a single length of 512 matches the default, 
+   other lengths keep the energy of the responses */
+void testFilterLengths(void)
+{
+    static const double same[]   = { 512 };
+    static const double staged[] = { 1024, 256, 128 };
+    CRoomSetup setup;
+    BRIR   *ref, *brir;
+    double ratio;
+    int    i, j, differs = 0;
+
+    DiffuseRoomsetup(&setup, 2);
+    setup.options.simulatespecular   = true;
+    setup.options.reflectionorder[0] = 3;
+    setup.options.reflectionorder[1] = 3;
+    setup.options.reflectionorder[2] = 3;
+    setup.options.responseduration   = 0.5;
+    ValidateSetup(&setup);
+    ref = Roomsim(&setup);
+
+    setup.options.filterlength   = same;
+    setup.options.nFilterLengths = LENGTH(same);
+    brir = Roomsim(&setup);
+    for (i=0; i<2; i++)
+        for (j=0; j<ref[i].nChannels * ref[i].nSamples; j++)
+            if (brir[i].sample[j] != ref[i].sample[j])
+                ERROR("filter length 512 differs from default");
+    ReleaseBRIR(brir);
+
+    setup.options.filterlength   = staged;
+    setup.options.nFilterLengths = LENGTH(staged);
+    brir = Roomsim(&setup);
+    for (i=0; i<2; i++)
+    {
+        if (brir[i].nSamples != ref[i].nSamples)
+            ERROR("response length changed by filter lengths");
+        ratio = ResponseEnergy(&brir[i]) / ResponseEnergy(&ref[i]);
+        if (ratio < 0.8 || ratio > 1.25)
+            ERROR("response energy changed by filter lengths");
+        for (j=0; j<ref[i].nChannels * ref[i].nSamples; j++)
+            differs |= brir[i].sample[j] != ref[i].sample[j];
+    }
+    if (!differs)
+        ERROR("filter lengths not applied");
+    ReleaseBRIR(brir);
+
+    ReleaseBRIR(ref);
+    CmdClearAllSensors();
+}
+
+/* Returns the time at which the Schroeder energy decay of the first channel 
+   of a response drops below level dB */
+double DecayTime(const BRIR *brir, double level)
+{
+    double total = 0, rest;
+    int    i;
+
+    for (i=0; i<brir->nSamples; i++)
+        total += brir->sample[i] * brir->sample[i];
+    for (i=0, rest=total; i<brir->nSamples && rest > total * pow(10.0, 0.1 * level); i++)
+        rest -= brir->sample[i] * brir->sample[i];
+    return (double) i / brir->fs;
+}
+
+/* Hybrid simulation: image sources up to the transition and a diffuse tail 
+   after it decay like a full simulation, with fewer image sources */
+void testHybridSimulation(void)
+{
+    static const double length[] = { 64 };
+    static const double transition[] = { 0.04, 0.08, -1 };
+    CRoomSetup setup;
+    BRIR   *full, *hybrid;
+    double t10, t40, h10, h40;
+    char   msg[128];
+    int    i, k;
+
+    DiffuseRoomsetup(&setup, 2);
+    setup.options.simulatespecular   = true;
+    setup.options.reflectionorder[0] = 16;
+    setup.options.reflectionorder[1] = 24;
+    setup.options.reflectionorder[2] = 32;
+    setup.options.numberofrays       = 2000;
+    setup.options.filterlength       = length;
+    setup.options.nFilterLengths     = LENGTH(length);
+    ValidateSetup(&setup);
+    full = Roomsim(&setup);
+
+    for (k=0; k<LENGTH(transition); k++)
+    {
+        setup.options.transitiontime = transition[k];
+        hybrid = Roomsim(&setup);
+        for (i=0; i<2; i++)
+        {
+            /* decay from -10 dB to -40 dB */
+            t10 = DecayTime(&full[i], -10);   t40 = DecayTime(&full[i], -40);
+            h10 = DecayTime(&hybrid[i], -10); h40 = DecayTime(&hybrid[i], -40);
+            if (fabs((h40 - h10) / (t40 - t10) - 1) > 0.2)
+            {
+                sprintf(msg, "energy decay differs (%.3f s, %.3f s)", t40 - t10, h40 - h10);
+                ERROR(msg);
+            }
+        }
+        ReleaseBRIR(hybrid);
+    }
+
+    ReleaseBRIR(full);
+    CmdClearAllSensors();
+}
+
+typedef struct {
+    CRoomSetup    setup[4];
+    BRIR          *brir[8];
+    volatile long next;
+} CConcurrentSetups;
+
+void ConcurrentSetupsWorker(int iThread, void *arg)
+{
+    CConcurrentSetups *jobs = (CConcurrentSetups *) arg;
+    long i;
+
+    char error[256];
+
+    (void) iThread;
+    while ((i = AtomicIncrement(&jobs->next) - 1) < LENGTH(jobs->brir))
+    {
+        if (RoomsimAcquireSensors(&jobs->setup[i % 4], error) < 0)
+            ERROR(error);
+        jobs->brir[i] = Roomsim(&jobs->setup[i % 4]);
+        RoomsimReleaseSensors();
+    }
+}
+
+void testConcurrentSetups(void)
+{
+    CConcurrentSetups jobs;
+    BRIR *brir;
+    int  i;
+
+    /* setups with different frequency bands share sensors, whose weights
+       must be prepared for one band configuration at a time */
+    for (i=0; i<4; i++)
+    {
+        DiffuseRoomsetup(&jobs.setup[i], 3);
+        jobs.setup[i].options.simulatespecular   = true;
+        jobs.setup[i].options.reflectionorder[0] = 2;
+        jobs.setup[i].options.reflectionorder[1] = 2;
+        jobs.setup[i].options.reflectionorder[2] = 2;
+        jobs.setup[i].options.bandsperoctave     = 1 + i % 2;
+        jobs.setup[i].options.numberofthreads    = 1;
+        jobs.setup[i].room.dimension[0]          = 6 + 0.5 * i;
+        ValidateSetup(&jobs.setup[i]);
+    }
+    jobs.next = 0;
+    ThreadRun(4, ConcurrentSetupsWorker, &jobs);
+
+    for (i=0; i<LENGTH(jobs.brir); i++)
+    {
+        brir = Roomsim(&jobs.setup[i % 4]);
+        CompareBRIR(&brir[2], &jobs.brir[i][2], 1e-12);
+        ReleaseBRIR(brir);
+        ReleaseBRIR(jobs.brir[i]);
+    }
+    CmdClearAllSensors();
+}
+
+void testSetupErrors(void)
+{
+    CRoomSetup setup;
+    CSensor    sensors[2];
+    BRIR       *brir;
+    char       error[256];
+
+    /* invalid setups are reported, not fatal */
+    DiffuseRoomsetup(&setup, 1);
+    if (CheckSetup(&setup, error) < 0)
+        ERROR(error);
+    setup.room.surface.nColsAbsorption--;
+    if (CheckSetup(&setup, error) == 0)
+        ERROR("incomplete absorption accepted");
+    setup.room.surface.nColsAbsorption++;
+    setup.options.raygenerator = "spiral";
+    if (CheckSetup(&setup, error) == 0)
+        ERROR("unknown ray generator accepted");
+    setup.options.raygenerator = "icosahedron";
+    setup.options.diffusedirections = 5120;
+    setup.options.diffusetimestep   = 1e-7;
+    if (CheckSetup(&setup, error) == 0)
+        ERROR("diffuse histograms beyond 2^32 bins accepted");
+    setup.options.diffusedirections = 6;
+    setup.options.diffusetimestep   = 0.010;
+
+    /* sensors that fail to load or cannot be simulated leave no sensor in use */
+    if (TryLoadSensor("ambisonics 9", ANY_FS, error) || TryLoadSensor("array unittest_missing.txt", ANY_FS, error))
+        ERROR("invalid sensor loaded");
+    sensors[0] = setup.receiver[0];
+    sensors[1] = setup.receiver[0];
+    sensors[1].description = "nosuchsensor";
+    setup.receiver = sensors;
+    setup.nReceivers = 2;
+    if (RoomsimAcquireSensors(&setup, error) == 0)
+        ERROR("unknown receiver accepted");
+    sensors[1].description = "ambisonics 1";
+    setup.source = sensors + 1;
+    setup.nReceivers = 1;
+    if (RoomsimAcquireSensors(&setup, error) == 0)
+        ERROR("ambisonics source accepted");
+
+    /* a valid setup runs after the failures */
+    DiffuseRoomsetup(&setup, 1);
+    if (RoomsimAcquireSensors(&setup, error) < 0)
+        ERROR(error);
+    brir = Roomsim(&setup);
+    RoomsimReleaseSensors();
+    ReleaseBRIR(brir);
+    CmdClearAllSensors();
+}
+
+void testArena(void)
+{
+    CArena     arena;
+    CArenaMark mark;
+    char       *p, *q;
+    size_t     i;
+
+    ArenaInit(&arena, 4096);
+
+    /* allocations are aligned, and zeroed by ArenaCalloc */
+    p = (char *) ArenaMalloc(&arena, 3);
+    q = (char *) ArenaCalloc(&arena, 100, sizeof(double));
+    if (((size_t) p | (size_t) q) % ARENA_ALIGNMENT != 0)
+        ERROR("misaligned arena allocation");
+    if (q < p + 3)
+        ERROR("overlapping arena allocations");
+    for (i=0; i<100*sizeof(double); i++)
+        if (q[i] != 0)
+            ERROR("arena allocation not zeroed");
+
+    /* large allocations get their own block; rewinding releases it */
+    mark = ArenaGetMark(&arena);
+    p = (char *) ArenaMalloc(&arena, 10000);
+    memset(p, 1, 10000);
+    if (arena.nBlocks != 2 || arena.used != 803 + 10000 || arena.peak != arena.used)
+        ERROR("incorrect arena usage");
+    ArenaRewind(&arena, mark);
+    if (arena.nBlocks != 1 || arena.used != 803 || arena.peak != 10803)
+        ERROR("incorrect arena usage after rewind");
+    if (ArenaMalloc(&arena, 64) != q + 832)
+        ERROR("rewound arena memory not reused");
+
+    ArenaRelease(&arena);
+    if (arena.nBlocks != 0 || arena.reserved != 0 || arena.used != 0)
+        ERROR("arena not released");
+}
+
 typedef struct {
     char *name;
     void (*run)(void);
@@ -378,9 +1904,33 @@ typedef struct {
 
 CUnittest unittest[] = {
     { "convolution",	                        testConvolution         },
+    { "convolution kernels",                    testConvolutionKernels  },
+    { "partitioned convolution",                testPartitionedConv     },
     { "linear interpolation",                   testLinearInterpolation },
     { "minimum phase FIR filter design",        testMinPhaseFIR         },
+    { "batched minimum phase design",           testMinPhaseFIRBatch    },
+    { "FFTW plan cache",                        testFFTWPlanCache       },
 	{ "freqz log magnitude frequency response", testFreqzLogMagnitude   },
+    { "arena allocator",                        testArena               },
     { "empty room",                             testEmptyRoom   },
+    { "setup file parser",                      testSetupParser         },
+    { "binary setup files",                     testBinarySetup         },
+    { "ray direction generators",               testRayGenerators       },
+    { "vectorized diffuse receivers",           testDiffuseReceivers    },
+    { "diffuse rain linear energy domain",      testDiffuseLinearDomain },
+    { "multithreaded ray tracing",              testDiffuseThreads      },
+    { "adaptive ray count",                     testDiffuseAdaptive     },
+    { "diffuse direction bins",                 testDiffuseDirections   },
+    { "ambisonics receivers",                   testAmbisonics          },
+    { "array receivers",                        testArraySensor         },
+    { "scene sweep",                            testSweep               },
+    { "trajectories",                           testTrajectory          },
+    { "real-time renderer",                     testRealtime            },
+    { "concurrent setups",                      testConcurrentSetups    },
+    { "setup and sensor errors",                testSetupErrors         },
+    { "sparse responses",                       testSparseResponses     },
+    { "filter lengths",                         testFilterLengths       },
+    { "hybrid simulation",                      testHybridSimulation    },
+    { "receiver orientations",                  testReceiverOrientations },
 };
 int nUnittests = sizeof(unittest) / sizeof(CUnittest);
@@ -1,3 +1,5 @@
+#include <stdio.h>
+
 // -------------------------------------------------- [ Section: Endianness ] -
 int isBigEndian();
 void reverseEndianness(const long long int size, void* value);
@@ -44,4 +46,22 @@ void waveDestroy(Wave* wave);
 void waveSetDuration(Wave* wave, const float seconds);
 void waveAddSample(Wave* wave, const float* samples);
 void waveAddSampleFloat(Wave* wave, const float* samples);
-void waveToFile(Wave* wave, const char* filename);
\ No newline at end of file
+void waveToFile(Wave* wave, const char* filename);
+
+// ------------------------------------------------- [ Section: Wave Stream ] -
+typedef struct WaveStream {
+	FILE* file;
+	int writing;
+	short int audioFormat;		// 1 for PCM, 3 for FLOAT
+	short int numChannels;
+	int sampleRate;
+	short int bitsPerSample;
+	long long int nFrames;		// frames in the file (reading) or written so far (writing)
+	long long int position;		// frames read so far
+} WaveStream;
+
+int waveOpenRead(WaveStream* stream, const char* filename);
+long long int waveReadFloat(WaveStream* stream, float* samples, long long int nFrames);
+int waveOpenWrite(WaveStream* stream, const char* filename, int const sampleRate, short int const numChannels);
+int waveWriteFloat(WaveStream* stream, const float* samples, long long int nFrames);
+int waveClose(WaveStream* stream);
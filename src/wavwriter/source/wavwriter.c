@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include "wavwriter.h"
 #include <math.h>
+#include <string.h>
 
 /* disable warnings about unsafe CRT functions */
 #ifdef _MSC_VER
@@ -190,4 +191,207 @@ void waveToFile(Wave* wave, const char* filename) {
 	toLittleEndian(sizeof(short int), (void*)&(wave->header.blockAlign));
 	toLittleEndian(sizeof(short int), (void*)&(wave->header.bitsPerSample));
 	toLittleEndian(sizeof(int), (void*)&(wave->header.subChunk2Size));
-}
\ No newline at end of file
+}
+// ------------------------------------------------- [ Section: Wave Stream ] -
+static unsigned int getLittleEndian(const unsigned char* p, int nBytes) {
+	unsigned int value = 0;
+	while (nBytes--) {
+		value = (value << 8) | p[nBytes];
+	}
+	return value;
+}
+static void putLittleEndian(unsigned char* p, unsigned int value, int nBytes) {
+	int i;
+	for (i = 0; i < nBytes; i += 1, value >>= 8) {
+		p[i] = (unsigned char)value;
+	}
+}
+
+// Opens a WAVE file for reading with waveReadFloat: PCM of 8 to 32 bits,
+// or floating point of 32 or 64 bits. Returns 1, or 0 if the file cannot
+// be opened or is not a supported WAVE file.
+int waveOpenRead(WaveStream* stream, const char* filename) {
+	unsigned char header[40];
+	unsigned int size;
+	int format = 0;
+
+	stream->writing = 0;
+	stream->position = 0;
+	stream->file = fopen(filename, "rb");
+	if (!stream->file) {
+		return 0;
+	}
+	if (fread(header, 1, 12, stream->file) != 12 || memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+		fclose(stream->file);
+		return 0;
+	}
+
+	// walk the chunks up to the data chunk, skipping unknown ones
+	for (;;) {
+		if (fread(header, 1, 8, stream->file) != 8) {
+			fclose(stream->file);
+			return 0;
+		}
+		size = getLittleEndian(header + 4, 4);
+		if (memcmp(header, "fmt ", 4) == 0 && size >= 16 && size <= sizeof(header)) {
+			if (fread(header, 1, size, stream->file) != size) {
+				fclose(stream->file);
+				return 0;
+			}
+			stream->audioFormat = (short int)getLittleEndian(header, 2);
+			stream->numChannels = (short int)getLittleEndian(header + 2, 2);
+			stream->sampleRate = (int)getLittleEndian(header + 4, 4);
+			stream->bitsPerSample = (short int)getLittleEndian(header + 14, 2);
+			if (stream->audioFormat == (short int)0xFFFE && size >= 26) {
+				// extensible format: the subformat starts with the format code
+				stream->audioFormat = (short int)getLittleEndian(header + 24, 2);
+			}
+			format = 1;
+			if (size & 1) {
+				fseek(stream->file, 1, SEEK_CUR);
+			}
+		}
+		else if (memcmp(header, "data", 4) == 0) {
+			break;
+		}
+		else if (fseek(stream->file, (long)(size + (size & 1)), SEEK_CUR) != 0) {
+			fclose(stream->file);
+			return 0;
+		}
+	}
+
+	if (!format || stream->numChannels < 1 ||
+		!((stream->audioFormat == 1 && stream->bitsPerSample >= 8 && stream->bitsPerSample <= 32 && stream->bitsPerSample % 8 == 0) ||
+		  (stream->audioFormat == 3 && (stream->bitsPerSample == 32 || stream->bitsPerSample == 64)))) {
+		fclose(stream->file);
+		return 0;
+	}
+	stream->nFrames = size / (stream->numChannels * (stream->bitsPerSample / 8));
+	return 1;
+}
+
+// Reads up to nFrames frames of interleaved samples, scaled to [-1,1).
+// Returns the number of frames read, 0 at the end of the data.
+long long int waveReadFloat(WaveStream* stream, float* samples, long long int nFrames) {
+	unsigned char buffer[4096];
+	int nBytes = stream->bitsPerSample / 8;
+	int frameBytes = nBytes * stream->numChannels;
+	long long int n, done = 0;
+	int i, k;
+	unsigned int bits;
+	float f;
+	double d;
+	unsigned long long int bits64;
+
+	if (nFrames > stream->nFrames - stream->position) {
+		nFrames = stream->nFrames - stream->position;
+	}
+	while (done < nFrames) {
+		n = nFrames - done;
+		if (n > (long long int)sizeof(buffer) / frameBytes) {
+			n = (long long int)sizeof(buffer) / frameBytes;
+		}
+		if (n < 1) {
+			n = 1;
+		}
+		if (frameBytes > (int)sizeof(buffer) || fread(buffer, frameBytes, (size_t)n, stream->file) != (size_t)n) {
+			break;
+		}
+		for (i = 0; i < n * stream->numChannels; i += 1) {
+			const unsigned char* p = buffer + i * nBytes;
+			if (stream->audioFormat == 3 && nBytes == 8) {
+				bits64 = (unsigned long long int)getLittleEndian(p + 4, 4) << 32 | getLittleEndian(p, 4);
+				memcpy(&d, &bits64, sizeof(d));
+				*samples++ = (float)d;
+			}
+			else if (stream->audioFormat == 3) {
+				bits = getLittleEndian(p, 4);
+				memcpy(&f, &bits, sizeof(f));
+				*samples++ = f;
+			}
+			else if (nBytes == 1) {
+				*samples++ = (p[0] - 128) / 128.0f;
+			}
+			else {
+				// sign-extend little-endian PCM of nBytes bytes
+				bits = getLittleEndian(p, nBytes) << (32 - 8 * nBytes);
+				k = (int)bits;
+				*samples++ = (float)(k / 2147483648.0);
+			}
+		}
+		done += n;
+		stream->position += n;
+	}
+	return done;
+}
+
+// Creates a WAVE file of 32-bit floating point samples, written with waveWriteFloat.
+// Returns 1, or 0 if the file cannot be created.
+int waveOpenWrite(WaveStream* stream, const char* filename, int const sampleRate, short int const numChannels) {
+	unsigned char header[44];
+
+	stream->writing = 1;
+	stream->audioFormat = 3;
+	stream->numChannels = numChannels;
+	stream->sampleRate = sampleRate;
+	stream->bitsPerSample = 32;
+	stream->nFrames = 0;
+	stream->position = 0;
+	stream->file = fopen(filename, "wb");
+	if (!stream->file) {
+		return 0;
+	}
+
+	// sizes are filled in by waveClose
+	memset(header, 0, sizeof(header));
+	fwrite(header, 1, sizeof(header), stream->file);
+	return 1;
+}
+
+// Appends nFrames frames of interleaved samples. Returns 1, or 0 on a write error.
+int waveWriteFloat(WaveStream* stream, const float* samples, long long int nFrames) {
+	unsigned char buffer[4096];
+	long long int i, n = nFrames * stream->numChannels;
+	int k = 0;
+	unsigned int bits;
+
+	for (i = 0; i < n; i += 1) {
+		memcpy(&bits, &samples[i], sizeof(bits));
+		putLittleEndian(buffer + k, bits, 4);
+		k += 4;
+		if (k == (int)sizeof(buffer) || i == n - 1) {
+			if (fwrite(buffer, 1, k, stream->file) != (size_t)k) {
+				return 0;
+			}
+			k = 0;
+		}
+	}
+	stream->nFrames += nFrames;
+	return 1;
+}
+
+// Closes a stream; the header of a written file receives its final sizes.
+// Returns 1, or 0 if the file could not be written.
+int waveClose(WaveStream* stream) {
+	unsigned char header[44];
+	unsigned int dataSize;
+	int ok = 1;
+
+	if (stream->writing) {
+		dataSize = (unsigned int)(stream->nFrames * stream->numChannels * 4);
+		memcpy(header, "RIFF", 4);
+		putLittleEndian(header + 4, 36 + dataSize, 4);
+		memcpy(header + 8, "WAVEfmt ", 8);
+		putLittleEndian(header + 16, 16, 4);
+		putLittleEndian(header + 20, 3, 2);
+		putLittleEndian(header + 22, stream->numChannels, 2);
+		putLittleEndian(header + 24, stream->sampleRate, 4);
+		putLittleEndian(header + 28, stream->sampleRate * stream->numChannels * 4, 4);
+		putLittleEndian(header + 32, stream->numChannels * 4, 2);
+		putLittleEndian(header + 34, 32, 2);
+		memcpy(header + 36, "data", 4);
+		putLittleEndian(header + 40, dataSize, 4);
+		ok = fseek(stream->file, 0, SEEK_SET) == 0 && fwrite(header, 1, sizeof(header), stream->file) == sizeof(header) && !ferror(stream->file);
+	}
+	return fclose(stream->file) == 0 && ok;
+}